@@ -45,10 +45,12 @@ static const char secretAccessKeyG[16] = "";
 
 
 
-// Request results, saved as globals -------------------------------------------
+// Request results, saved as thread-local globals ------------------------------
 
-static int statusG = 0;
-static char errorDetailsG[4096] = { 0 };
+// Every libs3 request is synchronous in the calling thread, so keeping the
+// results per thread is enough to make concurrent requests safe
+static __thread int statusG = 0;
+static __thread char errorDetailsG[4096] = { 0 };
 
 // response properties callback ------------------------------------------------
 
@@ -309,6 +311,8 @@ typedef struct put_object_callback_data
     uint64_t remainingLength;
     uint64_t contentLength;
     put_filler_t filler;
+    put_filler_ctx_t fillerCtx;
+    void *ctx;
     int noStatus;
 } put_object_callback_data;
 
@@ -323,7 +327,12 @@ static int putObjectDataCallback(int bufferSize, char *buffer,
     if (data->remainingLength) {
         int toRead = ((data->remainingLength > (unsigned) bufferSize) ?
                       (unsigned) bufferSize : data->remainingLength);
-        ret = data->filler(buffer, toRead);
+        if (data->fillerCtx) {
+            ret = data->fillerCtx(buffer, toRead, data->ctx);
+        }
+        else {
+            ret = data->filler(buffer, toRead);
+        }
     }
 
     data->offset += ret;
@@ -343,8 +352,9 @@ static int putObjectDataCallback(int bufferSize, char *buffer,
     return ret;
 }
 
-S3Status cloud_put_object(const char *bucketName, const char *key,
-                          uint64_t contentLength, put_filler_t filler) {
+static S3Status put_object(const char *bucketName, const char *key,
+                           uint64_t contentLength,
+                           put_object_callback_data *data) {
 
     S3BucketContext bucketContext =
     {
@@ -375,34 +385,68 @@ S3Status cloud_put_object(const char *bucketName, const char *key,
         &putObjectDataCallback
     };
 
+    data->offset = 0;
+    data->contentLength = data->remainingLength = contentLength;
+    data->noStatus = 0;
+
+    S3_put_object(&bucketContext, key, contentLength, &putProperties, 0,
+                  &putObjectHandler, data);
+
+    return statusG;
+}
+
+S3Status cloud_put_object(const char *bucketName, const char *key,
+                          uint64_t contentLength, put_filler_t filler) {
     put_object_callback_data data;
 
-    data.offset = 0;
-    data.contentLength = data.remainingLength = contentLength;
     data.filler = filler;
-    data.noStatus = 0;
+    data.fillerCtx = NULL;
+    data.ctx = NULL;
 
-    S3_put_object(&bucketContext, key, contentLength, &putProperties, 0,
-                  &putObjectHandler, &data);
+    return put_object(bucketName, key, contentLength, &data);
+}
 
-    return statusG;
+S3Status cloud_put_object_ctx(const char *bucketName, const char *key,
+                              uint64_t contentLength, put_filler_ctx_t filler,
+                              void *ctx) {
+    put_object_callback_data data;
+
+    data.filler = NULL;
+    data.fillerCtx = filler;
+    data.ctx = ctx;
+
+    return put_object(bucketName, key, contentLength, &data);
 }
 
 // Get object -----------------------------------------------------------------
 
+typedef struct get_object_callback_data
+{
+    get_filler_t filler;
+    get_filler_ctx_t fillerCtx;
+    void *ctx;
+} get_object_callback_data;
+
 static S3Status getObjectDataCallback(int bufferSize, const char *buffer,
                                       void *callbackData)
 {
-    get_filler_t filler = (get_filler_t) callbackData;
+    get_object_callback_data *data =
+        (get_object_callback_data *) callbackData;
 
-    int wrote = filler(buffer, (uint64_t) bufferSize);
+    int wrote = 0;
+    if (data->fillerCtx) {
+        wrote = data->fillerCtx(buffer, bufferSize, data->ctx);
+    }
+    else {
+        wrote = data->filler(buffer, (uint64_t) bufferSize);
+    }
 
     return ((wrote <  bufferSize) ? 
             S3StatusAbortedByCallback : S3StatusOK);
 }
 
-S3Status cloud_get_object(const char *bucketName, const char *key,
-                    get_filler_t filler) {
+static S3Status get_object(const char *bucketName, const char *key,
+                           get_object_callback_data *data) {
 
   uint64_t startByte = 0, byteCount = 0;
   int64_t ifModifiedSince = -1, ifNotModifiedSince = -1;
@@ -433,11 +477,33 @@ S3Status cloud_get_object(const char *bucketName, const char *key,
   };
 
   S3_get_object(&bucketContext, key, &getConditions, startByte,
-                byteCount, 0, &getObjectHandler, filler);
+                byteCount, 0, &getObjectHandler, data);
 
   return statusG;
 }
 
+S3Status cloud_get_object(const char *bucketName, const char *key,
+                    get_filler_t filler) {
+  get_object_callback_data data;
+
+  data.filler = filler;
+  data.fillerCtx = NULL;
+  data.ctx = NULL;
+
+  return get_object(bucketName, key, &data);
+}
+
+S3Status cloud_get_object_ctx(const char *bucketName, const char *key,
+                              get_filler_ctx_t filler, void *ctx) {
+  get_object_callback_data data;
+
+  data.filler = NULL;
+  data.fillerCtx = filler;
+  data.ctx = ctx;
+
+  return get_object(bucketName, key, &data);
+}
+
 S3Status cloud_delete_object(const char *bucketName, const char *key) {
   S3BucketContext bucketContext =
   {
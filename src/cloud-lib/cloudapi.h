@@ -8,6 +8,13 @@ typedef int(* put_filler_t) (char *buffer, int bufferLength);
 
 typedef int(* get_filler_t) (const char *buffer, int bufferLength);
 
+// Call back functions that carry a per-request context, so that concurrent
+// requests from different threads do not have to share global state
+typedef int(* put_filler_ctx_t) (char *buffer, int bufferLength, void *ctx);
+
+typedef int(* get_filler_ctx_t) (const char *buffer, int bufferLength,
+                                 void *ctx);
+
 typedef int(* list_bucket_filler_t) (const char *key, time_t modified_time,
                                      uint64_t size);
 
@@ -21,6 +28,7 @@ void cloud_destroy();
 
 // Print out return status of libs3 client library to stdout
 // It help show the error message after each libs3 call 
+// The status is kept per thread, so it reflects the calling thread's last call
 void cloud_print_error();
 
 // Basic S3 APIs: LIST, PUT, GET, DELETE   
@@ -39,6 +47,14 @@ S3Status cloud_put_object(const char *bucketName, const char *key,
 S3Status cloud_get_object(const char *bucketName, const char *key,
                           get_filler_t filler);
 
+// Same as above, "ctx" is passed through to every filler call
+S3Status cloud_put_object_ctx(const char *bucketName, const char *key,
+                              uint64_t contentLength, put_filler_ctx_t filler,
+                              void *ctx);
+
+S3Status cloud_get_object_ctx(const char *bucketName, const char *key,
+                              get_filler_ctx_t filler, void *ctx);
+
 S3Status cloud_delete_object(const char *bucketName, const char *key);
 
 #endif
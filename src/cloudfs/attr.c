@@ -0,0 +1,457 @@
+/**
+ * @file attr.c
+ * @brief Attributes of CloudFS files.
+ *
+ *        Whether a file is in the cloud, whether it is dirty, and the
+ *        attributes of the real file behind a proxy file are all kept in
+ *        a single versioned extended attribute (ATTR_NAME), so they are
+ *        read and written with one system call.
+ *
+ *        On top of that, the attributes of recently used files are cached
+ *        in memory, keyed by their pathname on SSD; a hit needs no system
+ *        call at all. CloudFS is the only one changing the attributes, so
+ *        the cache stays correct as long as every change goes through
+ *        attr_set(), and renames and removals are reported with
+ *        attr_rename() and attr_invalidate().
+ *
+ *        Older versions stored every attribute in its own extended
+ *        attribute; those are read when ATTR_NAME is missing and converted
+ *        on the spot.
+ *
+ * @author Yinsu Chu (yinsuc)
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+// #define DEBUG
+#include "cloudfs.h"
+
+#include "attr.h"
+
+/* extended attributes written by older versions, one per attribute */
+#define U_DEV ("user.st_dev")
+#define U_INO ("user.st_ino")
+#define U_MODE ("user.st_mode")
+#define U_NLINK ("user.st_nlink")
+#define U_UID ("user.st_uid")
+#define U_GID ("user.st_gid")
+#define U_RDEV ("user.st_rdev")
+#define U_SIZE ("user.st_size")
+#define U_BLKSIZE ("user.st_blksize")
+#define U_BLOCKS ("user.st_blocks")
+#define U_REMOTE ("user.remote")
+#define U_DIRTY ("user.dirty")
+
+extern FILE *Log;
+
+/* a cached attribute, in a hash bucket and in the LRU list */
+struct attr_entry {
+  char *fpath;
+  struct cloudfs_attr attr;
+  struct attr_entry *next;
+  struct attr_entry *lru_prev;
+  struct attr_entry *lru_next;
+};
+
+static int Num_buckets;
+static int Max_entries;
+static int Num_entries;
+static struct attr_entry **Buckets;
+static struct attr_entry *Lru_head; /* most recently used */
+static struct attr_entry *Lru_tail;
+
+/* protects the cache */
+static pthread_mutex_t Attr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Hash a pathname into a bucket.
+ * @param fpath The pathname.
+ * @return Index of the bucket.
+ */
+static int attr_hash(const char *fpath)
+{
+  unsigned int hash = 5381;
+  const char *c = NULL;
+  for (c = fpath; *c != '\0'; c++) {
+    hash = hash * 33 + (unsigned char) *c;
+  }
+  return hash % Num_buckets;
+}
+
+/**
+ * @brief Find a cached entry, the caller holds Attr_lock.
+ * @param fpath Pathname of the file.
+ * @return The entry, NULL if not cached.
+ */
+static struct attr_entry *attr_lookup(const char *fpath)
+{
+  struct attr_entry *e = NULL;
+  for (e = Buckets[attr_hash(fpath)]; e != NULL; e = e->next) {
+    if (strcmp(e->fpath, fpath) == 0) {
+      break;
+    }
+  }
+  return e;
+}
+
+/**
+ * @brief Take an entry out of the LRU list, the caller holds Attr_lock.
+ * @param e The entry.
+ * @return Void.
+ */
+static void attr_lru_remove(struct attr_entry *e)
+{
+  if (e->lru_prev != NULL) {
+    e->lru_prev->lru_next = e->lru_next;
+  } else {
+    Lru_head = e->lru_next;
+  }
+  if (e->lru_next != NULL) {
+    e->lru_next->lru_prev = e->lru_prev;
+  } else {
+    Lru_tail = e->lru_prev;
+  }
+}
+
+/**
+ * @brief Put an entry at the head of the LRU list, the caller holds Attr_lock.
+ * @param e The entry.
+ * @return Void.
+ */
+static void attr_lru_push(struct attr_entry *e)
+{
+  e->lru_prev = NULL;
+  e->lru_next = Lru_head;
+  if (Lru_head != NULL) {
+    Lru_head->lru_prev = e;
+  }
+  Lru_head = e;
+  if (Lru_tail == NULL) {
+    Lru_tail = e;
+  }
+}
+
+/**
+ * @brief Remove an entry from the cache and free it,
+ *        the caller holds Attr_lock.
+ * @param e The entry.
+ * @return Void.
+ */
+static void attr_drop(struct attr_entry *e)
+{
+  struct attr_entry **pp = &Buckets[attr_hash(e->fpath)];
+  while (*pp != e) {
+    pp = &((*pp)->next);
+  }
+  *pp = e->next;
+  attr_lru_remove(e);
+  Num_entries--;
+  free(e->fpath);
+  free(e);
+}
+
+/**
+ * @brief Look up the attributes of a file in the cache.
+ * @param fpath Pathname of the file.
+ * @param ap The attributes are returned here on a hit.
+ * @return 1 on a hit, 0 otherwise.
+ */
+static int attr_cache_get(char *fpath, struct cloudfs_attr *ap)
+{
+  int retval = 0;
+
+  if (Buckets == NULL) {
+    return retval;
+  }
+
+  pthread_mutex_lock(&Attr_lock);
+  struct attr_entry *e = attr_lookup(fpath);
+  if (e != NULL) {
+    memcpy(ap, &e->attr, sizeof(struct cloudfs_attr));
+    attr_lru_remove(e);
+    attr_lru_push(e);
+    retval = 1;
+  }
+  pthread_mutex_unlock(&Attr_lock);
+
+  return retval;
+}
+
+/**
+ * @brief Cache the attributes of a file, evicting the least recently
+ *        used entry if the cache is full.
+ * @param fpath Pathname of the file.
+ * @param ap The attributes.
+ * @return Void.
+ */
+static void attr_cache_put(char *fpath, struct cloudfs_attr *ap)
+{
+  if (Buckets == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&Attr_lock);
+  struct attr_entry *e = attr_lookup(fpath);
+  if (e != NULL) {
+    attr_lru_remove(e);
+  } else {
+    e = (struct attr_entry *) malloc(sizeof(struct attr_entry));
+    char *copy = strdup(fpath);
+    if ((e == NULL) || (copy == NULL)) {
+      free(e);
+      free(copy);
+      pthread_mutex_unlock(&Attr_lock);
+      return;
+    }
+    e->fpath = copy;
+    int bucket_id = attr_hash(fpath);
+    e->next = Buckets[bucket_id];
+    Buckets[bucket_id] = e;
+    Num_entries++;
+  }
+  memcpy(&e->attr, ap, sizeof(struct cloudfs_attr));
+  attr_lru_push(e);
+
+  if (Num_entries > Max_entries) {
+    attr_drop(Lru_tail);
+  }
+  pthread_mutex_unlock(&Attr_lock);
+}
+
+/**
+ * @brief Read the attributes written by older versions.
+ * @param fpath Pathname of the file.
+ * @param ap The attributes are returned here.
+ * @return 1 if found, 0 if the file has none, -errno otherwise.
+ */
+static int attr_load_legacy(char *fpath, struct cloudfs_attr *ap)
+{
+  int retval = 0;
+  int remote = 0;
+  int dirty = 0;
+
+  if (lgetxattr(fpath, U_REMOTE, &remote, sizeof(int)) < 0) {
+    return (errno == ENODATA) ? 0 : -errno;
+  }
+  lgetxattr(fpath, U_DIRTY, &dirty, sizeof(int));
+  ap->flags = (remote ? ATTR_REMOTE : 0) | (dirty ? ATTR_DIRTY : 0);
+
+  if (remote) {
+    struct stat *sp = &ap->st;
+    lgetxattr(fpath, U_DEV, &sp->st_dev, sizeof(dev_t));
+    lgetxattr(fpath, U_INO, &sp->st_ino, sizeof(ino_t));
+    lgetxattr(fpath, U_MODE, &sp->st_mode, sizeof(mode_t));
+    lgetxattr(fpath, U_NLINK, &sp->st_nlink, sizeof(nlink_t));
+    lgetxattr(fpath, U_UID, &sp->st_uid, sizeof(uid_t));
+    lgetxattr(fpath, U_GID, &sp->st_gid, sizeof(gid_t));
+    lgetxattr(fpath, U_RDEV, &sp->st_rdev, sizeof(dev_t));
+    lgetxattr(fpath, U_SIZE, &sp->st_size, sizeof(off_t));
+    lgetxattr(fpath, U_BLKSIZE, &sp->st_blksize, sizeof(blksize_t));
+    lgetxattr(fpath, U_BLOCKS, &sp->st_blocks, sizeof(blkcnt_t));
+  }
+  retval = 1;
+
+  dbg_print("[DBG] attr_load_legacy(fpath=\"%s\")=%d\n", fpath, retval);
+
+  return retval;
+}
+
+/**
+ * @brief Remove the attributes written by older versions.
+ * @param fpath Pathname of the file.
+ * @return Void.
+ */
+static void attr_remove_legacy(char *fpath)
+{
+  const char *names[] = { U_DEV, U_INO, U_MODE, U_NLINK, U_UID, U_GID,
+    U_RDEV, U_SIZE, U_BLKSIZE, U_BLOCKS, U_REMOTE, U_DIRTY };
+  size_t i = 0;
+  for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    lremovexattr(fpath, names[i]);
+  }
+}
+
+/**
+ * @brief Initialize the attribute cache.
+ * @param num_entries Maximum number of cached files, 0 turns caching off.
+ * @return 0 on success, -errno otherwise.
+ */
+int attr_init(int num_entries)
+{
+  int retval = 0;
+
+  if (num_entries > 0) {
+    Buckets = (struct attr_entry **)
+      calloc(num_entries, sizeof(struct attr_entry *));
+    if (Buckets == NULL) {
+      retval = cloudfs_error("attr_init");
+      return retval;
+    }
+  }
+  Num_buckets = num_entries;
+  Max_entries = num_entries;
+  Num_entries = 0;
+
+  dbg_print("[DBG] attr_init(num_entries=%d)=%d\n", num_entries, retval);
+
+  return retval;
+}
+
+/**
+ * @brief CloudFS should call this function upon exiting.
+ * @return Void.
+ */
+void attr_destroy(void)
+{
+  pthread_mutex_lock(&Attr_lock);
+  while (Lru_head != NULL) {
+    attr_drop(Lru_head);
+  }
+  free(Buckets);
+  Buckets = NULL;
+  pthread_mutex_unlock(&Attr_lock);
+}
+
+/**
+ * @brief Get the attributes of a file.
+ *        A file without attributes is a local file that is not dirty.
+ * @param fpath Pathname of the file on SSD.
+ * @param ap The attributes are returned here.
+ * @return 0 on success, -errno otherwise.
+ */
+int attr_get(char *fpath, struct cloudfs_attr *ap)
+{
+  int retval = 0;
+
+  if (attr_cache_get(fpath, ap)) {
+    return retval;
+  }
+
+  memset(ap, 0, sizeof(struct cloudfs_attr));
+  ssize_t len = lgetxattr(fpath, ATTR_NAME, ap, sizeof(struct cloudfs_attr));
+  if (len == (ssize_t) sizeof(struct cloudfs_attr)) {
+    if (ap->version != ATTR_VERSION) {
+      dbg_print("[ERR] %s has attributes of version %u\n", fpath,
+          ap->version);
+      return -EINVAL;
+    }
+  } else if (len >= 0) {
+    dbg_print("[ERR] %s has attributes of %d bytes\n", fpath, (int) len);
+    return -EINVAL;
+  } else if (errno != ENODATA) {
+    /* e.g. the file does not exist, which is not worth logging */
+    return -errno;
+  } else {
+    retval = attr_load_legacy(fpath, ap);
+    ap->version = ATTR_VERSION;
+    if (retval < 0) {
+      return retval;
+    }
+    if (retval > 0) {
+      dbg_print("[DBG] converting attributes of %s\n", fpath);
+      retval = attr_set(fpath, ap);
+      if (retval == 0) {
+        attr_remove_legacy(fpath);
+      }
+      return retval;
+    }
+  }
+
+  attr_cache_put(fpath, ap);
+
+  dbg_print("[DBG] attr_get(fpath=\"%s\", flags=%u)=%d\n", fpath, ap->flags,
+      retval);
+
+  return retval;
+}
+
+/**
+ * @brief Set the attributes of a file.
+ * @param fpath Pathname of the file on SSD.
+ * @param ap The attributes.
+ * @return 0 on success, -errno otherwise.
+ */
+int attr_set(char *fpath, struct cloudfs_attr *ap)
+{
+  int retval = 0;
+
+  ap->version = ATTR_VERSION;
+  retval = lsetxattr(fpath, ATTR_NAME, ap, sizeof(struct cloudfs_attr), 0);
+  if (retval < 0) {
+    retval = cloudfs_error("attr_set");
+    attr_invalidate(fpath);
+    return retval;
+  }
+  attr_cache_put(fpath, ap);
+
+  dbg_print("[DBG] attr_set(fpath=\"%s\", flags=%u)=%d\n", fpath, ap->flags,
+      retval);
+
+  return retval;
+}
+
+/**
+ * @brief Tell the cache a file has been renamed over another pathname.
+ * @param from The old pathname.
+ * @param to The new pathname.
+ * @return Void.
+ */
+void attr_rename(char *from, char *to)
+{
+  if (Buckets == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&Attr_lock);
+  struct attr_entry *e = attr_lookup(to);
+  if (e != NULL) {
+    attr_drop(e);
+  }
+  e = attr_lookup(from);
+  if (e != NULL) {
+    char *copy = strdup(to);
+    if (copy == NULL) {
+      attr_drop(e);
+    } else {
+      /* unlink from the old bucket, link into the new one */
+      struct attr_entry **pp = &Buckets[attr_hash(e->fpath)];
+      while (*pp != e) {
+        pp = &((*pp)->next);
+      }
+      *pp = e->next;
+      free(e->fpath);
+      e->fpath = copy;
+      int bucket_id = attr_hash(copy);
+      e->next = Buckets[bucket_id];
+      Buckets[bucket_id] = e;
+    }
+  }
+  pthread_mutex_unlock(&Attr_lock);
+}
+
+/**
+ * @brief Forget the cached attributes of a file.
+ * @param fpath Pathname of the file.
+ * @return Void.
+ */
+void attr_invalidate(char *fpath)
+{
+  if (Buckets == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&Attr_lock);
+  struct attr_entry *e = attr_lookup(fpath);
+  if (e != NULL) {
+    attr_drop(e);
+  }
+  pthread_mutex_unlock(&Attr_lock);
+}
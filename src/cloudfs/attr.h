@@ -0,0 +1,29 @@
+#ifndef __ATTR_H_
+#define __ATTR_H_
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* the extended attribute holding everything CloudFS keeps about a file */
+#define ATTR_NAME ("user.cloudfs")
+#define ATTR_VERSION (1)
+
+/* flags of a file */
+#define ATTR_REMOTE (0x1) /* content is in the cloud, the file is a proxy */
+#define ATTR_DIRTY (0x2) /* a cloud file changed since it was opened */
+
+/* value of ATTR_NAME, in host byte order */
+struct cloudfs_attr {
+  uint32_t version;
+  uint32_t flags;
+  struct stat st; /* attributes of the real file, valid for cloud files */
+};
+
+int attr_init(int num_entries);
+void attr_destroy(void);
+int attr_get(char *fpath, struct cloudfs_attr *ap);
+int attr_set(char *fpath, struct cloudfs_attr *ap);
+void attr_rename(char *from, char *to);
+void attr_invalidate(char *fpath);
+
+#endif
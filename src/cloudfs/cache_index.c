@@ -0,0 +1,183 @@
+/**
+ * @file cache_index.c
+ * @brief In-memory index of the segments in the cache directory.
+ *
+ *        Every cached segment has an entry, found by its key when the
+ *        segment is accessed, its ref_count changes or it leaves the
+ *        cache. The cache policy links the same entries into its own
+ *        lists or heap to order them for eviction (see cache_policy.c),
+ *        so the cache directory is only scanned once, when mounting.
+ *        Policies keeping track of segments no longer cached use an
+ *        index of their own.
+ *
+ *        An index does no locking, its user serializes the calls.
+ *
+ * @author Yinsu Chu (yinsuc)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// #define DEBUG
+#include "cloudfs.h"
+
+#include "cache_index.h"
+
+/* initial number of hash buckets */
+#define INDEX_MIN_SIZE (1024)
+
+extern FILE *Log;
+
+/**
+ * @brief Hash a key (FNV-1a).
+ * @param key The key.
+ * @return The hash value.
+ */
+static unsigned int cache_index_hash(const char *key)
+{
+  unsigned int h = 2166136261U;
+  while (*key != '\0') {
+    h = (h ^ (unsigned char) *key++) * 16777619U;
+  }
+  return h;
+}
+
+/**
+ * @brief Double the number of hash buckets of an index.
+ * @param idx The index.
+ * @return 0 on success, -ENOMEM otherwise.
+ */
+static int cache_index_rehash(struct cache_index *idx)
+{
+  int num_buckets = 2 * idx->num_buckets;
+  struct cache_entry **buckets = (struct cache_entry **)
+    calloc(num_buckets, sizeof(struct cache_entry *));
+  if (buckets == NULL) {
+    return -ENOMEM;
+  }
+
+  int i = 0;
+  for (i = 0; i < idx->num_buckets; i++) {
+    struct cache_entry *e = idx->buckets[i];
+    while (e != NULL) {
+      struct cache_entry *hnext = e->hnext;
+      unsigned int b = cache_index_hash(e->key) % num_buckets;
+      e->hnext = buckets[b];
+      buckets[b] = e;
+      e = hnext;
+    }
+  }
+  free(idx->buckets);
+  idx->buckets = buckets;
+  idx->num_buckets = num_buckets;
+
+  dbg_print("[DBG] cache index rehashed to %d buckets\n", num_buckets);
+
+  return 0;
+}
+
+/**
+ * @brief Initialize an empty index.
+ * @param idx The index.
+ * @return 0 on success, -errno otherwise.
+ */
+int cache_index_init(struct cache_index *idx)
+{
+  int retval = 0;
+
+  idx->num_buckets = INDEX_MIN_SIZE;
+  idx->count = 0;
+  idx->buckets = (struct cache_entry **)
+    calloc(idx->num_buckets, sizeof(struct cache_entry *));
+  if (idx->buckets == NULL) {
+    retval = cloudfs_error("cache_index_init");
+    return retval;
+  }
+
+  dbg_print("[DBG] cache_index_init()=%d\n", retval);
+
+  return retval;
+}
+
+/**
+ * @brief Find the entry of a key.
+ * @param idx The index.
+ * @param key The key.
+ * @return The entry, NULL if not found.
+ */
+struct cache_entry *cache_index_find(struct cache_index *idx, const char *key)
+{
+  struct cache_entry *e =
+    idx->buckets[cache_index_hash(key) % idx->num_buckets];
+  while ((e != NULL) && (strcmp(e->key, key) != 0)) {
+    e = e->hnext;
+  }
+  return e;
+}
+
+/**
+ * @brief Add an entry to an index, its key must not be there yet.
+ * @param idx The index.
+ * @param e The entry, allocated by malloc().
+ * @return 0 on success, -ENOMEM otherwise.
+ */
+int cache_index_insert(struct cache_index *idx, struct cache_entry *e)
+{
+  if ((idx->count >= idx->num_buckets) && (cache_index_rehash(idx) < 0)) {
+    return -ENOMEM;
+  }
+
+  unsigned int b = cache_index_hash(e->key) % idx->num_buckets;
+  e->hnext = idx->buckets[b];
+  idx->buckets[b] = e;
+  idx->count++;
+
+  dbg_print("[DBG] cache_index_insert(key=\"%s\"), %d entries\n",
+      e->key, idx->count);
+
+  return 0;
+}
+
+/**
+ * @brief Take an entry out of an index, the caller frees it.
+ * @param idx The index.
+ * @param e The entry.
+ * @return Void.
+ */
+void cache_index_delete(struct cache_index *idx, struct cache_entry *e)
+{
+  struct cache_entry **pe =
+    &idx->buckets[cache_index_hash(e->key) % idx->num_buckets];
+  while (*pe != e) {
+    pe = &(*pe)->hnext;
+  }
+  *pe = e->hnext;
+  idx->count--;
+
+  dbg_print("[DBG] cache_index_delete(key=\"%s\"), %d entries\n",
+      e->key, idx->count);
+}
+
+/**
+ * @brief Free an index and all of its entries.
+ * @param idx The index.
+ * @return Void.
+ */
+void cache_index_destroy(struct cache_index *idx)
+{
+  int i = 0;
+  for (i = 0; i < idx->num_buckets; i++) {
+    struct cache_entry *e = idx->buckets[i];
+    while (e != NULL) {
+      struct cache_entry *hnext = e->hnext;
+      free(e);
+      e = hnext;
+    }
+  }
+  free(idx->buckets);
+  idx->buckets = NULL;
+  idx->num_buckets = 0;
+  idx->count = 0;
+}
@@ -0,0 +1,36 @@
+#ifndef __CACHE_INDEX_H_
+#define __CACHE_INDEX_H_
+
+#include <time.h>
+
+#include "cloudfs.h"
+
+/* a segment in the cache directory, or one a cache policy remembers */
+struct cache_entry {
+  char key[MAX_KEY_LEN + 1];
+  long size; /* compressed size, i.e. the space it takes */
+  int ref_count;
+  int clean; /* the cloud has a valid copy too */
+  int busy; /* out of the policy, its cloud copy uploaded or deleted */
+  struct timespec atime; /* last access */
+  int list; /* list of the cache policy holding it */
+  int heap_pos; /* position in the heap of the cache policy */
+  struct cache_entry *prev; /* in the list of the cache policy */
+  struct cache_entry *next;
+  struct cache_entry *hnext; /* next in the same bucket */
+};
+
+/* entries by key */
+struct cache_index {
+  struct cache_entry **buckets;
+  int num_buckets;
+  int count;
+};
+
+int cache_index_init(struct cache_index *idx);
+struct cache_entry *cache_index_find(struct cache_index *idx, const char *key);
+int cache_index_insert(struct cache_index *idx, struct cache_entry *e);
+void cache_index_delete(struct cache_index *idx, struct cache_entry *e);
+void cache_index_destroy(struct cache_index *idx);
+
+#endif
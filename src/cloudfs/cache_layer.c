@@ -10,7 +10,9 @@
  *                     algorithm.
  *        3) Eviction: eviction starts if there is a segment S in the cloud
  *                     which the user wants to use, but the cache does not have
- *                     enough space. Here, ref_count has top priority,
+ *                     enough space. The cache replacement policy orders the
+ *                     segments to evict (see cache_policy.c). With the
+ *                     default one, ref_count has top priority,
  *                     then use LRU to break the tie.
  *                     For example, first find the least referenced segment in
  *                     cache. If its ref_count is more than S's, no eviction can
@@ -18,6 +20,41 @@
  *                     S's ref_count, then evict the least recently used segment
  *                     having the smallest ref_count. Repeat this procedure
  *                     untill cache has enough space.
+ *                     Clean segments are evicted first; a dirty one is
+ *                     only uploaded, outside of Cache_lock, if the clean
+ *                     ones do not free enough space.
+ *        4) Cloud copy: a downloaded segment is clean if its cloud copy is
+ *                       kept, then evicting it only removes the cache file;
+ *                       otherwise the cloud copy is deleted (exclusive) and
+ *                       evicting it uploads it again. The --cache-mode
+ *                       option chooses, or lets a cost model choose per
+ *                       segment (see cache_policy_keep_copy()). Uploaded
+ *                       segments are dirty until evicted.
+ *        5) Background eviction: with watermarks set, an evictor thread
+ *                       wakes up when the cache is used beyond the high
+ *                       watermark, and evicts segments in the order of the
+ *                       policy until it is used below the low one. It
+ *                       uploads dirty segments outside of Cache_lock, so
+ *                       reads and writes mostly find space reserved for
+ *                       them; evicting on demand as above is left for
+ *                       when the cache fills up faster than it drains.
+ *
+ *        The cache directory is mirrored in memory by the cache index,
+ *        and the policy orders its entries, so eviction never scans the
+ *        directory. Last accesses are also saved with the cache files, and
+ *        the index is rebuilt from them when mounting. The hash table
+ *        remains the authority on ref_count, the dedup layer reports
+ *        changes with cache_layer_set_ref().
+ *
+ *        All bookkeeping (Remaining_space, the cache directory and the
+ *        eviction algorithm) is protected by Cache_lock. Downloads and
+ *        compression happen outside of it in private ".part" files, which
+ *        are renamed into the cache directory while holding the lock.
+ *        Readers open a cache file while holding the lock and decompress
+ *        it afterwards, so an eviction in another thread cannot remove
+ *        the content from under them. A segment being uploaded for
+ *        eviction stays in the cache index but not in the policy, so it is
+ *        not evicted twice; it is deleted only after the upload.
  * @author Yinsu Chu (yinsuc)
  */
 
@@ -29,8 +66,9 @@
 #include <time.h>
 #include <stdlib.h>
 #include <string.h>
-#include <limits.h>
+#include <errno.h>
 #include <dirent.h>
+#include <pthread.h>
 
 // #define DEBUG
 #include "cloudfs.h"
@@ -38,11 +76,17 @@
 #include "cloudapi.h"
 #include "compress_layer.h"
 #include "hashtable.h"
+#include "fingerprint.h"
+#include "cache_index.h"
+#include "cache_policy.h"
+#include "stats.h"
 
 #define U_TIMESTAMP ("user.timestamp")
+#define U_CLEAN ("user.clean")
+
+/* suffix of files still being downloaded or compressed into the cache */
+#define PART_SUFFIX (".part")
 
-#define CANNOT_EVICT (-1000)
-#define NO_MORE_SEGS (-1001)
 
 extern FILE *Log;
 extern char Cache_path[MAX_PATH_LEN];
@@ -50,311 +94,568 @@ extern char Cache_path[MAX_PATH_LEN];
 static long Total_space;
 static long Remaining_space;
 
+/* the segments in the cache directory, and how they are replaced */
+static struct cache_index Entries;
+static struct cache_policy *Policy;
+static int Mode;
+
+/* the evictor, and the space used that wakes it up and puts it to sleep,
+ * 0 if there is no evictor */
+static pthread_t Evictor;
+static int Evictor_started;
+static long High_mark;
+static long Low_mark;
+static int Stopping;
+
+/* protects Remaining_space, the content of the cache directory,
+ * the entries, the policy and the evictor state */
+static pthread_mutex_t Cache_lock = PTHREAD_MUTEX_INITIALIZER;
+/* signaled when the evictor is needed, when an upload of the evictor is
+ * done, or the evictor should exit */
+static pthread_cond_t Evict_cond = PTHREAD_COND_INITIALIZER;
+
+/* statistics, the cloud ones are cost metrics of the cache policy */
+static unsigned long Hits;
+static unsigned long Misses;
+static unsigned long Evictions;
+static unsigned long Clean_evictions; /* evictions without upload */
+static unsigned long Deletions; /* segments deleted while cached */
+static unsigned long Background_evictions; /* evictions of the evictor */
+static unsigned long Rejected; /* downloads not kept for lack of space */
+static unsigned long Requests; /* cloud requests */
+static unsigned long Read_bytes; /* bytes downloaded from the cloud */
+
+/* makes the names of ".part" files unique */
+static int Part_seq;
+
 int cache_layer_evict_segments(struct cloudfs_seg *keep);
+static int cache_layer_clean(struct cache_entry *e);
+static int cache_layer_evict_drop(struct cache_entry *e, int uploaded);
+static void cache_layer_wake_evictor(void);
+static void *cache_layer_evictor(void *arg);
+
+/* how the policy evicts from the cache directory */
+static const struct cache_evict_ops Evict_ops = {
+  cache_layer_clean,
+  cache_layer_evict_drop
+};
+
+/* callback function for downloading from the cloud, "ctx" is the FILE */
+static int get_buffer(const char *buf, int len, void *ctx) {
+  __sync_fetch_and_add(&Read_bytes, len);
+  return fwrite(buf, 1, len, (FILE *) ctx);
+}
 
-/* callback function for downloading from the cloud */
-static FILE *Tfile;
-static int get_buffer(const char *buf, int len) {
-  return fwrite(buf, 1, len, Tfile);
+/* callback function for uploading to the cloud, "ctx" is the FILE */
+static int put_buffer(char *buf, int len, void *ctx) {
+  return fread(buf, 1, len, (FILE *) ctx);
 }
 
-/* callback function for uploading to the cloud */
-static FILE *Cfile;
-static int put_buffer(char *buf, int len) {
-  return fread(buf, 1, len, Cfile);
+/**
+ * @brief Generate a unique ".part" file name for a cache file.
+ * @param cache_file Pathname of the cache file.
+ * @param part_file The ".part" file name is returned here. It should have
+ *                  MAX_PATH_LEN bytes.
+ * @return Void.
+ */
+static void cache_layer_get_part_file(char *cache_file, char *part_file)
+{
+  snprintf(part_file, MAX_PATH_LEN, "%s%s.%d", cache_file, PART_SUFFIX,
+      __sync_fetch_and_add(&Part_seq, 1));
 }
 
-/* Referenced from time.h. Compares two timespec structure. */
-static inline int timespec_compare(const struct timespec *lhs,
-    const struct timespec *rhs)
+/**
+ * @brief Start keeping track of a segment that entered the cache.
+ *        The caller must hold Cache_lock.
+ * @param key Key of the segment.
+ * @param size Space taken by the segment.
+ * @param atime Last access of the segment.
+ * @param clean Whether the cloud has a valid copy of the segment.
+ * @param busy Whether to keep the segment out of the policy until
+ *             cache_layer_release().
+ * @return 0 on success, negative otherwise.
+ */
+static int cache_layer_track(char *key, long size, struct timespec *atime,
+    int clean, int busy)
 {
-  if (lhs->tv_sec < rhs->tv_sec) {
-    return -1;
+  int retval = 0;
+
+  struct cache_entry *e =
+    (struct cache_entry *) calloc(1, sizeof(struct cache_entry));
+  if (e == NULL) {
+    retval = cloudfs_error("cache_layer_track");
+    return retval;
   }
-  if (lhs->tv_sec > rhs->tv_sec) {
-    return 1;
+  strncpy(e->key, key, MAX_KEY_LEN);
+  e->size = size;
+  e->atime = *atime;
+  e->clean = clean;
+  e->busy = busy;
+
+  /* not referenced by any file yet if just uploaded to the cache */
+  struct cloudfs_seg seg;
+  seg.ref_count = 0;
+  seg.seg_size = 0;
+  memcpy(seg.key, e->key, MAX_KEY_LEN + 1);
+  struct cloudfs_seg found;
+  ht_search(&seg, &found);
+  e->ref_count = found.ref_count;
+
+  retval = cache_index_insert(&Entries, e);
+  if (retval < 0) {
+    free(e);
+    return retval;
+  }
+  if (busy) {
+    return retval;
   }
-  return lhs->tv_nsec - rhs->tv_nsec;
+  retval = Policy->insert(e);
+  if (retval < 0) {
+    cache_index_delete(&Entries, e);
+    free(e);
+    return retval;
+  }
+
+  return retval;
 }
 
 /**
- * @brief CloudFS should call this function upon starting.
- * @param total_space The --cache-size argument passed to CloudFS.
- * @param init_space Cache space already been used upon starting.
- * @return 0 on success (always 0 for now).
+ * @brief Give a busy segment to the policy, and wake up the threads
+ *        waiting for it. The caller must hold Cache_lock.
+ * @param e Entry of the segment, dropped if the policy fails to take it.
+ * @return 0 on success, negative otherwise.
  */
-int cache_layer_init(int total_space, int init_space)
+static int cache_layer_release(struct cache_entry *e)
 {
-  Total_space = total_space;
-  Remaining_space = total_space - init_space;
+  int retval = 0;
 
-  if (Remaining_space < 0) {
-    dbg_print("[DBG] Remaining_space is %ld,"
-        " starting eviction algorithm in cache_layer_init\n", Remaining_space);
-    cache_layer_evict_segments(NULL);
+  e->busy = 0;
+  pthread_cond_broadcast(&Evict_cond);
+  retval = Policy->insert(e);
+  if (retval < 0) {
+    dbg_print("[ERR] failed to give %s to the cache policy\n", e->key);
+    cache_index_delete(&Entries, e);
+    free(e);
   }
 
-  dbg_print("[DBG] cache_layer_init(), total %ld bytes, used %d bytes,"
-      " remaining %ld bytes\n", Total_space, init_space, Remaining_space);
+  return retval;
+}
 
-  return 0;
+/**
+ * @brief Stop keeping track of a segment that left the cache.
+ *        If the segment is busy, e.g. the evictor is uploading it, this
+ *        waits until it is done. The caller must hold Cache_lock.
+ * @param key Key of the segment.
+ * @param clean Whether the cloud had a valid copy is returned here.
+ * @return Space the segment took, -ENOENT if it was not in the cache.
+ */
+static long cache_layer_untrack(char *key, int *clean)
+{
+  struct cache_entry *e = NULL;
+  while (((e = cache_index_find(&Entries, key)) != NULL) && e->busy) {
+    pthread_cond_wait(&Evict_cond, &Cache_lock);
+  }
+  if (e == NULL) {
+    return -ENOENT;
+  }
+  long size = e->size;
+  *clean = e->clean;
+  Policy->remove(e);
+  cache_index_delete(&Entries, e);
+  free(e);
+  return size;
 }
 
 /**
- * @brief Update a cache file with current timestamp.
- *        The timestamp is saved as an extended attribute.
- * @param cache_file Pathname of the cache file. It should have
- *        MAX_PATH_LEN bytes.
+ * @brief Record an access to a segment in the cache.
+ *        The time is given to the cache policy, and saved as an extended
+ *        attribute of the cache file so the order survives remounting.
+ *        The caller must hold Cache_lock.
+ * @param key Key of the segment.
+ * @param size Space taken by the segment if it just entered the cache,
+ *             negative if it was there already.
+ * @param busy Whether a segment that just entered the cache is kept out
+ *             of the policy until cache_layer_release().
  * @return 0 on success, negative otherwise.
  */
-int update_timestamp(char *cache_file)
+static int cache_layer_touch(char *key, long size, int busy)
 {
   int retval = 0;
 
+  char cache_file[MAX_PATH_LEN] = "";
+  sprintf(cache_file, "%s/%s", Cache_path, key);
+
   struct timespec ts;
   retval = clock_gettime(CLOCK_REALTIME, &ts);
   if (retval < 0) {
-    retval = cloudfs_error("update_timestamp");
+    retval = cloudfs_error("cache_layer_touch");
     return retval;
   }
+
+  if (size >= 0) {
+    retval = cache_layer_track(key, size, &ts, 0, busy);
+  } else {
+    struct cache_entry *e = cache_index_find(&Entries, key);
+    if (e != NULL) {
+      e->atime = ts;
+      if (!e->busy) {
+        Policy->access(e);
+      }
+    } else {
+      retval = -ENOENT;
+    }
+  }
+  if (retval < 0) {
+    dbg_print("[ERR] failed to keep track of %s in the cache\n", key);
+    return retval;
+  }
+
   retval = lsetxattr(cache_file, U_TIMESTAMP, &ts, sizeof(struct timespec), 0);
   if (retval < 0) {
-    retval = cloudfs_error("update_timestamp");
+    retval = cloudfs_error("cache_layer_touch");
     return retval;
   }
 
   dbg_print("[DBG] cache file %s timestamp updated to %ld sec %ld nsec\n",
       cache_file, ts.tv_sec, ts.tv_nsec);
 
-  dbg_print("[DBG] update_timestamp(cache_file=\"%s\")=%d\n",
-      cache_file, retval);
-
   return retval;
 }
 
-/**
- * @brief Check whether a segment is in "evicted" array.
- * @param num_evicted Number of segments in "evicted".
- * @param evicted Array of segments.
- * @param key The MD5 of the cache file.
- *            It should have 2 * MD5_DIGEST_LENGTH bytes.
- * @return 0 on not in, 1 otherwise.
- */
-int cache_layer_in_evicted(int num_evicted, struct cloudfs_seg *evicted,
-    char *key)
+/* orders segments found in the cache directory by last access */
+static int cache_layer_cmp_atime(const void *a, const void *b)
 {
-  int i = 0;
-  for (i = 0; i < num_evicted; i++) {
-    dbg_print("[DBG] comparing with %s in \"evicted\"\n", evicted[i].md5);
-    if (memcmp(evicted[i].md5, key, 2 * MD5_DIGEST_LENGTH) == 0) {
-      dbg_print("[DBG] segment %s found in \"evicted\"\n", key);
-      return 1;
-    }
+  const struct cache_entry *ea = (const struct cache_entry *) a;
+  const struct cache_entry *eb = (const struct cache_entry *) b;
+  if (ea->atime.tv_sec != eb->atime.tv_sec) {
+    return (ea->atime.tv_sec < eb->atime.tv_sec) ? -1 : 1;
+  }
+  if (ea->atime.tv_nsec != eb->atime.tv_nsec) {
+    return (ea->atime.tv_nsec < eb->atime.tv_nsec) ? -1 : 1;
   }
-  dbg_print("[DBG] segment %s not found in \"evicted\"\n", key);
   return 0;
 }
 
 /**
- * @brief Traverse the cache directory, find the least ref_count value.
- *        "num_evicted" number of segments in "evicted" and the
- *        "keep" segment are ignored.
- * @param num_evicted Number of segments in "evicted".
- * @param evicted Array of segments to ignore.
- * @param keep Segment to ignore.
- * @param least_ref_count Return the result here.
+ * @brief Keep track of the segments in the cache directory.
+ *        They are given to the cache policy from the least recently
+ *        accessed, according to the times saved with the cache files.
  * @return 0 on success, negative otherwise.
  */
-int cache_layer_find_least_ref_count(int num_evicted,
-    struct cloudfs_seg *evicted, struct cloudfs_seg *keep,
-    int *least_ref_count)
+static int cache_layer_scan(void)
 {
   int retval = 0;
-  int least = INT_MAX;
+  int num_found = 0;
+  int max_found = 0;
+  struct cache_entry *found = NULL;
 
-  *least_ref_count = NO_MORE_SEGS;
-  dbg_print("[DBG] pre-set least_ref_count to NO_MORE_SEGS(%d)\n",
-      *least_ref_count);
+  DIR *dir = opendir(Cache_path);
+  if (dir == NULL) {
+    retval = cloudfs_error("cache_layer_scan");
+    return retval;
+  }
 
-  DIR *dir = NULL;
   struct dirent *ent = NULL;
-  if ((dir = opendir(Cache_path)) != NULL) {
-
-    while ((ent = readdir(dir)) != NULL) {
-      dbg_print("[DBG] scanning cache dir: %s\n", ent->d_name);
-
-      if ((strlen(ent->d_name) == (2 * MD5_DIGEST_LENGTH))
-          && ((keep == NULL)
-            || (memcmp(keep->md5, ent->d_name, 2 * MD5_DIGEST_LENGTH) != 0))
-          && (!cache_layer_in_evicted(num_evicted, evicted, ent->d_name))) {
-
-        dbg_print("[DBG] segment %s not in \"evicted\" and"
-            " not equal to \"keep\"\n", ent->d_name);
-
-        struct cloudfs_seg seg;
-        seg.ref_count = 0;
-        seg.seg_size = 0;
-        memset(seg.md5, '\0', 2 * MD5_DIGEST_LENGTH + 1);
-        memcpy(seg.md5, ent->d_name, 2 * MD5_DIGEST_LENGTH);
-
-        struct cloudfs_seg *found = NULL;
-        retval = ht_search(&seg, &found);
-        if (retval < 0) {
-          return retval;
-        }
-        dbg_print("[DBG] segment found in hash table:\n");
-#ifdef DEBUG
-        print_seg(found);
-#endif
+  while ((ent = readdir(dir)) != NULL) {
+    dbg_print("[DBG] scanning cache dir: %s\n", ent->d_name);
+
+    /* skip over . and .. */
+    if (!fp_is_key(ent->d_name)) {
+      continue;
+    }
 
-        if (found->ref_count < least) {
-          least = found->ref_count;
-          *least_ref_count = least;
-          dbg_print("[DBG] least_ref_count updated to %d\n", *least_ref_count);
-        }
+    if (num_found == max_found) {
+      max_found = (max_found > 0) ? 2 * max_found : 64;
+      struct cache_entry *enlarge = (struct cache_entry *)
+        realloc(found, max_found * sizeof(struct cache_entry));
+      if (enlarge == NULL) {
+        retval = cloudfs_error("cache_layer_scan");
+        break;
       }
+      found = enlarge;
+    }
+    struct cache_entry *e = &found[num_found];
+    memset(e->key, '\0', MAX_KEY_LEN + 1);
+    strncpy(e->key, ent->d_name, MAX_KEY_LEN);
+
+    char cache_file[MAX_PATH_LEN] = "";
+    sprintf(cache_file, "%s/%s", Cache_path, e->key);
+    struct stat sb;
+    if (lstat(cache_file, &sb) < 0) {
+      retval = cloudfs_error("cache_layer_scan");
+      break;
+    }
+    e->size = sb.st_size;
+
+    /* a file without timestamp is evicted first */
+    if (lgetxattr(cache_file, U_TIMESTAMP, &e->atime, sizeof(struct timespec))
+        != sizeof(struct timespec)) {
+      e->atime.tv_sec = 0;
+      e->atime.tv_nsec = 0;
+    }
+
+    /* a file not known to be clean is uploaded when evicted */
+    if (lgetxattr(cache_file, U_CLEAN, &e->clean, sizeof(int))
+        != sizeof(int)) {
+      e->clean = 0;
+    }
+    num_found++;
+  }
+  closedir(dir);
+
+  if (retval == 0) {
+    qsort(found, num_found, sizeof(struct cache_entry), cache_layer_cmp_atime);
+    int i = 0;
+    for (i = 0; (i < num_found) && (retval == 0); i++) {
+      retval = cache_layer_track(found[i].key, found[i].size,
+          &found[i].atime, found[i].clean, 0);
     }
-    closedir(dir);
-  } else {
-    retval = cloudfs_error("cache_layer_find_least_ref_count");
   }
+  free(found);
+
+  dbg_print("[DBG] cache_layer_scan()=%d, %d segments\n", retval,
+      Entries.count);
 
   return retval;
 }
 
 /**
- * @brief Traverse the cache directory, get the oldest seg with given ref_count.
- *        "num_evicted" number of segments in "evicted" and the
- *        "keep" segment are ignored.
- * @param num_evicted Number of segments in "evicted".
- * @param evicted Array of segments to ignore.
- * @param keep Segment to ignore.
- * @param least_ref_count Target ref_count to match.
- * @param next_evict Copy and return the qualified segment here.
+ * @brief Write the statistics of the cache layer.
+ * @param out The statistics file.
+ * @return Void.
+ */
+static void cache_layer_stats(FILE *out)
+{
+  pthread_mutex_lock(&Cache_lock);
+  fprintf(out, "policy %s\n", Policy->name);
+  fprintf(out, "mode %s\n", cache_policy_mode_name(Mode));
+  fprintf(out, "capacity %ld\n", Total_space);
+  fprintf(out, "used %ld\n", Total_space - Remaining_space);
+  fprintf(out, "segments %d\n", Entries.count);
+  fprintf(out, "hits %lu\n", Hits);
+  fprintf(out, "misses %lu\n", Misses);
+  fprintf(out, "evictions %lu\n", Evictions);
+  fprintf(out, "clean_evictions %lu\n", Clean_evictions);
+  fprintf(out, "deletions %lu\n", Deletions);
+  fprintf(out, "background_evictions %lu\n", Background_evictions);
+  fprintf(out, "rejected %lu\n", Rejected);
+  fprintf(out, "requests %lu\n", Requests);
+  fprintf(out, "read_bytes %lu\n", Read_bytes);
+  if (Policy->stats != NULL) {
+    Policy->stats(out);
+  }
+  pthread_mutex_unlock(&Cache_lock);
+}
+
+/**
+ * @brief CloudFS should call this function upon starting.
+ * @param total_space The --cache-size argument passed to CloudFS.
+ * @param init_space Cache space already been used upon starting.
+ * @param policy One of the CACHE_POLICY_* replacement policies.
+ * @param mode One of the CACHE_MODE_* modes.
+ * @param high_mark Percentage of the cache used that wakes the evictor up,
+ *                  0 for no evictor. The evictor is started by
+ *                  cache_layer_start_evictor().
+ * @param low_mark Percentage of the cache used the evictor stops at.
  * @return 0 on success, negative otherwise.
  */
-int cache_layer_find_oldest_seg(int num_evicted, struct cloudfs_seg *evicted,
-    struct cloudfs_seg *keep, int least_ref_count,
-    struct cloudfs_seg *next_evict)
+int cache_layer_init(int total_space, int init_space, int policy, int mode,
+    int high_mark, int low_mark)
 {
   int retval = 0;
-  struct timespec oldest_ts;
-  oldest_ts.tv_sec = 0;
-  oldest_ts.tv_nsec = 0;
 
-  DIR *dir = NULL;
-  struct dirent *ent = NULL;
-  if ((dir = opendir(Cache_path)) != NULL) {
+  pthread_mutex_lock(&Cache_lock);
+  Policy = cache_policy_get(policy);
+  Mode = mode;
+  Total_space = total_space;
+  Remaining_space = total_space - init_space;
 
-    while ((ent = readdir(dir)) != NULL) {
-      dbg_print("[DBG] scanning cache dir: %s\n", ent->d_name);
+  retval = cache_index_init(&Entries);
+  if (retval == 0) {
+    retval = Policy->init(total_space);
+  }
+  if (retval == 0) {
+    retval = cache_layer_scan();
+  }
 
-      /* skip over . and .. */
-      if (strlen(ent->d_name) != (2 * MD5_DIGEST_LENGTH)) {
-        continue;
-      }
+  if ((retval == 0) && (Remaining_space < 0)) {
+    dbg_print("[DBG] Remaining_space is %ld,"
+        " starting eviction algorithm in cache_layer_init\n", Remaining_space);
+    cache_layer_evict_segments(NULL);
+  }
 
-      struct cloudfs_seg seg;
-      seg.ref_count = 0;
-      seg.seg_size = 0;
-      memset(seg.md5, '\0', 2 * MD5_DIGEST_LENGTH + 1);
-      memcpy(seg.md5, ent->d_name, 2 * MD5_DIGEST_LENGTH);
+  if ((retval == 0) && (high_mark > 0)) {
+    High_mark = (long) total_space * high_mark / 100;
+    Low_mark = (long) total_space * low_mark / 100;
+  }
+  pthread_mutex_unlock(&Cache_lock);
 
-      struct cloudfs_seg *found = NULL;
-      retval = ht_search(&seg, &found);
-      if (retval < 0) {
-        return retval;
-      }
-      dbg_print("[DBG] segment found in hash table:\n");
-#ifdef DEBUG
-      print_seg(found);
-#endif
+  stats_register("cache", cache_layer_stats);
 
-      if ((found->ref_count == least_ref_count)
-          && ((keep == NULL)
-            || (memcmp(keep->md5, ent->d_name, 2 * MD5_DIGEST_LENGTH) != 0))
-          && (!cache_layer_in_evicted(num_evicted, evicted, ent->d_name))) {
-
-        dbg_print("[DBG] segment %s not in \"evicted\" and"
-            " not equal to \"keep\"\n", ent->d_name);
-
-        char cache_file[MAX_PATH_LEN] = "";
-        sprintf(cache_file, "%s/%s", Cache_path, found->md5);
-        dbg_print("[DBG] cache file %s has least_ref_count %d\n",
-            cache_file, found->ref_count);
-
-        struct timespec ts;
-        retval =
-          lgetxattr(cache_file, U_TIMESTAMP, &ts, sizeof(struct timespec));
-        if (retval < 0) {
-          retval = cloudfs_error("cache_layer_find_oldest_seg");
-          return retval;
-        }
-        dbg_print("[DBG] timestamp of %s:\n", cache_file);
-        dbg_print("      tv_sec = %ld\n", ts.tv_sec);
-        dbg_print("      tv_nsec = %ld\n", ts.tv_nsec);
-
-        if (oldest_ts.tv_sec == 0 && oldest_ts.tv_nsec == 0) {
-          oldest_ts = ts;
-          dbg_print("[DBG] oldest_ts initialized to:\n");
-          dbg_print("      tv_sec = %ld\n", oldest_ts.tv_sec);
-          dbg_print("      tv_nsec = %ld\n", oldest_ts.tv_nsec);
-
-          next_evict->ref_count = found->ref_count;
-          next_evict->seg_size = found->seg_size;
-          memset(next_evict->md5, '\0', 2 * MD5_DIGEST_LENGTH + 1);
-          memcpy(next_evict->md5, found->md5, 2 * MD5_DIGEST_LENGTH);
-          dbg_print("[DBG] next_evict initialized to:\n");
-#ifdef DEBUG
-          print_seg(next_evict);
-#endif
-        } else if (timespec_compare(&ts, &oldest_ts) < 0) {
-          oldest_ts = ts;
-          dbg_print("[DBG] oldest_ts updated to:\n");
-          dbg_print("      tv_sec = %ld\n", oldest_ts.tv_sec);
-          dbg_print("      tv_nsec = %ld\n", oldest_ts.tv_nsec);
-
-          next_evict->ref_count = found->ref_count;
-          next_evict->seg_size = found->seg_size;
-          memset(next_evict->md5, '\0', 2 * MD5_DIGEST_LENGTH + 1);
-          memcpy(next_evict->md5, found->md5, 2 * MD5_DIGEST_LENGTH);
-          dbg_print("[DBG] next_evict updated to:\n");
-#ifdef DEBUG
-          print_seg(next_evict);
-#endif
-        }
-      }
+  dbg_print("[DBG] cache_layer_init(), policy %s, mode %s, total %ld bytes,"
+      " used %d bytes, remaining %ld bytes, watermarks %ld/%ld bytes\n",
+      Policy->name, cache_policy_mode_name(Mode), Total_space, init_space,
+      Remaining_space, High_mark, Low_mark);
+
+  return retval;
+}
+
+/**
+ * @brief Start the evictor, if cache_layer_init() was given a high
+ *        watermark. This should be called after FUSE has forked into the
+ *        background, the threads of the parent are not in the daemon.
+ * @return 0 on success, negative otherwise.
+ */
+int cache_layer_start_evictor(void)
+{
+  int retval = 0;
+
+  pthread_mutex_lock(&Cache_lock);
+  if ((High_mark > 0) && !Evictor_started) {
+    Stopping = 0;
+    retval = -pthread_create(&Evictor, NULL, cache_layer_evictor, NULL);
+    if (retval == 0) {
+      Evictor_started = 1;
+      cache_layer_wake_evictor();
     }
-    closedir(dir);
-  } else {
-    retval = cloudfs_error("cache_layer_find_oldest_seg");
   }
+  pthread_mutex_unlock(&Cache_lock);
+
+  dbg_print("[DBG] cache_layer_start_evictor()=%d\n", retval);
+
   return retval;
 }
 
 /**
- * @brief Evict segments according to the cache eviction algorithm.
+ * @brief Stop the evictor, if it was started.
+ *        It returns after the evictor is done with its upload, if any.
+ * @return Void.
+ */
+void cache_layer_stop_evictor(void)
+{
+  pthread_mutex_lock(&Cache_lock);
+  Stopping = 1;
+  pthread_cond_broadcast(&Evict_cond);
+  int started = Evictor_started;
+  Evictor_started = 0;
+  pthread_mutex_unlock(&Cache_lock);
+
+  if (started) {
+    pthread_join(Evictor, NULL);
+  }
+}
+
+/**
+ * @brief Record a new reference count of a segment.
+ *        This should be called whenever the reference count of a segment
+ *        changes in the hash table, some cache policies depend on it.
+ * @param key Key of the segment.
+ * @param ref_count The reference count.
+ * @return Void.
+ */
+void cache_layer_set_ref(char *key, int ref_count)
+{
+  pthread_mutex_lock(&Cache_lock);
+  struct cache_entry *e = cache_index_find(&Entries, key);
+  if (e != NULL) {
+    e->ref_count = ref_count;
+    if ((Policy->update != NULL) && !e->busy) {
+      Policy->update(e);
+    }
+  }
+  pthread_mutex_unlock(&Cache_lock);
+}
+
+/**
+ * @brief Delete an evicted segment from the cache directory.
+ *        The segment must have been taken by Policy->victim(), and be
+ *        in the cloud already. The caller must hold Cache_lock.
+ * @param e Entry of the segment, freed on success.
+ * @return 0 on success, negative otherwise.
+ */
+static int cache_layer_drop(struct cache_entry *e)
+{
+  int retval = 0;
+
+  char cache_file[MAX_PATH_LEN] = "";
+  sprintf(cache_file, "%s/%s", Cache_path, e->key);
+
+  retval = remove(cache_file);
+  if (retval < 0) {
+    retval = cloudfs_error("cache_layer_drop");
+    return retval;
+  }
+  dbg_print("[DBG] cache file %s deleted\n", cache_file);
+
+  Remaining_space += e->size;
+  dbg_print("[DBG] global Remaining_space increased to %ld\n",
+      Remaining_space);
+
+  if (Policy->evicted != NULL) {
+    Policy->evicted(e);
+  }
+  cache_index_delete(&Entries, e);
+  free(e);
+  Evictions++;
+
+  return retval;
+}
+
+/**
+ * @brief Delete a segment evicted by cache_policy_evict() or
+ *        cache_policy_drain(), counting it as a clean eviction unless it
+ *        was uploaded to be evicted. The caller must hold Cache_lock.
+ * @param e Entry of the segment, freed on success.
+ * @param uploaded Whether the segment was uploaded to be evicted.
+ * @return 0 on success, negative otherwise.
+ */
+static int cache_layer_evict_drop(struct cache_entry *e, int uploaded)
+{
+  int retval = cache_layer_drop(e);
+  if ((retval == 0) && !uploaded) {
+    Clean_evictions++;
+  }
+  return retval;
+}
+
+/**
+ * @brief Wake the evictor up if the cache is used beyond the high
+ *        watermark. The caller must hold Cache_lock.
+ * @return Void.
+ */
+static void cache_layer_wake_evictor(void)
+{
+  if ((High_mark > 0) && (Total_space - Remaining_space > High_mark)) {
+    pthread_cond_broadcast(&Evict_cond);
+  }
+}
+
+/**
+ * @brief Evict segments according to the cache replacement policy.
  *        This is called when Remaining_space is less than zero and its purpose
  *        is to evict segments to make Remaining_space above or equal to zero.
- *        The algorithm works like this:
+ *        The policy gives the segments in the order to evict them, and
+ *        may refuse to evict one for "keep": e.g. with the refcount policy
  *          1) First evict the least referenced segments (less than ref_count of
  *             "keep"). Use timestamp to break ties (LRU).
  *          2) If "keep" has a least referenced count,
  *             evict based on timestamp (LRU).
  *          3) If "keep" is the ONLY segment with the least referenced count,
  *             return CANNOT_EVICT to indicate no segments can be evicted.
- *        Upon successful evition, this function should upload all
- *        evicted segments to the cloud, delete the copies in the cache and
- *        updates the global Remaining_space variable.
+ *        Nothing is evicted unless enough space can be freed.
+ *        Clean segments are evicted first; dirty ones are uploaded like
+ *        the evictor does, with Cache_lock released, only if the clean
+ *        ones do not free enough space (see cache_policy_evict()).
+ *        The caller must hold Cache_lock.
  * @param keep The segment struct of the segment causing the eviction.
- *             This segment should not be evicted.
+ *             This segment should not be evicted, it must not be tracked
+ *             yet.
  * @return 0 on success, CANNOT_EVICT if not segments can be evicted,
  *         negative otherwise.
  */
 int cache_layer_evict_segments(struct cloudfs_seg *keep)
 {
   int retval = 0;
-  long remaining_space = Remaining_space;
 
   dbg_print("[DBG] making space for this segment:\n");
 #ifdef DEBUG
@@ -364,145 +665,240 @@ int cache_layer_evict_segments(struct cloudfs_seg *keep)
 #endif
 
   /* search for "keep" in the hash table,
-   * save the result in "found" */
-  struct cloudfs_seg *found = NULL;
-  retval = ht_search(keep, &found);
-  if (retval < 0) {
-    return retval;
+   * save the result in "cand" */
+  struct cache_entry cand;
+  memset(&cand, 0, sizeof(struct cache_entry));
+  if (keep != NULL) {
+    struct cloudfs_seg found;
+    retval = ht_search(keep, &found);
+    if (retval < 0) {
+      return retval;
+    }
+    if (found.ref_count > 0) {
+      dbg_print("[DBG] segment found in hash table\n");
+    } else {
+      dbg_print("[ERR] segment not found in hash table\n");
+    }
+    memcpy(cand.key, keep->key, MAX_KEY_LEN + 1);
+    cand.ref_count = found.ref_count;
   }
-  if (found != NULL) {
-    dbg_print("[DBG] segment found in hash table\n");
-  } else {
-    dbg_print("[ERR] segment not found in hash table\n");
+
+  return cache_policy_evict(Policy, &Remaining_space,
+      (keep != NULL) ? &cand : NULL, &Evict_ops);
+}
+
+/**
+ * @brief Upload a dirty segment for eviction, making it clean.
+ *        Cache_lock is released during the upload, meanwhile the segment
+ *        stays in the cache index, out of the policy.
+ *        The caller must hold Cache_lock.
+ * @param e Entry of the segment, taken by Policy->victim().
+ * @return 0 on success, negative otherwise.
+ */
+static int cache_layer_clean(struct cache_entry *e)
+{
+  int retval = 0;
+
+  char cache_file[MAX_PATH_LEN] = "";
+  sprintf(cache_file, "%s/%s", Cache_path, e->key);
+
+  FILE *cfile = fopen(cache_file, "rb");
+  if (cfile == NULL) {
+    retval = cloudfs_error("cache_layer_clean");
+    return retval;
   }
 
-  int num_evicted = 0;
-  struct cloudfs_seg *evicted = NULL;
-  struct cloudfs_seg next_evict;
+  e->busy = 1;
+  char key[MAX_KEY_LEN + 1];
+  memcpy(key, e->key, MAX_KEY_LEN + 1);
+  long size = e->size;
+  pthread_mutex_unlock(&Cache_lock);
 
-  while (remaining_space < 0) {
+  __sync_fetch_and_add(&Requests, 1);
+  cloud_put_object_ctx(BUCKET, key, size, put_buffer, cfile);
+  cloud_print_error();
+  fclose(cfile);
+  dbg_print("[DBG] segment %s uploaded before eviction\n", cache_file);
 
-    /* traverse the cache directory, find the least ref_count value,
-     * excluding segments in "evicted" and the "found" segment */
-    int least_ref_count = 0;
-    retval = cache_layer_find_least_ref_count(num_evicted, evicted, found,
-        &least_ref_count);
-    if (retval < 0) {
-      return retval;
-    }
-    dbg_print("[DBG] least reference count value is %d\n", least_ref_count);
+  pthread_mutex_lock(&Cache_lock);
+  e->busy = 0;
+  e->clean = 1;
+  pthread_cond_broadcast(&Evict_cond);
 
-    if (least_ref_count == NO_MORE_SEGS
-        || ((found != NULL) && (least_ref_count > (found->ref_count)))) {
+  retval = lsetxattr(cache_file, U_CLEAN, &e->clean, sizeof(int), 0);
+  if (retval < 0) {
+    retval = cloudfs_error("cache_layer_clean");
+    return retval;
+  }
 
-      /* failed to evict */
-      if (evicted != NULL) {
-        free(evicted);
-      }
-      return CANNOT_EVICT;
+  return retval;
+}
 
-    } else {
+/**
+ * @brief Evict segments until the cache is used below the low watermark.
+ *        A segment accessed while the evictor uploaded it is given back
+ *        to the policy instead. The caller must hold Cache_lock.
+ * @return Void.
+ */
+static void cache_layer_evict_background(void)
+{
+  Background_evictions += cache_policy_drain(Policy, &Remaining_space,
+      Total_space - Low_mark, &Stopping, &Evict_ops);
 
-      /* traverse the cache directory,
-       * find the oldest segment with least_ref_count,
-       * excluding segments in "evicted" and the "found" segment */
-      retval = cache_layer_find_oldest_seg(num_evicted, evicted, found,
-          least_ref_count, &next_evict);
-      if (retval < 0) {
-        return retval;
-      }
-      dbg_print("[DBG] next segment to evict is:\n");
-#ifdef DEBUG
-      print_seg(&next_evict);
-#endif
+  dbg_print("[DBG] evictor done, remaining space %ld\n", Remaining_space);
+}
+
+/**
+ * @brief Main loop of the evictor.
+ *        It sleeps until the cache is used beyond the high watermark.
+ * @param arg Unused.
+ * @return NULL.
+ */
+static void *cache_layer_evictor(void *arg)
+{
+  (void) arg;
+
+  pthread_mutex_lock(&Cache_lock);
+  while (!Stopping) {
+    if (Total_space - Remaining_space > High_mark) {
+      cache_layer_evict_background();
+    }
+    if (!Stopping) {
+      pthread_cond_wait(&Evict_cond, &Cache_lock);
     }
+  }
+  pthread_mutex_unlock(&Cache_lock);
 
-    /* add the newly found segment to "evicted" */
-    int old_size = num_evicted * sizeof(struct cloudfs_seg);
-    dbg_print("[DBG] old size is %d * %d = %d\n",
-        num_evicted, sizeof(struct cloudfs_seg), old_size);
+  return NULL;
+}
 
-    num_evicted++;
+/**
+ * @brief Move a freshly downloaded segment into the cache directory.
+ *        This accounts for its space, and starts the eviction algorithm
+ *        if needed. If nothing can be evicted, the segment is only kept
+ *        long enough for the caller to decompress it, and its cloud copy
+ *        is kept; otherwise the cloud copy is deleted, unless the cache
+ *        mode keeps it and makes the segment clean. The cloud copy is
+ *        deleted with Cache_lock released, meanwhile the segment is busy
+ *        so that no eviction uploads it again.
+ *        The segment only enters the cache directory once there is space
+ *        for it. The eviction may release Cache_lock to upload a dirty
+ *        segment, so another thread may have cached the same segment
+ *        meanwhile, and then its copy is used.
+ *        The caller must hold Cache_lock.
+ * @param part_file Pathname of the downloaded file.
+ * @param cache_file Pathname of the cache file.
+ * @param segp Pointer to the segment struct of the downloaded segment.
+ * @param comp The opened cache file is returned here.
+ * @return 0 on success, negative otherwise.
+ */
+static int cache_layer_admit_seg(char *part_file, char *cache_file,
+    struct cloudfs_seg *segp, FILE **comp)
+{
+  int retval = 0;
+  int evict_failed = 0;
 
-    int new_size = num_evicted * sizeof(struct cloudfs_seg);
-    dbg_print("[DBG] new size is %d * %d = %d\n",
-        num_evicted, sizeof(struct cloudfs_seg), new_size);
+  /* update remaining space */
+  struct stat sb;
+  retval = lstat(part_file, &sb);
+  if (retval < 0) {
+    retval = cloudfs_error("cache_layer_admit_seg");
+    remove(part_file);
+    return retval;
+  }
+  Remaining_space -= (sb.st_size);
+  dbg_print("[DBG] segment size is %llu\n", sb.st_size);
+  dbg_print("[DBG] Remaining space decreases to %ld\n", Remaining_space);
 
-    struct cloudfs_seg *enlarge =
-      (struct cloudfs_seg *) realloc(evicted, new_size);
-    if (enlarge == NULL) {
-      retval = cloudfs_error("cache_layer_evict_segments");
+  /* start cache eviction algorithm if needed */
+  if (Remaining_space < 0) {
+    dbg_print("[DBG] remaining space less than zero, starting eviction\n");
+    retval = cache_layer_evict_segments(segp);
+    if (retval == CANNOT_EVICT) {
+      dbg_print("[DBG] cannot evict any segments\n");
+      Remaining_space += (sb.st_size);
+      dbg_print("[DBG] remaining space restored to %ld\n", Remaining_space);
+      evict_failed = 1;
+      Rejected++;
+      retval = 0;
+    } else if (retval < 0) {
+      Remaining_space += (sb.st_size);
+      remove(part_file);
       return retval;
     } else {
-      evicted = enlarge;
+      dbg_print("[DBG] eviction succeeded\n");
     }
-    dbg_print("[DBG] memory (re-)allocated\n");
-
-    struct cloudfs_seg *new_evicted = (struct cloudfs_seg *)
-      ((char *) evicted + old_size);
-    new_evicted->ref_count = next_evict.ref_count;
-    new_evicted->seg_size = next_evict.seg_size;
-    memset(new_evicted->md5, '\0', 2 * MD5_DIGEST_LENGTH + 1);
-    memcpy(new_evicted->md5, next_evict.md5, 2 * MD5_DIGEST_LENGTH);
-    dbg_print("[DBG] next segment to evict added to array\n");
-
-    char cache_file[MAX_PATH_LEN] = "";
-    sprintf(cache_file, "%s/%s", Cache_path, next_evict.md5);
+  } else {
+    /* Remaining space is enough, no need of eviction */
+    dbg_print("[DBG] remaining space is enough\n");
+  }
 
-    /* get compressed segment length */
-    struct stat sb;
-    retval = lstat(cache_file, &sb);
-    if (retval < 0) {
-      retval = cloudfs_error("cache_layer_evict_segments");
+  if (!evict_failed && (cache_index_find(&Entries, segp->key) != NULL)) {
+    /* cached by another thread while an eviction uploaded */
+    dbg_print("[DBG] segment found in cache after eviction\n");
+    Remaining_space += (sb.st_size);
+    remove(part_file);
+    *comp = fopen(cache_file, "rb");
+    if (*comp == NULL) {
+      retval = cloudfs_error("cache_layer_admit_seg");
       return retval;
     }
-    dbg_print("[DBG] length of compressed segment is %llu\n", sb.st_size);
-
-    remaining_space += (sb.st_size);
-    dbg_print("[DBG] remaining space increased to %ld\n", remaining_space);
+    return cache_layer_touch(segp->key, -1, 0);
   }
 
-  /* evict selected segments to the cloud */
-  int i = 0;
-  for (i = 0; i < num_evicted; i++) {
+  if (evict_failed) {
+    /* the opened file stays readable for the caller */
+    *comp = fopen(part_file, "rb");
+    if (*comp == NULL) {
+      retval = cloudfs_error("cache_layer_admit_seg");
+    }
+    remove(part_file);
+    return retval;
+  }
 
-    char cache_file[MAX_PATH_LEN] = "";
-    sprintf(cache_file, "%s/%s", Cache_path, evicted[i].md5);
+  retval = rename(part_file, cache_file);
+  if (retval < 0) {
+    retval = cloudfs_error("cache_layer_admit_seg");
+    Remaining_space += (sb.st_size);
+    remove(part_file);
+    return retval;
+  }
+  dbg_print("[DBG] segment downloaded as %s\n", cache_file);
 
-    /* get compressed segment length */
-    struct stat sb;
-    retval = lstat(cache_file, &sb);
-    if (retval < 0) {
-      retval = cloudfs_error("cache_layer_evict_segments");
-      return retval;
-    }
-    dbg_print("[DBG] length of compressed segment is %llu\n", sb.st_size);
+  *comp = fopen(cache_file, "rb");
+  if (*comp == NULL) {
+    retval = cloudfs_error("cache_layer_admit_seg");
+    return retval;
+  }
 
-    /* upload the segment */
-    Cfile = fopen(cache_file, "rb");
-    cloud_put_object(BUCKET, evicted[i].md5, sb.st_size, put_buffer);
-    cloud_print_error();
-    fclose(Cfile);
-    dbg_print("[DBG] segment %s uploaded\n", cache_file);
+  retval = cache_layer_touch(segp->key, sb.st_size, 1);
+  if (retval < 0) {
+    return retval;
+  }
 
-    /* delete the segment in cache */
-    retval = remove(cache_file);
+  struct cache_entry *e = cache_index_find(&Entries, segp->key);
+  if (cache_policy_keep_copy(Mode, e->size, e->ref_count, Evictions,
+        Deletions)) {
+    /* keep the cloud copy, evicting the segment costs nothing */
+    dbg_print("[DBG] cloud copy of %s kept\n", segp->key);
+    e->clean = 1;
+    retval = lsetxattr(cache_file, U_CLEAN, &e->clean, sizeof(int), 0);
     if (retval < 0) {
-      retval = cloudfs_error("cache_layer_evict_segments");
-      return retval;
+      retval = cloudfs_error("cache_layer_admit_seg");
     }
-    dbg_print("[DBG] cache file %s deleted\n", cache_file);
-
-    Remaining_space += (sb.st_size);
-    dbg_print("[DBG] global Remaining_space increased to %ld\n",
-        Remaining_space);
+  } else {
+    /* delete from cloud */
+    pthread_mutex_unlock(&Cache_lock);
+    __sync_fetch_and_add(&Requests, 1);
+    cloud_delete_object(BUCKET, segp->key);
+    cloud_print_error();
+    pthread_mutex_lock(&Cache_lock);
   }
 
-  if (evicted != NULL) {
-    free(evicted);
-  }
+  int released = cache_layer_release(e);
+  cache_layer_wake_evictor();
 
-  return retval;
+  return (retval < 0) ? retval : released;
 }
 
 /**
@@ -519,82 +915,70 @@ int cache_layer_evict_segments(struct cloudfs_seg *keep)
 int cache_layer_download_seg(char *target_file, struct cloudfs_seg *segp)
 {
   int retval = 0;
-  int evict_failed = 0;
+  FILE *comp = NULL;
 
   char cache_file[MAX_PATH_LEN] = "";
-  sprintf(cache_file, "%s/%s", Cache_path, segp->md5);
+  sprintf(cache_file, "%s/%s", Cache_path, segp->key);
   dbg_print("[DBG] download segment through the cache layer: %s\n", cache_file);
 #ifdef DEBUG
   print_seg(segp);
 #endif
 
-  if (access(cache_file, F_OK) < 0) {
-    dbg_print("[DBG] segment not found in cache\n");
+  pthread_mutex_lock(&Cache_lock);
+  if (Policy->reference != NULL) {
+    Policy->reference(segp->key);
+  }
+  comp = fopen(cache_file, "rb");
+  if (comp != NULL) {
+    Hits++;
+    retval = cache_layer_touch(segp->key, -1, 0);
+  } else {
+    Misses++;
+  }
+  pthread_mutex_unlock(&Cache_lock);
 
-    /* download to cache directory */
-    Tfile = fopen(cache_file, "wb");
-    cloud_get_object(BUCKET, segp->md5, get_buffer);
-    cloud_print_error();
-    fclose(Tfile);
-    dbg_print("[DBG] segment downloaded as %s\n", cache_file);
+  if (comp == NULL) {
+    dbg_print("[DBG] segment not found in cache\n");
 
-    /* update remaining space */
-    struct stat sb;
-    retval = lstat(cache_file, &sb);
-    if (retval < 0) {
+    /* download without holding the lock */
+    char part_file[MAX_PATH_LEN] = "";
+    cache_layer_get_part_file(cache_file, part_file);
+    FILE *tfile = fopen(part_file, "wb");
+    if (tfile == NULL) {
       retval = cloudfs_error("cache_layer_download_seg");
       return retval;
     }
-    Remaining_space -= (sb.st_size);
-    dbg_print("[DBG] segment size is %llu\n", sb.st_size);
-    dbg_print("[DBG] Remaining space decreases to %ld\n", Remaining_space);
-
-    /* start cache eviction algorithm if needed */
-    if (Remaining_space < 0) {
-      dbg_print("[DBG] remaining space less than zero, starting eviction\n");
-      retval = cache_layer_evict_segments(segp);
-      if (retval == CANNOT_EVICT) {
-        dbg_print("[DBG] cannot evict any segments\n");
-        Remaining_space += (sb.st_size);
-        dbg_print("[DBG] remaining space restored to %ld\n", Remaining_space);
-        evict_failed = 1;
-      } else if (retval < 0) {
-        return retval;
-      } else {
-        dbg_print("[DBG] eviction succeeded\n");
-
-        /* delete from cloud */
-        cloud_delete_object(BUCKET, segp->md5);
-        cloud_print_error();
-      }
+    __sync_fetch_and_add(&Requests, 1);
+    cloud_get_object_ctx(BUCKET, segp->key, get_buffer, tfile);
+    cloud_print_error();
+    fclose(tfile);
+
+    pthread_mutex_lock(&Cache_lock);
+    comp = fopen(cache_file, "rb");
+    if (comp != NULL) {
+      /* another thread has brought it into the cache meanwhile */
+      dbg_print("[DBG] segment found in cache after downloading\n");
+      remove(part_file);
+      retval = cache_layer_touch(segp->key, -1, 0);
     } else {
-      /* Remaining space is enough, no need of eviction */
-      dbg_print("[DBG] remaining space is enough\n");
-
-      /* delete from cloud */
-      cloud_delete_object(BUCKET, segp->md5);
-      cloud_print_error();
+      retval = cache_layer_admit_seg(part_file, cache_file, segp, &comp);
     }
+    pthread_mutex_unlock(&Cache_lock);
   } else {
     dbg_print("[DBG] segment found in cache\n");
   }
 
-  retval = compress_layer_decompress(cache_file, target_file);
   if (retval < 0) {
+    if (comp != NULL) {
+      fclose(comp);
+    }
     return retval;
   }
 
-  if (evict_failed) {
-    retval = remove(cache_file);
-    if (retval < 0) {
-      retval = cloudfs_error("cache_layer_download_seg");
-      return retval;
-    }
-  } else {
-    retval = update_timestamp(cache_file);
-    if (retval < 0) {
-      return retval;
-    }
+  retval = compress_layer_decompress_fp(comp, target_file);
+  fclose(comp);
+  if (retval < 0) {
+    return retval;
   }
 
   dbg_print("[DBG] cache_layer_download_seg(target_file=\"%s\","
@@ -623,35 +1007,52 @@ int cache_layer_upload_seg(char *fpath, long offset, char *key, long len)
   sprintf(cache_file, "%s/%s", Cache_path, key);
   dbg_print("[DBG] upload segment through the cache layer: %s\n", cache_file);
 
+  char part_file[MAX_PATH_LEN] = "";
+  cache_layer_get_part_file(cache_file, part_file);
+
   long len_compressed_file =
-    compress_layer_compress(fpath, offset, len, cache_file);
+    compress_layer_compress(fpath, offset, len, part_file);
   if (len_compressed_file < 0) {
     return len_compressed_file;
   }
 
-  if (Remaining_space < len_compressed_file) {
+  /* reserve the space and move the segment into the cache */
+  pthread_mutex_lock(&Cache_lock);
+  int in_cache = (Remaining_space >= len_compressed_file);
+  if (in_cache) {
+    dbg_print("[DBG] Remaining space is %ld, enough to hold the segment\n",
+        Remaining_space);
+    retval = rename(part_file, cache_file);
+    if (retval < 0) {
+      retval = cloudfs_error("cache_layer_upload_seg");
+    } else {
+      Remaining_space -= len_compressed_file;
+      dbg_print("[DBG] Remaining space decreased to %ld\n", Remaining_space);
+      retval = cache_layer_touch(key, len_compressed_file, 0);
+      cache_layer_wake_evictor();
+    }
+  }
+  pthread_mutex_unlock(&Cache_lock);
+
+  if (!in_cache) {
     dbg_print("[DBG] Remaining space is %ld, not enough to hold the segment,"
         " upload to the cloud\n", Remaining_space);
 
-    Cfile = fopen(cache_file, "rb");
-    cloud_put_object(BUCKET, key, len_compressed_file, put_buffer);
-    cloud_print_error();
-    fclose(Cfile);
-
-    retval = remove(cache_file);
-    if (retval < 0) {
+    FILE *cfile = fopen(part_file, "rb");
+    if (cfile == NULL) {
       retval = cloudfs_error("cache_layer_upload_seg");
       return retval;
     }
-  } else {
-    dbg_print("[DBG] Remaining space is %ld, enough to hold the segment\n",
-        Remaining_space);
-    retval = update_timestamp(cache_file);
+    __sync_fetch_and_add(&Requests, 1);
+    cloud_put_object_ctx(BUCKET, key, len_compressed_file, put_buffer, cfile);
+    cloud_print_error();
+    fclose(cfile);
+
+    retval = remove(part_file);
     if (retval < 0) {
+      retval = cloudfs_error("cache_layer_upload_seg");
       return retval;
     }
-    Remaining_space -= len_compressed_file;
-    dbg_print("[DBG] Remaining space decreased to %ld\n", Remaining_space);
   }
 
   dbg_print("[DBG] cache_layer_upload_seg(fpath=\"%s\", offset=%ld, key=\"%s\","
@@ -660,10 +1061,84 @@ int cache_layer_upload_seg(char *fpath, long offset, char *key, long len)
   return retval;
 }
 
+/**
+ * @brief Store a compressed segment held in memory through the cache layer.
+ *        Like cache_layer_upload_seg(), the segment is kept in the cache
+ *        directory if there is enough space, otherwise it is uploaded to the
+ *        cloud straight from memory.
+ * @param key Cloud key of the segment.
+ * @param comp The compressed segment.
+ * @param comp_len Length of the compressed segment.
+ * @return 0 on success, negative otherwise.
+ */
+int cache_layer_upload_buf(char *key, char *comp, long comp_len)
+{
+  int retval = 0;
+
+  char cache_file[MAX_PATH_LEN] = "";
+  sprintf(cache_file, "%s/%s", Cache_path, key);
+  dbg_print("[DBG] upload segment through the cache layer: %s\n", cache_file);
+
+  /* only write the segment out if it is likely to fit */
+  pthread_mutex_lock(&Cache_lock);
+  int in_cache = (Remaining_space >= comp_len);
+  pthread_mutex_unlock(&Cache_lock);
+
+  if (in_cache) {
+    char part_file[MAX_PATH_LEN] = "";
+    cache_layer_get_part_file(cache_file, part_file);
+
+    FILE *pfile = fopen(part_file, "wb");
+    if (pfile == NULL) {
+      retval = cloudfs_error("cache_layer_upload_buf");
+      return retval;
+    }
+    size_t written = fwrite(comp, 1, comp_len, pfile);
+    if ((fclose(pfile) != 0) || (written != (size_t) comp_len)) {
+      retval = cloudfs_error("cache_layer_upload_buf");
+      remove(part_file);
+      return retval;
+    }
+
+    /* reserve the space and move the segment into the cache */
+    pthread_mutex_lock(&Cache_lock);
+    in_cache = (Remaining_space >= comp_len);
+    if (in_cache) {
+      retval = rename(part_file, cache_file);
+      if (retval < 0) {
+        retval = cloudfs_error("cache_layer_upload_buf");
+      } else {
+        Remaining_space -= comp_len;
+        dbg_print("[DBG] Remaining space decreased to %ld\n", Remaining_space);
+        retval = cache_layer_touch(key, comp_len, 0);
+        cache_layer_wake_evictor();
+      }
+    }
+    pthread_mutex_unlock(&Cache_lock);
+
+    if (!in_cache) {
+      remove(part_file);
+    }
+  }
+
+  if (!in_cache) {
+    dbg_print("[DBG] not enough space to hold the segment,"
+        " upload to the cloud\n");
+    __sync_fetch_and_add(&Requests, 1);
+    retval = compress_layer_upload_buf(key, comp, comp_len);
+  }
+
+  dbg_print("[DBG] cache_layer_upload_buf(key=\"%s\", comp_len=%ld)=%d\n",
+      key, comp_len, retval);
+
+  return retval;
+}
+
 /**
  * @brief Remove a segment through the cache layer.
- *        This function will first search for the segment in the cache,
- *        if exist, remove from the cache; otherwise remove from the cloud.
+ *        This function will first search for the segment in the cache index,
+ *        if exist, remove from the cache, and from the cloud too if it is
+ *        clean; otherwise remove from the cloud.
  * @param key Cloud key of the segment.
  * @return 0 on success, negative otherwise.
  */
@@ -675,25 +1150,29 @@ int cache_layer_remove_seg(char *key)
   sprintf(cache_file, "%s/%s", Cache_path, key);
   dbg_print("[DBG] remove segment through the cache layer: %s\n", cache_file);
 
-  if (access(cache_file, F_OK) < 0) {
+  pthread_mutex_lock(&Cache_lock);
+  int clean = 1;
+  long size = cache_layer_untrack(key, &clean);
+  if (size < 0) {
     dbg_print("[DBG] segment not found in cache\n");
-    cloud_delete_object(BUCKET, key);
-    cloud_print_error();
   } else {
     dbg_print("[DBG] segment found in cache\n");
-    struct stat sb;
-    retval = lstat(cache_file, &sb);
-    if (retval < 0) {
-      retval = cloudfs_error("cache_layer_remove_seg");
-      return retval;
-    }
     retval = remove(cache_file);
     if (retval < 0) {
       retval = cloudfs_error("cache_layer_remove_seg");
-      return retval;
+    } else {
+      Remaining_space += size;
+      dbg_print("[DBG] remaining space increased to %ld\n", Remaining_space);
     }
-    Remaining_space += sb.st_size;
-    dbg_print("[DBG] remaining space increased to %ld\n", Remaining_space);
+    Deletions++;
+  }
+  pthread_mutex_unlock(&Cache_lock);
+
+  /* the cloud has a copy unless only the cache had one */
+  if (clean) {
+    __sync_fetch_and_add(&Requests, 1);
+    cloud_delete_object(BUCKET, key);
+    cloud_print_error();
   }
 
   dbg_print("[DBG] cache_layer_remove_seg(key=\"%s\")=%d", key, retval);
@@ -701,3 +1180,20 @@ int cache_layer_remove_seg(char *key)
   return retval;
 }
 
+/**
+ * @brief CloudFS should call this function when it exits.
+ *        The evictor is stopped first if it is still running.
+ * @return Void.
+ */
+void cache_layer_destroy(void)
+{
+  cache_layer_stop_evictor();
+
+  pthread_mutex_lock(&Cache_lock);
+  High_mark = 0;
+  Policy->destroy();
+  cache_index_destroy(&Entries);
+  pthread_mutex_unlock(&Cache_lock);
+
+  dbg_print("[DBG] cache_layer_destroy()\n");
+}
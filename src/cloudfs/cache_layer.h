@@ -1,10 +1,16 @@
 #ifndef __CACHE_LAYER_H_
 #define __CACHE_LAYER_H_
 
-int cache_layer_init(int total_space, int init_space);
+int cache_layer_init(int total_space, int init_space, int policy, int mode,
+    int high_mark, int low_mark);
+int cache_layer_start_evictor(void);
+void cache_layer_stop_evictor(void);
 int cache_layer_download_seg(char *target_file, struct cloudfs_seg *segp);
 int cache_layer_upload_seg(char *fpath, long offset, char *key, long len);
+int cache_layer_upload_buf(char *key, char *comp, long comp_len);
 int cache_layer_remove_seg(char *key);
+void cache_layer_set_ref(char *key, int ref_count);
+void cache_layer_destroy(void);
 
 #endif
 
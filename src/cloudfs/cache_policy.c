@@ -0,0 +1,912 @@
+/**
+ * @file cache_policy.c
+ * @brief Cache replacement policies of CloudFS.
+ *
+ *        A policy decides which cached segments are evicted first, and
+ *        optionally whether a segment is worth evicting others for. The
+ *        policies are:
+ *        1) refcount: the least referenced segments first, then the least
+ *                     recently used among those, in a heap. This is the
+ *                     original policy of the cache layer.
+ *        2) arc: Adaptive Replacement Cache. Segments seen once (T1) and
+ *                more than once (T2) are in two LRU lists; the keys of
+ *                recently evicted segments are kept in two ghost lists
+ *                (B1, B2), and a hit in a ghost list moves the target size
+ *                of T1 towards the list that would have kept it.
+ *        3) 2q: 2Q in its segmented LRU form. New segments enter a
+ *               probationary LRU list and move to a protected one, at most
+ *               80% of the cache, when accessed again. One sequential pass
+ *               only goes through the probationary list.
+ *        4) tinylfu: 2q, with an admission filter. Requests are counted in
+ *                    a count-min sketch of 4-bit counters, halved now and
+ *                    then so old popularity fades, and a segment only
+ *                    evicts segments requested less often than itself.
+ *
+ *        Whether the cloud copy of a downloaded segment is kept, so that
+ *        evicting the segment costs no upload, is also decided here (see
+ *        cache_policy_keep_copy()), and so is the order victims are
+ *        evicted and uploaded in (see cache_policy_evict() and
+ *        cache_policy_drain()), shared by the cache layer and the
+ *        simulator.
+ *
+ *        Sizes are in bytes, segments are not of the same size.
+ *        The cache layer serializes all calls.
+ *
+ * @author Yinsu Chu (yinsuc)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// #define DEBUG
+#include "cloudfs.h"
+
+#include "cache_policy.h"
+
+/* initial number of heap slots */
+#define HEAP_MIN_SIZE (1024)
+
+/* share of the cache for the protected list of 2q, in percent */
+#define PROTECTED_SHARE (80)
+
+/* rows of the sketch, and the value a counter sticks at */
+#define SKETCH_DEPTH (4)
+#define SKETCH_MAX (15)
+
+/* segment size assumed to size the sketch, and its limits (counters) */
+#define SKETCH_SEG_SIZE (4096)
+#define SKETCH_MIN_WIDTH (1024)
+#define SKETCH_MAX_WIDTH (1 << 22)
+
+/* counters are halved after this many requests per column */
+#define SKETCH_SAMPLE (10)
+
+/* the lists of arc and 2q */
+#define ARC_T1 (0)
+#define ARC_T2 (1)
+#define ARC_B1 (2)
+#define ARC_B2 (3)
+#define TWOQ_PROBATION (0)
+#define TWOQ_PROTECTED (1)
+
+extern FILE *Log;
+
+/* an LRU list of entries, "prev" points towards the MRU end */
+struct cache_list {
+  struct cache_entry *mru;
+  struct cache_entry *lru;
+  long bytes;
+  int count;
+};
+
+/**
+ * @brief Put an entry at the MRU end of a list.
+ * @param l The list.
+ * @param e The entry.
+ * @param id Identifier of the list, saved in the entry.
+ * @return Void.
+ */
+static void list_push_mru(struct cache_list *l, struct cache_entry *e, int id)
+{
+  e->list = id;
+  e->prev = NULL;
+  e->next = l->mru;
+  if (l->mru != NULL) {
+    l->mru->prev = e;
+  } else {
+    l->lru = e;
+  }
+  l->mru = e;
+  l->bytes += e->size;
+  l->count++;
+}
+
+/**
+ * @brief Put an entry at the LRU end of a list.
+ * @param l The list.
+ * @param e The entry.
+ * @param id Identifier of the list, saved in the entry.
+ * @return Void.
+ */
+static void list_push_lru(struct cache_list *l, struct cache_entry *e, int id)
+{
+  e->list = id;
+  e->next = NULL;
+  e->prev = l->lru;
+  if (l->lru != NULL) {
+    l->lru->next = e;
+  } else {
+    l->mru = e;
+  }
+  l->lru = e;
+  l->bytes += e->size;
+  l->count++;
+}
+
+/**
+ * @brief Take an entry out of a list.
+ * @param l The list.
+ * @param e The entry.
+ * @return Void.
+ */
+static void list_unlink(struct cache_list *l, struct cache_entry *e)
+{
+  if (e->prev != NULL) {
+    e->prev->next = e->next;
+  } else {
+    l->mru = e->next;
+  }
+  if (e->next != NULL) {
+    e->next->prev = e->prev;
+  } else {
+    l->lru = e->prev;
+  }
+  e->prev = NULL;
+  e->next = NULL;
+  l->bytes -= e->size;
+  l->count--;
+}
+
+/* refcount ---------------------------------------------------------------- */
+
+/* heap of entries, the next victim first */
+static struct cache_entry **Heap;
+static int Heap_size;
+static int Heap_cap;
+
+/**
+ * @brief Tell whether an entry should be evicted before another one.
+ * @param a An entry.
+ * @param b Another entry.
+ * @return Non-zero if "a" comes first.
+ */
+static int heap_before(struct cache_entry *a, struct cache_entry *b)
+{
+  if (a->ref_count != b->ref_count) {
+    return a->ref_count < b->ref_count;
+  }
+  if (a->atime.tv_sec != b->atime.tv_sec) {
+    return a->atime.tv_sec < b->atime.tv_sec;
+  }
+  return a->atime.tv_nsec < b->atime.tv_nsec;
+}
+
+/**
+ * @brief Put an entry at a position of the heap.
+ * @param e The entry.
+ * @param pos The position.
+ * @return Void.
+ */
+static void heap_set(struct cache_entry *e, int pos)
+{
+  Heap[pos] = e;
+  e->heap_pos = pos;
+}
+
+/**
+ * @brief Move an entry to its place in the heap, after its
+ *        ref_count or access time changed.
+ * @param e The entry.
+ * @return Void.
+ */
+static void heap_fix(struct cache_entry *e)
+{
+  int pos = e->heap_pos;
+
+  /* up */
+  while (pos > 0) {
+    int parent = (pos - 1) / 2;
+    if (!heap_before(e, Heap[parent])) {
+      break;
+    }
+    heap_set(Heap[parent], pos);
+    pos = parent;
+  }
+
+  /* down */
+  while (2 * pos + 1 < Heap_size) {
+    int child = 2 * pos + 1;
+    if ((child + 1 < Heap_size) && heap_before(Heap[child + 1], Heap[child])) {
+      child++;
+    }
+    if (!heap_before(Heap[child], e)) {
+      break;
+    }
+    heap_set(Heap[child], pos);
+    pos = child;
+  }
+
+  heap_set(e, pos);
+}
+
+static int refcount_init(long capacity)
+{
+  (void) capacity;
+  Heap_cap = HEAP_MIN_SIZE;
+  Heap_size = 0;
+  Heap = (struct cache_entry **)
+    malloc(Heap_cap * sizeof(struct cache_entry *));
+  if (Heap == NULL) {
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+static int refcount_insert(struct cache_entry *e)
+{
+  if (Heap_size == Heap_cap) {
+    struct cache_entry **heap = (struct cache_entry **)
+      realloc(Heap, 2 * Heap_cap * sizeof(struct cache_entry *));
+    if (heap == NULL) {
+      return -ENOMEM;
+    }
+    Heap = heap;
+    Heap_cap *= 2;
+  }
+  heap_set(e, Heap_size++);
+  heap_fix(e);
+  return 0;
+}
+
+static void refcount_fix(struct cache_entry *e)
+{
+  heap_fix(e);
+}
+
+static void refcount_remove(struct cache_entry *e)
+{
+  Heap_size--;
+  if (e->heap_pos < Heap_size) {
+    struct cache_entry *last = Heap[Heap_size];
+    heap_set(last, e->heap_pos);
+    heap_fix(last);
+  }
+}
+
+static struct cache_entry *refcount_victim(void)
+{
+  if (Heap_size == 0) {
+    return NULL;
+  }
+  struct cache_entry *e = Heap[0];
+  refcount_remove(e);
+  return e;
+}
+
+static void refcount_restore(struct cache_entry *e)
+{
+  /* the slot it left is still there */
+  refcount_insert(e);
+}
+
+/* a segment is not evicted for a less referenced one */
+static int refcount_admit(struct cache_entry *cand, struct cache_entry *victim)
+{
+  return (cand->ref_count == 0) || (victim->ref_count <= cand->ref_count);
+}
+
+static void refcount_destroy(void)
+{
+  free(Heap);
+  Heap = NULL;
+  Heap_size = 0;
+  Heap_cap = 0;
+}
+
+/* arc --------------------------------------------------------------------- */
+
+static struct cache_list Arc[4];
+static struct cache_index Ghosts;
+static long Arc_capacity;
+static long Arc_target; /* "p", the target size of T1 */
+
+/**
+ * @brief Forget a ghost entry.
+ * @param g The entry.
+ * @return Void.
+ */
+static void arc_drop_ghost(struct cache_entry *g)
+{
+  list_unlink(&Arc[g->list], g);
+  cache_index_delete(&Ghosts, g);
+  free(g);
+}
+
+/**
+ * @brief Keep the ghost lists within their limits, T1 and B1 together
+ *        at most the cache size, all lists at most twice the cache size.
+ * @return Void.
+ */
+static void arc_trim_ghosts(void)
+{
+  while ((Arc[ARC_T1].bytes + Arc[ARC_B1].bytes > Arc_capacity)
+      && (Arc[ARC_B1].lru != NULL)) {
+    arc_drop_ghost(Arc[ARC_B1].lru);
+  }
+  while ((Arc[ARC_T1].bytes + Arc[ARC_T2].bytes + Arc[ARC_B1].bytes
+        + Arc[ARC_B2].bytes > 2 * Arc_capacity)
+      && (Arc[ARC_B2].lru != NULL)) {
+    arc_drop_ghost(Arc[ARC_B2].lru);
+  }
+}
+
+static int arc_init(long capacity)
+{
+  memset(Arc, 0, sizeof(Arc));
+  Arc_capacity = capacity;
+  Arc_target = 0;
+  return cache_index_init(&Ghosts);
+}
+
+static int arc_insert(struct cache_entry *e)
+{
+  struct cache_entry *g = cache_index_find(&Ghosts, e->key);
+  if (g == NULL) {
+    list_push_mru(&Arc[ARC_T1], e, ARC_T1);
+    arc_trim_ghosts();
+    return 0;
+  }
+
+  /* it would still be cached if the list it left was larger */
+  if (g->list == ARC_B1) {
+    long ratio = Arc[ARC_B2].bytes / Arc[ARC_B1].bytes;
+    Arc_target += e->size * (ratio > 1 ? ratio : 1);
+    if (Arc_target > Arc_capacity) {
+      Arc_target = Arc_capacity;
+    }
+  } else {
+    long ratio = Arc[ARC_B1].bytes / Arc[ARC_B2].bytes;
+    Arc_target -= e->size * (ratio > 1 ? ratio : 1);
+    if (Arc_target < 0) {
+      Arc_target = 0;
+    }
+  }
+  dbg_print("[DBG] arc ghost hit in B%d, target size of T1 now %ld\n",
+      g->list - ARC_B1 + 1, Arc_target);
+  arc_drop_ghost(g);
+  list_push_mru(&Arc[ARC_T2], e, ARC_T2);
+  arc_trim_ghosts();
+  return 0;
+}
+
+static void arc_access(struct cache_entry *e)
+{
+  list_unlink(&Arc[e->list], e);
+  list_push_mru(&Arc[ARC_T2], e, ARC_T2);
+}
+
+static void arc_remove(struct cache_entry *e)
+{
+  list_unlink(&Arc[e->list], e);
+}
+
+static struct cache_entry *arc_victim(void)
+{
+  struct cache_list *l = &Arc[ARC_T2];
+  if ((Arc[ARC_T1].lru != NULL)
+      && ((Arc[ARC_T1].bytes > Arc_target) || (Arc[ARC_T2].lru == NULL))) {
+    l = &Arc[ARC_T1];
+  }
+  struct cache_entry *e = l->lru;
+  if (e != NULL) {
+    list_unlink(l, e);
+  }
+  return e;
+}
+
+static void arc_restore(struct cache_entry *e)
+{
+  list_push_lru(&Arc[e->list], e, e->list);
+}
+
+static void arc_evicted(struct cache_entry *e)
+{
+  struct cache_entry *g =
+    (struct cache_entry *) calloc(1, sizeof(struct cache_entry));
+  if (g == NULL) {
+    return;
+  }
+  memcpy(g->key, e->key, MAX_KEY_LEN + 1);
+  g->size = e->size;
+  if (cache_index_insert(&Ghosts, g) < 0) {
+    free(g);
+    return;
+  }
+  if (e->list == ARC_T1) {
+    list_push_mru(&Arc[ARC_B1], g, ARC_B1);
+  } else {
+    list_push_mru(&Arc[ARC_B2], g, ARC_B2);
+  }
+  arc_trim_ghosts();
+}
+
+static void arc_stats(FILE *out)
+{
+  fprintf(out, "arc_target_t1 %ld\n", Arc_target);
+  fprintf(out, "arc_t1_bytes %ld\n", Arc[ARC_T1].bytes);
+  fprintf(out, "arc_t2_bytes %ld\n", Arc[ARC_T2].bytes);
+  fprintf(out, "arc_b1_bytes %ld\n", Arc[ARC_B1].bytes);
+  fprintf(out, "arc_b2_bytes %ld\n", Arc[ARC_B2].bytes);
+}
+
+static void arc_destroy(void)
+{
+  cache_index_destroy(&Ghosts);
+  memset(Arc, 0, sizeof(Arc));
+}
+
+/* 2q ---------------------------------------------------------------------- */
+
+static struct cache_list Twoq[2];
+static long Protected_max;
+
+static int twoq_init(long capacity)
+{
+  memset(Twoq, 0, sizeof(Twoq));
+  Protected_max = capacity / 100 * PROTECTED_SHARE;
+  return 0;
+}
+
+static int twoq_insert(struct cache_entry *e)
+{
+  list_push_mru(&Twoq[TWOQ_PROBATION], e, TWOQ_PROBATION);
+  return 0;
+}
+
+static void twoq_access(struct cache_entry *e)
+{
+  list_unlink(&Twoq[e->list], e);
+  list_push_mru(&Twoq[TWOQ_PROTECTED], e, TWOQ_PROTECTED);
+
+  /* the least recently used protected segments are on probation again */
+  while ((Twoq[TWOQ_PROTECTED].bytes > Protected_max)
+      && (Twoq[TWOQ_PROTECTED].count > 1)) {
+    struct cache_entry *d = Twoq[TWOQ_PROTECTED].lru;
+    list_unlink(&Twoq[TWOQ_PROTECTED], d);
+    list_push_mru(&Twoq[TWOQ_PROBATION], d, TWOQ_PROBATION);
+  }
+}
+
+static void twoq_remove(struct cache_entry *e)
+{
+  list_unlink(&Twoq[e->list], e);
+}
+
+static struct cache_entry *twoq_victim(void)
+{
+  struct cache_list *l = &Twoq[TWOQ_PROBATION];
+  if (l->lru == NULL) {
+    l = &Twoq[TWOQ_PROTECTED];
+  }
+  struct cache_entry *e = l->lru;
+  if (e != NULL) {
+    list_unlink(l, e);
+  }
+  return e;
+}
+
+static void twoq_restore(struct cache_entry *e)
+{
+  list_push_lru(&Twoq[e->list], e, e->list);
+}
+
+static void twoq_stats(FILE *out)
+{
+  fprintf(out, "probation_bytes %ld\n", Twoq[TWOQ_PROBATION].bytes);
+  fprintf(out, "protected_bytes %ld\n", Twoq[TWOQ_PROTECTED].bytes);
+}
+
+static void twoq_destroy(void)
+{
+  memset(Twoq, 0, sizeof(Twoq));
+}
+
+/* tinylfu ----------------------------------------------------------------- */
+
+static unsigned char *Sketch; /* SKETCH_DEPTH rows of counters */
+static unsigned long Sketch_width; /* a power of 2 */
+static unsigned long Sketch_adds;
+static unsigned long Sketch_resets;
+
+/**
+ * @brief Compute the counters of a key, one per row of the sketch.
+ * @param key The key.
+ * @param idx Indices of the counters are returned here.
+ * @return Void.
+ */
+static void sketch_counters(const char *key, unsigned long *idx)
+{
+  unsigned long long h = 14695981039346656037ULL;
+  while (*key != '\0') {
+    h = (h ^ (unsigned char) *key++) * 1099511628211ULL;
+  }
+  unsigned long h1 = (unsigned long) (h & 0xffffffff);
+  unsigned long h2 = (unsigned long) (h >> 32) | 1;
+  int i = 0;
+  for (i = 0; i < SKETCH_DEPTH; i++) {
+    idx[i] = i * Sketch_width + ((h1 + i * h2) & (Sketch_width - 1));
+  }
+}
+
+/**
+ * @brief Estimate how often a key was requested lately.
+ * @param key The key.
+ * @return The estimate, at most SKETCH_MAX.
+ */
+static int sketch_frequency(const char *key)
+{
+  unsigned long idx[SKETCH_DEPTH];
+  int freq = SKETCH_MAX;
+  int i = 0;
+
+  sketch_counters(key, idx);
+  for (i = 0; i < SKETCH_DEPTH; i++) {
+    if (Sketch[idx[i]] < freq) {
+      freq = Sketch[idx[i]];
+    }
+  }
+  return freq;
+}
+
+static int tinylfu_init(long capacity)
+{
+  Sketch_width = SKETCH_MIN_WIDTH;
+  while ((Sketch_width < SKETCH_MAX_WIDTH)
+      && (Sketch_width < (unsigned long) (capacity / SKETCH_SEG_SIZE))) {
+    Sketch_width *= 2;
+  }
+  Sketch = (unsigned char *) calloc(SKETCH_DEPTH * Sketch_width, 1);
+  if (Sketch == NULL) {
+    return -ENOMEM;
+  }
+  Sketch_adds = 0;
+  Sketch_resets = 0;
+  return twoq_init(capacity);
+}
+
+static void tinylfu_reference(const char *key)
+{
+  unsigned long idx[SKETCH_DEPTH];
+  int i = 0;
+
+  sketch_counters(key, idx);
+  for (i = 0; i < SKETCH_DEPTH; i++) {
+    if (Sketch[idx[i]] < SKETCH_MAX) {
+      Sketch[idx[i]]++;
+    }
+  }
+
+  /* age all counters */
+  if (++Sketch_adds >= SKETCH_SAMPLE * Sketch_width) {
+    unsigned long j = 0;
+    for (j = 0; j < SKETCH_DEPTH * Sketch_width; j++) {
+      Sketch[j] >>= 1;
+    }
+    Sketch_adds /= 2;
+    Sketch_resets++;
+  }
+}
+
+static int tinylfu_admit(struct cache_entry *cand, struct cache_entry *victim)
+{
+  return sketch_frequency(cand->key) > sketch_frequency(victim->key);
+}
+
+static void tinylfu_stats(FILE *out)
+{
+  twoq_stats(out);
+  fprintf(out, "sketch_bytes %lu\n", SKETCH_DEPTH * Sketch_width);
+  fprintf(out, "sketch_resets %lu\n", Sketch_resets);
+}
+
+static void tinylfu_destroy(void)
+{
+  free(Sketch);
+  Sketch = NULL;
+  twoq_destroy();
+}
+
+/* ------------------------------------------------------------------------- */
+
+static struct cache_policy Policies[CACHE_POLICY_NUM] = {
+  { "refcount", refcount_init, NULL, refcount_insert, refcount_fix,
+    refcount_fix, refcount_remove, refcount_victim, refcount_restore, NULL,
+    refcount_admit, NULL, refcount_destroy },
+  { "arc", arc_init, NULL, arc_insert, arc_access, NULL, arc_remove,
+    arc_victim, arc_restore, arc_evicted, NULL, arc_stats, arc_destroy },
+  { "2q", twoq_init, NULL, twoq_insert, twoq_access, NULL, twoq_remove,
+    twoq_victim, twoq_restore, NULL, NULL, twoq_stats, twoq_destroy },
+  { "tinylfu", tinylfu_init, tinylfu_reference, twoq_insert, twoq_access,
+    NULL, twoq_remove, twoq_victim, twoq_restore, NULL, tinylfu_admit,
+    tinylfu_stats, tinylfu_destroy },
+};
+
+/**
+ * @brief Get a cache policy.
+ * @param type One of the CACHE_POLICY_* policies.
+ * @return The policy.
+ */
+struct cache_policy *cache_policy_get(int type)
+{
+  return &Policies[type];
+}
+
+/**
+ * @brief Get a cache policy by its name.
+ * @param name The name of the policy.
+ * @return One of the CACHE_POLICY_* policies, -1 if there is no such policy.
+ */
+int cache_policy_type(const char *name)
+{
+  int t = 0;
+  for (t = 0; t < CACHE_POLICY_NUM; t++) {
+    if (strcmp(name, Policies[t].name) == 0) {
+      return t;
+    }
+  }
+  return -1;
+}
+
+static const char *Mode_names[CACHE_MODE_NUM] = {
+  "exclusive",
+  "inclusive",
+  "auto",
+};
+
+/**
+ * @brief Get a cache mode by its name.
+ * @param name The name of the mode.
+ * @return One of the CACHE_MODE_* modes, -1 if there is no such mode.
+ */
+int cache_policy_mode(const char *name)
+{
+  int m = 0;
+  for (m = 0; m < CACHE_MODE_NUM; m++) {
+    if (strcmp(name, Mode_names[m]) == 0) {
+      return m;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Get the name of a cache mode.
+ * @param mode One of the CACHE_MODE_* modes.
+ * @return The name.
+ */
+const char *cache_policy_mode_name(int mode)
+{
+  return Mode_names[mode];
+}
+
+/**
+ * @brief Decide whether to keep the cloud copy of a segment downloaded
+ *        to the cache, i.e. whether the cache entry starts clean.
+ *        A segment leaves the cache either evicted or deleted, after its
+ *        last reference is gone. Deleting the cloud copy now costs a
+ *        request, and another one to upload the segment again if it is
+ *        evicted; keeping it costs a request only if the segment is
+ *        deleted while cached, but the space stays used in the cloud.
+ *        So with p the likelihood of an eviction, keeping the copy saves
+ *        2 * p requests for "size" bytes of capacity. p is estimated from
+ *        how the cached segments left so far, and grows with the number
+ *        of references, as every one of them must go before a deletion.
+ * @param mode One of the CACHE_MODE_* modes.
+ * @param size Compressed size of the segment.
+ * @param ref_count Reference count of the segment.
+ * @param evictions Segments evicted so far.
+ * @param deletions Segments deleted from the cache so far.
+ * @return 1 to keep the cloud copy, 0 to delete it.
+ */
+int cache_policy_keep_copy(int mode, long size, int ref_count,
+    unsigned long evictions, unsigned long deletions)
+{
+  if (mode != CACHE_MODE_AUTO) {
+    return (mode == CACHE_MODE_INCLUSIVE);
+  }
+
+  double deleted = (deletions + 1.0) / (evictions + deletions + 2.0);
+  double p = 1.0;
+  int i = 0;
+  for (i = 0; (i < ref_count) && (p > 0.0001); i++) {
+    p *= deleted;
+  }
+  p = (ref_count > 0) ? 1.0 - p : 1.0 - deleted;
+
+  dbg_print("[DBG] cache_policy_keep_copy(size=%ld, ref_count=%d),"
+      " eviction likelihood %f\n", size, ref_count, p);
+
+  return (2 * p * CLOUD_COST_REQUEST > size * CLOUD_COST_CAPACITY);
+}
+
+/**
+ * @brief Give segments taken by policy->victim() back to the policy,
+ *        in reverse order, but for "skip".
+ * @param policy The policy.
+ * @param num Number of segments.
+ * @param entries Entries of the segments, in the order they were taken.
+ * @param skip A segment not to give back, or NULL.
+ * @return Void.
+ */
+static void cache_policy_restore(struct cache_policy *policy, int num,
+    struct cache_entry **entries, struct cache_entry *skip)
+{
+  while (num > 0) {
+    struct cache_entry *e = entries[--num];
+    if (e != skip) {
+      policy->restore(e);
+    }
+  }
+}
+
+/**
+ * @brief Evict segments until the remaining space is not negative.
+ *        The policy gives the segments in the order to evict them, and
+ *        may refuse to evict one for "cand". Clean segments are evicted
+ *        first, dirty ones are skipped as long as the clean ones free
+ *        enough space. Otherwise the first dirty one is uploaded, and the
+ *        segments are selected again; it comes out first since it is put
+ *        back last. Nothing is evicted unless enough space can be freed.
+ * @param policy The policy.
+ * @param remaining_space Free space of the cache, negative to evict.
+ *                        It is read again after every upload, and
+ *                        ops->drop() gives the space back.
+ * @param cand The segment to make room for, NULL for none.
+ * @param ops How to upload and delete segments.
+ * @return 0 on success, CANNOT_EVICT if not enough can be evicted,
+ *         negative otherwise.
+ */
+int cache_policy_evict(struct cache_policy *policy,
+    const long *remaining_space, struct cache_entry *cand,
+    const struct cache_evict_ops *ops)
+{
+  int retval = 0;
+  int num_uploaded = 0; /* evicted first once selected again */
+  int max_evicted = 0;
+  struct cache_entry **evicted = NULL;
+
+  while (1) {
+    long space = *remaining_space;
+    long dirty_space = 0;
+    struct cache_entry *dirty = NULL;
+    int num_evicted = 0;
+
+    /* select the segments to evict, counting only the clean ones */
+    while (space < 0) {
+      struct cache_entry *e = policy->victim();
+      if (e == NULL) {
+        dbg_print("[DBG] no more segments to evict\n");
+        break;
+      }
+      if (num_evicted == max_evicted) {
+        max_evicted = (max_evicted > 0) ? 2 * max_evicted : HEAP_MIN_SIZE;
+        struct cache_entry **more = (struct cache_entry **)
+          realloc(evicted, max_evicted * sizeof(struct cache_entry *));
+        if (more == NULL) {
+          policy->restore(e);
+          cache_policy_restore(policy, num_evicted, evicted, NULL);
+          free(evicted);
+          return -ENOMEM;
+        }
+        evicted = more;
+      }
+      evicted[num_evicted++] = e;
+      dbg_print("[DBG] next segment to evict is %s, ref_count %d\n",
+          e->key, e->ref_count);
+
+      if ((cand != NULL) && (policy->admit != NULL)
+          && !policy->admit(cand, e)) {
+        dbg_print("[DBG] %s not worth evicting for\n", cand->key);
+        break;
+      }
+      if (e->clean) {
+        space += e->size;
+      } else {
+        dirty_space += e->size;
+        if (dirty == NULL) {
+          dirty = e;
+        }
+      }
+    }
+
+    if (space >= 0) {
+      /* delete the clean segments, the dirty ones stay in the cache */
+      int num_kept = 0;
+      int i = 0;
+      for (i = 0; i < num_evicted; i++) {
+        struct cache_entry *e = evicted[i];
+        if ((retval == 0) && e->clean) {
+          int uploaded = (num_uploaded > 0);
+          retval = ops->drop(e, uploaded);
+          if (retval == 0) {
+            num_uploaded -= uploaded;
+            continue;
+          }
+        }
+        evicted[num_kept++] = e;
+      }
+      cache_policy_restore(policy, num_kept, evicted, NULL);
+      free(evicted);
+      return retval;
+    }
+
+    if ((dirty == NULL) || (space + dirty_space < 0)) {
+      /* uploading the dirty segments would not help */
+      cache_policy_restore(policy, num_evicted, evicted, NULL);
+      free(evicted);
+      return CANNOT_EVICT;
+    }
+
+    cache_policy_restore(policy, num_evicted, evicted, dirty);
+    dbg_print("[DBG] not enough clean segments, uploading %s\n", dirty->key);
+    struct timespec atime = dirty->atime;
+    retval = ops->upload(dirty);
+    policy->restore(dirty);
+    if (retval < 0) {
+      free(evicted);
+      return retval;
+    }
+    num_uploaded++;
+    if ((dirty->atime.tv_sec != atime.tv_sec)
+        || (dirty->atime.tv_nsec != atime.tv_nsec)) {
+      dbg_print("[DBG] %s accessed while uploaded\n", dirty->key);
+      policy->access(dirty);
+    }
+  }
+}
+
+/**
+ * @brief Evict segments in the order of the policy until the remaining
+ *        space is at least "min_space", uploading the dirty ones first.
+ *        A segment accessed while it was uploaded is given back to the
+ *        policy instead.
+ * @param policy The policy.
+ * @param remaining_space Free space of the cache, ops->drop() gives the
+ *                        space back.
+ * @param min_space The free space to reach.
+ * @param stopping If not NULL, stop as soon as it is not 0.
+ * @param ops How to upload and delete segments.
+ * @return Number of segments evicted.
+ */
+int cache_policy_drain(struct cache_policy *policy,
+    const long *remaining_space, long min_space, const int *stopping,
+    const struct cache_evict_ops *ops)
+{
+  int num = 0;
+
+  while (((stopping == NULL) || !*stopping)
+      && (*remaining_space < min_space)) {
+    struct cache_entry *e = policy->victim();
+    if (e == NULL) {
+      dbg_print("[DBG] no more segments to drain\n");
+      break;
+    }
+
+    int uploaded = 0;
+    if (!e->clean) {
+      struct timespec atime = e->atime;
+      if (ops->upload(e) < 0) {
+        policy->restore(e);
+        break;
+      }
+      if ((e->atime.tv_sec != atime.tv_sec)
+          || (e->atime.tv_nsec != atime.tv_nsec)) {
+        dbg_print("[DBG] %s accessed while uploaded, not evicted\n", e->key);
+        policy->restore(e);
+        policy->access(e);
+        continue;
+      }
+      uploaded = 1;
+    }
+
+    if (ops->drop(e, uploaded) < 0) {
+      policy->restore(e);
+      break;
+    }
+    num++;
+  }
+
+  return num;
+}
@@ -0,0 +1,88 @@
+#ifndef __CACHE_POLICY_H_
+#define __CACHE_POLICY_H_
+
+#include <stdio.h>
+
+#include "cache_index.h"
+
+/* cache replacement policies, see cache_policy.c */
+#define CACHE_POLICY_REFCOUNT (0)
+#define CACHE_POLICY_ARC (1)
+#define CACHE_POLICY_2Q (2)
+#define CACHE_POLICY_TINYLFU (3)
+#define CACHE_POLICY_NUM (4)
+
+/* what becomes of the cloud copy of a segment downloaded to the cache */
+#define CACHE_MODE_EXCLUSIVE (0) /* deleted, evicting uploads it again */
+#define CACHE_MODE_INCLUSIVE (1) /* kept, evicting only drops the cache file */
+#define CACHE_MODE_AUTO (2) /* chosen per segment by the cost model */
+#define CACHE_MODE_NUM (3)
+
+/* prices, see calculate_cloud_cost() in scripts/functions.sh */
+#define CLOUD_COST_CAPACITY (0.000000091) /* per byte of peak usage */
+#define CLOUD_COST_REQUEST (0.01)
+#define CLOUD_COST_READ (0.000000114) /* per byte downloaded */
+
+/*
+ * A cache replacement policy orders the entries of the cache index for
+ * eviction. The cache layer owns the entries and serializes the calls;
+ * optional operations are NULL.
+ */
+struct cache_policy {
+  const char *name;
+  /* start with an empty cache of "capacity" bytes, 0 on success */
+  int (*init)(long capacity);
+  /* a segment is requested, whether cached or not (optional) */
+  void (*reference)(const char *key);
+  /* a segment enters the cache, 0 on success */
+  int (*insert)(struct cache_entry *e);
+  /* a cached segment is accessed, its atime is updated already */
+  void (*access)(struct cache_entry *e);
+  /* the ref_count of a cached segment changed (optional) */
+  void (*update)(struct cache_entry *e);
+  /* a cached segment is deleted */
+  void (*remove)(struct cache_entry *e);
+  /* take the next segment to evict out of the policy, NULL if none */
+  struct cache_entry *(*victim)(void);
+  /* put back a segment returned by victim(), in reverse order */
+  void (*restore)(struct cache_entry *e);
+  /* a segment returned by victim() was evicted (optional) */
+  void (*evicted)(struct cache_entry *e);
+  /* whether "victim" should make room for "cand", 1 if so (optional) */
+  int (*admit)(struct cache_entry *cand, struct cache_entry *victim);
+  /* write the statistics of the policy (optional) */
+  void (*stats)(FILE *out);
+  /* forget everything */
+  void (*destroy)(void);
+};
+
+/* returned by cache_policy_evict() if not enough can be evicted */
+#define CANNOT_EVICT (-1000)
+
+/*
+ * How cache_policy_evict() and cache_policy_drain() change the cache
+ * they evict from, so that CloudFS and the simulator evict the same way.
+ */
+struct cache_evict_ops {
+  /* upload a dirty segment taken by victim(), making it clean; the lock
+   * of the cache may be released meanwhile; 0 on success */
+  int (*upload)(struct cache_entry *e);
+  /* delete a segment taken by victim() from the cache and free it,
+   * "uploaded" if it was uploaded to be evicted; 0 on success */
+  int (*drop)(struct cache_entry *e, int uploaded);
+};
+
+struct cache_policy *cache_policy_get(int type);
+int cache_policy_type(const char *name);
+int cache_policy_mode(const char *name);
+const char *cache_policy_mode_name(int mode);
+int cache_policy_keep_copy(int mode, long size, int ref_count,
+    unsigned long evictions, unsigned long deletions);
+int cache_policy_evict(struct cache_policy *policy,
+    const long *remaining_space, struct cache_entry *cand,
+    const struct cache_evict_ops *ops);
+int cache_policy_drain(struct cache_policy *policy,
+    const long *remaining_space, long min_space, const int *stopping,
+    const struct cache_evict_ops *ops);
+
+#endif
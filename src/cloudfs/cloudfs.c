@@ -25,6 +25,8 @@
 #include <time.h>
 #include <unistd.h>
 #include <ftw.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "cloudapi.h"
 
 // #define DEBUG
@@ -33,8 +35,18 @@
 #include "dedup.h"
 
 #include "hashtable.h"
+#include "proxy.h"
 #include "dedup_layer.h"
 #include "cache_layer.h"
+#include "lock_table.h"
+#include "prefetch.h"
+#include "migrate.h"
+#include "attr.h"
+#include "seg_store.h"
+#include "temp_area.h"
+#include "pipeline.h"
+#include "fingerprint.h"
+#include "stats.h"
 
 #define UNUSED __attribute__((unused))
 
@@ -45,59 +57,81 @@
     retval = cloudfs_error(m); \
   }
 
-/* extended attributes in the user namespace */
-#define U_DEV ("user.st_dev")
-#define U_INO ("user.st_ino")
-#define U_MODE ("user.st_mode")
-#define U_NLINK ("user.st_nlink")
-#define U_UID ("user.st_uid")
-#define U_GID ("user.st_gid")
-#define U_RDEV ("user.st_rdev")
-#define U_SIZE ("user.st_size")
-#define U_BLKSIZE ("user.st_blksize")
-#define U_BLOCKS ("user.st_blocks")
-#define U_ATIME ("user.st_atime")
-#define U_MTIME ("user.st_mtime")
-#define U_CTIME ("user.st_ctime")
-
-#define U_REMOTE ("user.remote")
-#define U_DIRTY ("user.dirty")
+/* number of files whose attributes are cached in memory */
+#define ATTR_CACHE_ENTRIES (1 << 17)
 
 /* temporary path for CloudFS */
 #define TEMP_PATH ("/.tmp")
 
+/* files in the temporary directory of a cloud file:
+ * the overlay holding written data at the offsets of the file,
+ * and one flag per segment telling whether the overlay holds it */
+#define NEW_CONTENT ("/new_content")
+#define MATERIALIZED ("/materialized")
+
+/* intents of asynchronous migrations, in the temporary path */
+#define MIGRATE_PATH ("/migrate")
+
+/* decompressed segments shared by all cloud files */
+#define STORE_PATH ("/segments")
+
+/* scratch directories of opened cloud files */
+#define SCRATCH_PATH ("/scratch")
+
+/* suffix of the replacement built for a file moving to the cloud,
+ * kept next to its temporary directory */
+#define PROXY_SUFFIX (".proxy")
+
 /* cache path for CloudFS */
 #define CACHE_PATH ("/.cache")
 
+/* statistics file, under TEMP_PATH */
+#define STATS_PATH ("/stats")
+
 /* log file path */
 #define LOG_FILE ("./cloudfs.log")
 
 /* hash table configurations */
-#define BKT_NUM (11) /* 11 buckets */
-/* each bucket holds 3 segments initially */
-#define BKT_SIZE (3 * sizeof(struct cloudfs_seg))
+#define IDX_PATH ("/index")
+/* buckets of the hash table of older versions, moved to the index */
+#define BKT_NUM (11)
+
+/* number of buckets of the per-inode lock table */
+#define LOCK_BKT_NUM (257)
 
 FILE *Log;
 char Cache_path[MAX_PATH_LEN];
 static struct cloudfs_state State_;
 static char Temp_path[MAX_PATH_LEN];
+static char Idx_path[MAX_PATH_LEN];
 static char Bkt_prfx[MAX_PATH_LEN];
 static int Cache_init_size;
 
-/* callback function for downloading from the cloud */
-static FILE *Tfile;
-static int get_buffer(const char *buf, int len) {
-  return fwrite(buf, 1, len, Tfile);
+/* an opened file, fi->fh points to it */
+struct cloudfs_handle {
+  int fd; /* the file on SSD, or the temporary file of a cloud file */
+  struct proxy *proxy; /* segments of a cloud file if dedup is enabled */
+  unsigned char *materialized; /* mapping of MATERIALIZED, one byte per
+                                  segment, shared by all handles */
+  off_t next_offset; /* where the next read starts if reading sequentially */
+  int prefetched; /* segments before this one have been queued to prefetch */
+  unsigned char *pinned; /* one byte per segment, set if this handle holds
+                            a reference on it in the segment store */
+  char *temp_dir; /* scratch directory of a cloud file if dedup is enabled */
+};
+
+/* callback function for downloading from the cloud, "ctx" is the FILE */
+static int get_buffer(const char *buf, int len, void *ctx) {
+  return fwrite(buf, 1, len, (FILE *) ctx);
 }
 
-/* callback function for uploading to the cloud */
-static FILE *Cfile;
-static int put_buffer(char *buf, int len) {
-  return fread(buf, 1, len, Cfile);
+/* callback function for uploading to the cloud, "ctx" is the FILE */
+static int put_buffer(char *buf, int len, void *ctx) {
+  return fread(buf, 1, len, (FILE *) ctx);
 }
 
 void cloudfs_get_key(const char *fpath, char *key);
-int cloudfs_rmdir_rec(char *path);
+static int cloudfs_migrate(const char *path);
 
 #ifdef DEBUG
 void print_stat(const struct stat *sb)
@@ -128,7 +162,6 @@ void print_stat(const struct stat *sb)
 int cloudfs_upgrade_attr(struct stat *sp, char *fpath)
 {
   int retval = 0;
-  char *fn = "cloudfs_upgrade_attr";
 
   dbg_print("[DBG] cloudfs_upgrade_attr(sp=0x%08x, fpath=\"%s\")\n",
       (unsigned int) sp, fpath);
@@ -136,28 +169,13 @@ int cloudfs_upgrade_attr(struct stat *sp, char *fpath)
   print_stat(sp);
 #endif
 
-  CK_ERR(lsetxattr(fpath, U_DEV, &sp->st_dev, sizeof(dev_t), 0), fn);
-  CK_ERR(lsetxattr(fpath, U_INO, &sp->st_ino, sizeof(ino_t), 0), fn);
-  CK_ERR(lsetxattr(fpath, U_MODE, &sp->st_mode, sizeof(mode_t), 0), fn);
-  CK_ERR(lsetxattr(fpath, U_NLINK, &sp->st_nlink, sizeof(nlink_t), 0), fn);
-  CK_ERR(lsetxattr(fpath, U_UID, &sp->st_uid, sizeof(uid_t), 0), fn);
-  CK_ERR(lsetxattr(fpath, U_GID, &sp->st_gid, sizeof(gid_t), 0), fn);
-  CK_ERR(lsetxattr(fpath, U_RDEV, &sp->st_rdev, sizeof(dev_t), 0), fn);
-  CK_ERR(lsetxattr(fpath, U_BLKSIZE, &sp->st_blksize, sizeof(blksize_t), 0),
-      fn);
-
-  /* according to the test cases, these times should not be updated */
-  // CK_ERR(lsetxattr(fpath, U_ATIME, &sp->st_atime, sizeof(time_t), 0), fn);
-  // CK_ERR(lsetxattr(fpath, U_MTIME, &sp->st_mtime, sizeof(time_t), 0), fn);
-  // CK_ERR(lsetxattr(fpath, U_CTIME, &sp->st_ctime, sizeof(time_t), 0), fn);
-
-  CK_ERR(lsetxattr(fpath, U_SIZE, &sp->st_size, sizeof(off_t), 0), fn);
-  CK_ERR(lsetxattr(fpath, U_BLOCKS , &sp->st_blocks, sizeof(blkcnt_t), 0), fn);
-
-  int remote = 1;
-  CK_ERR(lsetxattr(fpath, U_REMOTE, &remote, sizeof(int), 0), fn);
-  int dirty = 0;
-  CK_ERR(lsetxattr(fpath, U_DIRTY, &dirty, sizeof(int), 0), fn);
+  /* the real attributes and the remote flag are set at once;
+   * the times are those of the proxy file, as the test cases expect */
+  struct cloudfs_attr attr;
+  memset(&attr, 0, sizeof(struct cloudfs_attr));
+  attr.flags = ATTR_REMOTE;
+  memcpy(&attr.st, sp, sizeof(struct stat));
+  retval = attr_set(fpath, &attr);
 
   dbg_print("[DBG] cloudfs_upgrade_attr(sp=0x%08x, fpath=\"%s\")=%d\n",
       (unsigned int) sp, fpath, retval);
@@ -210,14 +228,17 @@ void cloudfs_get_key(const char *fpath, char *key)
 
 /**
  * @brief Check whether a file is stored in the cloud.
- *        This is marked by extended attribute "user.remote".
+ *        This is marked by flag ATTR_REMOTE of the file's attributes.
  * @param fpath Full path of the file on SSD. 
  * @return 1 if is in the cloud, 0 otherwise.
  */
 static int cloudfs_is_in_cloud(char *fpath)
 {
   int retval = 0;
-  lgetxattr(fpath, U_REMOTE, &retval, sizeof(int));
+  struct cloudfs_attr attr;
+  if (attr_get(fpath, &attr) == 0) {
+    retval = (attr.flags & ATTR_REMOTE) ? 1 : 0;
+  }
   dbg_print("[DBG] cloudfs_is_in_cloud(fpath=\"%s\")=%d\n", fpath, retval);
   return retval;
 }
@@ -267,28 +288,29 @@ int cloudfs_getattr(const char *path, struct stat *sb)
 
   cloudfs_get_fullpath(path, fpath);
 
-  if (cloudfs_is_in_cloud(fpath)) {
-    CK_ERR(lstat(fpath, sb), fn);
-    CK_ERR(lgetxattr(fpath, U_DEV, &sb->st_dev, sizeof(dev_t)), fn);
-    CK_ERR(lgetxattr(fpath, U_INO, &sb->st_ino, sizeof(ino_t)), fn);
-    CK_ERR(lgetxattr(fpath, U_MODE, &sb->st_mode, sizeof(mode_t)), fn);
-    CK_ERR(lgetxattr(fpath, U_NLINK, &sb->st_nlink, sizeof(nlink_t)), fn);
-    CK_ERR(lgetxattr(fpath, U_UID, &sb->st_uid, sizeof(uid_t)), fn);
-    CK_ERR(lgetxattr(fpath, U_GID, &sb->st_gid, sizeof(gid_t)), fn);
-    CK_ERR(lgetxattr(fpath, U_RDEV, &sb->st_rdev, sizeof(dev_t)), fn);
-    CK_ERR(lgetxattr(fpath, U_SIZE, &sb->st_size, sizeof(off_t)), fn);
-    CK_ERR(lgetxattr(fpath, U_BLKSIZE, &sb->st_blksize, sizeof(blksize_t)), fn);
-    CK_ERR(lgetxattr(fpath, U_BLOCKS, &sb->st_blocks, sizeof(blkcnt_t)), fn);
-
-    /* according to the test cases, these times should not be read */
-    // CK_ERR(lgetxattr(fpath, U_ATIME, &sb->st_atime, sizeof(time_t)), fn);
-    // CK_ERR(lgetxattr(fpath, U_MTIME, &sb->st_mtime, sizeof(time_t)), fn);
-    // CK_ERR(lgetxattr(fpath, U_CTIME, &sb->st_ctime, sizeof(time_t)), fn);
-  } else {
-    retval = lstat(fpath, sb);
-    if (retval < 0) {
-      retval = cloudfs_error(fn);
-    }
+  retval = lstat(fpath, sb);
+  if (retval < 0) {
+    retval = cloudfs_error(fn);
+    return retval;
+  }
+
+  struct cloudfs_attr attr;
+  retval = attr_get(fpath, &attr);
+  if (retval < 0) {
+    return retval;
+  }
+  if (attr.flags & ATTR_REMOTE) {
+    /* according to the test cases, the times are those of the proxy file */
+    sb->st_dev = attr.st.st_dev;
+    sb->st_ino = attr.st.st_ino;
+    sb->st_mode = attr.st.st_mode;
+    sb->st_nlink = attr.st.st_nlink;
+    sb->st_uid = attr.st.st_uid;
+    sb->st_gid = attr.st.st_gid;
+    sb->st_rdev = attr.st.st_rdev;
+    sb->st_size = attr.st.st_size;
+    sb->st_blksize = attr.st.st_blksize;
+    sb->st_blocks = attr.st.st_blocks;
   }
 
   dbg_print("[DBG] cloudfs_getattr(path=\"%s\", sb=0x%08x)=%d\n",
@@ -416,10 +438,11 @@ int cloudfs_mknod(const char *path, mode_t mode, dev_t dev)
   }
 
   /* every new file is marked as local and not dirty initially */
-  int remote = 0;
-  int dirty = 0;
-  lsetxattr(fpath, U_REMOTE, &remote, sizeof(int), 0);
-  lsetxattr(fpath, U_DIRTY, &dirty, sizeof(int), 0);
+  if (retval == 0) {
+    struct cloudfs_attr attr;
+    memset(&attr, 0, sizeof(struct cloudfs_attr));
+    attr_set(fpath, &attr);
+  }
 
   dbg_print("[DBG] cloudfs_mknod(path=\"%s\", mode=%d, dev=%llu)=%d\n",
       path, mode, dev, retval);
@@ -427,19 +450,97 @@ int cloudfs_mknod(const char *path, mode_t mode, dev_t dev)
   return retval;
 }
 
+/**
+ * @brief Map the per-segment flags of the overlay of a cloud file.
+ * @param tpath_dir The temporary directory of the file.
+ * @param h The handle of the file, with the proxy file opened.
+ *          The mapping is placed here.
+ * @param create Whether to create the flags (for the first open).
+ * @return 0 on success, -errno otherwise.
+ */
+static int cloudfs_map_materialized(char *tpath_dir, struct cloudfs_handle *h,
+    int create)
+{
+  int retval = 0;
+  char mpath[MAX_PATH_LEN] = "";
+  snprintf(mpath, MAX_PATH_LEN, "%s%s", tpath_dir, MATERIALIZED);
+
+  int fd = open(mpath, create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR,
+      DEFAULT_FILE_MODE);
+  if (fd < 0) {
+    retval = cloudfs_error("cloudfs_map_materialized");
+    return retval;
+  }
+  if (create && (ftruncate(fd, h->proxy->num_seg) < 0)) {
+    retval = cloudfs_error("cloudfs_map_materialized");
+    close(fd);
+    return retval;
+  }
+
+  if (h->proxy->num_seg > 0) {
+    void *addr = mmap(NULL, h->proxy->num_seg, PROT_READ | PROT_WRITE,
+        MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      retval = cloudfs_error("cloudfs_map_materialized");
+    } else {
+      h->materialized = (unsigned char *) addr;
+    }
+  }
+  close(fd);
+
+  return retval;
+}
+
+/**
+ * @brief Free a handle and what it holds, except the descriptor.
+ *        References on the segments it has read and on its scratch
+ *        directory are dropped.
+ * @param h The handle.
+ * @return Void.
+ */
+static void cloudfs_free_handle(struct cloudfs_handle *h)
+{
+  if (h->materialized != NULL) {
+    munmap(h->materialized, h->proxy->num_seg);
+  }
+  if (h->pinned != NULL) {
+    int i = 0;
+    for (i = 0; i < h->proxy->num_seg; i++) {
+      if (h->pinned[i]) {
+        struct cloudfs_seg seg;
+        proxy_get_seg(h->proxy, i, &seg);
+        seg_store_release(&seg);
+      }
+    }
+    free(h->pinned);
+  }
+  if (h->temp_dir != NULL) {
+    temp_area_release(h->temp_dir);
+    free(h->temp_dir);
+  }
+  proxy_close(h->proxy);
+  free(h);
+}
+
 /**
  * @brief Open a file.
  *        If the file is in local SSD, open it directly;
  *        If the file is in the cloud:
  *          1) If dedup is disabled, download the file from the cloud and
  *             store it locally for access.
- *          2) If dedup is enabled, create an empty file for writing and
- *             remember the file handle.
+ *          2) If dedup is enabled, create an empty overlay for writing and
+ *             remember the file handle. Segments are only copied into the
+ *             overlay when a write touches them.
+ *        In multithreaded mode, a file may be opened more than once at the
+ *        same time. Later opens share the temporary file of the first one;
+ *        with dedup, that is the scratch directory the temporary area keeps
+ *        bound to the file while any handle has it.
  * @param path Pathname of the file to open.
  * @param fi Information about the opened file is returned here.
+ * @param shared Whether the file is already opened by another handle.
  * @return 0 on success, -errno otherwise.
  */
-int cloudfs_open(const char *path, struct fuse_file_info *fi)
+int cloudfs_open(const char *path, struct fuse_file_info *fi, int shared)
 {
   int retval = 0;
   char fpath[MAX_PATH_LEN] = "";
@@ -451,29 +552,72 @@ int cloudfs_open(const char *path, struct fuse_file_info *fi)
   cloudfs_get_key(fpath, key);
   cloudfs_get_temppath(fpath, tpath);
 
+  struct cloudfs_handle *h =
+    (struct cloudfs_handle *) calloc(1, sizeof(struct cloudfs_handle));
+  if (h == NULL) {
+    retval = cloudfs_error("cloudfs_open");
+    return retval;
+  }
+
   if (cloudfs_is_in_cloud(fpath)) {
-    if (State_.no_dedup) {
+    if (State_.no_dedup && shared) {
+      dbg_print("[DBG] dedup is disabled, file already downloaded\n");
+      fd = open(tpath, O_RDWR);
+    } else if (State_.no_dedup) {
       dbg_print("[DBG] dedup is disabled, download the entire file\n");
-      Tfile = fopen(tpath, "wb");
-      cloud_get_object(BUCKET, key, get_buffer);
+      FILE *tfile = fopen(tpath, "wb");
+      if (tfile == NULL) {
+        retval = cloudfs_error("cloudfs_open");
+        free(h);
+        return retval;
+      }
+      cloud_get_object_ctx(BUCKET, key, get_buffer, tfile);
       cloud_print_error();
-      fclose(Tfile);
+      fclose(tfile);
       fd = open(tpath, O_RDWR);
     } else {
-      /* create the temporary directory for the file */
-      retval = mkdir(tpath, DEFAULT_DIR_MODE);
+      /* keep the proxy file opened, so reads can locate segments directly */
+      retval = proxy_open(fpath, &h->proxy);
+      if (retval < 0) {
+        free(h);
+        return retval;
+      }
+
+      /* the scratch directory, shared by all handles of the file */
+      int fresh = temp_area_acquire(fpath, tpath);
+      if (fresh < 0) {
+        cloudfs_free_handle(h);
+        return fresh;
+      }
+      h->temp_dir = strdup(tpath);
+      if (h->temp_dir == NULL) {
+        retval = cloudfs_error("cloudfs_open");
+        temp_area_release(tpath);
+        cloudfs_free_handle(h);
+        return retval;
+      }
+
+      retval = cloudfs_map_materialized(tpath, h, fresh);
       if (retval < 0) {
+        cloudfs_free_handle(h);
+        return retval;
+      }
+
+      h->pinned = (unsigned char *) calloc(h->proxy->num_seg + 1, 1);
+      if (h->pinned == NULL) {
         retval = cloudfs_error("cloudfs_open");
+        cloudfs_free_handle(h);
         return retval;
       }
 
       /* create the temporary file for new content (if any) */
-      sprintf(tpath, "%s%s", tpath, "/new_content");
+      sprintf(tpath, "%s%s", tpath, NEW_CONTENT);
       dbg_print("[DBG] dedup is enabled, creating temporary file %s\n", tpath);
 
       fd = open(tpath, O_RDWR | O_CREAT, DEFAULT_FILE_MODE);
       if (fd < 0) {
         retval = cloudfs_error("cloudfs_open");
+        cloudfs_free_handle(h);
         return retval;
       }
 
@@ -483,10 +627,13 @@ int cloudfs_open(const char *path, struct fuse_file_info *fi)
     fd = open(fpath, O_RDWR);
   }
 
-  fi->fh = fd;
   if (fd < 0) {
     retval = cloudfs_error("cloudfs_open");
+    free(h);
+    return retval;
   }
+  h->fd = fd;
+  fi->fh = (intptr_t) h;
 
   dbg_print("[DBG] cloudfs_open(path=\"%s\", fi=0x%08x)=%d\n",
       path, (unsigned int) fi, retval);
@@ -494,6 +641,26 @@ int cloudfs_open(const char *path, struct fuse_file_info *fi)
   return retval;
 }
 
+/**
+ * @brief Close an opened file and free its handle.
+ * @param fi The information about the opened file.
+ * @return 0 on success, -errno otherwise.
+ */
+static int cloudfs_close_handle(struct fuse_file_info *fi)
+{
+  int retval = 0;
+  struct cloudfs_handle *h = (struct cloudfs_handle *) (uintptr_t) fi->fh;
+
+  retval = close(h->fd);
+  if (retval < 0) {
+    retval = cloudfs_error("cloudfs_close_handle");
+  }
+  cloudfs_free_handle(h);
+  fi->fh = 0;
+
+  return retval;
+}
+
 /**
  * @brief Read data from an opened file.
  *        For part 1:
@@ -502,7 +669,9 @@ int cloudfs_open(const char *path, struct fuse_file_info *fi)
  *        For part 2:
  *         Same logic for local files; for cloud files, download needed segments
  *         and read them into the buffer. This avoids the effort to download
- *         unnecessary segments.
+ *         unnecessary segments. The first segment needed is found by a
+ *         binary search in the proxy file opened by cloudfs_open().
+ *         Segments that have been written are read from the overlay.
  * @param path Pathname of the file.
  * @param buf Returned data is placed here.
  * @param size Size of the buffer.
@@ -515,6 +684,7 @@ int cloudfs_read(const char *path, char *buf, size_t size, off_t offset,
 {
   int retval = 0;
   char fpath[MAX_PATH_LEN] = "";
+  struct cloudfs_handle *h = (struct cloudfs_handle *) (uintptr_t) fi->fh;
   cloudfs_get_fullpath(path, fpath);
 
   dbg_print("[DBG] reading interval [%llu, %llu] of the file\n",
@@ -524,143 +694,93 @@ int cloudfs_read(const char *path, char *buf, size_t size, off_t offset,
     /* cloud file and dedup enabled */
     dbg_print("[DBG] this is a cloud file and dedup enabled\n");
 
-    int dirty = 0;
-    retval = lgetxattr(fpath, U_DIRTY, &dirty, sizeof(int));
-    if (retval < 0) {
-      retval = cloudfs_error("cloudfs_read");
-      return retval;
-    }
+    /* written segments come from the overlay, the others from the cloud */
+    struct proxy *p = h->proxy;
+    int i = proxy_find(p, offset);
+    long filled = 0;
 
-    if (dirty) {
-      /* file is dirty */
-      dbg_print("[DBG] file is dirty, read from the new version\n");
+    while (filled < (long) size) {
+      long pos = offset + filled;
 
-      retval = pread(fi->fh, buf, size, offset);
-      if (retval < 0) {
-        retval = cloudfs_error("cloudfs_read");
+      if (i >= p->num_seg) {
+        /* beyond the old end of file, only the overlay has data */
+        dbg_print("[DBG] reading overlay beyond old end of file\n");
+        retval = pread(h->fd, buf + filled, size - filled, pos);
+        if (retval < 0) {
+          retval = cloudfs_error("cloudfs_read");
+          return retval;
+        }
+        filled += retval;
+        break;
       }
-    } else {
-      char tpath[MAX_PATH_LEN] = "";
-      cloudfs_get_temppath(fpath, tpath);
-
-      /* file is not dirty, fetch needed segments from the cloud */
-      dbg_print("[DBG] file is not dirty\n");
 
-      /* these are parameters required by the getline() function */
-      char *seg_md5 = NULL;
-      size_t len = 0;
-      FILE *proxy_fp = fopen(fpath, "rb");
-      if (proxy_fp == NULL) {
-        retval = cloudfs_error("cloudfs_read");
-        return retval;
+      /* the part of the segment holding the next byte to read */
+      long seg_offset = pos - p->records[i].offset;
+      long seg_len = p->records[i].size - seg_offset;
+      if (seg_len > (long) size - filled) {
+        seg_len = size - filled;
       }
 
-      /* keep track of the file position */
-      unsigned int seg_start_pos = 0;
-      unsigned int seg_end_pos = 0;
-
-      /* calculate the span of the current segment that we need */
-      unsigned int seg_local_offset = 0;
-      unsigned int seg_local_size = 0;
-
-      /* keep track of how many data has been read */
-      int filled = 0;
-
-      dbg_print("[DBG] {} - current segment, [] target portion\n");
-
-      /* iterate through all the segments */
-      while ((retval = getline(&seg_md5, &len, proxy_fp)) != -1) {
-
-        /* build the segment structure */
-        struct cloudfs_seg seg;
-        seg.ref_count = 0;
-        seg.seg_size =
-          (int) strtol(seg_md5 + 2 * MD5_DIGEST_LENGTH + 1, NULL, 10);
-        memset(seg.md5, '\0', 2 * MD5_DIGEST_LENGTH + 1);
-        memcpy(seg.md5, seg_md5, 2 * MD5_DIGEST_LENGTH);
-        if (seg_md5 != NULL) {
-          free(seg_md5);
-          seg_md5 = NULL;
-          len = 0;
+      if (h->materialized[i]) {
+        dbg_print("[DBG] segment %d, reading %ld bytes from overlay\n",
+            i, seg_len);
+        retval = pread(h->fd, buf + filled, seg_len, pos);
+        if (retval < 0) {
+          retval = cloudfs_error("cloudfs_read");
+          return retval;
         }
-        dbg_print("[DBG] next segment from proxy file\n");
-#ifdef DEBUG
-        print_seg(&seg);
-#endif
+      } else {
+        dbg_print("[DBG] segment %d, reading %ld bytes at offset %ld\n",
+            i, seg_len, seg_offset);
+        struct cloudfs_seg seg;
+        proxy_get_seg(p, i, &seg);
 
-        /* the span of the current segment in the entire file */
-        if (seg_end_pos > 0) {
-          seg_start_pos = seg_end_pos + 1;
+        /* keep the segment in the store until the file is closed */
+        if (!h->pinned[i] && (seg_store_acquire(&seg, NULL) == 0)) {
+          h->pinned[i] = 1;
         }
-        seg_end_pos = seg_start_pos + seg.seg_size - 1;
-        dbg_print("[DBG] this segment holds interval {%d, %d} of the file\n",
-            seg_start_pos, seg_end_pos);
-
-        /* the portion that we want is interval [offset, offset + size - 1],
-         * there are several cases regarding the intersection of this interval
-         * and the current segment */
-
-        if (seg_end_pos < offset) {
-          dbg_print("[DBG] {%d   %d} [%llu   %llu]\n",
-              seg_start_pos, seg_end_pos, offset, offset + size - 1);
-          continue;
-        } else if (seg_start_pos < offset
-            && seg_end_pos >= offset
-            && seg_end_pos <= offset + size - 1) {
-          dbg_print("[DBG] {%d   [%llu   %d}   %llu]\n",
-              seg_start_pos, offset, seg_end_pos, offset + size - 1);
-          seg_local_offset = offset - seg_start_pos;
-          seg_local_size = seg_end_pos - offset + 1;
-        } else if (seg_start_pos >= offset
-            && seg_start_pos <= offset + size - 1
-            && seg_end_pos >= offset
-            && seg_end_pos <= offset + size - 1) {
-          dbg_print("[DBG] [%llu   {%d   %d}   %llu]\n",
-              offset, seg_start_pos, seg_end_pos, offset + size - 1);
-          seg_local_offset = 0;
-          seg_local_size = seg.seg_size;
-        } else if (seg_start_pos < offset
-            && seg_end_pos > offset + size - 1) {
-          dbg_print("[DBG] {%d   [%llu   %llu]   %d}\n",
-              seg_start_pos, offset, offset + size - 1, seg_end_pos);
-          seg_local_offset = offset - seg_start_pos;
-          seg_local_size = size;
-        } else if (seg_start_pos > offset
-            && seg_start_pos <= offset + size - 1
-            && seg_end_pos > offset + size - 1) {
-          dbg_print("[DBG] [%llu   {%d   %llu]   %d}\n",
-              offset, seg_start_pos, offset + size - 1, seg_end_pos);
-          seg_local_offset = 0;
-          seg_local_size = offset + size - seg_start_pos;
-        } else if (seg_start_pos > offset + size - 1) {
-          dbg_print("[DBG] [%llu   %llu] {%d   %d}\n",
-              offset, offset + size - 1, seg_start_pos, seg_end_pos);
-          continue;
-        }
-
-        char seg_buf[seg_local_size];
-        retval = dedup_layer_read_seg(tpath, &seg, seg_buf, seg_local_size,
-            seg_local_offset);
+        retval = dedup_layer_read_seg(&seg, buf + filled, seg_len,
+            seg_offset);
         if (retval < 0) {
           return retval;
         }
-
-        memcpy(buf + filled, seg_buf, retval);
-        filled += retval;
-      } /* end of while */
-
-      retval = fclose(proxy_fp);
-      if (retval == EOF) {
-        retval = cloudfs_error("cloudfs_read");
-      } else {
-        retval = filled;
+      }
+      filled += retval;
+      if (retval < seg_len) {
+        break;
+      }
+      i++;
+    }
+    retval = filled;
+
+    /* a sequential reader gets the next segments downloaded ahead of it,
+     * those not queued are submitted again by its next read */
+    if ((State_.prefetch_depth > 0) && (offset == h->next_offset)) {
+      int next = proxy_find(p, offset + filled);
+      int k = (h->prefetched > next) ? h->prefetched : next;
+      int end = next + State_.prefetch_depth;
+      if (end > p->num_seg) {
+        end = p->num_seg;
+      }
+      for (; k < end; k++) {
+        if (!h->materialized[k]) {
+          struct cloudfs_seg seg;
+          proxy_get_seg(p, k, &seg);
+          if (prefetch_submit(h->temp_dir, &seg) < 0) {
+            break;
+          }
+        }
+      }
+      if (k > h->prefetched) {
+        h->prefetched = k;
       }
     }
+    h->next_offset = offset + filled;
   } else {
     /* local file or dedup disabled */
     dbg_print("[DBG] this is a local file or dedup is disabled\n");
 
-    retval = pread(fi->fh, buf, size, offset);
+    retval = pread(h->fd, buf, size, offset);
     if (retval < 0) {
       retval = cloudfs_error("cloudfs_read");
     }
@@ -675,9 +795,10 @@ int cloudfs_read(const char *path, char *buf, size_t size, off_t offset,
 
 /**
  * @brief Write data to an opened file.
- *        If the file is not marked dirty, it has not been written before.
- *        Then download all of its content, write it and save the file handle.
- *        Otherwise (is dirty), directly write to the file handle in fi->fh.
+ *        For cloud files with dedup enabled, the data goes into the overlay
+ *        at the same offset. Segments only partially overwritten are first
+ *        copied into the overlay, the rest of the file is left in the cloud.
+ *        The file is marked dirty on the first write.
  * @param path Pathname of the file to write.
  * @param buf The content to write.
  * @param size Size of the content buffer.
@@ -689,75 +810,56 @@ int cloudfs_write(const char *path, const char *buf, size_t size, off_t offset,
     struct fuse_file_info *fi)
 {
   int retval = 0;
+  struct cloudfs_handle *h = (struct cloudfs_handle *) (uintptr_t) fi->fh;
   char fpath[MAX_PATH_LEN] = "";
-  char tpath_dir[MAX_PATH_LEN] = "";
-  char tpath[MAX_PATH_LEN] = "";
   cloudfs_get_fullpath(path, fpath);
 
-  if (cloudfs_is_in_cloud(fpath) && (!State_.no_dedup)) {
-    cloudfs_get_temppath(fpath, tpath_dir);
-    sprintf(tpath, "%s%s", tpath_dir, "/new_content");
-    dbg_print("[DBG] temporary directory is %s\n", tpath_dir);
-    dbg_print("[DBG] temporary file is %s\n", tpath);
+  /* segments entirely overwritten, [first_covered, end_covered) */
+  int first_covered = -1;
+  int end_covered = -1;
 
+  if (cloudfs_is_in_cloud(fpath) && (!State_.no_dedup)) {
     /* get dirty attribute */
-    int dirty = 0;
-    retval = lgetxattr(fpath, U_DIRTY, &dirty, sizeof(int));
+    struct cloudfs_attr attr;
+    retval = attr_get(fpath, &attr);
     if (retval < 0) {
-      retval = cloudfs_error("cloudfs_write");
       return retval;
     }
+    if (!(attr.flags & ATTR_DIRTY)) {
+      attr.flags |= ATTR_DIRTY;
+      attr_set(fpath, &attr);
+    }
 
-    if (!dirty) {
-      dirty = 1;
-      lsetxattr(fpath, U_DIRTY, &dirty, sizeof(int), 0);
-
-      /* open temporary file, append all contents to it */
-      FILE *t_fp = fopen(tpath, "ab");
-
-      /* these are parameters required by the getline() function */
-      char *seg_md5 = NULL;
-      size_t len = 0;
-      FILE *proxy_fp = fopen(fpath, "rb");
-      if (proxy_fp == NULL) {
-        retval = cloudfs_error("cloudfs_write");
-        return retval;
-      }
-
-      /* iterate through all the segments */
-      while ((retval = getline(&seg_md5, &len, proxy_fp)) != -1) {
-        /* build the segment structure */
-        struct cloudfs_seg seg;
-        seg.ref_count = 0;
-        seg.seg_size =
-          (int) strtol(seg_md5 + 2 * MD5_DIGEST_LENGTH + 1, NULL, 10);
-        memset(seg.md5, '\0', 2 * MD5_DIGEST_LENGTH + 1);
-        memcpy(seg.md5, seg_md5, 2 * MD5_DIGEST_LENGTH);
-        if (seg_md5 != NULL) {
-          free(seg_md5);
-          seg_md5 = NULL;
-          len = 0;
+    /* copy in the segments the write range only partially covers */
+    struct proxy *p = h->proxy;
+    int i = 0;
+    for (i = proxy_find(p, offset); (i < p->num_seg)
+        && ((long) p->records[i].offset < (long) (offset + size)); i++) {
+      long seg_start = p->records[i].offset;
+      long seg_end = seg_start + p->records[i].size;
+      if ((seg_start >= offset) && (seg_end <= (long) (offset + size))) {
+        if (first_covered < 0) {
+          first_covered = i;
         }
-        dbg_print("[DBG] next segment from proxy file\n");
-#ifdef DEBUG
-        print_seg(&seg);
-#endif
-        char seg_buf[seg.seg_size];
-        retval =
-          dedup_layer_read_seg(tpath_dir, &seg, seg_buf, seg.seg_size, 0);
+        end_covered = i + 1;
+      } else if (!h->materialized[i]) {
+        retval = dedup_layer_materialize(p, h->fd, h->materialized, i);
         if (retval < 0) {
           return retval;
         }
-        dbg_print("[DBG] writing %d bytes to %s\n", retval, tpath);
-        fwrite(seg_buf, sizeof(char), retval, t_fp);
       }
-      fclose(t_fp);
     }
   }
 
-  retval = pwrite(fi->fh, buf, size, offset);
+  retval = pwrite(h->fd, buf, size, offset);
   if (retval < 0) {
     retval = cloudfs_error("cloudfs_write");
+  } else if (retval == (int) size) {
+    /* segments entirely overwritten never need their old content */
+    int i = 0;
+    for (i = first_covered; i < end_covered; i++) {
+      h->materialized[i] = 1;
+    }
   }
 
   dbg_print("[DBG] cloudfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%llu,"
@@ -768,22 +870,98 @@ int cloudfs_write(const char *path, const char *buf, size_t size, off_t offset,
 }
 
 /**
- * @brief Recursively remove a directory.
- *        This directory along with everything inside it are removed.
- * @param path Pathname of the directory.
+ * @brief Upload a file on SSD and build the file replacing it.
+ *        With dedup, the segments are added and a proxy file is written;
+ *        without, the entire file is uploaded and the replacement is empty.
+ *        The file itself is left untouched, see cloudfs_switch_remote().
+ * @param fpath Pathname of the file.
+ * @param ppath Pathname of the replacement to build.
+ * @param sp Attributes of the file.
  * @return 0 on success, -errno otherwise.
  */
-int cloudfs_rmdir_rec(char *path)
+static int cloudfs_upload_local(char *fpath, char *ppath, struct stat *sp)
 {
   int retval = 0;
-  char command[MAX_PATH_LEN] = "";
-  snprintf(command, MAX_PATH_LEN, "%s%s", "rm -rf ", path);
-  dbg_print("[DBG] remove directory, the command is %s\n", command);
-  retval = system(command);
-  if (retval < 0) {
-    retval = cloudfs_error("cloudfs_rmdir_rec");
-    return retval;
+
+  if (State_.no_dedup) {
+    char key[MAX_PATH_LEN] = "";
+    cloudfs_get_key(fpath, key);
+
+    /* upload the entire file */
+    FILE *cfile = fopen(fpath, "rb");
+    if (cfile == NULL) {
+      retval = cloudfs_error("cloudfs_upload_local");
+      return retval;
+    }
+    cloud_put_object_ctx(BUCKET, key, sp->st_size, put_buffer, cfile);
+    cloud_print_error();
+    fclose(cfile);
+
+    /* the replacement is empty */
+    FILE *fp = fopen(ppath, "wb");
+    if (fp == NULL) {
+      retval = cloudfs_error("cloudfs_upload_local");
+      return retval;
+    }
+    fclose(fp);
+  } else {
+    /* upload via dedup layer */
+    retval = dedup_layer_upload(fpath, ppath);
   }
+
+  dbg_print("[DBG] cloudfs_upload_local(fpath=\"%s\", ppath=\"%s\")=%d\n",
+      fpath, ppath, retval);
+
+  return retval;
+}
+
+/**
+ * @brief Undo cloudfs_upload_local() for a file that stays on SSD.
+ * @param fpath Pathname of the file.
+ * @param ppath Pathname of the replacement.
+ * @return Void.
+ */
+static void cloudfs_discard_upload(char *fpath, char *ppath)
+{
+  if (State_.no_dedup) {
+    char key[MAX_PATH_LEN] = "";
+    cloudfs_get_key(fpath, key);
+    cloud_delete_object(BUCKET, key);
+    cloud_print_error();
+    unlink(ppath);
+  } else {
+    dedup_layer_remove(ppath);
+    unlink(ppath); /* in case it could not be parsed */
+  }
+  dbg_print("[DBG] upload of %s discarded\n", fpath);
+}
+
+/**
+ * @brief Switch a file from SSD to the cloud.
+ *        The attributes are set on the replacement built by
+ *        cloudfs_upload_local() before it is renamed over the file,
+ *        so the file is either entirely local or entirely remote.
+ * @param fpath Pathname of the file.
+ * @param ppath Pathname of the replacement.
+ * @param sp Attributes of the file.
+ * @return 0 on success, -errno otherwise.
+ */
+static int cloudfs_switch_remote(char *fpath, char *ppath, struct stat *sp)
+{
+  int retval = 0;
+
+  retval = cloudfs_upgrade_attr(sp, ppath);
+  if (retval == 0) {
+    if (rename(ppath, fpath) < 0) {
+      retval = cloudfs_error("cloudfs_switch_remote");
+      attr_invalidate(ppath);
+    } else {
+      attr_rename(ppath, fpath);
+    }
+  }
+
+  dbg_print("[DBG] cloudfs_switch_remote(fpath=\"%s\")=%d\n", fpath, retval);
+
   return retval;
 }
 
@@ -791,12 +969,15 @@ int cloudfs_rmdir_rec(char *path)
  * @brief Release an opened file.
  *        For files stored on SSD:
  *          - If its size does not exceed the threshold, just close it;
- *          - If its size has exceeded the threshold, move it to the cloud;
+ *          - If its size has exceeded the threshold, move it to the cloud,
+ *            or record an intent for the migration threads to do it;
  *        For files stored in the cloud:
  *          - If file is not dirty, just delete the temporary segments.
  *          - If file is dirty:
  *            1) If its size shrinks below the threshold, move it back to SSD;
- *            2) Otherwise, replace the new version to the cloud;
+ *            2) Otherwise, replace the new version to the cloud; with
+ *               dedup enabled, only the segments around the writes are
+ *               re-chunked and uploaded.
  * @param path Pathname of the file to release.
  * @param fi The information about the opened file.
  * @return 0 on success, -errno otherwise.
@@ -810,24 +991,64 @@ int cloudfs_release(const char *path, struct fuse_file_info *fi)
   char key[MAX_PATH_LEN] = "";
   struct stat sb;
 
+  struct cloudfs_handle *h = (struct cloudfs_handle *) (uintptr_t) fi->fh;
+
   cloudfs_get_fullpath(path, fpath);
-  cloudfs_get_temppath(fpath, tpath_dir);
+  if (h->temp_dir != NULL) {
+    strcpy(tpath_dir, h->temp_dir);
+  } else {
+    cloudfs_get_temppath(fpath, tpath_dir);
+  }
   cloudfs_get_key(fpath, key);
+  stats_write(0);
 
   if (State_.no_dedup) {
     sprintf(tpath, "%s", tpath_dir);
     dbg_print("[DBG] temporary file is %s\n", tpath);
   } else {
     /* get the correct temporary file path if dedup is enabled */
-    sprintf(tpath, "%s%s", tpath_dir, "/new_content");
+    sprintf(tpath, "%s%s", tpath_dir, NEW_CONTENT);
     dbg_print("[DBG] temporary directory is %s\n", tpath_dir);
     dbg_print("[DBG] temporary file is %s\n", tpath);
   }
 
+  /* a dirty cloud file staying in the cloud only has the part around the
+   * writes re-chunked; one moving back to SSD needs the entire new version
+   * in the overlay, so the untouched segments are copied in */
+  struct cloudfs_attr attr;
+  long new_size = 0;
+  if ((h->proxy != NULL) && (attr_get(fpath, &attr) == 0)
+      && (attr.flags & ATTR_DIRTY)) {
+    retval = fstat(h->fd, &sb);
+    if (retval < 0) {
+      retval = cloudfs_error("cloudfs_release");
+      cloudfs_close_handle(fi);
+      return retval;
+    }
+    new_size = (sb.st_size > h->proxy->file_size) ?
+      sb.st_size : h->proxy->file_size;
+
+    if (new_size < State_.threshold) {
+      int i = 0;
+      for (i = 0; (i < h->proxy->num_seg) && (retval == 0); i++) {
+        if (!h->materialized[i]) {
+          retval = dedup_layer_materialize(h->proxy, h->fd, h->materialized,
+              i);
+        }
+      }
+    } else {
+      retval = dedup_layer_update(fpath, tpath, h->proxy, h->fd,
+          h->materialized, new_size);
+    }
+    if (retval < 0) {
+      cloudfs_close_handle(fi);
+      return retval;
+    }
+  }
+
   /* close the temporary file */
-  retval = close(fi->fh);
+  retval = cloudfs_close_handle(fi);
   if (retval < 0) {
-    retval = cloudfs_error("cloudfs_release");
     return retval;
   }
   dbg_print("[DBG] temporary file closed\n");
@@ -836,14 +1057,12 @@ int cloudfs_release(const char *path, struct fuse_file_info *fi)
     /* cloud file */
 
     /* get dirty attribute */
-    int dirty = 0;
-    retval = lgetxattr(fpath, U_DIRTY, &dirty, sizeof(int));
+    retval = attr_get(fpath, &attr);
     if (retval < 0) {
-      retval = cloudfs_error("cloudfs_release");
       return retval;
     }
 
-    if (dirty) {
+    if (attr.flags & ATTR_DIRTY) {
       /* file content changed */
       dbg_print("[DBG] file is dirty\n");
 
@@ -853,6 +1072,11 @@ int cloudfs_release(const char *path, struct fuse_file_info *fi)
         retval = cloudfs_error("cloudfs_release");
         return retval;
       }
+      if (!State_.no_dedup) {
+        /* the overlay does not hold the untouched tail of the file */
+        sb.st_size = new_size;
+        sb.st_blocks = (new_size + 511) / 512;
+      }
 #ifdef DEBUG
       print_stat(&sb);
 #endif
@@ -888,25 +1112,23 @@ int cloudfs_release(const char *path, struct fuse_file_info *fi)
         }
 
         /* update attributes */
-        int remote_attr = 0;
-        int dirty_attr = 0;
-        lsetxattr(fpath, U_REMOTE, &remote_attr, sizeof(int), 0);
-        lsetxattr(fpath, U_DIRTY, &dirty_attr, sizeof(int), 0);
+        memset(&attr, 0, sizeof(struct cloudfs_attr));
+        attr_set(fpath, &attr);
 
       } else {
         /* synchronize to the cloud */
         dbg_print("[DBG] file size still exceeds threshold\n");
 
         if (State_.no_dedup) {
-          /* delete the file in the cloud */
-          cloud_delete_object(BUCKET, key);
-          cloud_print_error();
-
-          /* upload the new version */
-          Cfile = fopen(tpath, "rb");
-          cloud_put_object(BUCKET, key, sb.st_size, put_buffer);
+          /* upload the new version, it overwrites the old object */
+          FILE *cfile = fopen(tpath, "rb");
+          if (cfile == NULL) {
+            retval = cloudfs_error("cloudfs_release");
+            return retval;
+          }
+          cloud_put_object_ctx(BUCKET, key, sb.st_size, put_buffer, cfile);
           cloud_print_error();
-          fclose(Cfile);
+          fclose(cfile);
 
           /* remove the temporary file on SSD */
           retval = remove(tpath);
@@ -915,20 +1137,12 @@ int cloudfs_release(const char *path, struct fuse_file_info *fi)
             return retval;
           }
         } else {
-          /* replace the old version in the cloud */
-          retval = dedup_layer_remove(fpath);
-          if (retval < 0) {
-            return retval;
-          }
-          retval = rename(tpath, fpath);
+          /* the proxy file has been updated, drop the overlay */
+          retval = remove(tpath);
           if (retval < 0) {
             retval = cloudfs_error("cloudfs_release");
             return retval;
           }
-          retval = dedup_layer_upload(fpath);
-          if (retval < 0) {
-            return retval;
-          }
         }
 
         /* update attributes */
@@ -944,15 +1158,19 @@ int cloudfs_release(const char *path, struct fuse_file_info *fi)
         retval = cloudfs_error("cloudfs_release");
         return retval;
       }
+
+      /* proxy files written by older versions are converted lazily */
+      if (!State_.no_dedup) {
+        retval = proxy_migrate(fpath);
+        if (retval < 0) {
+          return retval;
+        }
+      }
     }
 
     if (!State_.no_dedup) {
-      /* delete the temporary directory */
-      retval = cloudfs_rmdir_rec(tpath_dir);
-      if (retval < 0) {
-        return retval;
-      }
-      dbg_print("[DBG] temporary directory %s removed\n", tpath_dir);
+      /* the scratch directory is emptied once its last reference is gone */
+      prefetch_cancel(tpath_dir);
     }
 
   } else {
@@ -972,26 +1190,18 @@ int cloudfs_release(const char *path, struct fuse_file_info *fi)
       /* move to the cloud */
       dbg_print("[DBG] file size exceeds threshold\n");
 
-      if (State_.no_dedup) {
-        /* upload the entire file */
-        Cfile = fopen(fpath, "rb");
-        cloud_put_object(BUCKET, key, sb.st_size, put_buffer);
-        cloud_print_error();
-        fclose(Cfile);
-
-        /* clear the file content */
-        FILE *fp = fopen(fpath, "wb");
-        fclose(fp);
+      if (State_.migrate_threads > 0) {
+        /* leave it to the migration threads */
+        retval = migrate_submit(path);
       } else {
-        /* upload via dedup layer */
-        retval = dedup_layer_upload(fpath);
+        char ppath[MAX_PATH_LEN] = "";
+        snprintf(ppath, MAX_PATH_LEN, "%s%s", tpath_dir, PROXY_SUFFIX);
+        retval = cloudfs_upload_local(fpath, ppath, &sb);
         if (retval < 0) {
           return retval;
         }
+        retval = cloudfs_switch_remote(fpath, ppath, &sb);
       }
-
-      /* update attributes */
-      cloudfs_upgrade_attr(&sb, fpath);
     }
   }
 
@@ -1084,6 +1294,24 @@ int cloudfs_readdir(const char *path UNUSED, void *buf, fuse_fill_dir_t filler,
  */
 void *cloudfs_init(struct fuse_conn_info *conn UNUSED)
 {
+  /* threads are started here, after FUSE has forked into the background */
+  if (!State_.no_dedup && (State_.prefetch_depth > 0)) {
+    if (prefetch_init(State_.prefetch_depth, State_.prefetch_budget) < 0) {
+      dbg_print("[ERR] failed to start prefetching threads\n");
+    }
+  }
+  if (!State_.no_dedup && !State_.no_cache) {
+    if (cache_layer_start_evictor() < 0) {
+      dbg_print("[ERR] failed to start the cache evictor\n");
+    }
+  }
+  if (State_.migrate_threads > 0) {
+    char mpath[MAX_PATH_LEN] = "";
+    snprintf(mpath, MAX_PATH_LEN, "%s%s", Temp_path, MIGRATE_PATH);
+    if (migrate_init(mpath, State_.migrate_threads, cloudfs_migrate) < 0) {
+      dbg_print("[ERR] failed to start migration threads\n");
+    }
+  }
   dbg_print("[DBG] cloudfs_init()\n");
   return NULL;
 }
@@ -1095,13 +1323,36 @@ void *cloudfs_init(struct fuse_conn_info *conn UNUSED)
  * @return Void.
  */
 void cloudfs_destroy(void *data UNUSED) {
-  cloud_destroy();
-  fclose(Log);
+  /* stop the threads first, they may still use everything below */
   if (!State_.no_dedup) {
+    prefetch_destroy();
+    if (!State_.no_cache) {
+      cache_layer_stop_evictor();
+    }
+  }
+  if (State_.migrate_threads > 0) {
+    migrate_destroy();
+  }
+
+  /* the statistics are taken from the layers, write them while alive */
+  stats_destroy();
+
+  if (!State_.no_dedup) {
+    temp_area_destroy();
+    seg_store_destroy();
+    if (!State_.no_cache) {
+      cache_layer_destroy();
+    }
     ht_destroy();
     dedup_layer_destroy();
   }
+  lock_table_destroy();
+  attr_destroy();
+
+  /* nothing talks to the cloud or logs any more */
+  cloud_destroy();
   dbg_print("[DBG] cloudfs_destroy()\n");
+  fclose(Log);
 }
 
 /**
@@ -1212,6 +1463,7 @@ int cloudfs_unlink(const char *path)
       retval = cloudfs_error("cloudfs_unlink");
     }
   }
+  attr_invalidate(fpath);
 
   dbg_print("[DBG] cloudfs_unlink(path=\"%s\")=%d\n", path, retval);
 
@@ -1240,25 +1492,230 @@ int cloudfs_rmdir(const char *path)
   return retval;
 }
 
+/**
+ * @brief Lock the inode a path currently refers to.
+ *        This is a no-op unless CloudFS runs in multithreaded mode.
+ *        Release replaces a cloud file that moves back to SSD with a new
+ *        inode, so the path is checked again after getting the lock and
+ *        the lock is retried if it now refers to another inode.
+ * @param path Pathname of the file, relative to the mount point.
+ * @return The lock to pass to lock_table_release(),
+ *         NULL if nothing is locked.
+ */
+static struct inode_lock *cloudfs_lock(const char *path)
+{
+  char fpath[MAX_PATH_LEN] = "";
+  struct stat sb;
+  struct inode_lock *lock = NULL;
+
+  if (!State_.multithread && (State_.migrate_threads == 0)) {
+    return NULL;
+  }
+
+  cloudfs_get_fullpath(path, fpath);
+  if (lstat(fpath, &sb) < 0) {
+    return NULL;
+  }
+
+  while (1) {
+    lock = lock_table_acquire(sb.st_ino);
+    if (lock == NULL) {
+      return NULL;
+    }
+
+    ino_t ino = sb.st_ino;
+    if (lstat(fpath, &sb) < 0) {
+      /* removed while waiting, whoever follows will notice it */
+      return lock;
+    }
+    if (sb.st_ino == ino) {
+      return lock;
+    }
+
+    dbg_print("[DBG] %s changed inode while locking, retrying\n", fpath);
+    lock_table_release(lock);
+  }
+}
+
+/**
+ * @brief Migrate a file on SSD to the cloud, called by migration threads.
+ *        The upload runs without holding the lock of the file, so it can
+ *        still be read from SSD meanwhile. The file is only switched to
+ *        the cloud if it is not opened and has not been opened for
+ *        writing since; otherwise the upload is discarded and the release
+ *        of the writer records a new intent.
+ * @param path CloudFS path of the file.
+ * @return 0 on success (or if there is nothing to do), -errno otherwise.
+ */
+static int cloudfs_migrate(const char *path)
+{
+  int retval = 0;
+  char fpath[MAX_PATH_LEN] = "";
+  char ppath[MAX_PATH_LEN] = "";
+  struct stat sb;
+  struct stat now;
+
+  cloudfs_get_fullpath(path, fpath);
+  cloudfs_get_temppath(fpath, ppath);
+  strncat(ppath, PROXY_SUFFIX, MAX_PATH_LEN - strlen(ppath) - 1);
+
+  /* the replacement left by a crash is stale, drop its references */
+  if (access(ppath, F_OK) == 0) {
+    cloudfs_discard_upload(fpath, ppath);
+  }
+
+  struct inode_lock *lock = cloudfs_lock(path);
+  int skip = (lock == NULL) || (lock->open_count > 0)
+    || (lstat(fpath, &sb) < 0) || cloudfs_is_in_cloud(fpath)
+    || (sb.st_size <= State_.threshold);
+  lock_table_release(lock);
+  if (skip) {
+    dbg_print("[DBG] %s does not need to be migrated now\n", fpath);
+    return retval;
+  }
+
+  retval = cloudfs_upload_local(fpath, ppath, &sb);
+  if (retval < 0) {
+    return retval;
+  }
+
+  lock = cloudfs_lock(path);
+  if ((lock == NULL) || (lock->open_count > 0) || migrate_changed(path)
+      || (lstat(fpath, &now) < 0) || (now.st_ino != sb.st_ino)
+      || (now.st_size != sb.st_size)) {
+    lock_table_release(lock);
+    cloudfs_discard_upload(fpath, ppath);
+    return retval;
+  }
+  retval = cloudfs_switch_remote(fpath, ppath, &now);
+  lock_table_release(lock);
+
+  dbg_print("[DBG] cloudfs_migrate(path=\"%s\")=%d\n", path, retval);
+
+  return retval;
+}
+
+/* operations below are serialized per file in multithreaded mode */
+
+static int cloudfs_getattr_locked(const char *path, struct stat *sb)
+{
+  struct inode_lock *lock = cloudfs_lock(path);
+  int retval = cloudfs_getattr(path, sb);
+  lock_table_release(lock);
+  return retval;
+}
+
+static int cloudfs_open_locked(const char *path, struct fuse_file_info *fi)
+{
+  struct inode_lock *lock = cloudfs_lock(path);
+  int shared = (lock != NULL) && (lock->open_count > 0);
+  int retval = cloudfs_open(path, fi, shared);
+  if ((retval == 0) && (lock != NULL)) {
+    lock->open_count++;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+      migrate_invalidate(path);
+    }
+  }
+  lock_table_release(lock);
+  return retval;
+}
+
+static int cloudfs_read_locked(const char *path, char *buf, size_t size,
+    off_t offset, struct fuse_file_info *fi)
+{
+  struct inode_lock *lock = cloudfs_lock(path);
+  int retval = cloudfs_read(path, buf, size, offset, fi);
+  lock_table_release(lock);
+  return retval;
+}
+
+static int cloudfs_write_locked(const char *path, const char *buf,
+    size_t size, off_t offset, struct fuse_file_info *fi)
+{
+  struct inode_lock *lock = cloudfs_lock(path);
+  int retval = cloudfs_write(path, buf, size, offset, fi);
+  lock_table_release(lock);
+  return retval;
+}
+
+static int cloudfs_release_locked(const char *path, struct fuse_file_info *fi)
+{
+  int retval = 0;
+  struct inode_lock *lock = cloudfs_lock(path);
+
+  if ((lock != NULL) && (lock->open_count > 1)) {
+    /* still opened elsewhere, the last release synchronizes the file */
+    lock->open_count--;
+    retval = cloudfs_close_handle(fi);
+  } else {
+    if (lock != NULL) {
+      lock->open_count = 0;
+    }
+
+    /* keep the scratch directory until the release is done with it */
+    struct cloudfs_handle *h = (struct cloudfs_handle *) (uintptr_t) fi->fh;
+    char temp_dir[MAX_PATH_LEN] = "";
+    if (h->temp_dir != NULL) {
+      strcpy(temp_dir, h->temp_dir);
+      temp_area_hold(temp_dir);
+    }
+    retval = cloudfs_release(path, fi);
+    if (temp_dir[0] != '\0') {
+      temp_area_release(temp_dir);
+    }
+  }
+  lock_table_release(lock);
+  return retval;
+}
+
+static int cloudfs_utimens_locked(const char *path,
+    const struct timespec tv[2])
+{
+  struct inode_lock *lock = cloudfs_lock(path);
+  int retval = cloudfs_utimens(path, tv);
+  lock_table_release(lock);
+  return retval;
+}
+
+static int cloudfs_chmod_locked(const char *path, mode_t mode)
+{
+  struct inode_lock *lock = cloudfs_lock(path);
+  int retval = cloudfs_chmod(path, mode);
+  lock_table_release(lock);
+  return retval;
+}
+
+static int cloudfs_unlink_locked(const char *path)
+{
+  struct inode_lock *lock = cloudfs_lock(path);
+  int retval = cloudfs_unlink(path);
+  if ((retval == 0) && (lock != NULL)) {
+    /* the path can no longer reach this inode */
+    lock->open_count = 0;
+  }
+  lock_table_release(lock);
+  return retval;
+}
+
 /* functions supported by CloudFS */
 static struct fuse_operations Cloudfs_operations = {
-  .getattr        = cloudfs_getattr,
+  .getattr        = cloudfs_getattr_locked,
   .getxattr       = cloudfs_getxattr,
   .setxattr       = cloudfs_setxattr,
   .mkdir          = cloudfs_mkdir,
   .mknod          = cloudfs_mknod,
-  .open           = cloudfs_open,
-  .read           = cloudfs_read,
-  .write          = cloudfs_write,
-  .release        = cloudfs_release,
+  .open           = cloudfs_open_locked,
+  .read           = cloudfs_read_locked,
+  .write          = cloudfs_write_locked,
+  .release        = cloudfs_release_locked,
   .opendir        = cloudfs_opendir,
   .readdir        = cloudfs_readdir,
   .init           = cloudfs_init,
   .destroy        = cloudfs_destroy,
   .access         = cloudfs_access,
-  .utimens        = cloudfs_utimens,
-  .chmod          = cloudfs_chmod,
-  .unlink         = cloudfs_unlink,
+  .utimens        = cloudfs_utimens_locked,
+  .chmod          = cloudfs_chmod_locked,
+  .unlink         = cloudfs_unlink_locked,
   .rmdir          = cloudfs_rmdir
 };
 
@@ -1272,7 +1729,9 @@ static int sum_cache(const char *fpath, const struct stat *sb,
     int typeflag UNUSED)
 {
   dbg_print("[DBG] scanning cache directory: %s\n", fpath);
-  if (strlen(fpath) == (strlen(Cache_path) + 1 + 2 * MD5_DIGEST_LENGTH)) {
+  if ((strncmp(fpath, Cache_path, strlen(Cache_path)) == 0)
+      && (fpath[strlen(Cache_path)] == '/')
+      && fp_is_key(fpath + strlen(Cache_path) + 1)) {
     dbg_print("[DBG] cache file found: %s\n", fpath);
     Cache_init_size += (sb->st_size);
     dbg_print("[DBG] cache initial size increased to %d\n", Cache_init_size);
@@ -1290,8 +1749,10 @@ int cloudfs_start(struct cloudfs_state *state, const char* fuse_runtime_name)
   argv[argc] = (char *) malloc(1024 * sizeof(char));
   strcpy(argv[argc++], state->fuse_path);
 
-  /* set the fuse mode to single thread */
-  argv[argc++] = "-s";
+  /* set the fuse mode to single thread, unless asked otherwise */
+  if (!state->multithread) {
+    argv[argc++] = "-s";
+  }
 
   /* run fuse in foreground */
   // argv[argc++] = "-f";
@@ -1318,6 +1779,16 @@ int cloudfs_start(struct cloudfs_state *state, const char* fuse_runtime_name)
     }
   }
 
+  if (lock_table_init(LOCK_BKT_NUM) < 0) {
+    dbg_print("[ERR] failed to initialize lock table\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (attr_init(ATTR_CACHE_ENTRIES) < 0) {
+    dbg_print("[ERR] failed to initialize attribute cache\n");
+    exit(EXIT_FAILURE);
+  }
+
   S3Status s3status = S3StatusOK;
   s3status = cloud_init(State_.hostname);
   if (s3status != S3StatusOK) {
@@ -1332,6 +1803,13 @@ int cloudfs_start(struct cloudfs_state *state, const char* fuse_runtime_name)
     exit(EXIT_FAILURE);
   }
 
+  char stats_path[MAX_PATH_LEN] = "";
+  snprintf(stats_path, MAX_PATH_LEN, "%s%s", Temp_path, STATS_PATH);
+  stats_init(stats_path);
+
+  memset(Idx_path, '\0', MAX_PATH_LEN);
+  snprintf(Idx_path, MAX_PATH_LEN, "%s%s", Temp_path, IDX_PATH);
+  dbg_print("[DBG] Idx_path=\"%s\"\n", Idx_path);
   memset(Bkt_prfx, '\0', MAX_PATH_LEN);
   snprintf(Bkt_prfx, MAX_PATH_LEN, "%s%s", Temp_path, "/bucket");
   dbg_print("[DBG] Bkt_prfx=\"%s\"\n", Bkt_prfx);
@@ -1356,18 +1834,38 @@ int cloudfs_start(struct cloudfs_state *state, const char* fuse_runtime_name)
 
   if (!State_.no_dedup) {
     dbg_print("[DBG] dedup enabled\n");
-    if (ht_init(Bkt_prfx, BKT_NUM, BKT_SIZE) < 0) {
+    if (ht_init(Idx_path, Bkt_prfx, BKT_NUM, State_.filter_fpr,
+        State_.filter_size) < 0) {
       dbg_print("[ERR] failed to initialize hash table\n");
       exit(EXIT_FAILURE);
     }
-    dedup_layer_init(State_.rabin_window_size, State_.avg_seg_size,
-        State_.avg_seg_size / 2, State_.avg_seg_size * 2, State_.no_cache);
+    dedup_layer_init(State_.chunker, State_.rabin_window_size,
+        State_.avg_seg_size, State_.avg_seg_size / 2, State_.avg_seg_size * 2,
+        State_.no_cache);
+    pipeline_init(State_.pipeline_workers, State_.pipeline_puts);
+    fp_init(State_.fingerprint);
+
+    char spath[MAX_PATH_LEN] = "";
+    snprintf(spath, MAX_PATH_LEN, "%s%s", Temp_path, STORE_PATH);
+    if (seg_store_init(spath, State_.store_size, dedup_layer_download_seg)
+        < 0) {
+      dbg_print("[ERR] failed to initialize segment store\n");
+      exit(EXIT_FAILURE);
+    }
+
+    snprintf(spath, MAX_PATH_LEN, "%s%s", Temp_path, SCRATCH_PATH);
+    if (temp_area_init(spath, TEMP_AREA_MAX_FREE) < 0) {
+      dbg_print("[ERR] failed to initialize scratch directories\n");
+      exit(EXIT_FAILURE);
+    }
     if (!State_.no_cache) {
       dbg_print("[DBG] cache enabled\n");
       dbg_print("[DBG] cache size %d bytes\n", State_.cache_size);
 
       /* initialize the cache layer */
-      cache_layer_init(State_.cache_size, Cache_init_size);
+      cache_layer_init(State_.cache_size, Cache_init_size,
+          State_.cache_policy, State_.cache_mode, State_.evict_high,
+          State_.evict_low);
     } else {
       dbg_print("[DBG] cache disabled\n");
     }
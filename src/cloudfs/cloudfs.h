@@ -4,7 +4,10 @@
 #define MAX_PATH_LEN 4096
 #define MAX_HOSTNAME_LEN 1024
 
-#include <openssl/md5.h>
+#include <openssl/sha.h>
+
+/* longest segment key, a SHA-256 one, see fingerprint.c */
+#define MAX_KEY_LEN (sizeof("sha256-") - 1 + 2 * SHA256_DIGEST_LENGTH)
 
 struct cloudfs_state {
   char ssd_path[MAX_PATH_LEN];
@@ -14,10 +17,25 @@ struct cloudfs_state {
   int threshold;
   int avg_seg_size;
   int rabin_window_size;
+  int chunker;
   int cache_size;
+  int prefetch_depth;
+  int prefetch_budget;
+  int migrate_threads;
+  int store_size;
+  int pipeline_workers;
+  int pipeline_puts;
+  int fingerprint;
+  int cache_policy;
+  int cache_mode;
+  int evict_high;
+  int evict_low;
+  double filter_fpr;
+  long filter_size;
   char no_dedup;
   char no_cache;
   char no_compress;
+  char multithread;
 };
 
 /* structure of the key for deduplication hash table,
@@ -25,7 +43,7 @@ struct cloudfs_state {
 struct cloudfs_seg {
   int ref_count;
   long seg_size;
-  char md5[MD5_DIGEST_LENGTH * 2 + 1];
+  char key[MAX_KEY_LEN + 1];
 };
 
 int cloudfs_start(struct cloudfs_state* state,
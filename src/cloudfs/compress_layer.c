@@ -5,7 +5,10 @@
  * @author Yinsu Chu (yinsuc)
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <stdlib.h>
 
 // #define DEBUG
 #include "cloudfs.h"
@@ -13,21 +16,20 @@
 #include "cloudapi.h"
 #include "compressapi.h"
 #include "zlib.h"
+#include "compress_layer.h"
 
 #define COMP_SUFFIX (".compressed")
 
 extern FILE *Log;
 
-/* callback function for downloading from the cloud */
-static FILE *Tfile;
-static int get_buffer(const char *buf, int len) {
-  return fwrite(buf, 1, len, Tfile);
+/* callback function for downloading from the cloud, "ctx" is the FILE */
+static int get_buffer(const char *buf, int len, void *ctx) {
+  return fwrite(buf, 1, len, (FILE *) ctx);
 }
 
-/* callback function for uploading to the cloud */
-static FILE *Cfile;
-static int put_buffer(char *buf, int len) {
-  return fread(buf, 1, len, Cfile);
+/* callback function for uploading to the cloud, "ctx" is the FILE */
+static int put_buffer(char *buf, int len, void *ctx) {
+  return fread(buf, 1, len, (FILE *) ctx);
 }
 
 /**
@@ -41,19 +43,44 @@ int compress_layer_decompress(char *fpath, char *target_file)
   int retval = 0;
 
   FILE *comp = fopen(fpath, "rb");
-  FILE *decomp = fopen(target_file, "wb");
-  if (comp == NULL || decomp == NULL) {
+  if (comp == NULL) {
     retval = cloudfs_error("compress_layer_decompress");
     return retval;
   }
 
-  retval = inf(comp, decomp);
+  retval = compress_layer_decompress_fp(comp, target_file);
   if (retval < 0) {
     dbg_print("[ERR] failed to decompress %s\n", fpath);
-    return retval;
   }
 
   fclose(comp);
+
+  return retval;
+}
+
+/**
+ * @brief Decompress an already opened file to the target file.
+ *        Holding the file open keeps its content readable even if
+ *        another thread removes it in the meantime.
+ * @param comp The compressed file, positioned at its beginning.
+ * @param target_file Pathname of the file to store the result.
+ * @return 0 on success, negative otherwise.
+ */
+int compress_layer_decompress_fp(FILE *comp, char *target_file)
+{
+  int retval = 0;
+
+  FILE *decomp = fopen(target_file, "wb");
+  if (decomp == NULL) {
+    retval = cloudfs_error("compress_layer_decompress_fp");
+    return retval;
+  }
+
+  retval = inf(comp, decomp);
+  if (retval < 0) {
+    dbg_print("[ERR] failed to decompress into %s\n", target_file);
+  }
+
   fclose(decomp);
 
   return retval;
@@ -64,8 +91,7 @@ int compress_layer_decompress(char *fpath, char *target_file)
  *        and decompress into "target_file".
  * @param target_file Pathname of the file to decompress into.
  *                    It should have MAX_PATH_LEN bytes.
- * @param key The key of the cloud file. It should have
- *            MD5_DIGEST_LENGTH bytes.
+ * @param key The key of the cloud file.
  * @return 0 on success, negative otherwise.
  */
 int compress_layer_download_seg(char *target_file, char *key)
@@ -75,10 +101,14 @@ int compress_layer_download_seg(char *target_file, char *key)
   char tpath[MAX_PATH_LEN] = "";
   sprintf(tpath, "%s%s", target_file, COMP_SUFFIX);
 
-  Tfile = fopen(tpath, "wb");
-  cloud_get_object(BUCKET, key, get_buffer);
+  FILE *tfile = fopen(tpath, "wb");
+  if (tfile == NULL) {
+    retval = cloudfs_error("compress_layer_download_seg");
+    return retval;
+  }
+  cloud_get_object_ctx(BUCKET, key, get_buffer, tfile);
   cloud_print_error();
-  fclose(Tfile);
+  fclose(tfile);
 
   dbg_print("[DBG] compressed segment downloaded to file %s\n", tpath);
 
@@ -171,10 +201,14 @@ int compress_layer_upload_seg(char *fpath, long offset, char *key, long len)
     return len_compressed_file;
   }
 
-  Cfile = fopen(tpath, "rb");
-  cloud_put_object(BUCKET, key, len_compressed_file, put_buffer);
+  FILE *cfile = fopen(tpath, "rb");
+  if (cfile == NULL) {
+    retval = cloudfs_error("compress_layer_upload_seg");
+    return retval;
+  }
+  cloud_put_object_ctx(BUCKET, key, len_compressed_file, put_buffer, cfile);
   cloud_print_error();
-  fclose(Cfile);
+  fclose(cfile);
 
   retval = remove(tpath);
   if (retval < 0) {
@@ -187,3 +221,71 @@ int compress_layer_upload_seg(char *fpath, long offset, char *key, long len)
   return retval;
 }
 
+/**
+ * @brief Compress a segment held in memory.
+ * @param data The segment.
+ * @param len Length of the segment.
+ * @param comp The compressed segment is returned here, it must be freed
+ *             by the caller of this function.
+ * @return Length of the compressed segment on success, negative otherwise.
+ */
+long compress_layer_compress_buf(char *data, long len, char **comp)
+{
+  long retval = 0;
+
+  /* fmemopen() may refuse an empty buffer, the segment is read by length */
+  FILE *decomp = fmemopen(data, (len > 0) ? len : 1, "rb");
+  if (decomp == NULL) {
+    retval = cloudfs_error("compress_layer_compress_buf - fmemopen");
+    return retval;
+  }
+
+  size_t comp_len = 0;
+  FILE *cfile = open_memstream(comp, &comp_len);
+  if (cfile == NULL) {
+    retval = cloudfs_error("compress_layer_compress_buf - open_memstream");
+    fclose(decomp);
+    return retval;
+  }
+
+  retval = def(decomp, cfile, len, Z_DEFAULT_COMPRESSION);
+  fclose(decomp);
+  fclose(cfile);
+  if (retval < 0) {
+    dbg_print("[ERR] failed to compress a segment in memory\n");
+    free(*comp);
+    *comp = NULL;
+    return retval;
+  }
+  retval = comp_len;
+
+  dbg_print("[DBG] compress_layer_compress_buf(len=%ld)=%ld\n", len, retval);
+
+  return retval;
+}
+
+/**
+ * @brief Upload a compressed segment held in memory to the cloud.
+ * @param key Cloud key of the segment.
+ * @param comp The compressed segment.
+ * @param comp_len Length of the compressed segment.
+ * @return 0 on success, negative otherwise.
+ */
+int compress_layer_upload_buf(char *key, char *comp, long comp_len)
+{
+  int retval = 0;
+
+  FILE *cfile = fmemopen(comp, comp_len, "rb");
+  if (cfile == NULL) {
+    retval = cloudfs_error("compress_layer_upload_buf");
+    return retval;
+  }
+  cloud_put_object_ctx(BUCKET, key, comp_len, put_buffer, cfile);
+  cloud_print_error();
+  fclose(cfile);
+
+  dbg_print("[DBG] compress_layer_upload_buf(key=\"%s\", comp_len=%ld)=%d\n",
+      key, comp_len, retval);
+
+  return retval;
+}
@@ -1,11 +1,16 @@
 #ifndef __COMPRESS_LAYER_H_
 #define __COMPRESS_LAYER_H_
 
+#include <stdio.h>
+
 int compress_layer_decompress(char *fpath, char *target_file);
+int compress_layer_decompress_fp(FILE *comp, char *target_file);
 int compress_layer_download_seg(char *target_file, char *key);
 long compress_layer_compress(char *fpath, long offset, long len,
     char *target_file);
 int compress_layer_upload_seg(char *fpath, long offset, char *key, long len);
+long compress_layer_compress_buf(char *data, long len, char **comp);
+int compress_layer_upload_buf(char *key, char *comp, long comp_len);
 
 #endif
 
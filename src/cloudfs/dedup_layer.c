@@ -13,6 +13,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
 
 // #define DEBUG
 #include "cloudfs.h"
@@ -20,170 +21,69 @@
 #include "cloudapi.h"
 #include "hashtable.h"
 #include "dedup.h"
+#include "compressapi.h"
 #include "compress_layer.h"
 #include "cache_layer.h"
+#include "proxy.h"
+#include "dedup_layer.h"
+#include "seg_store.h"
+#include "pipeline.h"
+#include "fingerprint.h"
 
 #define BUF_LEN (1024)
 
+/* number of locks guarding segments, a segment uses the one its key hashes to */
+#define SEG_LOCK_NUM (64)
+
 extern FILE *Log;
-static rabinpoly_t *Rp;
+static int Chunker;
 static unsigned int Window_size;
 static unsigned int Avg_seg_size;
 static unsigned int Min_seg_size;
 static unsigned int Max_seg_size;
 static int Cache_disabled;
 
-void dedup_layer_get_key(unsigned char *md5, char *key);
+/* serialize adding and removing the same segment from different threads,
+ * so that a segment is never uploaded twice or deleted while being added */
+static pthread_mutex_t Seg_locks[SEG_LOCK_NUM];
 
 /**
- * @brief A helper function to dedup_layer_segmentation.
- *        It allocates memory for newly found segments.
- * @param num_seg Number of segments is updated here.
- * @param segs Segments are updated here.
- * @param segment_len The length of the new segment.
- * @param md5 The MD5 of the new segment.
- * @return 0 on success, -errno otherwise.
+ * @brief Get the lock guarding a segment.
+ * @param segp The segment.
+ * @return Pointer to the mutex.
  */
-static int dedup_layer_update_segments(int *num_seg, struct cloudfs_seg **segs,
-    int segment_len, char *md5)
+static pthread_mutex_t *dedup_layer_seg_lock(struct cloudfs_seg *segp)
 {
-  int retval = 0;
-  dbg_print("[DBG] new segment found\n");
-
-  int old_size = (*num_seg) * sizeof(struct cloudfs_seg);
-  dbg_print("[DBG] old size is %d * %d = %d\n",
-      *num_seg, sizeof(struct cloudfs_seg), old_size);
-
-  (*num_seg)++;
-  int new_size = (*num_seg) * sizeof(struct cloudfs_seg);
-  dbg_print("[DBG] new size is %d * %d = %d\n",
-      *num_seg, sizeof(struct cloudfs_seg), new_size);
-
-  struct cloudfs_seg *enlarge =
-    (struct cloudfs_seg *) realloc((*segs), new_size);
-  if (enlarge == NULL) {
-    retval = cloudfs_error("dedup_layer_update_segments");
-    return retval;
-  } else {
-    (*segs) = enlarge;
-  }
-  dbg_print("[DBG] memory (re-)allocated\n");
-
-  struct cloudfs_seg *new_seg = (struct cloudfs_seg *)
-    ((char *) (*segs) + old_size);
-  new_seg->ref_count = 0;
-  new_seg->seg_size = segment_len;
-  memset(new_seg->md5, '\0', 2 * MD5_DIGEST_LENGTH + 1);
-  memcpy(new_seg->md5, md5, 2 * MD5_DIGEST_LENGTH);
-#ifdef DEBUG
-  print_seg(new_seg);
-#endif
-
-  return retval;
-}
-
-/**
- * @brief Cut a file into segments.
- *        Reference: dedup-lib/rabin-example.c in the provided code.
- * @param fpath Pathname of the file. It should have MAX_PATH_LEN bytes.
- * @param num_seg Return the number of segments here.
- * @param segs Return the array of segments here. It must be freed
- *             by the caller of this function.
- * @return 0 on success, -1 otherwise.
- */
-static int dedup_layer_segmentation(char *fpath, int *num_seg,
-    struct cloudfs_seg **segs)
-{
-  int retval = 0;
-
-  int fd = open(fpath, O_RDONLY);
-  if (fd < 0) {
-    retval = cloudfs_error("dedup_layer_segmentation");
-    return retval;
-  }
-  dbg_print("[DBG] segmenting file %s\n", fpath);
-
-  Rp = rabin_init(Window_size, Avg_seg_size, Min_seg_size, Max_seg_size);
-  if (Rp == NULL) {
-    return -1;
-  }
-
-  MD5_CTX ctx;
-  unsigned char md5[MD5_DIGEST_LENGTH] = "";
-  int new_segment = 0;
-  int len = 0;
-  int segment_len = 0;
-  char buf[BUF_LEN] = "";
-  int bytes = 0;
-
-  MD5_Init(&ctx);
-  while ((bytes = read(fd, buf, BUF_LEN)) > 0) {
-    char *buftoread = (char *) buf;
-    while ((len = rabin_segment_next(Rp, buftoread, bytes,
-            &new_segment)) > 0) {
-
-      MD5_Update(&ctx, buftoread, len);
-      segment_len += len;
-
-      if (new_segment) {
-        MD5_Final(md5, &ctx);
-
-        char ch_md5[2 * MD5_DIGEST_LENGTH + 1] = "";
-        dedup_layer_get_key(md5, ch_md5);
-        retval = dedup_layer_update_segments(num_seg, segs, segment_len,
-            ch_md5);
-        if (retval < 0) {
-          return retval;
-        }
-
-        MD5_Init(&ctx);
-        segment_len = 0;
-      }
-
-      buftoread += len;
-      bytes -= len;
-
-      if (bytes <= 0) {
-        break;
-      }
-    }
-    if (len == -1) {
-      dbg_print("[ERR] failed to process the segment\n");
-      return -1;
-    }
-  }
-  MD5_Final(md5, &ctx);
-
-  char ch_md5[2 * MD5_DIGEST_LENGTH + 1] = "";
-  dedup_layer_get_key(md5, ch_md5);
-  retval = dedup_layer_update_segments(num_seg, segs, segment_len, ch_md5);
-  if (retval < 0) {
-    return retval;
-  }
-
-  rabin_free(&Rp);
-
-  retval = close(fd);
-  if (retval < 0) {
-    retval = cloudfs_error("dedup_layer_segmentation");
+  unsigned int hash = 0;
+  int i = 0;
+  for (i = 0; (i < (int) MAX_KEY_LEN) && (segp->key[i] != '\0'); i++) {
+    hash = hash * 31 + (unsigned char) segp->key[i];
   }
-
-  return retval;
+  return &Seg_locks[hash % SEG_LOCK_NUM];
 }
 
 /**
  * @brief Initialize the dedup layer.
- * @param Parameters required to initialize Rabin Fingerprinting library.
+ * @param chunker The chunking engine, a chunker_type_t.
+ * @param Parameters required to initialize the chunking engine.
  * @return 0 on success, -1 otherwise.
  */
-void dedup_layer_init(unsigned int window_size, unsigned int avg_seg_size,
-    unsigned int min_seg_size, unsigned int max_seg_size, int no_cache)
+void dedup_layer_init(int chunker, unsigned int window_size,
+    unsigned int avg_seg_size, unsigned int min_seg_size,
+    unsigned int max_seg_size, int no_cache)
 {
+  Chunker = chunker;
   Window_size = window_size;
   Avg_seg_size = avg_seg_size;
   Min_seg_size = min_seg_size;
   Max_seg_size = max_seg_size;
   Cache_disabled = no_cache;
+
+  int i = 0;
+  for (i = 0; i < SEG_LOCK_NUM; i++) {
+    pthread_mutex_init(&Seg_locks[i], NULL);
+  }
+
   dbg_print("[DBG] dedup_layer_init()\n");
 }
 
@@ -196,48 +96,77 @@ void dedup_layer_destroy(void)
   dbg_print("[DBG] dedup_layer_destroy()\n");
 }
 
+/**
+ * @brief Download a segment from cache/cloud and decompress it.
+ *        This is how the segment store gets its segments.
+ * @param spath Pathname of the file to save the segment.
+ * @param segp The segment.
+ * @return 0 on success, -errno otherwise.
+ */
+int dedup_layer_download_seg(char *spath, struct cloudfs_seg *segp)
+{
+  int retval = 0;
+
+  if (Cache_disabled) {
+    retval = compress_layer_download_seg(spath, segp->key);
+  } else {
+    retval = cache_layer_download_seg(spath, segp);
+  }
+  /* the counter is only written out now and then, report this segment */
+  compress_compute_cost_flush();
+  if (retval >= 0) {
+    dbg_print("[DBG] segment downloaded from the cloud\n");
+    retval = 0;
+  }
+
+  dbg_print("[DBG] dedup_layer_download_seg(spath=\"%s\", key=%s)=%d\n",
+      spath, segp->key, retval);
+
+  return retval;
+}
+
+/**
+ * @brief Make sure a segment is in the segment store, e.g. to prefetch it.
+ * @param segp The segment.
+ * @return 0 on success, -errno otherwise.
+ */
+int dedup_layer_fetch_seg(struct cloudfs_seg *segp)
+{
+  int retval = seg_store_acquire(segp, NULL);
+  if (retval == 0) {
+    seg_store_release(segp);
+  }
+  return retval;
+}
+
 /**
  * @brief Read part of a segment.
- *        Each cloud file has its own temporary directory to save segments
- *        downloaded from the cloud. This function first searches in this
- *        temporary directory to see whether the segment has already
- *        been downloaded; if not, it downloads the segment from cache/cloud,
- *        then it reads the segment.
- * @param temp_dir The temporary directory to save segments. Its
- *                  size should be MAX_PATH_LEN.
+ *        Segments are read from the segment store shared by all files,
+ *        which downloads a segment only if no one has it yet.
  * @param segp The segment to read.
  * @param buf The buffer to hold the returned data.
  * @param size Size of the buffer.
  * @param offset The offset into the segment to start reading.
  * @return Size read on success, -errno otherwise.
  */
-int dedup_layer_read_seg(char *temp_dir, struct cloudfs_seg *segp, char *buf,
-    int size, long offset)
+int dedup_layer_read_seg(struct cloudfs_seg *segp, char *buf, int size,
+    long offset)
 {
   int retval = 0;
 
-  dbg_print("[DBG] cloud key is %s\n", segp->md5);
-
-  char tpath[MAX_PATH_LEN] = "";
-  snprintf(tpath, MAX_PATH_LEN, "%s/%s", temp_dir, segp->md5);
-  dbg_print("[DBG] local file path %s\n", tpath);
+  dbg_print("[DBG] cloud key is %s\n", segp->key);
 
-  if (access(tpath, F_OK) < 0) {
-    dbg_print("[DBG] segment not found in temporary directory\n");
-    if (Cache_disabled) {
-      retval = compress_layer_download_seg(tpath, segp->md5);
-    } else {
-      retval = cache_layer_download_seg(tpath, segp);
-    }
-    if (retval < 0) {
-      return retval;
-    }
-    dbg_print("[DBG] segment downloaded from the cloud\n");
+  char spath[MAX_PATH_LEN] = "";
+  retval = seg_store_acquire(segp, spath);
+  if (retval < 0) {
+    return retval;
   }
+  dbg_print("[DBG] local file path %s\n", spath);
 
-  int fd = open(tpath, O_RDONLY);
+  int fd = open(spath, O_RDONLY);
   if (fd < 0) {
     retval = cloudfs_error("dedup_layer_read_seg");
+    seg_store_release(segp);
     return retval;
   }
 
@@ -247,28 +176,53 @@ int dedup_layer_read_seg(char *temp_dir, struct cloudfs_seg *segp, char *buf,
   }
 
   close(fd);
+  seg_store_release(segp);
 
-  dbg_print("[DBG] dedup_layer_read_seg(temp_dir=\"%s\","
-      " segp=0x%08x, buf=0x%08x, size=%d, offset=%ld)=%d\n",
-      temp_dir, (unsigned int) segp, (unsigned int) buf, size, offset, retval);
+  dbg_print("[DBG] dedup_layer_read_seg(segp=0x%08x, buf=0x%08x, size=%d,"
+      " offset=%ld)=%d\n", (unsigned int) segp, (unsigned int) buf, size,
+      offset, retval);
 
   return retval;
 }
 
 /**
- * @brief A helper function to convert the numeric MD5 representation
- *        to character MD5 representation.
- * @param md5 The numeric MD5.
- * @param key The character MD5 is returned here. It should have at least
- *            2 * MD5_DIGEST_LENGTH + 1 bytes.
- * @return Void.
+ * @brief Copy a segment of a cloud file into its overlay.
+ *        The overlay is the temporary file holding the new content of the
+ *        file at the same offsets; a flag per segment tells whether the
+ *        overlay has the data of that segment.
+ * @param p The proxy file of the file.
+ * @param fd Descriptor of the overlay.
+ * @param materialized The per-segment flags, updated here.
+ * @param i Index of the segment.
+ * @return 0 on success, -errno otherwise.
  */
-void dedup_layer_get_key(unsigned char *md5, char *key)
+int dedup_layer_materialize(struct proxy *p, int fd,
+    unsigned char *materialized, int i)
 {
-  int i = 0;
-  for (i = 0; i < 2 * MD5_DIGEST_LENGTH; i = i + 2) {
-    sprintf(key + i, "%02x", md5[i / 2]);
+  int retval = 0;
+  struct cloudfs_seg seg;
+  proxy_get_seg(p, i, &seg);
+
+  char *seg_buf = (char *) malloc(seg.seg_size > 0 ? seg.seg_size : 1);
+  if (seg_buf == NULL) {
+    retval = cloudfs_error("dedup_layer_materialize");
+    return retval;
   }
+
+  retval = dedup_layer_read_seg(&seg, seg_buf, seg.seg_size, 0);
+  if (retval >= 0) {
+    dbg_print("[DBG] segment %d materialized at offset %llu\n", i,
+        (unsigned long long) p->records[i].offset);
+    if (pwrite(fd, seg_buf, retval, p->records[i].offset) != retval) {
+      retval = cloudfs_error("dedup_layer_materialize");
+    } else {
+      materialized[i] = 1;
+      retval = 0;
+    }
+  }
+  free(seg_buf);
+
+  return retval;
 }
 
 /**
@@ -290,42 +244,40 @@ static int dedup_layer_add_seg(struct cloudfs_seg *segp, char *fpath,
   print_seg(segp);
 #endif
 
-  struct cloudfs_seg *found = NULL;
-  retval = ht_search(segp, &found);
-  if (retval < 0) {
-    return retval;
-  }
+  pthread_mutex_t *seg_lock = dedup_layer_seg_lock(segp);
+  pthread_mutex_lock(seg_lock);
 
-  if (found != NULL) {
-    dbg_print("[DBG] segment to add found in hash table\n");
-#ifdef DEBUG
-    print_seg(found);
-#endif
-    (found->ref_count)++;
-    ht_sync(found);
-  } else {
+  retval = ht_add_ref(segp, 1);
+  if (retval >= 0) {
+    dbg_print("[DBG] segment to add found in hash table,"
+        " ref_count increased to %d\n", retval);
+    if (!Cache_disabled) {
+      cache_layer_set_ref(segp->key, retval);
+    }
+    retval = 0;
+  } else if (retval == -ENOENT) {
     dbg_print("[DBG] segment to add not found in hash table\n");
 
-    dbg_print("[DBG] cloud key is %s\n", segp->md5);
+    dbg_print("[DBG] cloud key is %s\n", segp->key);
 
     /* upload the segment */
     if (Cache_disabled) {
       retval =
-        compress_layer_upload_seg(fpath, offset, segp->md5, segp->seg_size);
+        compress_layer_upload_seg(fpath, offset, segp->key, segp->seg_size);
     } else {
-      retval = cache_layer_upload_seg(fpath, offset, segp->md5, segp->seg_size);
-    }
-    if (retval < 0) {
-      return retval;
+      retval = cache_layer_upload_seg(fpath, offset, segp->key, segp->seg_size);
     }
-    dbg_print("[DBG] uploaded to the cloud\n");
-
-    retval = ht_insert(segp);
-    if (retval < 0) {
-      return retval;
+    if (retval == 0) {
+      dbg_print("[DBG] uploaded to the cloud\n");
+      retval = ht_insert(segp);
+      if ((retval == 0) && !Cache_disabled) {
+        cache_layer_set_ref(segp->key, segp->ref_count);
+      }
     }
   }
 
+  pthread_mutex_unlock(seg_lock);
+
   return retval;
 }
 
@@ -342,37 +294,124 @@ static int dedup_layer_remove_seg(struct cloudfs_seg *segp)
 {
   int retval = 0;
 
-  struct cloudfs_seg *found = NULL;
-  retval = ht_search(segp, &found);
-  if (retval < 0) {
-    return retval;
-  }
+  pthread_mutex_t *seg_lock = dedup_layer_seg_lock(segp);
+  pthread_mutex_lock(seg_lock);
 
-  if (found != NULL) {
-    dbg_print("[DBG] segment to remove found in hash table\n");
-#ifdef DEBUG
-    print_seg(found);
-#endif
-    (found->ref_count)--;
-    ht_sync(found);
-    if (found->ref_count == 0) {
+  retval = ht_add_ref(segp, -1);
+  if (retval >= 0) {
+    dbg_print("[DBG] segment to remove found in hash table,"
+        " ref_count decreased to %d\n", retval);
+    if (retval == 0) {
       if (Cache_disabled) {
-        cloud_delete_object(BUCKET, segp->md5);
+        cloud_delete_object(BUCKET, segp->key);
         cloud_print_error();
       } else {
-        cache_layer_remove_seg(segp->md5);
+        cache_layer_remove_seg(segp->key);
       }
+    } else if (!Cache_disabled) {
+      cache_layer_set_ref(segp->key, retval);
     }
-  } else {
+    retval = 0;
+  } else if (retval == -ENOENT) {
     dbg_print("[DBG] segment to remove not found in hash table\n");
+    retval = 0;
   }
 
+  pthread_mutex_unlock(seg_lock);
+
   dbg_print("[DBG] dedup_layer_remove_seg(segp=0x%08x)=%d\n",
       (unsigned int) segp, retval);
 
   return retval;
 }
 
+/**
+ * @brief Tell the upload pipeline whether a segment is stored already.
+ * @param segp The segment.
+ * @return 1 if it is in the hash table, 0 otherwise.
+ */
+static int dedup_layer_is_stored(struct cloudfs_seg *segp)
+{
+  struct cloudfs_seg found;
+  ht_search(segp, &found);
+  return (found.ref_count > 0);
+}
+
+/**
+ * @brief Add a segment coming out of the upload pipeline.
+ *        Same as dedup_layer_add_seg(), but the segment is in memory and
+ *        usually compressed already.
+ * @param ps The segment.
+ * @return 0 on success, -errno otherwise.
+ */
+static int dedup_layer_store_seg(struct pipeline_seg *ps)
+{
+  long retval = 0;
+  struct cloudfs_seg *segp = &ps->seg;
+
+  dbg_print("[DBG] adding segment - offset %ld from the pipeline\n",
+      ps->offset);
+#ifdef DEBUG
+  print_seg(segp);
+#endif
+
+  pthread_mutex_t *seg_lock = dedup_layer_seg_lock(segp);
+  pthread_mutex_lock(seg_lock);
+
+  retval = ht_add_ref(segp, 1);
+  if (retval >= 0) {
+    dbg_print("[DBG] segment to add found in hash table,"
+        " ref_count increased to %ld\n", retval);
+    if (!Cache_disabled) {
+      cache_layer_set_ref(segp->key, retval);
+    }
+    retval = 0;
+  } else if (retval == -ENOENT) {
+    dbg_print("[DBG] segment to add not found in hash table\n");
+
+    /* it was stored when hashed, but removed since */
+    retval = 0;
+    if (ps->comp == NULL) {
+      retval = compress_layer_compress_buf(ps->data, ps->len, &ps->comp);
+      if (retval >= 0) {
+        ps->comp_len = retval;
+        retval = 0;
+      }
+    }
+
+    /* upload the segment */
+    if (retval == 0) {
+      if (Cache_disabled) {
+        retval = compress_layer_upload_buf(segp->key, ps->comp, ps->comp_len);
+      } else {
+        retval = cache_layer_upload_buf(segp->key, ps->comp, ps->comp_len);
+      }
+    }
+    if (retval == 0) {
+      dbg_print("[DBG] uploaded to the cloud\n");
+      segp->ref_count = 1;
+      retval = ht_insert(segp);
+      if ((retval == 0) && !Cache_disabled) {
+        cache_layer_set_ref(segp->key, segp->ref_count);
+      }
+    }
+  }
+
+  pthread_mutex_unlock(seg_lock);
+
+  return retval;
+}
+
+/**
+ * @brief Undo dedup_layer_store_seg() when the upload pipeline fails.
+ * @param segp The segment.
+ * @return Void.
+ */
+static void dedup_layer_unstore_seg(struct cloudfs_seg *segp)
+{
+  dedup_layer_remove_seg(segp);
+}
+
 /**
  * @brief Delete a file stored in the cloud.
  *        This function iterates through all the segments
@@ -385,29 +424,18 @@ static int dedup_layer_remove_seg(struct cloudfs_seg *segp)
 int dedup_layer_remove(char *fpath)
 {
   int retval = 0;
+  int i = 0;
 
-  /* these are parameters required by the getline() function */
-  char *seg_md5 = NULL;
-  size_t len = 0;
-  FILE *proxy_fp = fopen(fpath, "rb");
-  if (proxy_fp == NULL) {
-    retval = cloudfs_error("dedup_layer_remove");
+  struct proxy *p = NULL;
+  retval = proxy_open(fpath, &p);
+  if (retval < 0) {
     return retval;
   }
 
   /* iterate through all the segments */
-  while ((retval = getline(&seg_md5, &len, proxy_fp)) != -1) {
-    /* build the segment structure */
+  for (i = 0; i < p->num_seg; i++) {
     struct cloudfs_seg seg;
-    seg.ref_count = 0;
-    seg.seg_size = (int) strtol(seg_md5 + 2 * MD5_DIGEST_LENGTH + 1, NULL, 10);
-    memset(seg.md5, '\0', 2 * MD5_DIGEST_LENGTH + 1);
-    memcpy(seg.md5, seg_md5, 2 * MD5_DIGEST_LENGTH);
-    if (seg_md5 != NULL) {
-      free(seg_md5);
-      seg_md5 = NULL;
-      len = 0;
-    }
+    proxy_get_seg(p, i, &seg);
     dbg_print("[DBG] next segment in proxy file\n");
 #ifdef DEBUG
     print_seg(&seg);
@@ -415,13 +443,15 @@ int dedup_layer_remove(char *fpath)
 
     retval = dedup_layer_remove_seg(&seg);
     if (retval < 0) {
+      proxy_close(p);
       return retval;
     }
   }
+  proxy_close(p);
 
-  retval = fclose(proxy_fp);
-  if (retval == EOF) {
-    retval = cloudfs_error("dedup_layer_remove");
+  /* the references are dropped for good before the proxy file goes */
+  retval = ht_commit();
+  if (retval < 0) {
     return retval;
   }
 
@@ -439,69 +469,435 @@ int dedup_layer_remove(char *fpath)
 
 /**
  * @brief Upload a big file into the cloud.
- *        It also updates the original file to be a proxy file.
+ *        The segments of the file are added and a proxy file recording
+ *        them is written aside; the file itself is left untouched, the
+ *        caller replaces it with the proxy file.
  * @param fpath Pathname of the file.
+ * @param ppath Pathname of the proxy file to write.
  * @return 0 on success, -errno otherwise.
  */
-int dedup_layer_upload(char *fpath)
+int dedup_layer_upload(char *fpath, char *ppath)
 {
   int retval = 0;
 
-  /* segment the file */
+  chunker_t *ck = chunker_init(Chunker, Window_size, Avg_seg_size,
+      Min_seg_size, Max_seg_size);
+  if (ck == NULL) {
+    return -1;
+  }
+
+  /* segment the file and add the segments */
   int num_seg = 0;
   struct cloudfs_seg *segs = NULL;
-
-  retval = dedup_layer_segmentation(fpath, &num_seg, &segs);
+  struct pipeline_ops ops = {
+    dedup_layer_is_stored,
+    dedup_layer_store_seg,
+    dedup_layer_unstore_seg
+  };
+  retval = pipeline_run(fpath, ck, &ops, &num_seg, &segs);
+  chunker_free(&ck);
+  /* the counters are only written out now and then, report this file */
+  compress_compute_cost_flush();
+  if (retval < 0) {
+    return retval;
+  }
   dbg_print("[DBG] file %s segmented to %d segments\n", fpath, num_seg);
 
-  /* create a temporary proxy file to record the segments */
-  char proxy_tmp[MAX_PATH_LEN] = "";
-  snprintf(proxy_tmp, MAX_PATH_LEN, "%s.tmp", fpath);
+  /* the references are durable before a proxy file points to them */
+  retval = ht_commit();
+  if (retval < 0) {
+    free(segs);
+    return retval;
+  }
+
+  /* record the segments in the proxy file */
+  retval = proxy_write(ppath, segs, num_seg);
+  free(segs);
+
+  dbg_print("[DBG] dedup_layer_upload(fpath=\"%s\", ppath=\"%s\")=%d\n",
+      fpath, ppath, retval);
+
+  return retval;
+}
+
+/**
+ * @brief A helper function to dedup_layer_update.
+ *        It appends a record to a growing array of records.
+ * @param num_rec Number of records, updated here.
+ * @param records The records, (re-)allocated here.
+ * @param fp Fingerprint algorithm of the digest.
+ * @param digest Digest of the segment.
+ * @param size Size of the segment.
+ * @return 0 on success, -errno otherwise.
+ */
+static int dedup_layer_append_record(int *num_rec,
+    struct proxy_record **records, int fp, const unsigned char *digest,
+    long size)
+{
+  int retval = 0;
 
-  FILE *proxy_fp = fopen(proxy_tmp, "wb");
-  if (proxy_fp == NULL) {
-    retval = cloudfs_error("dedup_layer_upload");
+  struct proxy_record *enlarge = (struct proxy_record *)
+    realloc(*records, (*num_rec + 1) * sizeof(struct proxy_record));
+  if (enlarge == NULL) {
+    retval = cloudfs_error("dedup_layer_append_record");
     return retval;
   }
-  dbg_print("[DBG] temporary proxy file is %s\n", proxy_tmp);
+  *records = enlarge;
 
+  memset(&enlarge[*num_rec], 0, sizeof(struct proxy_record));
+  enlarge[*num_rec].fp = fp;
+  memcpy(enlarge[*num_rec].digest, digest, fp_digest_len(fp));
+  enlarge[*num_rec].size = size;
+  enlarge[*num_rec].offset = 0;
+  (*num_rec)++;
+
+  return retval;
+}
+
+/**
+ * @brief Order two proxy records by algorithm, digest and size,
+ *        for qsort().
+ * @param a Pointer to the first record pointer.
+ * @param b Pointer to the second record pointer.
+ * @return Negative, zero or positive like memcmp().
+ */
+static int dedup_layer_cmp_record(const void *a, const void *b)
+{
+  const struct proxy_record *ra = *(const struct proxy_record * const *) a;
+  const struct proxy_record *rb = *(const struct proxy_record * const *) b;
+  int cmp = (int) ra->fp - (int) rb->fp;
+  if (cmp == 0) {
+    cmp = memcmp(ra->digest, rb->digest, FP_MAX_DIGEST_LEN);
+  }
+  if (cmp == 0 && ra->size != rb->size) {
+    cmp = (ra->size < rb->size) ? -1 : 1;
+  }
+  return cmp;
+}
+
+/**
+ * @brief Replace a list of segments by another one in the hash table.
+ *        The two lists are diffed first: a segment appearing in both
+ *        keeps its reference and is not touched at all. Of the rest,
+ *        the new segments are added before the old ones are removed,
+ *        so a segment shared with another file or version is never
+ *        deleted from the cache/cloud only to be uploaded again.
+ *        If adding a new segment fails, the ones added already are
+ *        removed again, so the hash table is left as it was.
+ * @param fpath Pathname of the file holding the data of the new segments.
+ * @param old_recs The segments to drop.
+ * @param num_old Number of segments to drop.
+ * @param new_recs The segments to add, with their offsets in "fpath".
+ * @param num_new Number of segments to add.
+ * @return 0 on success, -errno otherwise.
+ */
+static int dedup_layer_replace_refs(char *fpath, struct proxy_record *old_recs,
+    int num_old, struct proxy_record *new_recs, int num_new)
+{
+  int retval = 0;
   int i = 0;
-  long offset = 0;
-  for (i = 0; i < num_seg; i++) {
-    dbg_print("[DBG] segment offset %ld\n", offset);
-    fprintf(proxy_fp, "%s-%ld\n", segs[i].md5, segs[i].seg_size);
-    dbg_print("[DBG] segment added to proxy file\n");
-#ifdef DEBUG
-    print_seg(&(segs[i]));
-#endif
-    segs[i].ref_count = 1;
-    retval = dedup_layer_add_seg(&(segs[i]), fpath, offset);
-    if (retval < 0) {
-      return retval;
+  int j = 0;
+  int kept = 0;
+
+  struct proxy_record **olds = (struct proxy_record **)
+    malloc((num_old + 1) * sizeof(struct proxy_record *));
+  struct proxy_record **news = (struct proxy_record **)
+    malloc((num_new + 1) * sizeof(struct proxy_record *));
+  if ((olds == NULL) || (news == NULL)) {
+    retval = cloudfs_error("dedup_layer_replace_refs");
+    free(olds);
+    free(news);
+    return retval;
+  }
+  for (i = 0; i < num_old; i++) {
+    olds[i] = &old_recs[i];
+  }
+  for (i = 0; i < num_new; i++) {
+    news[i] = &new_recs[i];
+  }
+  qsort(olds, num_old, sizeof(struct proxy_record *), dedup_layer_cmp_record);
+  qsort(news, num_new, sizeof(struct proxy_record *), dedup_layer_cmp_record);
+
+  /* cancel out the segments present in both lists */
+  i = 0;
+  j = 0;
+  while ((i < num_old) && (j < num_new)) {
+    int cmp = dedup_layer_cmp_record(&olds[i], &news[j]);
+    if (cmp == 0) {
+      olds[i++] = NULL;
+      news[j++] = NULL;
+      kept++;
+    } else if (cmp < 0) {
+      i++;
+    } else {
+      j++;
+    }
+  }
+  dbg_print("[DBG] %d segments kept, %d added, %d removed\n",
+      kept, num_new - kept, num_old - kept);
+
+  /* bump the new segments first */
+  for (j = 0; j < num_new; j++) {
+    if (news[j] != NULL) {
+      struct cloudfs_seg seg;
+      memset(&seg, 0, sizeof(struct cloudfs_seg));
+      fp_key(news[j]->fp, news[j]->digest, seg.key);
+      seg.seg_size = news[j]->size;
+      seg.ref_count = 1;
+      retval = dedup_layer_add_seg(&seg, fpath, news[j]->offset);
+      if (retval < 0) {
+        break;
+      }
     }
-    offset += segs[i].seg_size;
   }
-  fclose(proxy_fp);
-  free(segs);
 
-  /* delete the original file */
-  retval = unlink(fpath);
+  /* undo the references added before the failure */
   if (retval < 0) {
-    retval = cloudfs_error("dedup_layer_upload");
+    dbg_print("[ERR] failed to add segment %d, rolling back\n", j);
+    while (--j >= 0) {
+      if (news[j] != NULL) {
+        struct cloudfs_seg seg;
+        memset(&seg, 0, sizeof(struct cloudfs_seg));
+        fp_key(news[j]->fp, news[j]->digest, seg.key);
+        seg.seg_size = news[j]->size;
+        dedup_layer_remove_seg(&seg);
+      }
+    }
+  }
+
+  /* then release the old ones */
+  for (i = 0; (i < num_old) && (retval == 0); i++) {
+    if (olds[i] != NULL) {
+      struct cloudfs_seg seg;
+      memset(&seg, 0, sizeof(struct cloudfs_seg));
+      fp_key(olds[i]->fp, olds[i]->digest, seg.key);
+      seg.seg_size = olds[i]->size;
+      retval = dedup_layer_remove_seg(&seg);
+    }
+  }
+
+  free(olds);
+  free(news);
+
+  return retval;
+}
+
+/**
+ * @brief Synchronize a modified cloud file by re-chunking only the part
+ *        around the writes.
+ *        Segmentation restarts at the old boundary in front of the
+ *        first written segment. A cut only depends on the bytes of its own
+ *        segment (a Rabin segment is never shorter than the rolling window,
+ *        the gear hash starts over with every segment), so
+ *        once a new cut beyond the last written byte falls on an old
+ *        boundary, the rest of the old segments are cut the same way again.
+ *        Segments before the restart point and after that boundary keep
+ *        their digests and are never read; segments in between are copied
+ *        into the overlay as the chunker reaches them.
+ *        References move from the replaced segments to the new ones
+ *        through dedup_layer_replace_refs().
+ * @param fpath Pathname of the proxy file.
+ * @param tpath Pathname of the overlay.
+ * @param p The proxy file of the old version.
+ * @param fd Descriptor of the overlay.
+ * @param materialized The per-segment flags of the overlay, a segment
+ *                     is considered written if its flag is set.
+ * @param new_size Size of the new version.
+ * @return 0 on success, -errno otherwise.
+ */
+int dedup_layer_update(char *fpath, char *tpath,
+    struct proxy *p, int fd, unsigned char *materialized, long new_size)
+{
+  int retval = 0;
+  int i = 0;
+
+  /* locate the written part, [first, last] in segments */
+  int first = -1;
+  int last = -1;
+  for (i = 0; i < p->num_seg; i++) {
+    if (materialized[i]) {
+      if (first < 0) {
+        first = i;
+      }
+      last = i;
+    }
+  }
+
+  long dirty_end = 0;
+  if (last >= 0) {
+    dirty_end = p->records[last].offset + p->records[last].size;
+  }
+  if (new_size > p->file_size) {
+    /* the last segment was cut by the old end of file, redo it as well */
+    dirty_end = new_size;
+    if ((first < 0) || (first > p->num_seg - 1)) {
+      first = (p->num_seg > 0) ? p->num_seg - 1 : 0;
+    }
+  }
+  if (first < 0) {
+    dbg_print("[DBG] no segment written, proxy file unchanged\n");
     return retval;
   }
-  dbg_print("[DBG] old proxy file removed\n");
+  if ((Chunker == CHUNKER_RABIN) && (Min_seg_size < Window_size)) {
+    /* cuts depend on the previous segment, segment the whole file */
+    first = 0;
+    dirty_end = new_size;
+  }
+
+  long start = (p->num_seg > 0) ? (long) p->records[first].offset : 0;
+  dbg_print("[DBG] re-chunking from offset %ld, written up to %ld\n",
+      start, dirty_end);
+
+  chunker_t *ck = chunker_init(Chunker, Window_size, Avg_seg_size,
+      Min_seg_size, Max_seg_size);
+  if (ck == NULL) {
+    return -1;
+  }
+
+  /* records of the new version, the prefix is kept as it is */
+  int num_rec = 0;
+  struct proxy_record *records = NULL;
+  for (i = 0; (i < first) && (retval == 0); i++) {
+    retval = dedup_layer_append_record(&num_rec, &records,
+        p->records[i].fp, p->records[i].digest, p->records[i].size);
+  }
+  int new_first = num_rec;
+
+  /* the segments re-chunked are mostly the old ones, so they keep the
+   * algorithm of the file, or they would all be stored again */
+  int fp = (first < p->num_seg) ? (int) p->records[first].fp : fp_default();
+  struct fp_ctx ctx;
+  memset(&ctx, 0, sizeof(struct fp_ctx));
+  unsigned char digest[FP_MAX_DIGEST_LEN];
+  int new_segment = 0;
+  int len = 0;
+  long segment_len = 0;
+  char buf[BUF_LEN] = "";
+  long pos = start;
+  int k = first;      /* old segment holding "pos" */
+  int suffix = p->num_seg; /* first old segment kept after the new ones */
+
+  if (retval == 0) {
+    retval = fp_begin(&ctx, fp);
+  }
+  while ((retval == 0) && (pos < new_size)) {
+    while ((k < p->num_seg) &&
+        ((long) (p->records[k].offset + p->records[k].size) <= pos)) {
+      k++;
+    }
 
-  /* rename the proxy file to the original file's name */
-  retval = rename(proxy_tmp, fpath);
+    long bytes = new_size - pos;
+    if (bytes > BUF_LEN) {
+      bytes = BUF_LEN;
+    }
+    if (k < p->num_seg) {
+      /* make sure the overlay has the data of the old segment */
+      if (!materialized[k]) {
+        retval = dedup_layer_materialize(p, fd, materialized, k);
+        if (retval < 0) {
+          break;
+        }
+      }
+      long seg_end = p->records[k].offset + p->records[k].size;
+      if (bytes > seg_end - pos) {
+        bytes = seg_end - pos;
+      }
+    }
+
+    bytes = pread(fd, buf, bytes, pos);
+    if (bytes <= 0) {
+      retval = (bytes < 0) ? cloudfs_error("dedup_layer_update") : -EIO;
+      break;
+    }
+
+    char *buftoread = (char *) buf;
+    while ((len = chunker_next(ck, buftoread, bytes,
+            &new_segment)) > 0) {
+      fp_update(&ctx, buftoread, len);
+      segment_len += len;
+      pos += len;
+
+      if (new_segment) {
+        fp_final(&ctx, digest);
+        retval = dedup_layer_append_record(&num_rec, &records, fp, digest,
+            segment_len);
+        if (retval == 0) {
+          retval = fp_begin(&ctx, fp);
+        }
+        if (retval < 0) {
+          break;
+        }
+        segment_len = 0;
+
+        /* boundaries line up again, keep the rest of the old segments */
+        if ((pos >= dirty_end) && (pos < p->file_size)) {
+          int j = proxy_find(p, pos);
+          if ((long) p->records[j].offset == pos) {
+            suffix = j;
+            break;
+          }
+        }
+      }
+
+      buftoread += len;
+      bytes -= len;
+      if (bytes <= 0) {
+        break;
+      }
+    }
+    if (len == -1) {
+      dbg_print("[ERR] failed to process the segment\n");
+      retval = -1;
+    }
+    if (suffix < p->num_seg) {
+      break;
+    }
+  }
+  chunker_free(&ck);
+
+  if ((retval == 0) && (suffix == p->num_seg)) {
+    /* the tail of the file, same as in the upload pipeline */
+    fp_final(&ctx, digest);
+    retval = dedup_layer_append_record(&num_rec, &records, fp, digest,
+        segment_len);
+  }
+  /* the digest of an unfinished segment is not needed any more */
+  fp_abort(&ctx);
+  int new_end = num_rec;
+  for (i = suffix; (i < p->num_seg) && (retval == 0); i++) {
+    retval = dedup_layer_append_record(&num_rec, &records,
+        p->records[i].fp, p->records[i].digest, p->records[i].size);
+  }
   if (retval < 0) {
-    retval = cloudfs_error("dedup_layer_upload");
+    free(records);
     return retval;
   }
-  dbg_print("[DBG] temporary proxy file renamed\n");
+  dbg_print("[DBG] old segments [%d, %d) replaced by %d new segments\n",
+      first, suffix, new_end - new_first);
 
-  dbg_print("[DBG] dedup_layer_upload(fpath=\"%s\")=%d\n", fpath, retval);
+  long offset = 0;
+  for (i = 0; i < num_rec; i++) {
+    records[i].offset = offset;
+    offset += records[i].size;
+  }
+
+  /* move references from the replaced segments to the new ones */
+  retval = dedup_layer_replace_refs(tpath, p->records + first,
+      suffix - first, records + new_first, new_end - new_first);
+  compress_compute_cost_flush();
+  if (retval == 0) {
+    retval = ht_commit();
+  }
+  if (retval < 0) {
+    free(records);
+    return retval;
+  }
+
+  retval = proxy_replace(fpath, records, num_rec, new_size);
+  free(records);
+
+  dbg_print("[DBG] dedup_layer_update(fpath=\"%s\", new_size=%ld)=%d\n",
+      fpath, new_size, retval);
 
   return retval;
 }
-
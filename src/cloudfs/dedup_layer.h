@@ -1,13 +1,20 @@
 #ifndef __DEDUP_LAYER_H_
 #define __DEDUP_LAYER_H_
 
-void dedup_layer_init(int window_size, int avg_seg_size, int min_seg_size,
-    int max_seg_size, int no_cache);
+void dedup_layer_init(int chunker, unsigned int window_size,
+    unsigned int avg_seg_size, unsigned int min_seg_size,
+    unsigned int max_seg_size, int no_cache);
 void dedup_layer_destroy(void);
-int dedup_layer_read_seg(char *temp_dir, struct cloudfs_seg *segp, char *buf,
-    int size, int offset);
+int dedup_layer_download_seg(char *spath, struct cloudfs_seg *segp);
+int dedup_layer_fetch_seg(struct cloudfs_seg *segp);
+int dedup_layer_read_seg(struct cloudfs_seg *segp, char *buf, int size,
+    long offset);
+int dedup_layer_materialize(struct proxy *p, int fd,
+    unsigned char *materialized, int i);
 int dedup_layer_remove(char *fpath);
-int dedup_layer_upload(char *fpath);
+int dedup_layer_upload(char *fpath, char *ppath);
+int dedup_layer_update(char *fpath, char *tpath, struct proxy *p, int fd,
+    unsigned char *materialized, long new_size);
 
 #endif
 
@@ -0,0 +1,250 @@
+/**
+ * @file filter.c
+ * @brief Counting Bloom filter of segment digests.
+ *
+ *        A filter answers whether a segment may be in the hash table: a
+ *        "no" is always right, a "yes" is wrong with a small probability,
+ *        the false-positive rate. New data is mostly segments never seen
+ *        before, which the filter turns away without looking at the
+ *        table.
+ *
+ *        Each segment sets "num_hashes" counters, picked by double hashing
+ *        of its digest; digests are uniformly distributed, so their bytes
+ *        are used as the two hashes. Counters rather than bits let
+ *        segments be removed. A counter has 4 bits and sticks at its
+ *        maximum, which is never reached in practice; a stuck counter is
+ *        never decremented, so the filter never says "no" for a segment
+ *        it holds.
+ *
+ *        The number of counters is computed from the number of entries
+ *        and the false-positive rate wanted, limited by a memory budget,
+ *        which raises the rate when it applies. The filter does no
+ *        locking, its user serializes the calls.
+ *
+ * @author Yinsu Chu (yinsuc)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+// #define DEBUG
+#include "cloudfs.h"
+
+#include "filter.h"
+
+/* value a counter sticks at */
+#define COUNTER_MAX (15)
+
+/* most counters set by one segment */
+#define MAX_HASHES (16)
+
+extern FILE *Log;
+
+/**
+ * @brief Create an empty filter.
+ * @param capacity Number of entries to size the filter for.
+ * @param fpr False-positive rate wanted at "capacity" entries,
+ *            between 0 and 1.
+ * @param max_bytes Most memory the counters may use, 0 for no limit.
+ * @return The filter, NULL if out of memory.
+ */
+struct filter *filter_new(uint64_t capacity, double fpr, size_t max_bytes)
+{
+  if (capacity == 0) {
+    capacity = 1;
+  }
+
+  /* optimal number of counters and hashes for the rate wanted */
+  double ln2 = log(2.0);
+  uint64_t num_counters = (uint64_t) ceil(-(double) capacity * log(fpr)
+      / (ln2 * ln2));
+  if (num_counters < 64) {
+    num_counters = 64;
+  }
+  if ((max_bytes > 0) && (num_counters > 2 * (uint64_t) max_bytes)) {
+    num_counters = 2 * (uint64_t) max_bytes;
+  }
+  int num_hashes = (int) lround((double) num_counters / capacity * ln2);
+  if (num_hashes < 1) {
+    num_hashes = 1;
+  }
+  if (num_hashes > MAX_HASHES) {
+    num_hashes = MAX_HASHES;
+  }
+
+  struct filter *f = (struct filter *) calloc(1, sizeof(struct filter));
+  if (f == NULL) {
+    return NULL;
+  }
+  f->counters = (unsigned char *) calloc((num_counters + 1) / 2, 1);
+  if (f->counters == NULL) {
+    free(f);
+    return NULL;
+  }
+  f->num_counters = num_counters;
+  f->num_hashes = num_hashes;
+  f->capacity = capacity;
+  f->fpr = fpr;
+
+  dbg_print("[DBG] filter_new(capacity=%llu, fpr=%f)=%llu counters,"
+      " %d hashes\n", (unsigned long long) capacity, fpr,
+      (unsigned long long) num_counters, num_hashes);
+
+  return f;
+}
+
+/**
+ * @brief Free a filter.
+ * @param f The filter, it may be NULL.
+ * @return Void.
+ */
+void filter_free(struct filter *f)
+{
+  if (f == NULL) {
+    return;
+  }
+  free(f->counters);
+  free(f);
+}
+
+/**
+ * @brief Compute the counters of a segment.
+ * @param f The filter.
+ * @param fp Fingerprint algorithm of the digest.
+ * @param digest The raw digest, at least 16 bytes.
+ * @param idx Indices of the counters are returned here, it should have
+ *            MAX_HASHES elements.
+ * @return Void.
+ */
+static void filter_counters(struct filter *f, int fp,
+    const unsigned char *digest, uint64_t *idx)
+{
+  uint64_t h1 = 0;
+  uint64_t h2 = 0;
+  int i = 0;
+
+  memcpy(&h1, digest, sizeof(uint64_t));
+  memcpy(&h2, digest + sizeof(uint64_t), sizeof(uint64_t));
+  h1 ^= (uint64_t) fp * 0x9e3779b97f4a7c15ULL;
+  h2 |= 1;
+  for (i = 0; i < f->num_hashes; i++) {
+    idx[i] = (h1 + i * h2) % f->num_counters;
+  }
+}
+
+/**
+ * @brief Get the value of a counter.
+ * @param f The filter.
+ * @param i Index of the counter.
+ * @return The value.
+ */
+static int counter_get(struct filter *f, uint64_t i)
+{
+  return (f->counters[i / 2] >> (4 * (i % 2))) & 0x0f;
+}
+
+/**
+ * @brief Set the value of a counter.
+ * @param f The filter.
+ * @param i Index of the counter.
+ * @param v The value, at most COUNTER_MAX.
+ * @return Void.
+ */
+static void counter_set(struct filter *f, uint64_t i, int v)
+{
+  int shift = 4 * (i % 2);
+  f->counters[i / 2] = (f->counters[i / 2] & ~(0x0f << shift)) | (v << shift);
+}
+
+/**
+ * @brief Add a segment to a filter.
+ * @param f The filter.
+ * @param fp Fingerprint algorithm of the digest.
+ * @param digest The raw digest.
+ * @return Void.
+ */
+void filter_add(struct filter *f, int fp, const unsigned char *digest)
+{
+  uint64_t idx[MAX_HASHES];
+  int i = 0;
+
+  filter_counters(f, fp, digest, idx);
+  for (i = 0; i < f->num_hashes; i++) {
+    int v = counter_get(f, idx[i]);
+    if (v < COUNTER_MAX) {
+      counter_set(f, idx[i], v + 1);
+    }
+  }
+  f->count++;
+}
+
+/**
+ * @brief Remove a segment that was added to a filter.
+ * @param f The filter.
+ * @param fp Fingerprint algorithm of the digest.
+ * @param digest The raw digest.
+ * @return Void.
+ */
+void filter_remove(struct filter *f, int fp, const unsigned char *digest)
+{
+  uint64_t idx[MAX_HASHES];
+  int i = 0;
+
+  filter_counters(f, fp, digest, idx);
+  for (i = 0; i < f->num_hashes; i++) {
+    int v = counter_get(f, idx[i]);
+    if ((v > 0) && (v < COUNTER_MAX)) {
+      counter_set(f, idx[i], v - 1);
+    }
+  }
+  if (f->count > 0) {
+    f->count--;
+  }
+}
+
+/**
+ * @brief Check whether a segment may be in a filter.
+ * @param f The filter.
+ * @param fp Fingerprint algorithm of the digest.
+ * @param digest The raw digest.
+ * @return 0 if it is not, 1 if it may be.
+ */
+int filter_may_contain(struct filter *f, int fp,
+    const unsigned char *digest)
+{
+  uint64_t idx[MAX_HASHES];
+  int i = 0;
+
+  filter_counters(f, fp, digest, idx);
+  for (i = 0; i < f->num_hashes; i++) {
+    if (counter_get(f, idx[i]) == 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * @brief Get the memory used by the counters of a filter.
+ * @param f The filter.
+ * @return Size in bytes.
+ */
+size_t filter_bytes(struct filter *f)
+{
+  return (f->num_counters + 1) / 2;
+}
+
+/**
+ * @brief Estimate the false-positive rate of a filter with the entries
+ *        it holds now.
+ * @param f The filter.
+ * @return The rate, between 0 and 1.
+ */
+double filter_est_fpr(struct filter *f)
+{
+  double fill = 1.0 - exp(-(double) f->num_hashes * f->count
+      / f->num_counters);
+  return pow(fill, f->num_hashes);
+}
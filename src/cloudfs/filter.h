@@ -0,0 +1,26 @@
+#ifndef __FILTER_H_
+#define __FILTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* a counting Bloom filter of segment digests */
+struct filter {
+  unsigned char *counters; /* 4-bit counters, two per byte */
+  uint64_t num_counters;
+  int num_hashes;
+  uint64_t capacity; /* entries it was sized for */
+  uint64_t count; /* entries in it */
+  double fpr; /* target false-positive rate at "capacity" entries */
+};
+
+struct filter *filter_new(uint64_t capacity, double fpr, size_t max_bytes);
+void filter_free(struct filter *f);
+void filter_add(struct filter *f, int fp, const unsigned char *digest);
+void filter_remove(struct filter *f, int fp, const unsigned char *digest);
+int filter_may_contain(struct filter *f, int fp,
+    const unsigned char *digest);
+size_t filter_bytes(struct filter *f);
+double filter_est_fpr(struct filter *f);
+
+#endif
@@ -0,0 +1,257 @@
+/**
+ * @file fingerprint.c
+ * @brief Fingerprints of segments.
+ *
+ *        A segment is identified by a digest of its content, computed with
+ *        one of several algorithms. Its key, used in the hash table, as
+ *        the name of the cloud object and of the cache and store files, is
+ *        the hex representation of the digest behind a prefix naming the
+ *        algorithm, e.g. "sha256-9f86d0...". MD5 keys have no prefix, so
+ *        the segments written before other algorithms existed keep their
+ *        keys; a key is told apart by its prefix and length.
+ *
+ *        The algorithm of new segments is picked when mounting. Digests are
+ *        computed by the OpenSSL EVP interface, which uses the SHA
+ *        extensions of the CPU when it has them.
+ * @author Yinsu Chu (yinsuc)
+ */
+
+#include <string.h>
+#include <errno.h>
+
+// #define DEBUG
+#include "cloudfs.h"
+
+#include "fingerprint.h"
+
+/* name, key prefix, digest size and OpenSSL digest of each algorithm,
+ * in FP_* order */
+static const struct {
+  const char *name;
+  const char *prefix;
+  int digest_len;
+  const EVP_MD *(*md)(void);
+} Algorithms[FP_NUM] = {
+  { "md5", "", MD5_DIGEST_LENGTH, EVP_md5 },
+  { "sha256", "sha256-", SHA256_DIGEST_LENGTH, EVP_sha256 },
+};
+
+/* algorithm of new segments */
+static int Default_type = FP_SHA256;
+
+/**
+ * @brief Set the algorithm used for new segments.
+ * @param type One of the FP_* algorithms.
+ * @return Void.
+ */
+void fp_init(int type)
+{
+  Default_type = type;
+}
+
+/**
+ * @brief Get the algorithm used for new segments.
+ * @return One of the FP_* algorithms.
+ */
+int fp_default(void)
+{
+  return Default_type;
+}
+
+/**
+ * @brief Get the size of the digests of an algorithm.
+ * @param type One of the FP_* algorithms.
+ * @return Size of the raw digest in bytes.
+ */
+int fp_digest_len(int type)
+{
+  return Algorithms[type].digest_len;
+}
+
+/**
+ * @brief Start an incremental fingerprint computation.
+ *        It should be finished by fp_final() or dropped by fp_abort().
+ * @param ctx The context to initialize.
+ * @param type One of the FP_* algorithms.
+ * @return 0 on success, -ENOMEM otherwise.
+ */
+int fp_begin(struct fp_ctx *ctx, int type)
+{
+  ctx->type = type;
+  ctx->md = EVP_MD_CTX_new();
+  if (ctx->md == NULL) {
+    return -ENOMEM;
+  }
+  if (!EVP_DigestInit_ex(ctx->md, Algorithms[type].md(), NULL)) {
+    fp_abort(ctx);
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+/**
+ * @brief Add data to an incremental fingerprint computation.
+ * @param ctx The context.
+ * @param data The data.
+ * @param len Size of the data.
+ * @return Void.
+ */
+void fp_update(struct fp_ctx *ctx, const void *data, size_t len)
+{
+  EVP_DigestUpdate(ctx->md, data, len);
+}
+
+/**
+ * @brief Finish an incremental fingerprint computation.
+ * @param ctx The context, it should be started again to be reused.
+ * @param digest The raw digest is returned here, it should have at least
+ *               FP_MAX_DIGEST_LEN bytes.
+ * @return Void.
+ */
+void fp_final(struct fp_ctx *ctx, unsigned char *digest)
+{
+  EVP_DigestFinal_ex(ctx->md, digest, NULL);
+  fp_abort(ctx);
+}
+
+/**
+ * @brief Drop an incremental fingerprint computation.
+ *        Nothing is done if it is finished already.
+ * @param ctx The context.
+ * @return Void.
+ */
+void fp_abort(struct fp_ctx *ctx)
+{
+  EVP_MD_CTX_free(ctx->md);
+  ctx->md = NULL;
+}
+
+/**
+ * @brief Compute the fingerprint of a buffer.
+ * @param type One of the FP_* algorithms.
+ * @param data The data.
+ * @param len Size of the data.
+ * @param digest The raw digest is returned here, it should have at least
+ *               FP_MAX_DIGEST_LEN bytes.
+ * @return Void.
+ */
+void fp_digest(int type, const void *data, size_t len, unsigned char *digest)
+{
+  EVP_Digest(data, len, digest, NULL, Algorithms[type].md(), NULL);
+}
+
+/**
+ * @brief Convert a raw digest to the key of its segment.
+ * @param type Algorithm of the digest.
+ * @param digest The raw digest.
+ * @param key The key is returned here. It should have at least
+ *            MAX_KEY_LEN + 1 bytes.
+ * @return Void.
+ */
+void fp_key(int type, const unsigned char *digest, char *key)
+{
+  static const char hex[] = "0123456789abcdef";
+  int i = 0;
+
+  int prefix_len = strlen(Algorithms[type].prefix);
+  memcpy(key, Algorithms[type].prefix, prefix_len);
+  key += prefix_len;
+  for (i = 0; i < Algorithms[type].digest_len; i++) {
+    key[2 * i] = hex[digest[i] >> 4];
+    key[2 * i + 1] = hex[digest[i] & 0x0f];
+  }
+  key[2 * Algorithms[type].digest_len] = '\0';
+}
+
+/**
+ * @brief Convert a key back to its algorithm and raw digest.
+ * @param key The key, it does not need to be a valid one.
+ * @param type If not NULL, the algorithm is returned here.
+ * @param digest If not NULL, the raw digest is returned here, it should
+ *               have at least FP_MAX_DIGEST_LEN bytes.
+ * @return 0 on success, -EINVAL if "key" is not a key.
+ */
+int fp_parse_key(const char *key, int *type, unsigned char *digest)
+{
+  int t = 0;
+  int i = 0;
+
+  /* the algorithm with the longest matching prefix, MD5 matches all */
+  int match = -1;
+  for (t = 0; t < FP_NUM; t++) {
+    const char *prefix = Algorithms[t].prefix;
+    if ((strncmp(key, prefix, strlen(prefix)) == 0)
+        && ((match < 0)
+          || (strlen(prefix) > strlen(Algorithms[match].prefix)))) {
+      match = t;
+    }
+  }
+
+  const char *hex = key + strlen(Algorithms[match].prefix);
+  int digest_len = Algorithms[match].digest_len;
+  if (strlen(hex) != (size_t) (2 * digest_len)) {
+    return -EINVAL;
+  }
+  for (i = 0; i < 2 * digest_len; i++) {
+    char c = hex[i];
+    int v = 0;
+    if (c >= '0' && c <= '9') {
+      v = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      v = c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      v = c - 'A' + 10;
+    } else {
+      return -EINVAL;
+    }
+    if (digest == NULL) {
+      continue;
+    }
+    if (i % 2 == 0) {
+      digest[i / 2] = v << 4;
+    } else {
+      digest[i / 2] |= v;
+    }
+  }
+
+  if (type != NULL) {
+    *type = match;
+  }
+  return 0;
+}
+
+/**
+ * @brief Check whether a name, e.g. of a cache file, is a segment key.
+ * @param name The name.
+ * @return 1 if it is a key, 0 otherwise.
+ */
+int fp_is_key(const char *name)
+{
+  return fp_parse_key(name, NULL, NULL) == 0;
+}
+
+/**
+ * @brief Get the name of an algorithm, e.g. "md5" or "sha256".
+ * @param type One of the FP_* algorithms.
+ * @return The name.
+ */
+const char *fp_name(int type)
+{
+  return Algorithms[type].name;
+}
+
+/**
+ * @brief Get an algorithm by its name.
+ * @param name The name, as returned by fp_name().
+ * @return One of the FP_* algorithms, -1 if there is no such algorithm.
+ */
+int fp_type(const char *name)
+{
+  int t = 0;
+  for (t = 0; t < FP_NUM; t++) {
+    if (strcmp(name, Algorithms[t].name) == 0) {
+      return t;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,37 @@
+#ifndef __FINGERPRINT_H_
+#define __FINGERPRINT_H_
+
+#include <stddef.h>
+#include <openssl/evp.h>
+#include <openssl/md5.h>
+#include <openssl/sha.h>
+
+/* fingerprint algorithms of segments, the values are stored in proxy files */
+#define FP_MD5 (0)
+#define FP_SHA256 (1)
+#define FP_NUM (2)
+
+/* size of the longest raw digest */
+#define FP_MAX_DIGEST_LEN (SHA256_DIGEST_LENGTH)
+
+/* an incremental fingerprint computation */
+struct fp_ctx {
+  int type;
+  EVP_MD_CTX *md;
+};
+
+void fp_init(int type);
+int fp_default(void);
+int fp_digest_len(int type);
+int fp_begin(struct fp_ctx *ctx, int type);
+void fp_update(struct fp_ctx *ctx, const void *data, size_t len);
+void fp_final(struct fp_ctx *ctx, unsigned char *digest);
+void fp_abort(struct fp_ctx *ctx);
+void fp_digest(int type, const void *data, size_t len, unsigned char *digest);
+void fp_key(int type, const unsigned char *digest, char *key);
+int fp_parse_key(const char *key, int *type, unsigned char *digest);
+int fp_is_key(const char *name);
+const char *fp_name(int type);
+int fp_type(const char *name);
+
+#endif
@@ -2,42 +2,199 @@
  * @file hashtable.c
  * @brief A persistent hash table implementation.
  *
- *        This is a separate-chaining design, there is an array where each
- *        element in the array is a linked-list. I'll call an element of the
- *        array "bucket" and an element of the linked-list "slot".
+ *        This is an open-addressing design with linear probing. The table
+ *        is a single file that is mmap-ed upon file system starting: a
+ *        small header holding the capacity and the number of used slots,
+ *        followed by an array of slots. A slot is keyed on the raw digest
+ *        of a segment and its fingerprint algorithm, the first bytes of the
+ *        digest pick the slot to start probing from, so a lookup touches a
+ *        few slots next to each other and no file system calls.
  *
- *        Each bucket in the hash table is a file, and all buckets are mmap-ed
- *        upon file system starting.
- *        
- *        Any changes to the hash table is made first in the memory region
- *        of the file and then msync-ed to disk. Inside each bucket, there are
- *        multiple slots where one slot can hold one cloudfs_seg structure.
- *        When all slots in a bucket are used up, this bucket will be enlarged
- *        to be twice the previous size.
+ *        A segment whose reference count drops to zero leaves a deleted
+ *        mark in its slot, so that the probing of other segments does not
+ *        stop there.
+ *
+ *        Any changes to the hash table is made in the memory region of the
+ *        file and appended to a journal, the table itself is not msync-ed
+ *        for each change. ht_commit() writes the journal to disk with a
+ *        single flush, callers commit at the end of each file operation,
+ *        e.g. an upload, and concurrent commits share a flush. A journal
+ *        record holds the new state of a segment, not the change, so
+ *        replaying records that are in the table already does no harm.
+ *        When the journal grows large, the tables are msync-ed and the
+ *        journal emptied, a checkpoint. ht_init() replays the journal
+ *        left by a crash.
+ *
+ *        When used and deleted slots reach 3/4 of the capacity, a new table
+ *        file is created, sized to be at most half full, and the segments
+ *        are moved into it a few slots at a time by the following
+ *        operations. Until then lookups check the new table first and the
+ *        old one second. Moved slots are not changed in the old table, they
+ *        are below a mark that is written to it only once the new table is
+ *        on disk, at a checkpoint. The new table has a higher generation
+ *        number, so an interrupted move goes on after the next mount.
+ *
+ *        Lookups copy the slot out, and reference count changes are made
+ *        in place by ht_add_ref(). A single mutex makes all operations
+ *        safe to call from multiple threads.
+ *
+ *        A counting Bloom filter of the segments in the tables is kept in
+ *        memory, built when mounting and updated as segments come and go,
+ *        so most lookups of segments that are not in the table, the usual
+ *        case for new data, do not probe the table at all.
+ *
+ *        The bucket files of older versions, a separate-chaining design
+ *        with one file per bucket, are moved into a new table by
+ *        ht_init().
  *
  * @author Yinsu Chu (yinsuc)
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
-#include <sys/xattr.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <openssl/md5.h>
+#include "zlib.h"
 
 // #define DEBUG
 #include "cloudfs.h"
 
-static char Bkt_prfx[MAX_PATH_LEN];
-static int Bkt_num;
-static int Bkt_size;
+#include "fingerprint.h"
+#include "filter.h"
+#include "stats.h"
+
+/* first bytes of a table file */
+#define HT_MAGIC ("CFSI")
+#define HT_MAGIC_LEN (4)
+#define HT_VERSION (1)
+
+/* the slots start at this offset of a table file */
+#define HT_HDR_SIZE (64)
+
+/* capacity of the first table, always a power of two */
+#define HT_MIN_CAP (1024)
+
+/* the table is replaced when used and deleted slots exceed 3/4 of it */
+#define HT_MAX_LOAD(cap) ((cap) / 4 * 3)
+
+/* least number of old slots moved by each operation during a resize */
+#define HT_MIGRATE_STEP (16)
+
+/* records are buffered and written to the journal when this is full */
+#define HT_LOG_BUF (64 * 1024)
+
+/* a checkpoint is done when the journal grows beyond this */
+#define HT_LOG_MAX (4 * 1024 * 1024)
+
+/* states of a slot, an all-zero slot is empty */
+#define SLOT_EMPTY (0)
+#define SLOT_USED (1)
+#define SLOT_DELETED (2)
+
+/* header of a table file */
+struct ht_header {
+  char magic[HT_MAGIC_LEN];
+  uint32_t version;
+  uint64_t generation; /* the newer of two table files is the current one */
+  uint64_t capacity;
+  uint64_t used;
+  uint64_t deleted;
+  uint32_t clean; /* set when unmounted, "used" and "deleted" are exact */
+  uint64_t moved; /* slots of an old table below this are in the new one */
+};
+
+/* one segment of the table */
+struct ht_slot {
+  unsigned char digest[FP_MAX_DIGEST_LEN]; /* zero padded */
+  uint8_t fp;
+  uint8_t state;
+  uint16_t unused;
+  int32_t ref_count;
+  int64_t seg_size;
+};
+
+/* a mapped table file */
+struct ht_table {
+  int id; /* which of the two table files */
+  void *addr; /* NULL if the table does not exist */
+  size_t len;
+  struct ht_header *hdr;
+  struct ht_slot *slots;
+  uint64_t moved; /* slots below this were moved to the current table */
+};
+
+/* a journal record, the new state of a segment */
+struct ht_log_rec {
+  uint32_t crc; /* of the rest of the record */
+  int32_t ref_count; /* zero if the segment was removed */
+  int64_t seg_size;
+  uint8_t fp;
+  uint8_t unused[7];
+  unsigned char digest[FP_MAX_DIGEST_LEN];
+};
+
+/* slot layout of the bucket files of the second version,
+ * named prefix, bucket number and "-v2" */
+struct slot_v2 {
+  int ref_count;
+  long seg_size;
+  char key[MAX_KEY_LEN + 1];
+};
+
+/* slot layout of the bucket files of the first version,
+ * named prefix and bucket number, keys are MD5s */
+struct slot_v1 {
+  int ref_count;
+  long seg_size;
+  char md5[MD5_DIGEST_LENGTH * 2 + 1];
+};
+
+static char Idx_path[MAX_PATH_LEN];
 
 extern FILE *Log;
 
-/* store the mmap addresses of each bucket file */
-static void **Buckets;
+/* the table new segments go to, and the one being moved into it */
+static struct ht_table Cur;
+static struct ht_table Old;
+
+/* serializes all accesses to the tables and appends to the journal */
+static pthread_mutex_t Ht_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the journal, records not written yet are kept in Log_buf */
+static int Log_fd = -1;
+static char Log_buf[HT_LOG_BUF];
+static int Log_buf_len;
+static off_t Log_size;
+
+/* records appended, written to the journal file,
+ * and on disk, counted since mounting */
+static uint64_t Log_appended;
+static uint64_t Log_written;
+static uint64_t Log_durable;
+
+/* serializes commits, taken before Ht_lock */
+static pthread_mutex_t Commit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* filter of the segments in the tables, NULL if turned off */
+static struct filter *Filter;
+static double Filter_fpr;
+static size_t Filter_max_bytes;
+
+/* lookups checked by the filter, turned away by it,
+ * and let through for segments that are not in the tables */
+static uint64_t Filter_lookups;
+static uint64_t Filter_skips;
+static uint64_t Filter_false_pos;
 
 #ifdef DEBUG
 void print_seg(struct cloudfs_seg *segp)
@@ -45,430 +202,1190 @@ void print_seg(struct cloudfs_seg *segp)
   dbg_print("[DBG] print segment 0x%08x\n", (unsigned int) segp);
   dbg_print("      ref_count=%d\n", segp->ref_count);
   dbg_print("      seg_size=%ld\n", segp->seg_size);
-  dbg_print("      md5=%s\n", segp->md5);
+  dbg_print("      key=%s\n", segp->key);
 }
 #endif
 
 /**
- * @brief Enlarge the size of a bucket file.
- *        This is done when the bucket file is initially created,
- *        or when there is not enough room to insert segments.
- * @param bucket Pathname of the bucket file.
- * @param create If set, this file will be newly created.
- * @return 0 on success, -errno otherwise.
+ * @brief Get the pathname of a table file.
+ * @param id Which of the two table files.
+ * @param path The pathname is returned here, it should have at least
+ *             MAX_PATH_LEN bytes.
+ * @return Void.
+ */
+static void table_path(int id, char *path)
+{
+  snprintf(path, MAX_PATH_LEN, "%s.%d", Idx_path, id);
+}
+
+/**
+ * @brief Compute the slot to start probing from.
+ *        Digests are uniformly distributed already, their first bytes
+ *        are used as is.
+ * @param t The table.
+ * @param fp Fingerprint algorithm of the digest.
+ * @param digest The raw digest.
+ * @return Index of the slot.
  */
-static int stretch_bucket(char *bucket, int create)
+static uint64_t table_home(struct ht_table *t, int fp,
+    const unsigned char *digest)
+{
+  uint64_t h = 0;
+  memcpy(&h, digest, sizeof(uint64_t));
+  h ^= (uint64_t) fp * 0x9e3779b97f4a7c15ULL;
+  return h & (t->hdr->capacity - 1);
+}
+
+/**
+ * @brief Map an existing table file.
+ * @param id Which of the two table files.
+ * @param t The mapped table is returned here.
+ * @return 0 on success, -ENOENT if there is no such file,
+ *         -EINVAL if it is not a table file, -errno otherwise.
+ */
+static int table_open(int id, struct ht_table *t)
 {
   int retval = 0;
+  char path[MAX_PATH_LEN] = "";
 
-  /* create or open the bucket file */
-  int fd = 0;
-  if (create) {
-    fd = open(bucket, O_RDWR | O_CREAT | O_EXCL, DEFAULT_FILE_MODE);
-  } else {
-    fd = open(bucket, O_RDWR);
-  }
+  memset(t, 0, sizeof(struct ht_table));
+  table_path(id, path);
+  int fd = open(path, O_RDWR);
   if (fd < 0) {
-    retval = cloudfs_error("stretch_bucket - open");
+    if (errno == ENOENT) {
+      return -ENOENT;
+    }
+    retval = cloudfs_error("table_open - open");
     return retval;
   }
-
-  /* read the file size */
   struct stat sb;
-  retval = fstat(fd, &sb);
-  if (retval < 0) {
-    retval = cloudfs_error("stretch_bucket - fstat");
+  if (fstat(fd, &sb) < 0) {
+    retval = cloudfs_error("table_open - fstat");
+    close(fd);
+    return retval;
+  }
+  if (sb.st_size < HT_HDR_SIZE) {
+    close(fd);
+    return -EINVAL;
+  }
+  void *addr = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+      fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    retval = cloudfs_error("table_open - mmap");
     return retval;
   }
-  dbg_print("[DBG] size of the file to stretch is %llu\n", sb.st_size);
 
-  /* calculate the target size to stretch to */
-  int target_size = sb.st_size * 2;
-  if (target_size <= 0) {
-    target_size = Bkt_size;
+  struct ht_header *hdr = (struct ht_header *) addr;
+  uint64_t cap = hdr->capacity;
+  if ((memcmp(hdr->magic, HT_MAGIC, HT_MAGIC_LEN) != 0)
+      || (hdr->version != HT_VERSION) || (cap == 0)
+      || ((cap & (cap - 1)) != 0)
+      || ((uint64_t) sb.st_size
+        != HT_HDR_SIZE + cap * sizeof(struct ht_slot))) {
+    munmap(addr, sb.st_size);
+    return -EINVAL;
   }
-  dbg_print("[DBG] stretch target size is %d\n", target_size);
 
-  /* stretch the file */
-  if (lseek(fd, target_size - 1, SEEK_SET) < 0) {
-    retval = cloudfs_error("stretch_bucket - lseek");
+  t->id = id;
+  t->addr = addr;
+  t->len = sb.st_size;
+  t->hdr = hdr;
+  t->slots = (struct ht_slot *) (addr + HT_HDR_SIZE);
+  t->moved = hdr->moved;
+  return retval;
+}
+
+/**
+ * @brief Create an empty table file and map it.
+ *        The table is built at a temporary pathname, and renamed to
+ *        a table file by table_publish() once complete. New files are
+ *        zero filled, so all slots start empty.
+ * @param generation Generation number of the table.
+ * @param cap Number of slots, a power of two.
+ * @param t The mapped table is returned here.
+ * @return 0 on success, -errno otherwise.
+ */
+static int table_create(uint64_t generation, uint64_t cap,
+    struct ht_table *t)
+{
+  int retval = 0;
+  char tmp[MAX_PATH_LEN] = "";
+
+  memset(t, 0, sizeof(struct ht_table));
+  snprintf(tmp, MAX_PATH_LEN, "%s.new", Idx_path);
+  size_t len = HT_HDR_SIZE + cap * sizeof(struct ht_slot);
+  int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, DEFAULT_FILE_MODE);
+  if (fd < 0) {
+    retval = cloudfs_error("table_create - open");
     return retval;
   }
-
-  /* mark the end of the file to make the stretch effective */
-  if (write(fd, "\0", 1) < 0) {
-    retval = cloudfs_error("stretch_bucket - write");
+  if (ftruncate(fd, len) < 0) {
+    retval = cloudfs_error("table_create - ftruncate");
+    close(fd);
     return retval;
   }
+  void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    retval = cloudfs_error("table_create - mmap");
+    return retval;
+  }
+
+  t->id = -1;
+  t->addr = addr;
+  t->len = len;
+  t->hdr = (struct ht_header *) addr;
+  t->slots = (struct ht_slot *) (addr + HT_HDR_SIZE);
+  memcpy(t->hdr->magic, HT_MAGIC, HT_MAGIC_LEN);
+  t->hdr->version = HT_VERSION;
+  t->hdr->generation = generation;
+  t->hdr->capacity = cap;
 
-  /* close the file */
-  retval = close(fd);
+  dbg_print("[DBG] table_create(generation=%llu, cap=%llu)\n",
+      (unsigned long long) generation, (unsigned long long) cap);
+
+  return retval;
+}
+
+/**
+ * @brief Write a whole table to disk and unmap it.
+ * @param t The table, it may not exist.
+ * @return Void.
+ */
+static void table_close(struct ht_table *t)
+{
+  if (t->addr == NULL) {
+    return;
+  }
+  if (msync(t->addr, t->len, MS_SYNC) < 0) {
+    cloudfs_error("table_close - msync");
+  }
+  if (munmap(t->addr, t->len) < 0) {
+    cloudfs_error("table_close - munmap");
+  }
+  memset(t, 0, sizeof(struct ht_table));
+}
+
+/**
+ * @brief Turn a table built by table_create() into a table file.
+ *        The table is written to disk first, so a table file is never
+ *        incomplete. A failed table is closed and removed.
+ * @param t The table.
+ * @param id Which of the two table files it becomes.
+ * @return 0 on success, -errno otherwise.
+ */
+static int table_publish(struct ht_table *t, int id)
+{
+  int retval = 0;
+  char tmp[MAX_PATH_LEN] = "";
+  char path[MAX_PATH_LEN] = "";
+
+  snprintf(tmp, MAX_PATH_LEN, "%s.new", Idx_path);
+  table_path(id, path);
+  if (msync(t->addr, t->len, MS_SYNC) < 0) {
+    retval = cloudfs_error("table_publish - msync");
+  } else if (rename(tmp, path) < 0) {
+    retval = cloudfs_error("table_publish - rename");
+  }
   if (retval < 0) {
-    retval = cloudfs_error("stretch_bucket - close");
+    table_close(t);
+    unlink(tmp);
+    return retval;
+  }
+  t->id = id;
+  return retval;
+}
+
+/**
+ * @brief Recount the used and deleted slots of a table,
+ *        for tables that were not unmapped cleanly.
+ * @param t The table.
+ * @return Void.
+ */
+static void table_recount(struct ht_table *t)
+{
+  uint64_t i = 0;
+  t->hdr->used = 0;
+  t->hdr->deleted = 0;
+  for (i = 0; i < t->hdr->capacity; i++) {
+    if (t->slots[i].state == SLOT_USED) {
+      t->hdr->used++;
+    } else if (t->slots[i].state == SLOT_DELETED) {
+      t->hdr->deleted++;
+    }
+  }
+}
+
+/**
+ * @brief Find the slot holding a segment in a table.
+ * @param t The table, it may not exist.
+ * @param fp Fingerprint algorithm of the digest.
+ * @param digest The raw digest, zero padded.
+ * @return The slot, NULL if the segment is not in the table.
+ */
+static struct ht_slot *table_find(struct ht_table *t, int fp,
+    const unsigned char *digest)
+{
+  if (t->addr == NULL) {
+    return NULL;
+  }
+  uint64_t mask = t->hdr->capacity - 1;
+  uint64_t i = table_home(t, fp, digest);
+  uint64_t n = 0;
+  for (n = 0; n <= mask; n++, i = (i + 1) & mask) {
+    struct ht_slot *slotp = &t->slots[i];
+    if (slotp->state == SLOT_EMPTY) {
+      break;
+    }
+    if ((slotp->state == SLOT_USED) && (i >= t->moved) && (slotp->fp == fp)
+        && (memcmp(slotp->digest, digest, FP_MAX_DIGEST_LEN) == 0)) {
+      return slotp;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Put a segment into a table, which must not hold it already.
+ *        The first empty or deleted slot on its probe sequence is taken.
+ * @param t The table.
+ * @param fp Fingerprint algorithm of the digest.
+ * @param digest The raw digest, zero padded.
+ * @param ref_count Reference count of the segment.
+ * @param seg_size Size of the segment.
+ * @return 0 on success, -ENOSPC if the table is full.
+ */
+static int table_put(struct ht_table *t, int fp, const unsigned char *digest,
+    int ref_count, long seg_size)
+{
+  uint64_t mask = t->hdr->capacity - 1;
+  uint64_t i = table_home(t, fp, digest);
+  uint64_t n = 0;
+  for (n = 0; n <= mask; n++, i = (i + 1) & mask) {
+    struct ht_slot *slotp = &t->slots[i];
+    if (slotp->state == SLOT_USED) {
+      continue;
+    }
+    if (slotp->state == SLOT_DELETED) {
+      t->hdr->deleted--;
+    }
+    memcpy(slotp->digest, digest, FP_MAX_DIGEST_LEN);
+    slotp->fp = fp;
+    slotp->ref_count = ref_count;
+    slotp->seg_size = seg_size;
+    slotp->state = SLOT_USED;
+    t->hdr->used++;
+    return 0;
+  }
+  return -ENOSPC;
+}
+
+/**
+ * @brief Free the slot of a segment, leaving a deleted mark.
+ * @param t The table holding the slot.
+ * @param slotp The slot.
+ * @return Void.
+ */
+static void table_remove(struct ht_table *t, struct ht_slot *slotp)
+{
+  slotp->state = SLOT_DELETED;
+  slotp->ref_count = 0;
+  t->hdr->used--;
+  t->hdr->deleted++;
+}
+
+/**
+ * @brief Move some slots of the old table into the current one.
+ *        The old table is left as it is, the moved slots are below
+ *        Old.moved. It is removed by ht_sync_tables() once all are moved.
+ *        The caller must hold Ht_lock.
+ * @param all If set, move all remaining slots.
+ * @return 0 on success, -errno otherwise.
+ */
+static int ht_migrate(int all)
+{
+  int retval = 0;
+
+  if (Old.addr == NULL) {
     return retval;
   }
 
-  dbg_print("[DBG] stretch_bucket(fd=%d)=%d\n", fd, retval);
+  /* enough slots per operation to empty the old table before
+   * a quarter of the current one is filled by new segments */
+  uint64_t quarter = Cur.hdr->capacity / 4;
+  uint64_t step = (Old.hdr->capacity + quarter - 1) / quarter;
+  if (step < HT_MIGRATE_STEP) {
+    step = HT_MIGRATE_STEP;
+  }
+
+  uint64_t n = 0;
+  while ((Old.moved < Old.hdr->capacity) && (all || (n < step))) {
+    struct ht_slot *slotp = &Old.slots[Old.moved];
+    /* an interrupted move may have copied the slot already */
+    if ((slotp->state == SLOT_USED)
+        && (table_find(&Cur, slotp->fp, slotp->digest) == NULL)) {
+      retval = table_put(&Cur, slotp->fp, slotp->digest,
+          slotp->ref_count, slotp->seg_size);
+      if (retval < 0) {
+        dbg_print("[ERR] no room to move slot %llu\n",
+            (unsigned long long) Old.moved);
+        return retval;
+      }
+    }
+    Old.moved++;
+    n++;
+  }
 
   return retval;
 }
 
 /**
- * @brief Fill empty segment slots to the second half of a bucket or all bucket.
- * @param bucket Pathname of the bucket file.
- * @param all If set, fill the entire file instead of the second half.
+ * @brief Write the tables to disk.
+ *        The current table is written first, then the mark of the moved
+ *        slots of the old table, which is removed if all are moved.
+ *        The caller must hold Ht_lock.
  * @return 0 on success, -errno otherwise.
  */
-static int add_slots(char *bucket, int all)
+static int ht_sync_tables(void)
 {
   int retval = 0;
 
-  /* open the bucket file */
-  int fd = 0;
-  fd = open(bucket, O_RDWR);
-  if (fd < 0) {
-    retval = cloudfs_error("add_slots - open");
+  if (msync(Cur.addr, Cur.len, MS_SYNC) < 0) {
+    retval = cloudfs_error("ht_sync_tables - msync");
+    return retval;
+  }
+  if (Old.addr == NULL) {
     return retval;
   }
 
-  /* read the file size */
-  struct stat sb;
-  retval = fstat(fd, &sb);
-  if (retval < 0) {
-    retval = cloudfs_error("add_slots - fstat");
+  if (Old.moved == Old.hdr->capacity) {
+    char path[MAX_PATH_LEN] = "";
+    table_path(Old.id, path);
+    dbg_print("[DBG] old table %s is empty, removing\n", path);
+    table_close(&Old);
+    if (unlink(path) < 0) {
+      retval = cloudfs_error("ht_sync_tables - unlink");
+    }
     return retval;
   }
-  dbg_print("[DBG] size of the file to add slots is %llu\n", sb.st_size);
 
-  /* starting point to fill */
-  int start_size = all ? 0 : (sb.st_size / 2);
+  Old.hdr->moved = Old.moved;
+  if (msync(Old.addr, Old.len, MS_SYNC) < 0) {
+    retval = cloudfs_error("ht_sync_tables - msync");
+  }
+  return retval;
+}
+
+/**
+ * @brief Build the filter again from the tables, sized for the current
+ *        table when full.
+ *        The caller must hold Ht_lock.
+ * @return Void.
+ */
+static void ht_filter_rebuild(void)
+{
+  uint64_t i = 0;
 
-  /* how many slots to fill */
-  int num_slots = sb.st_size / sizeof(struct cloudfs_seg);
-  if (!all) {
-    num_slots /= 2;
+  if (Filter_fpr <= 0) {
+    return;
+  }
+  filter_free(Filter);
+  Filter = filter_new(HT_MAX_LOAD(Cur.hdr->capacity), Filter_fpr,
+      Filter_max_bytes);
+  if (Filter == NULL) {
+    dbg_print("[ERR] no memory for the filter, turned off\n");
+    return;
   }
-  dbg_print("[DBG] number of slots to fill is %d\n", num_slots);
+  for (i = 0; i < Cur.hdr->capacity; i++) {
+    if (Cur.slots[i].state == SLOT_USED) {
+      filter_add(Filter, Cur.slots[i].fp, Cur.slots[i].digest);
+    }
+  }
+  for (i = Old.moved; (Old.addr != NULL) && (i < Old.hdr->capacity); i++) {
+    if (Old.slots[i].state == SLOT_USED) {
+      filter_add(Filter, Old.slots[i].fp, Old.slots[i].digest);
+    }
+  }
+}
 
-  void *mstart = NULL;
-  mstart = mmap(NULL, sb.st_size, PROT_WRITE, MAP_SHARED, fd, 0);
-  if (mstart == MAP_FAILED) {
-    retval = cloudfs_error("add_slots - mmap");
+/**
+ * @brief Start moving the segments into a new table if the current one
+ *        has no room for one more.
+ *        The caller must hold Ht_lock.
+ * @return 0 on success, -errno otherwise.
+ */
+static int ht_grow(void)
+{
+  int retval = 0;
+
+  uint64_t load = Cur.hdr->used + Cur.hdr->deleted + 1;
+  if (load <= HT_MAX_LOAD(Cur.hdr->capacity)) {
     return retval;
   }
 
-  /* no more need of the file descriptor */
-  retval = close(fd);
+  /* the previous resize should be done by now,
+   * its old table is removed to make room for the new one */
+  retval = ht_migrate(1);
+  if (retval == 0) {
+    retval = ht_sync_tables();
+  }
   if (retval < 0) {
-    retval = cloudfs_error("add_slots - close");
     return retval;
   }
 
-  /* fill in empty slots */
-  int i = 0;
-  for (i = 0; i < num_slots; i++) {
-    struct cloudfs_seg *slotp = (struct cloudfs_seg *)
-      (mstart + start_size + i * sizeof(struct cloudfs_seg));
-    slotp->ref_count = 0;
-    slotp->seg_size = 0;
-    memset(slotp->md5, '\0', 2 * MD5_DIGEST_LENGTH + 1);
-    memcpy(slotp->md5, "fakefakefakefakefakefakefakefake",
-        2 * MD5_DIGEST_LENGTH);
-  }
-
-  /* unmap the bucket, sync to disk */
-  retval = munmap(mstart, sb.st_size);
+  uint64_t cap = HT_MIN_CAP;
+  while (cap < 2 * (Cur.hdr->used + 1)) {
+    cap *= 2;
+  }
+
+  struct ht_table t;
+  retval = table_create(Cur.hdr->generation + 1, cap, &t);
+  if (retval < 0) {
+    return retval;
+  }
+  retval = table_publish(&t, 1 - Cur.id);
   if (retval < 0) {
-    retval = cloudfs_error("add_slots - munmap");
     return retval;
   }
 
+  dbg_print("[DBG] resizing hash table from %llu to %llu slots\n",
+      (unsigned long long) Cur.hdr->capacity, (unsigned long long) cap);
+  Old = Cur;
+  Old.moved = 0;
+  Cur = t;
+  ht_filter_rebuild();
+
   return retval;
 }
 
 /**
- * @brief Initialize the hash table.
- *        This function creates bucket files if the hash table is empty.
- *        Also it mmaps all bucket files to memory for future use.
- * @param bkt_prfx Path of the bucket files, except the bucket number.
- *                 E.g. the prefix is /mnt/ssd/.tmp/bucket, and there are
- *                 10 buckets, then bucket files are /mnt/ssd/.tmp/bucket0
- *                 to /mnt/ssd/.tmp/bucket9.
- * @param bkt_num Number of bucket files.
- * @param bkt_size Default size of each bucket file in bytes.
+ * @brief Find the slot holding a segment, in either table.
+ *        The caller must hold Ht_lock, and the returned pointer is only
+ *        valid until Ht_lock is released.
+ * @param fp Fingerprint algorithm of the digest.
+ * @param digest The raw digest, zero padded.
+ * @param tp The table holding the slot is returned here.
+ * @return The slot, NULL if the segment is not in the hash table.
+ */
+static struct ht_slot *ht_find_slot(int fp, const unsigned char *digest,
+    struct ht_table **tp)
+{
+  struct ht_slot *slotp = table_find(&Cur, fp, digest);
+  *tp = &Cur;
+  if (slotp == NULL) {
+    slotp = table_find(&Old, fp, digest);
+    *tp = &Old;
+  }
+  return slotp;
+}
+
+/**
+ * @brief Find the slot holding a segment, asking the filter first.
+ *        The caller must hold Ht_lock, and the returned pointer is only
+ *        valid until Ht_lock is released.
+ * @param fp Fingerprint algorithm of the digest.
+ * @param digest The raw digest, zero padded.
+ * @param tp The table holding the slot is returned here.
+ * @return The slot, NULL if the segment is not in the hash table.
+ */
+static struct ht_slot *ht_lookup(int fp, const unsigned char *digest,
+    struct ht_table **tp)
+{
+  if (Filter != NULL) {
+    Filter_lookups++;
+    if (!filter_may_contain(Filter, fp, digest)) {
+      Filter_skips++;
+      return NULL;
+    }
+  }
+  struct ht_slot *slotp = ht_find_slot(fp, digest, tp);
+  if ((Filter != NULL) && (slotp == NULL)) {
+    Filter_false_pos++;
+  }
+  return slotp;
+}
+
+/**
+ * @brief Convert the key of a segment to the digest its slot is keyed on.
+ * @param key Key of the segment.
+ * @param fp The fingerprint algorithm is returned here.
+ * @param digest The raw digest is returned here, zero padded,
+ *               it should have FP_MAX_DIGEST_LEN bytes.
+ * @return 0 on success, -EINVAL if the key is not valid.
+ */
+static int ht_key_digest(char *key, int *fp, unsigned char *digest)
+{
+  memset(digest, 0, FP_MAX_DIGEST_LEN);
+  if (fp_parse_key(key, fp, digest) < 0) {
+    dbg_print("[ERR] invalid segment key \"%s\"\n", key);
+    return -EINVAL;
+  }
+  return 0;
+}
+
+/**
+ * @brief Set the state of a segment in the tables.
+ *        The caller must hold Ht_lock.
+ * @param fp Fingerprint algorithm of the digest.
+ * @param digest The raw digest, zero padded.
+ * @param ref_count New reference count, the segment is removed if it
+ *                  is not positive.
+ * @param seg_size Size of the segment.
  * @return 0 on success, -errno otherwise.
  */
-int ht_init(char *bkt_prfx, int bkt_num, int bkt_size)
+static int ht_apply(int fp, const unsigned char *digest, int ref_count,
+    long seg_size)
 {
   int retval = 0;
-  int fd = 0;
-  int i = 0;
-  char bkt_file[MAX_PATH_LEN] = "";
+  struct ht_table *tp = NULL;
+  struct ht_slot *slotp = ht_lookup(fp, digest, &tp);
 
-  /* initialize static global variables */
-  memset(Bkt_prfx, '\0', MAX_PATH_LEN);
-  strncpy(Bkt_prfx, bkt_prfx, MAX_PATH_LEN - 1);
-  Bkt_num = bkt_num;
-  Bkt_size = bkt_size;
-  Buckets = (void **) malloc(bkt_num * sizeof(void *));
-  if (Buckets == NULL) {
-    retval = cloudfs_error("ht_init - malloc");
+  if (ref_count <= 0) {
+    /* when replaying, a slot moved before the crash is in both tables */
+    while (slotp != NULL) {
+      table_remove(tp, slotp);
+      if (Filter != NULL) {
+        filter_remove(Filter, fp, digest);
+      }
+      slotp = ht_find_slot(fp, digest, &tp);
+    }
     return retval;
   }
-  for (i = 0; i < bkt_num; i++) {
-    Buckets[i] = NULL;
+
+  if (slotp != NULL) {
+    slotp->ref_count = ref_count;
+    slotp->seg_size = seg_size;
+    return retval;
   }
 
-  /* for each bucket file, create it if needed,
-   * and then mmap that file, save the pointers to Buckets */
-  for (i = 0; i < bkt_num; i++) {
-    snprintf(bkt_file, MAX_PATH_LEN, "%s%d", bkt_prfx, i);
-    if (access(bkt_file, F_OK) < 0) {
-      dbg_print("[DBG] bucket file %s does not exist\n", bkt_file);
-      retval = stretch_bucket(bkt_file, 1);
-      if (retval < 0) {
-        return retval;
-      }
-      retval = add_slots(bkt_file, 1);
-      if (retval < 0) {
-        return retval;
-      }
-    } else {
-      dbg_print("[DBG] bucket file %s exists\n", bkt_file);
-    }
+  retval = ht_grow();
+  if (retval == 0) {
+    retval = table_put(&Cur, fp, digest, ref_count, seg_size);
+  }
+  if ((retval == 0) && (Filter != NULL)) {
+    filter_add(Filter, fp, digest);
+  }
+  return retval;
+}
 
-    fd = open(bkt_file, O_RDWR);
-    if (fd < 0) {
-      retval = cloudfs_error("ht_init - open");
-      return retval;
-    }
-    struct stat sb;
-    retval = fstat(fd, &sb);
-    if (retval < 0) {
-      retval = cloudfs_error("ht_init - fstat");
-      return retval;
-    }
+/**
+ * @brief Write the buffered records to the journal file, without
+ *        waiting for them to reach the disk.
+ *        The caller must hold Ht_lock.
+ * @return 0 on success, -errno otherwise.
+ */
+static int ht_log_write(void)
+{
+  int retval = 0;
+  int done = 0;
 
-    Buckets[i] = mmap(NULL, sb.st_size, PROT_WRITE, MAP_SHARED, fd, 0);
-    if (Buckets[i] == MAP_FAILED) {
-      retval = cloudfs_error("ht_init - mmap");
+  while (done < Log_buf_len) {
+    ssize_t n = write(Log_fd, Log_buf + done, Log_buf_len - done);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      retval = cloudfs_error("ht_log_write - write");
       return retval;
     }
+    done += n;
+  }
+  Log_size += Log_buf_len;
+  Log_buf_len = 0;
+  Log_written = Log_appended;
 
-    if (close(fd) < 0) {
-      retval = cloudfs_error("ht_init - close");
+  return retval;
+}
+
+/**
+ * @brief Append the new state of a segment to the journal.
+ *        The caller must hold Ht_lock.
+ * @param fp Fingerprint algorithm of the digest.
+ * @param digest The raw digest, zero padded.
+ * @param ref_count New reference count, zero if the segment was removed.
+ * @param seg_size Size of the segment.
+ * @return 0 on success, -errno otherwise.
+ */
+static int ht_log(int fp, const unsigned char *digest, int ref_count,
+    long seg_size)
+{
+  int retval = 0;
+
+  if (Log_buf_len + sizeof(struct ht_log_rec) > HT_LOG_BUF) {
+    retval = ht_log_write();
+    if (retval < 0) {
       return retval;
     }
   }
 
-  dbg_print("[DBG] ht_init(bkt_prfx=\"%s\", bkt_num=%d,"
-      " bkt_size=%d)=%d\n", bkt_prfx, bkt_num, bkt_size, retval);
+  struct ht_log_rec *rec = (struct ht_log_rec *) (Log_buf + Log_buf_len);
+  memset(rec, 0, sizeof(struct ht_log_rec));
+  rec->ref_count = (ref_count > 0) ? ref_count : 0;
+  rec->seg_size = seg_size;
+  rec->fp = fp;
+  memcpy(rec->digest, digest, FP_MAX_DIGEST_LEN);
+  rec->crc = crc32(0L, (const Bytef *) rec + sizeof(uint32_t),
+      sizeof(struct ht_log_rec) - sizeof(uint32_t));
+  Log_buf_len += sizeof(struct ht_log_rec);
+  Log_appended++;
 
   return retval;
 }
 
 /**
- * @brief Calculate hash value based on MD5 of a segment.
- *        The current implementation is just sum over the
- *        characters in the MD5 array.
- * @param md5 MD5 of a segment.
- * @return The calculated hash value for the hash table.
+ * @brief Write the tables to disk and empty the journal.
+ *        Buffered records are dropped, their changes are on disk now.
+ *        The caller must hold Commit_lock and Ht_lock.
+ * @return 0 on success, -errno otherwise.
  */
-static int hash_value(char *md5)
+static int ht_checkpoint(void)
 {
-  int i = 0;
-  int sum = 0;
-  for (i = 0; i < 2 * MD5_DIGEST_LENGTH; i++) {
-    sum += (int) md5[i];
+  int retval = 0;
+
+  retval = ht_sync_tables();
+  if (retval < 0) {
+    return retval;
+  }
+
+  if (ftruncate(Log_fd, 0) < 0) {
+    retval = cloudfs_error("ht_checkpoint - ftruncate");
+    return retval;
+  }
+  if (fsync(Log_fd) < 0) {
+    retval = cloudfs_error("ht_checkpoint - fsync");
+    return retval;
   }
-  dbg_print("[DBG] hash value is %d\n", sum);
-  return sum;
+  Log_size = 0;
+  Log_buf_len = 0;
+  Log_written = Log_appended;
+  Log_durable = Log_appended;
+
+  dbg_print("[DBG] ht_checkpoint()=%d\n", retval);
+
+  return retval;
 }
 
 /**
- * @brief Inserts a segment into the hash table.
- *        Insertion is done by iterating each slot
- *        in the bucket. If some slot's "ref_count"
- *        field is zero, insert there; if all slots
- *        are occupied, stretch the bucket.
- * @param segp Pointer to the segment to insert.
- * @return 0 on success, -1 otherwise.
+ * @brief Replay the journal left by a crash onto the tables.
+ *        Replaying stops at the first incomplete or damaged record,
+ *        which was never committed.
+ * @return 0 on success, -errno otherwise.
  */
-int ht_insert(struct cloudfs_seg *segp)
+static int ht_replay(void)
 {
   int retval = 0;
-  int bucket_id = 0;
-  unsigned int i = 0;
-  char bucket[MAX_PATH_LEN] = "";
-
-  bucket_id = hash_value(segp->md5) % Bkt_num;
-  snprintf(bucket , MAX_PATH_LEN, "%s%d", Bkt_prfx, bucket_id);
-  dbg_print("[DBG] target bucket file is %s\n", bucket);
 
   struct stat sb;
-  retval = lstat(bucket, &sb);
-  if (retval < 0) {
-    retval = cloudfs_error("ht_insert - lstat");
+  if (fstat(Log_fd, &sb) < 0) {
+    retval = cloudfs_error("ht_replay - fstat");
+    return retval;
+  }
+  if (sb.st_size == 0) {
     return retval;
   }
-  dbg_print("[DBG] file size is %llu\n", sb.st_size);
 
-  dbg_print("[DBG] inserting segment\n");
-#ifdef DEBUG
-  print_seg(segp);
-#endif
+  struct ht_log_rec *recs = (struct ht_log_rec *) malloc(sb.st_size);
+  if (recs == NULL) {
+    retval = cloudfs_error("ht_replay - malloc");
+    return retval;
+  }
+  if (pread(Log_fd, recs, sb.st_size, 0) != sb.st_size) {
+    retval = cloudfs_error("ht_replay - pread");
+    free(recs);
+    return retval;
+  }
 
-  int success = 0;
-  for (i = 0; i < sb.st_size / sizeof(struct cloudfs_seg); i++) {
-    struct cloudfs_seg *slotp = (struct cloudfs_seg *)
-      (Buckets[bucket_id] + i * sizeof(struct cloudfs_seg));
-    if (slotp->ref_count == 0) {
-      dbg_print("[DBG] slot %d is available\n", i);
-      slotp->ref_count = segp->ref_count;
-      slotp->seg_size = segp->seg_size;
-      memset(slotp->md5, '\0', 2 * MD5_DIGEST_LENGTH + 1);
-      memcpy(slotp->md5, segp->md5, 2 * MD5_DIGEST_LENGTH);
-      msync(slotp, sizeof(struct cloudfs_seg), MS_SYNC);
-      success = 1;
+  long i = 0;
+  long num_rec = sb.st_size / sizeof(struct ht_log_rec);
+  for (i = 0; (i < num_rec) && (retval == 0); i++) {
+    struct ht_log_rec *rec = &recs[i];
+    uLong crc = crc32(0L, (const Bytef *) rec + sizeof(uint32_t),
+        sizeof(struct ht_log_rec) - sizeof(uint32_t));
+    if ((crc != rec->crc) || (rec->fp >= FP_NUM)) {
+      dbg_print("[DBG] journal ends at damaged record %ld\n", i);
       break;
     }
+    retval = ht_apply(rec->fp, rec->digest, rec->ref_count, rec->seg_size);
   }
+  free(recs);
 
-  if (!success) {
-    dbg_print("[DBG] bucket is full\n");
-    if (munmap(Buckets[bucket_id], sb.st_size) < 0) {
-      retval = cloudfs_error("ht_insert - munmap");
-      return retval;
+  dbg_print("[DBG] ht_replay()=%d, %ld of %ld records replayed\n", retval,
+      i, num_rec);
+
+  return retval;
+}
+
+/**
+ * @brief Move the segments of the bucket files of older versions into
+ *        a new table.
+ *        Each bucket file is read with the slot layout of its version.
+ *        If bucket 0 of the first version exists, a migration to the
+ *        second one did not finish and the files of the first version
+ *        are the complete ones.
+ * @param bkt_prfx Path of the bucket files, except the bucket number.
+ * @param bkt_num Number of bucket files.
+ * @param t The new table is returned here, its "addr" is NULL if there
+ *          are no bucket files.
+ * @return 0 on success, -errno otherwise.
+ */
+static int ht_import_buckets(char *bkt_prfx, int bkt_num, struct ht_table *t)
+{
+  int retval = 0;
+  int i = 0;
+  char bucket[MAX_PATH_LEN] = "";
+  void **maps = NULL;
+  size_t *lens = NULL;
+
+  memset(t, 0, sizeof(struct ht_table));
+  snprintf(bucket, MAX_PATH_LEN, "%s0", bkt_prfx);
+  int v1 = (access(bucket, F_OK) == 0);
+  size_t slot_size = v1 ? sizeof(struct slot_v1) : sizeof(struct slot_v2);
+
+  maps = (void **) calloc(bkt_num, sizeof(void *));
+  lens = (size_t *) calloc(bkt_num, sizeof(size_t));
+  if ((maps == NULL) || (lens == NULL)) {
+    retval = cloudfs_error("ht_import_buckets - calloc");
+    goto out;
+  }
+
+  /* map all bucket files, their slots bound the number of segments */
+  uint64_t slots = 0;
+  for (i = 0; i < bkt_num; i++) {
+    snprintf(bucket, MAX_PATH_LEN, v1 ? "%s%d" : "%s%d-v2", bkt_prfx, i);
+    int fd = open(bucket, O_RDONLY);
+    if (fd < 0) {
+      if (errno == ENOENT) {
+        continue;
+      }
+      retval = cloudfs_error("ht_import_buckets - open");
+      goto out;
     }
-    retval = stretch_bucket(bucket, 0);
-    if (retval < 0) {
-      return retval;
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+      retval = cloudfs_error("ht_import_buckets - fstat");
+      close(fd);
+      goto out;
     }
-    retval = add_slots(bucket, 0);
-    if (retval < 0) {
-      return retval;
+    if (sb.st_size > 0) {
+      maps[i] = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (maps[i] == MAP_FAILED) {
+        maps[i] = NULL;
+        retval = cloudfs_error("ht_import_buckets - mmap");
+        close(fd);
+        goto out;
+      }
+      lens[i] = sb.st_size;
+      slots += sb.st_size / slot_size;
     }
-    int fd = open(bucket, O_RDWR);
-    if (fd < 0) {
-      retval = cloudfs_error("ht_insert - open");
+    close(fd);
+  }
+  if (slots == 0) {
+    goto out;
+  }
+
+  uint64_t cap = HT_MIN_CAP;
+  while (cap < 2 * (slots + 1)) {
+    cap *= 2;
+  }
+  retval = table_create(1, cap, t);
+  if (retval < 0) {
+    goto out;
+  }
+
+  dbg_print("[DBG] importing %s bucket files into %llu slots\n",
+      v1 ? "first version" : "second version", (unsigned long long) cap);
+  for (i = 0; i < bkt_num; i++) {
+    unsigned int j = 0;
+    for (j = 0; (maps[i] != NULL) && (j < lens[i] / slot_size); j++) {
+      char key[MAX_KEY_LEN + 1];
+      int ref_count = 0;
+      long seg_size = 0;
+      memset(key, '\0', MAX_KEY_LEN + 1);
+      if (v1) {
+        struct slot_v1 *old = (struct slot_v1 *) (maps[i] + j * slot_size);
+        ref_count = old->ref_count;
+        seg_size = old->seg_size;
+        memcpy(key, old->md5, 2 * MD5_DIGEST_LENGTH);
+      } else {
+        struct slot_v2 *old = (struct slot_v2 *) (maps[i] + j * slot_size);
+        ref_count = old->ref_count;
+        seg_size = old->seg_size;
+        memcpy(key, old->key, MAX_KEY_LEN);
+      }
+      int fp = 0;
+      unsigned char digest[FP_MAX_DIGEST_LEN];
+      if ((ref_count <= 0) || (ht_key_digest(key, &fp, digest) < 0)
+          || (table_find(t, fp, digest) != NULL)) {
+        continue;
+      }
+      retval = table_put(t, fp, digest, ref_count, seg_size);
+      if (retval < 0) {
+        goto out;
+      }
+    }
+  }
+
+out:
+  for (i = 0; (maps != NULL) && (i < bkt_num); i++) {
+    if (maps[i] != NULL) {
+      munmap(maps[i], lens[i]);
+    }
+  }
+  free(maps);
+  free(lens);
+  return retval;
+}
+
+/**
+ * @brief Write the statistics of the hash table and its filter.
+ * @param out The statistics file.
+ * @return Void.
+ */
+static void ht_stats(FILE *out)
+{
+  pthread_mutex_lock(&Ht_lock);
+  if (Cur.addr != NULL) {
+    fprintf(out, "capacity %llu\n", (unsigned long long) Cur.hdr->capacity);
+    fprintf(out, "used %llu\n", (unsigned long long) Cur.hdr->used);
+    fprintf(out, "deleted %llu\n", (unsigned long long) Cur.hdr->deleted);
+  }
+  fprintf(out, "resizing %d\n", Old.addr != NULL);
+  fprintf(out, "journal_bytes %lld\n", (long long) (Log_size + Log_buf_len));
+  if (Filter != NULL) {
+    fprintf(out, "filter_bytes %lu\n", (unsigned long) filter_bytes(Filter));
+    fprintf(out, "filter_entries %llu\n",
+        (unsigned long long) Filter->count);
+    fprintf(out, "filter_hashes %d\n", Filter->num_hashes);
+    fprintf(out, "filter_target_fpr %f\n", Filter->fpr);
+    fprintf(out, "filter_est_fpr %f\n", filter_est_fpr(Filter));
+  }
+  fprintf(out, "filter_lookups %llu\n", (unsigned long long) Filter_lookups);
+  fprintf(out, "filter_skips %llu\n", (unsigned long long) Filter_skips);
+  fprintf(out, "filter_false_positives %llu\n",
+      (unsigned long long) Filter_false_pos);
+  pthread_mutex_unlock(&Ht_lock);
+}
+
+/**
+ * @brief Initialize the hash table.
+ *        This function maps the table files, creating the table if there
+ *        is none, from the bucket files of older versions if they exist.
+ *        The journal is replayed and a checkpoint is done.
+ * @param idx_path Path of the table files, except the suffix. E.g. the
+ *                 path is /mnt/ssd/.tmp/index, then table files are
+ *                 /mnt/ssd/.tmp/index.0 and /mnt/ssd/.tmp/index.1, and
+ *                 the journal is /mnt/ssd/.tmp/index.log.
+ * @param bkt_prfx Path of the bucket files of older versions, except the
+ *                 bucket number, e.g. /mnt/ssd/.tmp/bucket.
+ * @param bkt_num Number of bucket files of older versions.
+ * @param filter_fpr False-positive rate of the filter, 0 turns it off.
+ * @param filter_size Most memory the filter may use in bytes, 0 for no
+ *                    limit.
+ * @return 0 on success, -errno otherwise.
+ */
+int ht_init(char *idx_path, char *bkt_prfx, int bkt_num, double filter_fpr,
+    long filter_size)
+{
+  int retval = 0;
+  int i = 0;
+  char path[MAX_PATH_LEN] = "";
+  struct ht_table t[2];
+
+  /* initialize static global variables */
+  memset(Idx_path, '\0', MAX_PATH_LEN);
+  strncpy(Idx_path, idx_path, MAX_PATH_LEN - 1);
+  memset(&Cur, 0, sizeof(struct ht_table));
+  memset(&Old, 0, sizeof(struct ht_table));
+  Log_buf_len = 0;
+  Log_size = 0;
+  Log_appended = 0;
+  Log_written = 0;
+  Log_durable = 0;
+  Filter = NULL;
+  Filter_fpr = filter_fpr;
+  Filter_max_bytes = filter_size;
+  Filter_lookups = 0;
+  Filter_skips = 0;
+  Filter_false_pos = 0;
+
+  /* a table being built when unmounted is incomplete */
+  snprintf(path, MAX_PATH_LEN, "%s.new", Idx_path);
+  unlink(path);
+
+  for (i = 0; i < 2; i++) {
+    retval = table_open(i, &t[i]);
+    if (retval == -EINVAL) {
+      dbg_print("[ERR] hash table file %d is corrupted\n", i);
       return retval;
     }
-    retval = fstat(fd, &sb);
-    if (retval < 0) {
-      retval = cloudfs_error("ht_insert - fstat");
+    if ((retval < 0) && (retval != -ENOENT)) {
       return retval;
     }
-    Buckets[bucket_id] =
-      mmap(NULL, sb.st_size, PROT_WRITE, MAP_SHARED, fd, 0);
-    if (Buckets[bucket_id] == MAP_FAILED) {
-      retval = cloudfs_error("ht_insert - mmap");
+    retval = 0;
+  }
+
+  if ((t[0].addr == NULL) && (t[1].addr == NULL)) {
+    retval = ht_import_buckets(bkt_prfx, bkt_num, &t[0]);
+    if ((retval == 0) && (t[0].addr == NULL)) {
+      dbg_print("[DBG] creating an empty hash table\n");
+      retval = table_create(1, HT_MIN_CAP, &t[0]);
+    }
+    if (retval < 0) {
+      table_close(&t[0]);
+      unlink(path);
       return retval;
     }
-    retval = close(fd);
+    t[0].hdr->clean = 1;
+    retval = table_publish(&t[0], 0);
     if (retval < 0) {
-      retval = cloudfs_error("ht_insert - close");
       return retval;
     }
-    struct cloudfs_seg *slotp = (struct cloudfs_seg *)
-      (Buckets[bucket_id] + sb.st_size / 2);
-    slotp->ref_count = segp->ref_count;
-    slotp->seg_size = segp->seg_size;
-    memset(slotp->md5, '\0', 2 * MD5_DIGEST_LENGTH + 1);
-    memcpy(slotp->md5, segp->md5, 2 * MD5_DIGEST_LENGTH);
-    msync(slotp, sizeof(struct cloudfs_seg), MS_SYNC);
   }
 
-  dbg_print("[DBG] ht_insert(segp=0x%08x)=%d\n", (unsigned int) segp, retval);
+  /* the bucket files are no longer needed once a table exists */
+  for (i = 0; i < bkt_num; i++) {
+    snprintf(path, MAX_PATH_LEN, "%s%d", bkt_prfx, i);
+    unlink(path);
+    snprintf(path, MAX_PATH_LEN, "%s%d-v2", bkt_prfx, i);
+    unlink(path);
+  }
+
+  /* with two tables, the older one was being moved into the newer one */
+  if ((t[0].addr != NULL) && (t[1].addr != NULL)) {
+    int cur = (t[1].hdr->generation > t[0].hdr->generation) ? 1 : 0;
+    Cur = t[cur];
+    Old = t[1 - cur];
+  } else {
+    Cur = (t[0].addr != NULL) ? t[0] : t[1];
+  }
+
+  if (!Cur.hdr->clean) {
+    dbg_print("[DBG] hash table was not unmounted cleanly, recounting\n");
+    table_recount(&Cur);
+  }
+  Cur.hdr->clean = 0;
+  msync(Cur.addr, HT_HDR_SIZE, MS_SYNC);
+  if (Old.addr != NULL) {
+    if (!Old.hdr->clean) {
+      table_recount(&Old);
+    }
+    Old.hdr->clean = 0;
+    msync(Old.addr, HT_HDR_SIZE, MS_SYNC);
+  }
+
+  /* replay what was committed after the last checkpoint */
+  snprintf(path, MAX_PATH_LEN, "%s.log", Idx_path);
+  Log_fd = open(path, O_RDWR | O_CREAT | O_APPEND, DEFAULT_FILE_MODE);
+  if (Log_fd < 0) {
+    retval = cloudfs_error("ht_init - open");
+    return retval;
+  }
+  retval = ht_replay();
+  if (retval < 0) {
+    return retval;
+  }
+  retval = ht_checkpoint();
+  ht_filter_rebuild();
+  stats_register("index", ht_stats);
+
+  dbg_print("[DBG] ht_init(idx_path=\"%s\", bkt_prfx=\"%s\", bkt_num=%d)=%d,"
+      " %llu of %llu slots used\n", idx_path, bkt_prfx, bkt_num, retval,
+      (unsigned long long) Cur.hdr->used,
+      (unsigned long long) Cur.hdr->capacity);
 
   return retval;
 }
 
 /**
- * @brief Search for a particular segment.
- *        Match is found if their md5s are the same.
- * @param segp The segment to search for.
- * @param found If found, place the match's pointer here,
- *              If not found, this will be set to NULL.
+ * @brief Make the changes made so far durable.
+ *        The buffered journal records are written and flushed once for
+ *        all the callers waiting meanwhile; a caller whose records were
+ *        flushed by another one returns at once. A checkpoint is done if
+ *        the journal has grown large.
  * @return 0 on success, -errno otherwise.
  */
-int ht_search(struct cloudfs_seg *segp, struct cloudfs_seg **found)
+int ht_commit(void)
 {
   int retval = 0;
-  int bucket_id = 0;
-  char bucket[MAX_PATH_LEN] = "";
 
-  bucket_id = hash_value(segp->md5) % Bkt_num;
-  snprintf(bucket , MAX_PATH_LEN, "%s%d", Bkt_prfx, bucket_id);
-  dbg_print("[DBG] bucket file to search is %s\n", bucket);
+  pthread_mutex_lock(&Ht_lock);
+  uint64_t mine = Log_appended;
+  pthread_mutex_unlock(&Ht_lock);
 
-  struct stat sb;
-  retval = lstat(bucket, &sb);
-  if (retval < 0) {
-    retval = cloudfs_error("ht_search - lstat");
-    return retval;
+  pthread_mutex_lock(&Commit_lock);
+  if (Log_durable < mine) {
+    pthread_mutex_lock(&Ht_lock);
+    retval = ht_log_write();
+    uint64_t written = Log_written;
+    pthread_mutex_unlock(&Ht_lock);
+
+    /* records appended meanwhile are flushed too, but not counted */
+    if ((retval == 0) && (fdatasync(Log_fd) < 0)) {
+      retval = cloudfs_error("ht_commit - fdatasync");
+    }
+    if (retval == 0) {
+      Log_durable = written;
+    }
+  }
+
+  pthread_mutex_lock(&Ht_lock);
+  if ((retval == 0) && (Log_size > HT_LOG_MAX)) {
+    retval = ht_checkpoint();
   }
+  pthread_mutex_unlock(&Ht_lock);
+  pthread_mutex_unlock(&Commit_lock);
+
+  return retval;
+}
+
+/**
+ * @brief Inserts a segment into the hash table.
+ *        The table is resized first if it has no room for one more.
+ *        A segment that is in the table already gets the new values.
+ *        The change is durable after the next ht_commit().
+ * @param segp Pointer to the segment to insert.
+ * @return 0 on success, -errno otherwise.
+ */
+int ht_insert(struct cloudfs_seg *segp)
+{
+  int retval = 0;
+  int fp = 0;
+  unsigned char digest[FP_MAX_DIGEST_LEN];
 
-  dbg_print("[DBG] searching segment\n");
+  dbg_print("[DBG] inserting segment\n");
 #ifdef DEBUG
   print_seg(segp);
 #endif
 
-  unsigned int i = 0;
-  for (i = 0; i < sb.st_size / sizeof(struct cloudfs_seg); i++) {
-    struct cloudfs_seg *slotp = (struct cloudfs_seg *)
-      (Buckets[bucket_id] + i * sizeof(struct cloudfs_seg));
-    if ((slotp->ref_count > 0)
-        && (memcmp(slotp->md5, segp->md5, 2 * MD5_DIGEST_LENGTH) == 0)) {
-      dbg_print("[DBG] segment found at slot %d\n", i);
-      *found = slotp;
-      return retval;
-    }
+  retval = ht_key_digest(segp->key, &fp, digest);
+  if (retval < 0) {
+    return retval;
   }
-  dbg_print("[DBG] segment not found\n");
-  *found = NULL;
+
+  pthread_mutex_lock(&Ht_lock);
+  retval = ht_migrate(0);
+  if (retval == 0) {
+    retval = ht_apply(fp, digest, segp->ref_count, segp->seg_size);
+  }
+  if (retval == 0) {
+    retval = ht_log(fp, digest, segp->ref_count, segp->seg_size);
+  }
+  pthread_mutex_unlock(&Ht_lock);
+
+  dbg_print("[DBG] ht_insert(segp=0x%08x)=%d\n", (unsigned int) segp, retval);
+
   return retval;
 }
 
 /**
- * @brief CloudFS should call this function upon exiting.
- *        This function unmaps all buckets and frees allocated memory.
- * @return Void.
+ * @brief Search for a particular segment.
+ *        Match is found if their keys are the same.
+ * @param segp The segment to search for.
+ * @param found If found, a copy of the match is placed here,
+ *              If not found, its "ref_count" will be set to zero.
+ * @return 0 on success, -errno otherwise.
  */
-void ht_destroy(void)
+int ht_search(struct cloudfs_seg *segp, struct cloudfs_seg *found)
 {
-  int i = 0;
-  char bucket[MAX_PATH_LEN] = "";
+  int retval = 0;
+  int fp = 0;
+  unsigned char digest[FP_MAX_DIGEST_LEN];
 
-  for (i = 0; i < Bkt_num; i++) {
-    snprintf(bucket , MAX_PATH_LEN, "%s%d", Bkt_prfx, i);
-    dbg_print("[DBG] unmapping %s\n", bucket);
+  found->ref_count = 0;
+  retval = ht_key_digest(segp->key, &fp, digest);
+  if (retval < 0) {
+    return retval;
+  }
 
-    struct stat sb;
-    if (lstat(bucket, &sb) < 0) {
-      cloudfs_error("ht_destroy - lstat");
-      continue;
+  pthread_mutex_lock(&Ht_lock);
+  retval = ht_migrate(0);
+  struct ht_table *tp = NULL;
+  struct ht_slot *slotp = ht_lookup(fp, digest, &tp);
+  if (slotp != NULL) {
+    found->ref_count = slotp->ref_count;
+    found->seg_size = slotp->seg_size;
+    if (found != segp) {
+      memcpy(found->key, segp->key, MAX_KEY_LEN + 1);
     }
+  }
+  pthread_mutex_unlock(&Ht_lock);
 
-    if (munmap(Buckets[i], sb.st_size) < 0) {
-      cloudfs_error("ht_destroy - munmap");
-      continue;
-    }
+  return retval;
+}
+
+/**
+ * @brief Change the reference count of a segment in the hash table.
+ *        A segment whose reference count drops to zero frees its slot.
+ *        The change is durable after the next ht_commit().
+ * @param segp The segment to update.
+ * @param delta The amount to add to the reference count.
+ * @return The new reference count on success, -ENOENT if the segment
+ *         is not in the hash table, -errno otherwise.
+ */
+int ht_add_ref(struct cloudfs_seg *segp, int delta)
+{
+  int retval = 0;
+  int fp = 0;
+  unsigned char digest[FP_MAX_DIGEST_LEN];
+
+  retval = ht_key_digest(segp->key, &fp, digest);
+  if (retval < 0) {
+    return retval;
   }
 
-  if (Buckets != NULL) {
-    free(Buckets);
+  pthread_mutex_lock(&Ht_lock);
+  retval = ht_migrate(0);
+  if (retval == 0) {
+    struct ht_table *tp = NULL;
+    struct ht_slot *slotp = ht_lookup(fp, digest, &tp);
+    if (slotp == NULL) {
+      retval = -ENOENT;
+    } else {
+      int ref_count = slotp->ref_count + delta;
+      long seg_size = slotp->seg_size;
+      retval = ht_apply(fp, digest, ref_count, seg_size);
+      if (retval == 0) {
+        retval = ht_log(fp, digest, ref_count, seg_size);
+      }
+      if (retval == 0) {
+        retval = (ref_count > 0) ? ref_count : 0;
+      }
+    }
   }
+  pthread_mutex_unlock(&Ht_lock);
+
+  dbg_print("[DBG] ht_add_ref(segp=0x%08x, delta=%d)=%d\n",
+      (unsigned int) segp, delta, retval);
+
+  return retval;
 }
 
 /**
- * @brief A wrapper function for msync.
- *        This should be called everytime when an item in the hash
- *        table is updated (such as ref_count).
- * @param segp The segment to sync.
+ * @brief CloudFS should call this function upon exiting.
+ *        This function does a last checkpoint, marks the tables clean,
+ *        writes them to disk and unmaps them.
  * @return Void.
  */
-void ht_sync(struct cloudfs_seg *segp)
+void ht_destroy(void)
 {
-  msync(segp, sizeof(struct cloudfs_seg), MS_SYNC);
+  pthread_mutex_lock(&Commit_lock);
+  pthread_mutex_lock(&Ht_lock);
+  if (Log_fd >= 0) {
+    ht_checkpoint();
+    close(Log_fd);
+    Log_fd = -1;
+  }
+  if (Cur.addr != NULL) {
+    Cur.hdr->clean = 1;
+    table_close(&Cur);
+  }
+  if (Old.addr != NULL) {
+    Old.hdr->clean = 1;
+    table_close(&Old);
+  }
+  filter_free(Filter);
+  Filter = NULL;
+  pthread_mutex_unlock(&Ht_lock);
+  pthread_mutex_unlock(&Commit_lock);
 }
-
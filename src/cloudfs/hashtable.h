@@ -1,14 +1,16 @@
 #ifndef __HASHTABLE_H_
 #define __HASHTABLE_H_
 
-int ht_init(char *bkt_prfx, int bkt_num, int bkt_size);
+int ht_init(char *idx_path, char *bkt_prfx, int bkt_num, double filter_fpr,
+    long filter_size);
+int ht_commit(void);
 int ht_insert(struct cloudfs_seg *segp);
-int ht_search(struct cloudfs_seg *segp, struct cloudfs_seg **found);
+int ht_search(struct cloudfs_seg *segp, struct cloudfs_seg *found);
+int ht_add_ref(struct cloudfs_seg *segp, int delta);
 void ht_destroy(void);
 #ifdef DEBUG
 void print_seg(struct cloudfs_seg *segp);
 #endif
-void ht_sync(struct cloudfs_seg *segp);
 
 #endif
 
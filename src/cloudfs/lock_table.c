@@ -0,0 +1,140 @@
+/**
+ * @file lock_table.c
+ * @brief Per-inode lock table of CloudFS.
+ *
+ *        When FUSE runs multithreaded, operations on the same file must not
+ *        interleave (a release may be replacing the proxy file while a read
+ *        is walking its segments), while operations on different files
+ *        should proceed in parallel. Every file is therefore protected by
+ *        its own mutex, looked up by inode number.
+ *
+ *        Locks are created on demand and reference counted, so the table
+ *        only holds entries for inodes that some thread is working on or
+ *        that are still opened (open_count).
+ *
+ * @author Yinsu Chu (yinsuc)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+// #define DEBUG
+#include "cloudfs.h"
+
+#include "lock_table.h"
+
+extern FILE *Log;
+
+static int Num_buckets;
+static struct inode_lock **Buckets;
+
+/* protects the bucket lists and reference counts, never held for long */
+static pthread_mutex_t Table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Initialize the lock table.
+ * @param num_buckets Number of hash buckets.
+ * @return 0 on success, -errno otherwise.
+ */
+int lock_table_init(int num_buckets)
+{
+  int retval = 0;
+
+  Num_buckets = num_buckets;
+  Buckets = (struct inode_lock **)
+    calloc(num_buckets, sizeof(struct inode_lock *));
+  if (Buckets == NULL) {
+    retval = cloudfs_error("lock_table_init");
+    return retval;
+  }
+
+  dbg_print("[DBG] lock_table_init(num_buckets=%d)=%d\n", num_buckets, retval);
+
+  return retval;
+}
+
+/**
+ * @brief Get the lock of an inode and lock it.
+ *        The lock is created if no other thread is holding
+ *        or waiting for it.
+ * @param ino Inode number of the file on SSD.
+ * @return The locked inode lock, NULL if out of memory.
+ */
+struct inode_lock *lock_table_acquire(ino_t ino)
+{
+  int bucket_id = ino % Num_buckets;
+  struct inode_lock *lk = NULL;
+
+  pthread_mutex_lock(&Table_lock);
+  for (lk = Buckets[bucket_id]; lk != NULL; lk = lk->next) {
+    if (lk->ino == ino) {
+      break;
+    }
+  }
+  if (lk == NULL) {
+    lk = (struct inode_lock *) malloc(sizeof(struct inode_lock));
+    if (lk == NULL) {
+      pthread_mutex_unlock(&Table_lock);
+      cloudfs_error("lock_table_acquire");
+      return NULL;
+    }
+    lk->ino = ino;
+    lk->ref_count = 0;
+    lk->open_count = 0;
+    pthread_mutex_init(&lk->mutex, NULL);
+    lk->next = Buckets[bucket_id];
+    Buckets[bucket_id] = lk;
+  }
+  lk->ref_count++;
+  pthread_mutex_unlock(&Table_lock);
+
+  pthread_mutex_lock(&lk->mutex);
+
+  dbg_print("[DBG] lock_table_acquire(ino=%lu)\n", (unsigned long) ino);
+
+  return lk;
+}
+
+/**
+ * @brief Unlock an inode lock and drop the reference to it.
+ *        The lock is freed when nobody else is using it
+ *        and the file is not opened.
+ * @param lk The lock returned by lock_table_acquire(), can be NULL.
+ * @return Void.
+ */
+void lock_table_release(struct inode_lock *lk)
+{
+  if (lk == NULL) {
+    return;
+  }
+
+  dbg_print("[DBG] lock_table_release(ino=%lu)\n", (unsigned long) lk->ino);
+
+  pthread_mutex_unlock(&lk->mutex);
+
+  pthread_mutex_lock(&Table_lock);
+  lk->ref_count--;
+  if ((lk->ref_count == 0) && (lk->open_count == 0)) {
+    struct inode_lock **pp = &Buckets[lk->ino % Num_buckets];
+    while (*pp != lk) {
+      pp = &((*pp)->next);
+    }
+    *pp = lk->next;
+    pthread_mutex_destroy(&lk->mutex);
+    free(lk);
+  }
+  pthread_mutex_unlock(&Table_lock);
+}
+
+/**
+ * @brief CloudFS should call this function upon exiting.
+ * @return Void.
+ */
+void lock_table_destroy(void)
+{
+  if (Buckets != NULL) {
+    free(Buckets);
+    Buckets = NULL;
+  }
+}
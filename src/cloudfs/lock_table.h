@@ -0,0 +1,21 @@
+#ifndef __LOCK_TABLE_H_
+#define __LOCK_TABLE_H_
+
+#include <pthread.h>
+#include <sys/types.h>
+
+/* a lock for one inode on SSD, shared by all threads working on it */
+struct inode_lock {
+  ino_t ino;
+  int ref_count;
+  int open_count; /* opened handles, only changed while holding "mutex" */
+  pthread_mutex_t mutex;
+  struct inode_lock *next;
+};
+
+int lock_table_init(int num_buckets);
+struct inode_lock *lock_table_acquire(ino_t ino);
+void lock_table_release(struct inode_lock *lk);
+void lock_table_destroy(void);
+
+#endif
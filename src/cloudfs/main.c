@@ -10,6 +10,9 @@
 #include <string.h>
 #include <strings.h>
 #include "cloudfs.h"
+#include "dedup.h"
+#include "fingerprint.h"
+#include "cache_policy.h"
 
 static void usageExit(FILE *out)
 {
@@ -27,9 +30,38 @@ static void usageExit(FILE *out)
       "Desired average segment size for deduplication(in KB)\n"
       "   -/--rabin-window-size: Size of the internal rolling window used for"
       "                           calculating Rabin fingerprint(in bytes)\n"
+      "   -C/--chunker         :  Chunking engine for deduplication, rabin"
+      " (default) or gear\n"
+      "   -F/--fingerprint     :  Fingerprint of new segments, sha256"
+      " (default) or md5\n"
       "   -/--no-cache        :  Turn off the file cache\n"
       "   -/--no-compress        :  Turn off the compression\n"
       "   -c/--cache-size      :  The maximum size of SSD cache(in KB)\n"
+      "   -E/--cache-policy    :  Cache replacement policy, refcount"
+      " (default), arc, 2q or tinylfu\n"
+      "   -I/--cache-mode      :  Whether downloaded segments keep their cloud"
+      " copy, exclusive (default), inclusive or auto\n"
+      "   -H/--evict-high      :  Percentage of the cache used that starts"
+      " background eviction, 0 (default) evicts on demand only\n"
+      "   -L/--evict-low       :  Percentage of the cache used background"
+      " eviction stops at, below --evict-high (default 80)\n"
+      "   -m/--multithread     :  Run FUSE in multithreaded mode\n"
+      "   -p/--prefetch-depth  :  Segments to prefetch ahead of a sequential"
+      " reader, 0 turns prefetching off\n"
+      "   -b/--prefetch-budget :  Maximum size of segments being prefetched"
+      "(in KB)\n"
+      "   -M/--migrate-threads :  Threads moving big files to the cloud"
+      " after close, 0 moves them during close\n"
+      "   -B/--store-size      :  Size of decompressed segments kept on SSD"
+      " for reuse after close(in KB)\n"
+      "   -P/--pipeline-workers:  Threads hashing and compressing segments"
+      " of uploaded files, 0 uses one per processor\n"
+      "   -U/--pipeline-puts   :  Segments of uploaded files PUT at the same"
+      " time\n"
+      "   -R/--filter-fpr      :  False-positive rate of the filter in front"
+      " of the dedup index, 0 turns the filter off\n"
+      "   -K/--filter-size     :  Maximum size of the filter in front of the"
+      " dedup index(in KB), 0 for no limit\n"
       "\n"
       " Commands (with <required parameters> and [optional parameters]) :\n"
       "\n");
@@ -46,9 +78,24 @@ static struct option longOptionsG[] =
   { "no-dedup",			no_argument,				0,  'd' },
   { "avg-seg-size",		required_argument,			0,  'S' },
   { "rabin-window-size",	required_argument,			0,  'w' },
+  { "chunker",			required_argument,			0,  'C' },
+  { "fingerprint",		required_argument,			0,  'F' },
   { "no-cache",			no_argument,				0,  'o' },
   { "no-compress",		no_argument,				0,  'z' },
   { "cache-size",			required_argument,			0,  'c' },
+  { "cache-policy",		required_argument,			0,  'E' },
+  { "cache-mode",		required_argument,			0,  'I' },
+  { "evict-high",		required_argument,			0,  'H' },
+  { "evict-low",		required_argument,			0,  'L' },
+  { "multithread",		no_argument,				0,  'm' },
+  { "prefetch-depth",		required_argument,			0,  'p' },
+  { "prefetch-budget",	required_argument,			0,  'b' },
+  { "migrate-threads",	required_argument,			0,  'M' },
+  { "store-size",		required_argument,			0,  'B' },
+  { "pipeline-workers",	required_argument,			0,  'P' },
+  { "pipeline-puts",		required_argument,			0,  'U' },
+  { "filter-fpr",		required_argument,			0,  'R' },
+  { "filter-size",		required_argument,			0,  'K' },
   { 0,					0,							0,   0	}
 };
 
@@ -67,15 +114,30 @@ static void parse_arguments(int argc, char* argv[],
   state->no_dedup = 0;
   state->avg_seg_size = 4096;
   state->rabin_window_size = 48;
+  state->chunker = CHUNKER_RABIN;
+  state->fingerprint = FP_SHA256;
 
   state->no_cache = 0;
   state->cache_size = 32*1024*1024;
+  state->cache_policy = CACHE_POLICY_REFCOUNT;
+  state->cache_mode = CACHE_MODE_EXCLUSIVE;
+  state->evict_high = 0;
+  state->evict_low = 80;
   state->no_compress = 0;
+  state->multithread = 0;
+  state->prefetch_depth = 0;
+  state->prefetch_budget = 8*1024*1024;
+  state->migrate_threads = 0;
+  state->store_size = 32*1024*1024;
+  state->pipeline_workers = 0;
+  state->pipeline_puts = 4;
+  state->filter_fpr = 0.01;
+  state->filter_size = 16*1024*1024;
 
   // Parse args
   while (1) {
     int idx = 0;
-    int c = getopt_long(argc, argv, "s:f:h:a:t:dS:w:oc:z:", longOptionsG, &idx);
+    int c = getopt_long(argc, argv, "s:f:h:a:t:dS:w:C:F:oc:E:I:H:L:z:mp:b:M:B:P:U:R:K:", longOptionsG, &idx);
 
     if (c == -1) {
       // End of options
@@ -110,21 +172,95 @@ static void parse_arguments(int argc, char* argv[],
       case 'w': 
         state->rabin_window_size = atoi(optarg);
         break;
+      case 'C':
+        state->chunker = chunker_type(optarg);
+        if (state->chunker < 0) {
+          fprintf(stderr, "\nERROR: Unknown chunker: %s\n", optarg);
+          usageExit(stderr);
+        }
+        break;
+      case 'F':
+        state->fingerprint = fp_type(optarg);
+        if (state->fingerprint < 0) {
+          fprintf(stderr, "\nERROR: Unknown fingerprint: %s\n", optarg);
+          usageExit(stderr);
+        }
+        break;
       case 'o':
         state->no_cache = 1;
         break;
       case 'c':
         state->cache_size = atoi(optarg)*1024;
         break;
+      case 'E':
+        state->cache_policy = cache_policy_type(optarg);
+        if (state->cache_policy < 0) {
+          fprintf(stderr, "\nERROR: Unknown cache policy: %s\n", optarg);
+          usageExit(stderr);
+        }
+        break;
+      case 'I':
+        state->cache_mode = cache_policy_mode(optarg);
+        if (state->cache_mode < 0) {
+          fprintf(stderr, "\nERROR: Unknown cache mode: %s\n", optarg);
+          usageExit(stderr);
+        }
+        break;
+      case 'H':
+        state->evict_high = atoi(optarg);
+        break;
+      case 'L':
+        state->evict_low = atoi(optarg);
+        break;
       case 'z':
         state->no_compress = 1;
         break;
+      case 'm':
+        state->multithread = 1;
+        break;
+      case 'p':
+        state->prefetch_depth = atoi(optarg);
+        break;
+      case 'b':
+        state->prefetch_budget = atoi(optarg)*1024;
+        break;
+      case 'M':
+        state->migrate_threads = atoi(optarg);
+        break;
+      case 'B':
+        state->store_size = atoi(optarg)*1024;
+        break;
+      case 'P':
+        state->pipeline_workers = atoi(optarg);
+        break;
+      case 'U':
+        state->pipeline_puts = atoi(optarg);
+        break;
+      case 'R':
+        state->filter_fpr = atof(optarg);
+        if ((state->filter_fpr < 0) || (state->filter_fpr >= 1)) {
+          fprintf(stderr, "\nERROR: Invalid false-positive rate: %s\n",
+              optarg);
+          usageExit(stderr);
+        }
+        break;
+      case 'K':
+        state->filter_size = atol(optarg)*1024;
+        break;
       default:
         fprintf(stderr, "\nERROR: Unknown option: -%c\n", c);
         // Usage exit
         usageExit(stderr);
     }
   }
+
+  if ((state->evict_high < 0) || (state->evict_high > 100)
+      || ((state->evict_high > 0) && ((state->evict_low < 0)
+          || (state->evict_low >= state->evict_high)))) {
+    fprintf(stderr, "\nERROR: Invalid watermarks: %d%% and %d%%\n",
+        state->evict_high, state->evict_low);
+    usageExit(stderr);
+  }
 }
 
 // main ------------------------------------------------------------------------
@@ -0,0 +1,467 @@
+/**
+ * @file migrate.c
+ * @brief Asynchronous migration of files from SSD to the cloud.
+ *
+ *        When a file on SSD grows beyond the threshold, cloudfs_release()
+ *        only records an intent to migrate it and returns; a pool of
+ *        threads does the uploading afterwards. Until a migration is
+ *        complete the file stays local, so it is read from SSD as usual.
+ *
+ *        An intent is a small file in the migration directory, named by a
+ *        sequence number and holding the CloudFS path of the file. It is
+ *        synced to disk before release returns and removed once the
+ *        migration is done, so intents left by a crash are replayed in
+ *        order on the next mount.
+ *
+ *        The actual work is done by a callback from CloudFS. A file opened
+ *        for writing while it is being migrated is marked as changed, the
+ *        callback checks this before switching the file to the cloud and
+ *        gives up if so; the release of the writer records a new intent.
+ *
+ * @author Yinsu Chu (yinsuc)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// #define DEBUG
+#include "cloudfs.h"
+
+#include "migrate.h"
+
+extern FILE *Log;
+
+/* a file to migrate */
+struct migrate_job {
+  char path[MAX_PATH_LEN];
+  long seq; /* sequence number, also the name of the intent */
+  int changed; /* opened for writing while being migrated */
+  struct migrate_job *next;
+};
+
+static char Dir[MAX_PATH_LEN];
+static long Next_seq;
+static migrate_fn_t Migrate_fn;
+static int Num_threads;
+static pthread_t Threads[MIGRATE_MAX_THREADS];
+static int Stopping;
+
+static struct migrate_job *Queue_head;
+static struct migrate_job *Queue_tail;
+static struct migrate_job *Running; /* jobs taken by the threads */
+
+/* protects everything above */
+static pthread_mutex_t Migrate_lock = PTHREAD_MUTEX_INITIALIZER;
+/* signaled when a job is queued or completes, or the threads should exit */
+static pthread_cond_t Migrate_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Get the pathname of an intent.
+ * @param seq Sequence number of the intent.
+ * @param ipath The pathname is returned here. It should have
+ *              at least MAX_PATH_LEN bytes.
+ * @return Void.
+ */
+static void migrate_get_intent(long seq, char *ipath)
+{
+  snprintf(ipath, MAX_PATH_LEN, "%s/%ld", Dir, seq);
+}
+
+/**
+ * @brief Durably record an intent.
+ * @param path CloudFS path of the file to migrate.
+ * @param seq Sequence number of the intent.
+ * @return 0 on success, -errno otherwise.
+ */
+static int migrate_write_intent(const char *path, long seq)
+{
+  int retval = 0;
+  char ipath[MAX_PATH_LEN] = "";
+  migrate_get_intent(seq, ipath);
+
+  int fd = open(ipath, O_WRONLY | O_CREAT | O_TRUNC, DEFAULT_FILE_MODE);
+  if (fd < 0) {
+    retval = cloudfs_error("migrate_write_intent");
+    return retval;
+  }
+  size_t len = strlen(path);
+  if ((write(fd, path, len) != (ssize_t) len) || (fsync(fd) < 0)) {
+    retval = cloudfs_error("migrate_write_intent");
+  }
+  close(fd);
+
+  /* the new directory entry must be durable as well */
+  int dfd = open(Dir, O_RDONLY);
+  if (dfd >= 0) {
+    fsync(dfd);
+    close(dfd);
+  }
+
+  if (retval < 0) {
+    unlink(ipath);
+  }
+
+  dbg_print("[DBG] migrate_write_intent(path=\"%s\", seq=%ld)=%d\n",
+      path, seq, retval);
+
+  return retval;
+}
+
+/**
+ * @brief Append a job to the queue, the caller holds Migrate_lock.
+ * @param path CloudFS path of the file to migrate.
+ * @param seq Sequence number of its intent.
+ * @return 0 on success, -errno otherwise.
+ */
+static int migrate_enqueue(const char *path, long seq)
+{
+  int retval = 0;
+
+  struct migrate_job *job =
+    (struct migrate_job *) malloc(sizeof(struct migrate_job));
+  if (job == NULL) {
+    retval = cloudfs_error("migrate_enqueue");
+    return retval;
+  }
+  strncpy(job->path, path, MAX_PATH_LEN);
+  job->path[MAX_PATH_LEN - 1] = '\0';
+  job->seq = seq;
+  job->changed = 0;
+  job->next = NULL;
+
+  if (Queue_tail == NULL) {
+    Queue_head = job;
+  } else {
+    Queue_tail->next = job;
+  }
+  Queue_tail = job;
+  pthread_cond_broadcast(&Migrate_cond);
+
+  return retval;
+}
+
+/**
+ * @brief Find the job of a file in a list.
+ * @param list The list.
+ * @param path CloudFS path of the file.
+ * @return The job, NULL if not found.
+ */
+static struct migrate_job *migrate_find(struct migrate_job *list,
+    const char *path)
+{
+  struct migrate_job *job = NULL;
+  for (job = list; job != NULL; job = job->next) {
+    if (strcmp(job->path, path) == 0) {
+      break;
+    }
+  }
+  return job;
+}
+
+/**
+ * @brief Take the first queued job whose file is not being migrated by
+ *        another thread, the caller holds Migrate_lock.
+ * @return The job, NULL if there is none.
+ */
+static struct migrate_job *migrate_take(void)
+{
+  struct migrate_job **pp = &Queue_head;
+  struct migrate_job *prev = NULL;
+
+  while (*pp != NULL) {
+    struct migrate_job *job = *pp;
+    if (migrate_find(Running, job->path) == NULL) {
+      *pp = job->next;
+      if (Queue_tail == job) {
+        Queue_tail = prev;
+      }
+      job->next = Running;
+      Running = job;
+      return job;
+    }
+    prev = job;
+    pp = &(job->next);
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief Main loop of a migration thread.
+ *        Queued jobs are drained before the thread exits.
+ * @param arg Unused.
+ * @return NULL.
+ */
+static void *migrate_worker(void *arg)
+{
+  (void) arg;
+
+  pthread_mutex_lock(&Migrate_lock);
+  while (1) {
+    struct migrate_job *job = migrate_take();
+    if (job == NULL) {
+      if (Stopping && (Queue_head == NULL)) {
+        break;
+      }
+      pthread_cond_wait(&Migrate_cond, &Migrate_lock);
+      continue;
+    }
+    pthread_mutex_unlock(&Migrate_lock);
+
+    dbg_print("[DBG] migrating %s\n", job->path);
+    int retval = Migrate_fn(job->path);
+    if (retval < 0) {
+      /* keep the intent, it is retried on next mount */
+      dbg_print("[ERR] failed to migrate %s, error %d\n", job->path, retval);
+    } else {
+      char ipath[MAX_PATH_LEN] = "";
+      migrate_get_intent(job->seq, ipath);
+      unlink(ipath);
+    }
+
+    pthread_mutex_lock(&Migrate_lock);
+    struct migrate_job **pp = &Running;
+    while (*pp != job) {
+      pp = &((*pp)->next);
+    }
+    *pp = job->next;
+    free(job);
+    pthread_cond_broadcast(&Migrate_cond);
+  }
+  pthread_mutex_unlock(&Migrate_lock);
+
+  return NULL;
+}
+
+/**
+ * @brief Order two sequence numbers, for qsort().
+ * @param a Pointer to the first one.
+ * @param b Pointer to the second one.
+ * @return Negative, zero or positive.
+ */
+static int migrate_cmp_seq(const void *a, const void *b)
+{
+  long sa = *(const long *) a;
+  long sb = *(const long *) b;
+  return (sa > sb) - (sa < sb);
+}
+
+/**
+ * @brief Queue the intents left in the migration directory.
+ * @return 0 on success, -errno otherwise.
+ */
+static int migrate_replay(void)
+{
+  int retval = 0;
+
+  DIR *dirp = opendir(Dir);
+  if (dirp == NULL) {
+    retval = cloudfs_error("migrate_replay");
+    return retval;
+  }
+
+  int num = 0;
+  long *seqs = NULL;
+  struct dirent *entry = NULL;
+  while ((entry = readdir(dirp)) != NULL) {
+    char *end = NULL;
+    long seq = strtol(entry->d_name, &end, 10);
+    if ((entry->d_name[0] == '\0') || (*end != '\0')) {
+      continue;
+    }
+    long *enlarge = (long *) realloc(seqs, (num + 1) * sizeof(long));
+    if (enlarge == NULL) {
+      retval = cloudfs_error("migrate_replay");
+      break;
+    }
+    seqs = enlarge;
+    seqs[num++] = seq;
+  }
+  closedir(dirp);
+
+  qsort(seqs, num, sizeof(long), migrate_cmp_seq);
+
+  int i = 0;
+  for (i = 0; (i < num) && (retval == 0); i++) {
+    char ipath[MAX_PATH_LEN] = "";
+    char path[MAX_PATH_LEN] = "";
+    migrate_get_intent(seqs[i], ipath);
+
+    int fd = open(ipath, O_RDONLY);
+    if (fd < 0) {
+      continue;
+    }
+    ssize_t len = read(fd, path, MAX_PATH_LEN - 1);
+    close(fd);
+    if (len <= 0) {
+      unlink(ipath);
+      continue;
+    }
+    path[len] = '\0';
+
+    dbg_print("[DBG] replaying intent %ld for %s\n", seqs[i], path);
+    retval = migrate_enqueue(path, seqs[i]);
+    if (seqs[i] >= Next_seq) {
+      Next_seq = seqs[i] + 1;
+    }
+  }
+  free(seqs);
+
+  return retval;
+}
+
+/**
+ * @brief Initialize asynchronous migration.
+ *        Intents left from the last mount are queued again.
+ * @param dir The directory to keep intents in, created if missing.
+ * @param num_threads Number of migration threads.
+ * @param fn The function that migrates a file.
+ * @return 0 on success, -errno otherwise.
+ */
+int migrate_init(char *dir, int num_threads, migrate_fn_t fn)
+{
+  int retval = 0;
+
+  strncpy(Dir, dir, MAX_PATH_LEN);
+  Dir[MAX_PATH_LEN - 1] = '\0';
+  Migrate_fn = fn;
+  Next_seq = 0;
+
+  if ((mkdir(Dir, DEFAULT_DIR_MODE) < 0) && (errno != EEXIST)) {
+    retval = cloudfs_error("migrate_init");
+    return retval;
+  }
+
+  pthread_mutex_lock(&Migrate_lock);
+  retval = migrate_replay();
+  pthread_mutex_unlock(&Migrate_lock);
+  if (retval < 0) {
+    return retval;
+  }
+
+  if (num_threads > MIGRATE_MAX_THREADS) {
+    num_threads = MIGRATE_MAX_THREADS;
+  }
+  int i = 0;
+  for (i = 0; i < num_threads; i++) {
+    retval = pthread_create(&Threads[i], NULL, migrate_worker, NULL);
+    if (retval != 0) {
+      retval = -retval;
+      break;
+    }
+    Num_threads++;
+  }
+
+  dbg_print("[DBG] migrate_init(dir=\"%s\", num_threads=%d)=%d\n",
+      dir, num_threads, retval);
+
+  return retval;
+}
+
+/**
+ * @brief CloudFS should call this function upon exiting.
+ *        It returns after all queued migrations are done.
+ * @return Void.
+ */
+void migrate_destroy(void)
+{
+  pthread_mutex_lock(&Migrate_lock);
+  Stopping = 1;
+  pthread_cond_broadcast(&Migrate_cond);
+  pthread_mutex_unlock(&Migrate_lock);
+
+  int i = 0;
+  for (i = 0; i < Num_threads; i++) {
+    pthread_join(Threads[i], NULL);
+  }
+  Num_threads = 0;
+
+  /* only left if the threads could not be started,
+   * the intents are still there for the next mount */
+  while (Queue_head != NULL) {
+    struct migrate_job *job = Queue_head;
+    Queue_head = job->next;
+    free(job);
+  }
+  Queue_tail = NULL;
+}
+
+/**
+ * @brief Record an intent to migrate a file and queue it.
+ *        Nothing is recorded if the file is queued already.
+ * @param path CloudFS path of the file.
+ * @return 0 on success, -errno otherwise.
+ */
+int migrate_submit(const char *path)
+{
+  int retval = 0;
+
+  pthread_mutex_lock(&Migrate_lock);
+  if (migrate_find(Queue_head, path) != NULL) {
+    pthread_mutex_unlock(&Migrate_lock);
+    return retval;
+  }
+  long seq = Next_seq++;
+  pthread_mutex_unlock(&Migrate_lock);
+
+  retval = migrate_write_intent(path, seq);
+  if (retval < 0) {
+    return retval;
+  }
+
+  pthread_mutex_lock(&Migrate_lock);
+  retval = migrate_enqueue(path, seq);
+  pthread_mutex_unlock(&Migrate_lock);
+
+  dbg_print("[DBG] migrate_submit(path=\"%s\")=%d\n", path, retval);
+
+  return retval;
+}
+
+/**
+ * @brief Mark a file being migrated as changed.
+ *        CloudFS calls this when the file is opened for writing.
+ * @param path CloudFS path of the file.
+ * @return Void.
+ */
+void migrate_invalidate(const char *path)
+{
+  if (Num_threads == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&Migrate_lock);
+  struct migrate_job *job = migrate_find(Running, path);
+  if (job != NULL) {
+    dbg_print("[DBG] %s opened for writing while being migrated\n", path);
+    job->changed = 1;
+  }
+  pthread_mutex_unlock(&Migrate_lock);
+}
+
+/**
+ * @brief Check whether a file being migrated has changed.
+ * @param path CloudFS path of the file.
+ * @return 1 if it has, 0 otherwise.
+ */
+int migrate_changed(const char *path)
+{
+  int retval = 0;
+
+  pthread_mutex_lock(&Migrate_lock);
+  struct migrate_job *job = migrate_find(Running, path);
+  if (job != NULL) {
+    retval = job->changed;
+  }
+  pthread_mutex_unlock(&Migrate_lock);
+
+  return retval;
+}
@@ -0,0 +1,17 @@
+#ifndef __MIGRATE_H_
+#define __MIGRATE_H_
+
+/* upper limit of migration threads */
+#define MIGRATE_MAX_THREADS (8)
+
+/* moves the file at a CloudFS path to the cloud,
+ * returns 0 when done (or nothing to do), -errno to retry on next mount */
+typedef int (*migrate_fn_t)(const char *path);
+
+int migrate_init(char *dir, int num_threads, migrate_fn_t fn);
+void migrate_destroy(void);
+int migrate_submit(const char *path);
+void migrate_invalidate(const char *path);
+int migrate_changed(const char *path);
+
+#endif
@@ -0,0 +1,700 @@
+/**
+ * @file pipeline.c
+ * @brief Staged upload pipeline of the dedup layer.
+ *
+ *        Uploading a big file used to be strictly sequential: segment the
+ *        whole file, then for each segment reopen the file, compress the
+ *        segment and PUT it. Here the work is split into stages connected
+ *        by bounded queues, so that they overlap:
+ *
+ *          reader -> chunker -> workers -> uploaders
+ *
+ *        1) The reader (the calling thread) streams the file in big aligned
+ *           blocks, telling the kernel the file is read sequentially.
+ *        2) The chunker runs the chunking engine over the blocks in one
+ *           pass and emits the segments in file order. A segment lying in
+ *           one block is not copied, it points into the block, which is
+ *           freed once all such segments are stored; only the few segments
+ *           crossing a block boundary are copied.
+ *        3) A pool of workers fingerprints each segment in place
+ *           and, unless the segment is stored already, compresses it in
+ *           memory.
+ *        4) A pool of uploaders stores the segments, so several PUTs are in
+ *           flight at the same time.
+ *
+ *        The queues are bounded, so the memory held by a run does not
+ *        depend on the size of the file. When any stage fails, the others
+ *        drain their queues without doing any more work, and the segments
+ *        stored so far are unstored.
+ *
+ * @author Yinsu Chu (yinsuc)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// #define DEBUG
+#include "cloudfs.h"
+
+#include "dedup.h"
+#include "compress_layer.h"
+#include "proxy.h"
+#include "dedup_layer.h"
+#include "pipeline.h"
+#include "fingerprint.h"
+
+/* size and alignment of the blocks read from the file */
+#define BLOCK_LEN (1024 * 1024)
+#define BLOCK_ALIGN (4096)
+
+/* capacity of the queues */
+#define BLOCK_QUEUE_LEN (4)
+#define SEGS_PER_WORKER (4)
+#define SEGS_PER_PUT (4)
+
+extern FILE *Log;
+
+static int Workers;
+static int Puts;
+
+/* a bounded queue between two stages */
+struct pipeline_queue {
+  struct pipeline_seg *head;
+  struct pipeline_seg *tail;
+  int len;
+  int cap;
+  int closed; /* no more items will be pushed */
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+};
+
+/* state of one run, i.e. the upload of one file */
+struct pipeline {
+  chunker_t *ck;
+  struct pipeline_ops *ops;
+  struct pipeline_queue blocks; /* reader -> chunker */
+  struct pipeline_queue segs; /* chunker -> workers */
+  struct pipeline_queue uploads; /* workers -> uploaders */
+  struct pipeline_seg *first; /* all the segments in file order, */
+  struct pipeline_seg *last; /* only touched by the chunker until the end */
+  int num_seg;
+  int workers_left;
+  int failed; /* the first error, 0 if none */
+  /* protects the queues, workers_left, failed and the refs of blocks */
+  pthread_mutex_t lock;
+};
+
+/**
+ * @brief Initialize the pipeline.
+ * @param workers Number of hashing/compressing workers, 0 to use one per
+ *                online processor.
+ * @param puts Number of PUTs in flight.
+ * @return 0 on success, -errno otherwise.
+ */
+int pipeline_init(int workers, int puts)
+{
+  int retval = 0;
+
+  if (workers <= 0) {
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (workers <= 0) {
+    workers = 1;
+  }
+  if (workers > PIPELINE_MAX_WORKERS) {
+    workers = PIPELINE_MAX_WORKERS;
+  }
+  if (puts <= 0) {
+    puts = 1;
+  }
+  if (puts > PIPELINE_MAX_PUTS) {
+    puts = PIPELINE_MAX_PUTS;
+  }
+  Workers = workers;
+  Puts = puts;
+
+  dbg_print("[DBG] pipeline_init(workers=%d, puts=%d)=%d\n", Workers, Puts,
+      retval);
+
+  return retval;
+}
+
+/**
+ * @brief Initialize an empty queue.
+ * @param q The queue.
+ * @param cap Capacity of the queue.
+ * @return Void.
+ */
+static void pipeline_queue_init(struct pipeline_queue *q, int cap)
+{
+  memset(q, 0, sizeof(struct pipeline_queue));
+  q->cap = cap;
+  pthread_cond_init(&q->not_empty, NULL);
+  pthread_cond_init(&q->not_full, NULL);
+}
+
+/**
+ * @brief Destroy a drained queue.
+ * @param q The queue.
+ * @return Void.
+ */
+static void pipeline_queue_destroy(struct pipeline_queue *q)
+{
+  pthread_cond_destroy(&q->not_empty);
+  pthread_cond_destroy(&q->not_full);
+}
+
+/**
+ * @brief Drop a reference on a block, it is freed with the last one.
+ *        The caller holds the lock of the run.
+ * @param block The block.
+ * @return Void.
+ */
+static void pipeline_put_block(struct pipeline_seg *block)
+{
+  if (--block->refs == 0) {
+    free(block->data);
+    free(block);
+  }
+}
+
+/**
+ * @brief Drop the data of a segment, along with its compressed form.
+ *        The caller holds the lock of the run.
+ * @param ps The segment.
+ * @return Void.
+ */
+static void pipeline_drop_data(struct pipeline_seg *ps)
+{
+  if (ps->block != NULL) {
+    pipeline_put_block(ps->block);
+    ps->block = NULL;
+  } else {
+    free(ps->data);
+  }
+  ps->data = NULL;
+  free(ps->comp);
+  ps->comp = NULL;
+}
+
+/**
+ * @brief Record a failure, so that all the stages wind down.
+ *        The caller holds the lock of the run.
+ * @param pl The run.
+ * @param error The error, negative.
+ * @return Void.
+ */
+static void pipeline_fail(struct pipeline *pl, int error)
+{
+  if (pl->failed == 0) {
+    pl->failed = (error < 0) ? error : -EIO;
+  }
+  /* producers stop waiting for room once the run has failed */
+  pthread_cond_broadcast(&pl->blocks.not_full);
+  pthread_cond_broadcast(&pl->segs.not_full);
+  pthread_cond_broadcast(&pl->uploads.not_full);
+}
+
+/**
+ * @brief Push an item, waiting for room unless the run has failed.
+ *        The caller holds the lock of the run.
+ * @param pl The run.
+ * @param q The queue.
+ * @param ps The item.
+ * @return Void.
+ */
+static void pipeline_push(struct pipeline *pl, struct pipeline_queue *q,
+    struct pipeline_seg *ps)
+{
+  while ((q->len >= q->cap) && (pl->failed == 0)) {
+    pthread_cond_wait(&q->not_full, &pl->lock);
+  }
+  ps->next = NULL;
+  if (q->tail == NULL) {
+    q->head = ps;
+  } else {
+    q->tail->next = ps;
+  }
+  q->tail = ps;
+  q->len++;
+  pthread_cond_signal(&q->not_empty);
+}
+
+/**
+ * @brief Pop an item, waiting for one unless the queue is closed.
+ *        The caller holds the lock of the run.
+ * @param pl The run.
+ * @param q The queue.
+ * @return The item, NULL if the queue is closed and empty.
+ */
+static struct pipeline_seg *pipeline_pop(struct pipeline *pl,
+    struct pipeline_queue *q)
+{
+  while ((q->head == NULL) && !q->closed) {
+    pthread_cond_wait(&q->not_empty, &pl->lock);
+  }
+  struct pipeline_seg *ps = q->head;
+  if (ps != NULL) {
+    q->head = ps->next;
+    if (q->head == NULL) {
+      q->tail = NULL;
+    }
+    q->len--;
+    pthread_cond_signal(&q->not_full);
+  }
+  return ps;
+}
+
+/**
+ * @brief Close a queue, consumers get NULL once it is drained.
+ *        The caller holds the lock of the run.
+ * @param q The queue.
+ * @return Void.
+ */
+static void pipeline_close(struct pipeline_queue *q)
+{
+  q->closed = 1;
+  pthread_cond_broadcast(&q->not_empty);
+}
+
+/**
+ * @brief Hand a complete segment from the chunker to the workers.
+ * @param pl The run.
+ * @param data The segment.
+ * @param len Length of the segment.
+ * @param offset Offset of the segment in the file.
+ * @param block The block "data" points into, NULL if "data" is allocated
+ *              and owned by the pipeline from now on.
+ * @return 0 on success, -errno otherwise.
+ */
+static int pipeline_emit(struct pipeline *pl, char *data, long len,
+    long offset, struct pipeline_seg *block)
+{
+  int retval = 0;
+
+  struct pipeline_seg *ps =
+    (struct pipeline_seg *) calloc(1, sizeof(struct pipeline_seg));
+  if (ps == NULL) {
+    retval = cloudfs_error("pipeline_emit");
+    if (block == NULL) {
+      free(data);
+    }
+    return retval;
+  }
+  ps->seg.ref_count = 1;
+  ps->seg.seg_size = len;
+  ps->offset = offset;
+  ps->data = data;
+  ps->len = len;
+
+  if (pl->last == NULL) {
+    pl->first = ps;
+  } else {
+    pl->last->order = ps;
+  }
+  pl->last = ps;
+  pl->num_seg++;
+
+  pthread_mutex_lock(&pl->lock);
+  if (block != NULL) {
+    ps->block = block;
+    block->refs++;
+  }
+  pipeline_push(pl, &pl->segs, ps);
+  pthread_mutex_unlock(&pl->lock);
+
+  dbg_print("[DBG] segment of %ld bytes at offset %ld emitted\n", len,
+      offset);
+
+  return retval;
+}
+
+/**
+ * @brief Append bytes to a segment being copied.
+ * @param buf The copy, (re-)allocated here.
+ * @param len Length of the copy, updated here.
+ * @param src The bytes to append.
+ * @param n Number of bytes to append.
+ * @return 0 on success, -errno otherwise.
+ */
+static int pipeline_append(char **buf, long *len, const char *src, long n)
+{
+  int retval = 0;
+
+  if (n == 0) {
+    return retval;
+  }
+  char *enlarge = (char *) realloc(*buf, *len + n);
+  if (enlarge == NULL) {
+    retval = cloudfs_error("pipeline_append");
+    return retval;
+  }
+  memcpy(enlarge + *len, src, n);
+  *buf = enlarge;
+  *len += n;
+
+  return retval;
+}
+
+/**
+ * @brief Main loop of the chunker.
+ *        The segments are cut the same way as before the pipeline existed
+ *        (reference: dedup-lib/rabin-example.c), including a last segment
+ *        for the tail of the file, which may be empty.
+ * @param arg The run.
+ * @return NULL.
+ */
+static void *pipeline_chunker(void *arg)
+{
+  struct pipeline *pl = (struct pipeline *) arg;
+  int retval = 0;
+
+  /* the part of the current segment in earlier blocks, copied */
+  char *carry = NULL;
+  long carry_len = 0;
+  long offset = 0;
+
+  pthread_mutex_lock(&pl->lock);
+  struct pipeline_seg *block = NULL;
+  while ((block = pipeline_pop(pl, &pl->blocks)) != NULL) {
+    int failed = pl->failed;
+    pthread_mutex_unlock(&pl->lock);
+
+    char *start = block->data; /* the current segment in this block */
+    char *buftoread = block->data;
+    long bytes = block->len;
+    int new_segment = 0;
+    int len = 0;
+    while (!failed && (retval == 0) && (bytes > 0) &&
+        ((len = chunker_next(pl->ck, buftoread, bytes,
+                                   &new_segment)) > 0)) {
+      buftoread += len;
+      bytes -= len;
+
+      if (new_segment) {
+        if (carry == NULL) {
+          retval = pipeline_emit(pl, start, buftoread - start, offset, block);
+          offset += buftoread - start;
+        } else {
+          retval = pipeline_append(&carry, &carry_len, start,
+              buftoread - start);
+          if (retval == 0) {
+            retval = pipeline_emit(pl, carry, carry_len, offset, NULL);
+            offset += carry_len;
+            carry = NULL;
+          }
+        }
+        carry_len = 0;
+        start = buftoread;
+      }
+    }
+    if (len == -1) {
+      dbg_print("[ERR] failed to process the segment\n");
+      retval = -EIO;
+    }
+    if (!failed && (retval == 0)) {
+      retval = pipeline_append(&carry, &carry_len, start, buftoread - start);
+    }
+
+    pthread_mutex_lock(&pl->lock);
+    pipeline_put_block(block);
+    if (retval < 0) {
+      pipeline_fail(pl, retval);
+      retval = 0;
+    }
+  }
+
+  /* the tail of the file */
+  if (pl->failed == 0) {
+    pthread_mutex_unlock(&pl->lock);
+    if (carry == NULL) {
+      carry = (char *) malloc(1);
+    }
+    if (carry == NULL) {
+      retval = cloudfs_error("pipeline_chunker");
+    } else {
+      retval = pipeline_emit(pl, carry, carry_len, offset, NULL);
+    }
+    carry = NULL;
+    pthread_mutex_lock(&pl->lock);
+    if (retval < 0) {
+      pipeline_fail(pl, retval);
+    }
+  }
+  pipeline_close(&pl->segs);
+  pthread_mutex_unlock(&pl->lock);
+
+  free(carry);
+
+  return NULL;
+}
+
+/**
+ * @brief Main loop of a worker, which hashes and compresses segments.
+ * @param arg The run.
+ * @return NULL.
+ */
+static void *pipeline_worker(void *arg)
+{
+  struct pipeline *pl = (struct pipeline *) arg;
+
+  pthread_mutex_lock(&pl->lock);
+  struct pipeline_seg *ps = NULL;
+  while ((ps = pipeline_pop(pl, &pl->segs)) != NULL) {
+    int failed = pl->failed;
+    pthread_mutex_unlock(&pl->lock);
+
+    long retval = 0;
+    if (!failed) {
+      unsigned char digest[FP_MAX_DIGEST_LEN];
+      fp_digest(fp_default(), ps->data, ps->len, digest);
+      fp_key(fp_default(), digest, ps->seg.key);
+
+      /* a segment stored already is only referenced again */
+      if (!pl->ops->is_stored(&ps->seg)) {
+        retval = compress_layer_compress_buf(ps->data, ps->len, &ps->comp);
+        if (retval >= 0) {
+          ps->comp_len = retval;
+        }
+      }
+    }
+
+    pthread_mutex_lock(&pl->lock);
+    if (retval < 0) {
+      pipeline_fail(pl, retval);
+    }
+    pipeline_push(pl, &pl->uploads, ps);
+  }
+  if (--pl->workers_left == 0) {
+    pipeline_close(&pl->uploads);
+  }
+  pthread_mutex_unlock(&pl->lock);
+
+  return NULL;
+}
+
+/**
+ * @brief Main loop of an uploader, which stores segments.
+ * @param arg The run.
+ * @return NULL.
+ */
+static void *pipeline_uploader(void *arg)
+{
+  struct pipeline *pl = (struct pipeline *) arg;
+
+  pthread_mutex_lock(&pl->lock);
+  struct pipeline_seg *ps = NULL;
+  while ((ps = pipeline_pop(pl, &pl->uploads)) != NULL) {
+    int failed = pl->failed;
+    pthread_mutex_unlock(&pl->lock);
+
+    int retval = 0;
+    if (!failed) {
+      retval = pl->ops->store(ps);
+      if (retval == 0) {
+        ps->stored = 1;
+      }
+    }
+    pthread_mutex_lock(&pl->lock);
+    /* only the descriptor is kept until the end of the run */
+    pipeline_drop_data(ps);
+    if (retval < 0) {
+      pipeline_fail(pl, retval);
+    }
+  }
+  pthread_mutex_unlock(&pl->lock);
+
+  return NULL;
+}
+
+/**
+ * @brief Read a file into the pipeline, block by block.
+ * @param pl The run.
+ * @param fd Descriptor of the file.
+ * @return Void. Errors are recorded in the run.
+ */
+static void pipeline_read(struct pipeline *pl, int fd)
+{
+  int retval = 0;
+
+  while (1) {
+    pthread_mutex_lock(&pl->lock);
+    int failed = pl->failed;
+    pthread_mutex_unlock(&pl->lock);
+    if (failed) {
+      break;
+    }
+
+    struct pipeline_seg *block =
+      (struct pipeline_seg *) calloc(1, sizeof(struct pipeline_seg));
+    if (block == NULL) {
+      retval = cloudfs_error("pipeline_read");
+      break;
+    }
+    retval = -posix_memalign((void **) &block->data, BLOCK_ALIGN, BLOCK_LEN);
+    if (retval < 0) {
+      free(block);
+      break;
+    }
+    block->refs = 1;
+
+    /* a short read only happens at the end of the file */
+    long len = 0;
+    ssize_t bytes = 0;
+    while ((len < BLOCK_LEN) &&
+        ((bytes = read(fd, block->data + len, BLOCK_LEN - len)) > 0)) {
+      len += bytes;
+    }
+    if ((bytes < 0) || (len == 0)) {
+      if (bytes < 0) {
+        retval = cloudfs_error("pipeline_read");
+      }
+      free(block->data);
+      free(block);
+      break;
+    }
+    block->len = len;
+
+    pthread_mutex_lock(&pl->lock);
+    pipeline_push(pl, &pl->blocks, block);
+    pthread_mutex_unlock(&pl->lock);
+  }
+
+  pthread_mutex_lock(&pl->lock);
+  if (retval < 0) {
+    pipeline_fail(pl, retval);
+  }
+  pipeline_close(&pl->blocks);
+  pthread_mutex_unlock(&pl->lock);
+}
+
+/**
+ * @brief Segment a file and store all its segments.
+ * @param fpath Pathname of the file.
+ * @param ck Chunking engine, fresh for this file.
+ * @param ops How to store the segments.
+ * @param num_seg Return the number of segments here.
+ * @param segs Return the segments in file order here, each with ref_count 1.
+ *             It must be freed by the caller of this function.
+ * @return 0 on success, -errno otherwise. On failure no segment is left
+ *         stored.
+ */
+int pipeline_run(char *fpath, chunker_t *ck, struct pipeline_ops *ops,
+    int *num_seg, struct cloudfs_seg **segs)
+{
+  int retval = 0;
+  int i = 0;
+
+  int fd = open(fpath, O_RDONLY);
+  if (fd < 0) {
+    retval = cloudfs_error("pipeline_run");
+    return retval;
+  }
+  dbg_print("[DBG] segmenting file %s\n", fpath);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  struct pipeline pl;
+  memset(&pl, 0, sizeof(struct pipeline));
+  pl.ck = ck;
+  pl.ops = ops;
+  pipeline_queue_init(&pl.blocks, BLOCK_QUEUE_LEN);
+  pipeline_queue_init(&pl.segs, Workers * SEGS_PER_WORKER);
+  pipeline_queue_init(&pl.uploads, Puts * SEGS_PER_PUT);
+  pthread_mutex_init(&pl.lock, NULL);
+
+  pthread_t chunker;
+  pthread_t workers[PIPELINE_MAX_WORKERS];
+  pthread_t uploaders[PIPELINE_MAX_PUTS];
+  int has_chunker = 0;
+  int num_workers = 0;
+  int num_uploaders = 0;
+
+  pthread_mutex_lock(&pl.lock);
+  if (pthread_create(&chunker, NULL, pipeline_chunker, &pl) == 0) {
+    has_chunker = 1;
+  }
+  for (i = 0; i < Workers; i++) {
+    if (pthread_create(&workers[num_workers], NULL, pipeline_worker,
+          &pl) == 0) {
+      num_workers++;
+    }
+  }
+  for (i = 0; i < Puts; i++) {
+    if (pthread_create(&uploaders[num_uploaders], NULL, pipeline_uploader,
+          &pl) == 0) {
+      num_uploaders++;
+    }
+  }
+  pl.workers_left = num_workers;
+  if (!has_chunker || (num_workers == 0) || (num_uploaders == 0)) {
+    dbg_print("[ERR] failed to start the pipeline\n");
+    pipeline_fail(&pl, -EAGAIN);
+    /* close the queues of the stages that are missing */
+    if (!has_chunker) {
+      pipeline_close(&pl.segs);
+    }
+    if (num_workers == 0) {
+      pipeline_close(&pl.uploads);
+    }
+  }
+  pthread_mutex_unlock(&pl.lock);
+
+  pipeline_read(&pl, fd);
+
+  if (has_chunker) {
+    pthread_join(chunker, NULL);
+  }
+  for (i = 0; i < num_workers; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  for (i = 0; i < num_uploaders; i++) {
+    pthread_join(uploaders[i], NULL);
+  }
+
+  /* nothing is queued now, unless a stage failed to start */
+  struct pipeline_seg *ps = NULL;
+  while ((ps = pl.blocks.head) != NULL) {
+    pl.blocks.head = ps->next;
+    pipeline_put_block(ps);
+  }
+  retval = pl.failed;
+
+  *segs = NULL;
+  if (retval == 0) {
+    *segs = (struct cloudfs_seg *)
+      malloc(pl.num_seg * sizeof(struct cloudfs_seg));
+    if (*segs == NULL) {
+      retval = cloudfs_error("pipeline_run");
+    }
+  }
+  *num_seg = 0;
+  while ((ps = pl.first) != NULL) {
+    pl.first = ps->order;
+    if (retval == 0) {
+      (*segs)[(*num_seg)++] = ps->seg;
+    } else if (ps->stored) {
+      ops->unstore(&ps->seg);
+    }
+    pipeline_drop_data(ps);
+    free(ps);
+  }
+
+  pthread_mutex_destroy(&pl.lock);
+  pipeline_queue_destroy(&pl.blocks);
+  pipeline_queue_destroy(&pl.segs);
+  pipeline_queue_destroy(&pl.uploads);
+
+  if (close(fd) < 0 && retval == 0) {
+    retval = cloudfs_error("pipeline_run");
+  }
+
+  dbg_print("[DBG] pipeline_run(fpath=\"%s\", num_seg=%d)=%d\n", fpath,
+      *num_seg, retval);
+
+  return retval;
+}
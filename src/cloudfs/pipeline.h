@@ -0,0 +1,40 @@
+#ifndef __PIPELINE_H_
+#define __PIPELINE_H_
+
+#include "dedup.h"
+
+/* upper limits of the hashing/compressing workers and of the PUTs in flight */
+#define PIPELINE_MAX_WORKERS (32)
+#define PIPELINE_MAX_PUTS (16)
+
+/* a segment going through the pipeline */
+struct pipeline_seg {
+  struct cloudfs_seg seg;
+  long offset;
+  char *data; /* the segment, dropped once it is stored */
+  long len;
+  struct pipeline_seg *block; /* the block "data" points into, NULL if the
+                                 segment owns "data" */
+  int refs; /* of a block: segments pointing into it, plus the chunker */
+  char *comp; /* compressed segment, NULL if not compressed (yet) */
+  long comp_len;
+  int stored;
+  struct pipeline_seg *next; /* in a queue */
+  struct pipeline_seg *order; /* in file order */
+};
+
+/* how segments are stored, supplied by the user of the pipeline */
+struct pipeline_ops {
+  /* return 1 if the segment is stored already, so it need not be compressed */
+  int (*is_stored)(struct cloudfs_seg *segp);
+  /* store the segment (or add a reference to it), 0 on success */
+  int (*store)(struct pipeline_seg *ps);
+  /* undo store() when a later segment fails */
+  void (*unstore)(struct cloudfs_seg *segp);
+};
+
+int pipeline_init(int workers, int puts);
+int pipeline_run(char *fpath, chunker_t *ck, struct pipeline_ops *ops,
+    int *num_seg, struct cloudfs_seg **segs);
+
+#endif
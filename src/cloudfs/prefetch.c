@@ -0,0 +1,235 @@
+/**
+ * @file prefetch.c
+ * @brief Segment prefetching of CloudFS.
+ *
+ *        Reading a segment that is not in the segment store costs a GET
+ *        from the cache/cloud plus decompression. When a file is read
+ *        sequentially, cloudfs_read() submits the next segments here, and a
+ *        pool of threads downloads them into the store ahead of the reader,
+ *        so several GETs are in flight at the same time. A reader asking
+ *        for a segment being prefetched waits for it in the store.
+ *
+ *        The bytes of the segments queued or being downloaded are bounded
+ *        by a budget, segments beyond it are submitted again by a later
+ *        read, once the budget allows it. Jobs
+ *        are tagged with the temporary directory of their file, so those
+ *        of a closed file can be dropped.
+ *
+ * @author Yinsu Chu (yinsuc)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+// #define DEBUG
+#include "cloudfs.h"
+
+#include "prefetch.h"
+#include "proxy.h"
+#include "dedup_layer.h"
+
+extern FILE *Log;
+
+/* a segment to download for a file */
+struct prefetch_job {
+  char temp_dir[MAX_PATH_LEN];
+  struct cloudfs_seg seg;
+  struct prefetch_job *next;
+};
+
+static int Num_threads;
+static pthread_t Threads[PREFETCH_MAX_THREADS];
+static long Budget;
+static long Queued_bytes; /* queued or being downloaded by the threads */
+static int Stopping;
+
+static struct prefetch_job *Queue_head;
+static struct prefetch_job *Queue_tail;
+
+/* protects everything above */
+static pthread_mutex_t Prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+/* signaled when a job is queued or the threads should exit */
+static pthread_cond_t Job_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Main loop of a prefetching thread.
+ * @param arg Unused.
+ * @return NULL.
+ */
+static void *prefetch_worker(void *arg)
+{
+  (void) arg;
+
+  pthread_mutex_lock(&Prefetch_lock);
+  while (1) {
+    while ((Queue_head == NULL) && !Stopping) {
+      pthread_cond_wait(&Job_cond, &Prefetch_lock);
+    }
+    if (Stopping) {
+      break;
+    }
+
+    struct prefetch_job *job = Queue_head;
+    Queue_head = job->next;
+    if (Queue_head == NULL) {
+      Queue_tail = NULL;
+    }
+    pthread_mutex_unlock(&Prefetch_lock);
+
+    dbg_print("[DBG] prefetching segment %s for %s\n", job->seg.key,
+        job->temp_dir);
+    dedup_layer_fetch_seg(&job->seg);
+
+    pthread_mutex_lock(&Prefetch_lock);
+    Queued_bytes -= job->seg.seg_size;
+    free(job);
+  }
+  pthread_mutex_unlock(&Prefetch_lock);
+
+  return NULL;
+}
+
+/**
+ * @brief Initialize prefetching.
+ * @param depth Number of segments to prefetch ahead of a sequential reader,
+ *              0 turns prefetching off.
+ * @param budget Maximum bytes of segments queued or being prefetched.
+ * @return 0 on success, -errno otherwise.
+ */
+int prefetch_init(int depth, long budget)
+{
+  int retval = 0;
+
+  Budget = budget;
+  Num_threads = (depth < PREFETCH_MAX_THREADS) ? depth : PREFETCH_MAX_THREADS;
+
+  int i = 0;
+  for (i = 0; i < Num_threads; i++) {
+    retval = pthread_create(&Threads[i], NULL, prefetch_worker, NULL);
+    if (retval != 0) {
+      Num_threads = i;
+      retval = -retval;
+      break;
+    }
+  }
+
+  dbg_print("[DBG] prefetch_init(depth=%d, budget=%ld)=%d\n", depth, budget,
+      retval);
+
+  return retval;
+}
+
+/**
+ * @brief CloudFS should call this function upon exiting.
+ *        Queued segments are dropped, downloads in progress complete.
+ * @return Void.
+ */
+void prefetch_destroy(void)
+{
+  pthread_mutex_lock(&Prefetch_lock);
+  Stopping = 1;
+  pthread_cond_broadcast(&Job_cond);
+  pthread_mutex_unlock(&Prefetch_lock);
+
+  int i = 0;
+  for (i = 0; i < Num_threads; i++) {
+    pthread_join(Threads[i], NULL);
+  }
+  Num_threads = 0;
+
+  while (Queue_head != NULL) {
+    struct prefetch_job *job = Queue_head;
+    Queue_head = job->next;
+    free(job);
+  }
+  Queue_tail = NULL;
+  Queued_bytes = 0;
+}
+
+/**
+ * @brief Queue a segment for prefetching.
+ *        Nothing happens if the segment is queued already.
+ * @param temp_dir The temporary directory of the file, identifying it.
+ * @param segp The segment.
+ * @return 0 if the segment is queued, -EAGAIN if it does not fit in the
+ *         budget, negative otherwise, e.g. if prefetching is off.
+ */
+int prefetch_submit(char *temp_dir, struct cloudfs_seg *segp)
+{
+  int retval = 0;
+
+  if (Num_threads == 0) {
+    return -EPERM;
+  }
+
+  pthread_mutex_lock(&Prefetch_lock);
+  if (Queued_bytes + segp->seg_size > Budget) {
+    dbg_print("[DBG] prefetch budget exhausted, %ld bytes queued\n",
+        Queued_bytes);
+    pthread_mutex_unlock(&Prefetch_lock);
+    return -EAGAIN;
+  }
+
+  struct prefetch_job *job = NULL;
+  for (job = Queue_head; job != NULL; job = job->next) {
+    if ((strcmp(job->seg.key, segp->key) == 0)
+        && (strcmp(job->temp_dir, temp_dir) == 0)) {
+      pthread_mutex_unlock(&Prefetch_lock);
+      return retval;
+    }
+  }
+
+  job = (struct prefetch_job *) malloc(sizeof(struct prefetch_job));
+  if (job == NULL) {
+    retval = cloudfs_error("prefetch_submit");
+    pthread_mutex_unlock(&Prefetch_lock);
+    return retval;
+  }
+  strncpy(job->temp_dir, temp_dir, MAX_PATH_LEN);
+  job->temp_dir[MAX_PATH_LEN - 1] = '\0';
+  memcpy(&job->seg, segp, sizeof(struct cloudfs_seg));
+  job->next = NULL;
+  if (Queue_tail == NULL) {
+    Queue_head = job;
+  } else {
+    Queue_tail->next = job;
+  }
+  Queue_tail = job;
+  Queued_bytes += segp->seg_size;
+
+  pthread_cond_signal(&Job_cond);
+  pthread_mutex_unlock(&Prefetch_lock);
+
+  return retval;
+}
+
+/**
+ * @brief Stop prefetching for a file that is closed.
+ *        Queued segments of the file are dropped, downloads in progress
+ *        complete into the segment store.
+ * @param temp_dir The temporary directory of the file.
+ * @return Void.
+ */
+void prefetch_cancel(char *temp_dir)
+{
+  pthread_mutex_lock(&Prefetch_lock);
+
+  struct prefetch_job **pp = &Queue_head;
+  Queue_tail = NULL;
+  while (*pp != NULL) {
+    struct prefetch_job *job = *pp;
+    if (strcmp(job->temp_dir, temp_dir) == 0) {
+      *pp = job->next;
+      Queued_bytes -= job->seg.seg_size;
+      free(job);
+    } else {
+      Queue_tail = job;
+      pp = &(job->next);
+    }
+  }
+
+  pthread_mutex_unlock(&Prefetch_lock);
+}
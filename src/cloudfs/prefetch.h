@@ -0,0 +1,12 @@
+#ifndef __PREFETCH_H_
+#define __PREFETCH_H_
+
+/* upper limit of prefetching threads, also bounds the GETs in flight */
+#define PREFETCH_MAX_THREADS (8)
+
+int prefetch_init(int depth, long budget);
+void prefetch_destroy(void);
+int prefetch_submit(char *temp_dir, struct cloudfs_seg *segp);
+void prefetch_cancel(char *temp_dir);
+
+#endif
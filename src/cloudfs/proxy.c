@@ -0,0 +1,489 @@
+/**
+ * @file proxy.c
+ * @brief Proxy files of CloudFS.
+ *        A file stored in the cloud leaves a proxy file on SSD, which lists
+ *        the segments of the file in order. The proxy file is binary:
+ *
+ *          struct proxy_header
+ *          struct proxy_record [num_seg]
+ *
+ *        Each record holds the fingerprint algorithm and the raw digest,
+ *        the size and the offset of the segment in the file, so the file
+ *        can be mmap-ed and any offset be located with a binary search,
+ *        without parsing anything. Integers are stored in host byte order.
+ *
+ *        Older versions of CloudFS wrote text proxy files, one "md5-size"
+ *        line per segment, and then version 1 binary files, whose records
+ *        have no algorithm as they are all MD5s. These are still read
+ *        (into memory) and are converted to the current format by
+ *        proxy_migrate(), or whenever the file is uploaded again.
+ * @author Yinsu Chu (yinsuc)
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+// #define DEBUG
+#include "cloudfs.h"
+
+#include "proxy.h"
+
+extern FILE *Log;
+
+/**
+ * @brief Read a text proxy file into memory.
+ * @param fpath Pathname of the proxy file.
+ * @param p The records are placed here.
+ * @return 0 on success, -errno otherwise.
+ */
+static int proxy_load_text(char *fpath, struct proxy *p)
+{
+  int retval = 0;
+  int capacity = 0;
+
+  /* these are parameters required by the getline() function */
+  char *line = NULL;
+  size_t len = 0;
+  FILE *proxy_fp = fopen(fpath, "rb");
+  if (proxy_fp == NULL) {
+    retval = cloudfs_error("proxy_load_text");
+    return retval;
+  }
+
+  long offset = 0;
+  while (getline(&line, &len, proxy_fp) != -1) {
+    if (p->num_seg == capacity) {
+      capacity = (capacity == 0) ? 64 : capacity * 2;
+      struct proxy_record *records = (struct proxy_record *)
+        realloc(p->records, capacity * sizeof(struct proxy_record));
+      if (records == NULL) {
+        retval = cloudfs_error("proxy_load_text");
+        break;
+      }
+      p->records = records;
+    }
+
+    struct proxy_record *rec = &(p->records[p->num_seg]);
+    memset(rec, 0, sizeof(struct proxy_record));
+    char key[2 * MD5_DIGEST_LENGTH + 1] = "";
+    strncpy(key, line, 2 * MD5_DIGEST_LENGTH);
+    rec->fp = FP_MD5;
+    if ((strlen(line) < 2 * MD5_DIGEST_LENGTH + 2)
+        || (fp_parse_key(key, NULL, rec->digest) < 0)) {
+      dbg_print("[ERR] malformed line in proxy file %s\n", fpath);
+      retval = -EINVAL;
+      break;
+    }
+    rec->size = strtol(line + 2 * MD5_DIGEST_LENGTH + 1, NULL, 10);
+    rec->offset = offset;
+    offset += rec->size;
+    p->num_seg++;
+  }
+  if (line != NULL) {
+    free(line);
+  }
+  fclose(proxy_fp);
+
+  p->file_size = offset;
+
+  return retval;
+}
+
+/**
+ * @brief Read the records of a version 1 binary proxy file into memory.
+ * @param addr Mapping of the proxy file, with a valid header.
+ * @param p The records are placed here.
+ * @return 0 on success, -errno otherwise.
+ */
+static int proxy_load_v1(void *addr, struct proxy *p)
+{
+  int retval = 0;
+  int i = 0;
+
+  struct proxy_header *hdr = (struct proxy_header *) addr;
+  struct proxy_record_v1 *old = (struct proxy_record_v1 *)
+    ((char *) addr + sizeof(struct proxy_header));
+
+  p->records = (struct proxy_record *)
+    calloc(hdr->num_seg > 0 ? hdr->num_seg : 1, sizeof(struct proxy_record));
+  if (p->records == NULL) {
+    retval = cloudfs_error("proxy_load_v1");
+    return retval;
+  }
+  for (i = 0; i < (int) hdr->num_seg; i++) {
+    p->records[i].fp = FP_MD5;
+    memcpy(p->records[i].digest, old[i].digest, MD5_DIGEST_LENGTH);
+    p->records[i].size = old[i].size;
+    p->records[i].offset = old[i].offset;
+  }
+  p->num_seg = hdr->num_seg;
+  p->file_size = hdr->file_size;
+
+  return retval;
+}
+
+/**
+ * @brief Map a binary proxy file and check its header.
+ *        Files of version 1 are read into memory instead.
+ * @param fd Descriptor of the proxy file.
+ * @param len Size of the proxy file.
+ * @param p The mapping is placed here.
+ * @return 0 on success, -errno otherwise.
+ */
+static int proxy_map_binary(int fd, size_t len, struct proxy *p)
+{
+  int retval = 0;
+
+  void *addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    retval = cloudfs_error("proxy_map_binary");
+    return retval;
+  }
+
+  struct proxy_header *hdr = (struct proxy_header *) addr;
+  size_t rec_len = (hdr->version == 1) ? sizeof(struct proxy_record_v1)
+    : sizeof(struct proxy_record);
+  if (((hdr->version != PROXY_VERSION) && (hdr->version != 1))
+      || (hdr->num_seg > (len - sizeof(struct proxy_header)) / rec_len)) {
+    dbg_print("[ERR] bad proxy header, version %u, %llu segments\n",
+        hdr->version, (unsigned long long) hdr->num_seg);
+    munmap(addr, len);
+    return -EINVAL;
+  }
+
+  if (hdr->version == 1) {
+    retval = proxy_load_v1(addr, p);
+    munmap(addr, len);
+    return retval;
+  }
+
+  p->addr = addr;
+  p->len = len;
+  p->num_seg = hdr->num_seg;
+  p->file_size = hdr->file_size;
+  p->records = (struct proxy_record *)
+    ((char *) addr + sizeof(struct proxy_header));
+
+  return retval;
+}
+
+/**
+ * @brief Check whether an opened proxy file is in the binary format.
+ * @param fd Descriptor of the proxy file.
+ * @param size Size of the proxy file.
+ * @return 1 if it is binary, 0 otherwise.
+ */
+static int proxy_is_binary(int fd, off_t size)
+{
+  char magic[PROXY_MAGIC_LEN];
+  return (size >= (off_t) sizeof(struct proxy_header))
+    && (pread(fd, magic, PROXY_MAGIC_LEN, 0) == PROXY_MAGIC_LEN)
+    && (memcmp(magic, PROXY_MAGIC, PROXY_MAGIC_LEN) == 0);
+}
+
+/**
+ * @brief Open a proxy file, in either format.
+ * @param fpath Pathname of the proxy file.
+ * @param pp The opened proxy is returned here. It should be closed
+ *           with proxy_close().
+ * @return 0 on success, -errno otherwise.
+ */
+int proxy_open(char *fpath, struct proxy **pp)
+{
+  int retval = 0;
+
+  struct proxy *p = (struct proxy *) calloc(1, sizeof(struct proxy));
+  if (p == NULL) {
+    retval = cloudfs_error("proxy_open");
+    return retval;
+  }
+
+  int fd = open(fpath, O_RDONLY);
+  if (fd < 0) {
+    retval = cloudfs_error("proxy_open");
+    free(p);
+    return retval;
+  }
+
+  struct stat sb;
+  if (fstat(fd, &sb) < 0) {
+    retval = cloudfs_error("proxy_open");
+  } else if (proxy_is_binary(fd, sb.st_size)) {
+    retval = proxy_map_binary(fd, sb.st_size, p);
+  } else {
+    dbg_print("[DBG] %s is a text proxy file\n", fpath);
+    retval = proxy_load_text(fpath, p);
+  }
+  close(fd);
+
+  if (retval < 0) {
+    proxy_close(p);
+    return retval;
+  }
+  *pp = p;
+
+  dbg_print("[DBG] proxy_open(fpath=\"%s\")=%d, %d segments, %ld bytes\n",
+      fpath, retval, p->num_seg, p->file_size);
+
+  return retval;
+}
+
+/**
+ * @brief Find the segment holding a given file offset (binary search).
+ * @param p The opened proxy file.
+ * @param offset Offset into the file.
+ * @return Index of the segment, "num_seg" if the offset is
+ *         beyond the end of the file.
+ */
+int proxy_find(struct proxy *p, long offset)
+{
+  int low = 0;
+  int high = p->num_seg;
+
+  /* find the first segment ending after "offset" */
+  while (low < high) {
+    int mid = low + (high - low) / 2;
+    struct proxy_record *rec = &(p->records[mid]);
+    if ((long) (rec->offset + rec->size) <= offset) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  return low;
+}
+
+/**
+ * @brief Get a segment of a proxy file.
+ * @param p The opened proxy file.
+ * @param i Index of the segment.
+ * @param segp The segment is returned here, "ref_count" is set to zero.
+ * @return Void.
+ */
+void proxy_get_seg(struct proxy *p, int i, struct cloudfs_seg *segp)
+{
+  segp->ref_count = 0;
+  segp->seg_size = p->records[i].size;
+  fp_key(p->records[i].fp, p->records[i].digest, segp->key);
+}
+
+/**
+ * @brief Close a proxy file.
+ * @param p The proxy returned by proxy_open(), can be NULL.
+ * @return Void.
+ */
+void proxy_close(struct proxy *p)
+{
+  if (p == NULL) {
+    return;
+  }
+  if (p->addr != NULL) {
+    munmap(p->addr, p->len);
+  } else if (p->records != NULL) {
+    free(p->records);
+  }
+  free(p);
+}
+
+/**
+ * @brief Write records into a new binary proxy file.
+ * @param fpath Pathname of the proxy file, it is truncated if it exists.
+ * @param records The records, in file order.
+ * @param num_seg Number of records.
+ * @param file_size Size of the entire file.
+ * @return 0 on success, -errno otherwise.
+ */
+static int proxy_write_records(char *fpath, struct proxy_record *records,
+    int num_seg, long file_size)
+{
+  int retval = 0;
+
+  FILE *proxy_fp = fopen(fpath, "wb");
+  if (proxy_fp == NULL) {
+    retval = cloudfs_error("proxy_write_records");
+    return retval;
+  }
+
+  struct proxy_header hdr;
+  memset(&hdr, 0, sizeof(struct proxy_header));
+  memcpy(hdr.magic, PROXY_MAGIC, PROXY_MAGIC_LEN);
+  hdr.version = PROXY_VERSION;
+  hdr.num_seg = num_seg;
+  hdr.file_size = file_size;
+
+  if ((fwrite(&hdr, sizeof(struct proxy_header), 1, proxy_fp) != 1)
+      || ((num_seg > 0) && (fwrite(records, sizeof(struct proxy_record),
+            num_seg, proxy_fp) != (size_t) num_seg))) {
+    retval = cloudfs_error("proxy_write_records");
+  }
+  if (fclose(proxy_fp) == EOF && retval == 0) {
+    retval = cloudfs_error("proxy_write_records");
+  }
+
+  dbg_print("[DBG] proxy_write_records(fpath=\"%s\", num_seg=%d)=%d\n",
+      fpath, num_seg, retval);
+
+  return retval;
+}
+
+/**
+ * @brief Write a binary proxy file for the given segments.
+ * @param fpath Pathname of the proxy file, it is truncated if it exists.
+ * @param segs The segments, in file order.
+ * @param num_seg Number of segments.
+ * @return 0 on success, -errno otherwise.
+ */
+int proxy_write(char *fpath, struct cloudfs_seg *segs, int num_seg)
+{
+  int retval = 0;
+  int i = 0;
+  long offset = 0;
+
+  struct proxy_record *records = (struct proxy_record *)
+    calloc(num_seg > 0 ? num_seg : 1, sizeof(struct proxy_record));
+  if (records == NULL) {
+    retval = cloudfs_error("proxy_write");
+    return retval;
+  }
+
+  for (i = 0; i < num_seg; i++) {
+    int fp = FP_MD5;
+    fp_parse_key(segs[i].key, &fp, records[i].digest);
+    records[i].fp = fp;
+    records[i].size = segs[i].seg_size;
+    records[i].offset = offset;
+    offset += segs[i].seg_size;
+  }
+
+  retval = proxy_write_records(fpath, records, num_seg, offset);
+  free(records);
+
+  return retval;
+}
+
+/**
+ * @brief Copy all extended attributes of a file to another one.
+ * @param src Pathname of the source file.
+ * @param dst Pathname of the target file.
+ * @return 0 on success, -errno otherwise.
+ */
+static int proxy_copy_xattr(char *src, char *dst)
+{
+  int retval = 0;
+
+  ssize_t list_len = llistxattr(src, NULL, 0);
+  if (list_len <= 0) {
+    return (list_len < 0) ? cloudfs_error("proxy_copy_xattr") : 0;
+  }
+
+  char names[list_len];
+  list_len = llistxattr(src, names, list_len);
+  if (list_len < 0) {
+    retval = cloudfs_error("proxy_copy_xattr");
+    return retval;
+  }
+
+  char *name = NULL;
+  for (name = names; name < names + list_len; name += strlen(name) + 1) {
+    char value[MAX_PATH_LEN];
+    ssize_t value_len = lgetxattr(src, name, value, MAX_PATH_LEN);
+    if ((value_len < 0)
+        || (lsetxattr(dst, name, value, value_len, 0) < 0)) {
+      retval = cloudfs_error("proxy_copy_xattr");
+      return retval;
+    }
+  }
+
+  return retval;
+}
+
+/**
+ * @brief Replace the content of a proxy file with new records.
+ *        The records are written into a temporary file which takes over
+ *        the extended attributes of the old one and is then renamed over
+ *        it, so the pathname gets a new inode; the caller should do this
+ *        when nobody else has the file opened.
+ * @param fpath Pathname of the proxy file.
+ * @param records The records, in file order.
+ * @param num_seg Number of records.
+ * @param file_size Size of the entire file.
+ * @return 0 on success, -errno otherwise.
+ */
+int proxy_replace(char *fpath, struct proxy_record *records, int num_seg,
+    long file_size)
+{
+  int retval = 0;
+
+  char proxy_tmp[MAX_PATH_LEN] = "";
+  snprintf(proxy_tmp, MAX_PATH_LEN, "%s.tmp", fpath);
+
+  retval = proxy_write_records(proxy_tmp, records, num_seg, file_size);
+  if (retval == 0) {
+    retval = proxy_copy_xattr(fpath, proxy_tmp);
+  }
+  if (retval == 0 && rename(proxy_tmp, fpath) < 0) {
+    retval = cloudfs_error("proxy_replace");
+  }
+  if (retval < 0) {
+    unlink(proxy_tmp);
+  }
+
+  dbg_print("[DBG] proxy_replace(fpath=\"%s\", num_seg=%d)=%d\n",
+      fpath, num_seg, retval);
+
+  return retval;
+}
+
+/**
+ * @brief Convert a proxy file of an older format to the current one.
+ *        The new file replaces the old one with a rename, so the
+ *        pathname gets a new inode; the caller should do this when
+ *        nobody else has the file opened.
+ * @param fpath Pathname of the proxy file.
+ * @return 0 on success (or if it is current already), -errno otherwise.
+ */
+int proxy_migrate(char *fpath)
+{
+  int retval = 0;
+
+  int fd = open(fpath, O_RDONLY);
+  if (fd < 0) {
+    retval = cloudfs_error("proxy_migrate");
+    return retval;
+  }
+  struct stat sb;
+  struct proxy_header hdr;
+  int current = (fstat(fd, &sb) == 0) && proxy_is_binary(fd, sb.st_size)
+    && (pread(fd, &hdr, sizeof(struct proxy_header), 0)
+        == sizeof(struct proxy_header))
+    && (hdr.version == PROXY_VERSION);
+  close(fd);
+  if (current) {
+    return retval;
+  }
+  dbg_print("[DBG] converting %s to the current proxy format\n", fpath);
+
+  struct proxy *p = NULL;
+  retval = proxy_open(fpath, &p);
+  if (retval < 0) {
+    return retval;
+  }
+
+  retval = proxy_replace(fpath, p->records, p->num_seg, p->file_size);
+  proxy_close(p);
+
+  dbg_print("[DBG] proxy_migrate(fpath=\"%s\")=%d\n", fpath, retval);
+
+  return retval;
+}
@@ -0,0 +1,56 @@
+#ifndef __PROXY_H_
+#define __PROXY_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fingerprint.h"
+
+/* first bytes of a binary proxy file,
+ * text proxy files start with a hex digit instead */
+#define PROXY_MAGIC ("CFSP")
+#define PROXY_MAGIC_LEN (4)
+#define PROXY_VERSION (2)
+
+/* header of a binary proxy file, followed by "num_seg" records */
+struct proxy_header {
+  char magic[PROXY_MAGIC_LEN];
+  uint32_t version;
+  uint64_t num_seg;
+  uint64_t file_size;
+};
+
+/* one segment of the file, records are kept in file order */
+struct proxy_record {
+  uint32_t fp; /* fingerprint algorithm of the digest, FP_* */
+  unsigned char digest[FP_MAX_DIGEST_LEN]; /* zero padded */
+  uint64_t size;
+  uint64_t offset; /* where the segment starts in the file */
+};
+
+/* a record of version 1 binary proxy files, digests are MD5s */
+struct proxy_record_v1 {
+  unsigned char digest[MD5_DIGEST_LENGTH];
+  uint64_t size;
+  uint64_t offset;
+};
+
+/* an opened proxy file */
+struct proxy {
+  int num_seg;
+  long file_size;
+  struct proxy_record *records;
+  void *addr; /* mapping of a binary proxy file, NULL for older ones */
+  size_t len;
+};
+
+int proxy_open(char *fpath, struct proxy **pp);
+int proxy_find(struct proxy *p, long offset);
+void proxy_get_seg(struct proxy *p, int i, struct cloudfs_seg *segp);
+void proxy_close(struct proxy *p);
+int proxy_write(char *fpath, struct cloudfs_seg *segs, int num_seg);
+int proxy_replace(char *fpath, struct proxy_record *records, int num_seg,
+    long file_size);
+int proxy_migrate(char *fpath);
+
+#endif
@@ -0,0 +1,494 @@
+/**
+ * @file seg_store.c
+ * @brief Store of decompressed segments shared by all opened files.
+ *
+ *        Segments read from the cache/cloud are decompressed into a single
+ *        directory, one file per segment named by its key. A segment is
+ *        downloaded once no matter how many files contain it or how many
+ *        times they are opened, and the same file serves every reader.
+ *
+ *        A segment in use is referenced: by a reader while it is reading,
+ *        and by an opened file that has read it until the file is closed.
+ *        Unreferenced segments stay in the store in LRU order and are
+ *        removed, least recently used first, once the store holds more
+ *        bytes than its budget. Referenced segments are never removed, so
+ *        the budget may be exceeded while they are in use.
+ *
+ *        A segment is downloaded by the first thread asking for it, into a
+ *        partial file synced and renamed when complete; the others wait for
+ *        it. Since the content of a segment never changes, complete segments
+ *        left by a previous mount are reused. A segment whose size does not
+ *        match the one recorded in the hash table is removed and downloaded
+ *        again.
+ *
+ * @author Yinsu Chu (yinsuc)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// #define DEBUG
+#include "cloudfs.h"
+
+#include "seg_store.h"
+#include "hashtable.h"
+#include "fingerprint.h"
+
+/* number of buckets of the segment index */
+#define STORE_BKT_NUM (4099)
+
+/* suffix of a segment being downloaded */
+#define PART_SUFFIX (".part")
+
+#define SEG_LOADING (0)
+#define SEG_READY (1)
+#define SEG_FAILED (2)
+
+extern FILE *Log;
+
+/* a segment in the store */
+struct seg_entry {
+  char key[MAX_KEY_LEN + 1];
+  long size;
+  int ref_count;
+  int state;
+  struct seg_entry *next; /* in the bucket */
+  struct seg_entry *lru_prev; /* in the LRU list, if not referenced */
+  struct seg_entry *lru_next;
+};
+
+static char Dir[MAX_PATH_LEN];
+static long Budget;
+static long Used_bytes; /* bytes of the segments ready in the store */
+static seg_store_load_fn_t Load_fn;
+
+static struct seg_entry *Buckets[STORE_BKT_NUM];
+static struct seg_entry *Lru_head; /* most recently used */
+static struct seg_entry *Lru_tail;
+
+/* protects everything above */
+static pthread_mutex_t Store_lock = PTHREAD_MUTEX_INITIALIZER;
+/* signaled when a segment is downloaded, or fails to */
+static pthread_cond_t Load_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * @brief Get the bucket of a segment.
+ * @param key Key of the segment.
+ * @return Index of the bucket.
+ */
+static int seg_store_hash(const char *key)
+{
+  unsigned int hash = 0;
+  int i = 0;
+  for (i = 0; (i < (int) MAX_KEY_LEN) && (key[i] != '\0'); i++) {
+    hash = hash * 31 + (unsigned char) key[i];
+  }
+  return hash % STORE_BKT_NUM;
+}
+
+/**
+ * @brief Find a segment, the caller holds Store_lock.
+ * @param key Key of the segment.
+ * @return The entry, NULL if not in the store.
+ */
+static struct seg_entry *seg_store_lookup(const char *key)
+{
+  struct seg_entry *e = NULL;
+  for (e = Buckets[seg_store_hash(key)]; e != NULL; e = e->next) {
+    if (strcmp(e->key, key) == 0) {
+      break;
+    }
+  }
+  return e;
+}
+
+/**
+ * @brief Take a segment out of its bucket, the caller holds Store_lock.
+ * @param e The entry.
+ * @return Void.
+ */
+static void seg_store_unhash(struct seg_entry *e)
+{
+  struct seg_entry **pp = &Buckets[seg_store_hash(e->key)];
+  while ((*pp != NULL) && (*pp != e)) {
+    pp = &((*pp)->next);
+  }
+  if (*pp != NULL) {
+    *pp = e->next;
+  }
+}
+
+/**
+ * @brief Take a segment out of the LRU list, the caller holds Store_lock.
+ * @param e The entry.
+ * @return Void.
+ */
+static void seg_store_lru_remove(struct seg_entry *e)
+{
+  if (e->lru_prev != NULL) {
+    e->lru_prev->lru_next = e->lru_next;
+  } else {
+    Lru_head = e->lru_next;
+  }
+  if (e->lru_next != NULL) {
+    e->lru_next->lru_prev = e->lru_prev;
+  } else {
+    Lru_tail = e->lru_prev;
+  }
+  e->lru_prev = NULL;
+  e->lru_next = NULL;
+}
+
+/**
+ * @brief Put a segment at the head of the LRU list,
+ *        the caller holds Store_lock.
+ * @param e The entry.
+ * @return Void.
+ */
+static void seg_store_lru_push(struct seg_entry *e)
+{
+  e->lru_prev = NULL;
+  e->lru_next = Lru_head;
+  if (Lru_head != NULL) {
+    Lru_head->lru_prev = e;
+  }
+  Lru_head = e;
+  if (Lru_tail == NULL) {
+    Lru_tail = e;
+  }
+}
+
+/**
+ * @brief Get the pathname of a segment in the store.
+ * @param key Key of the segment.
+ * @param spath The pathname is returned here. It should have at least
+ *              MAX_PATH_LEN bytes.
+ * @return Void.
+ */
+static void seg_store_get_path(const char *key, char *spath)
+{
+  snprintf(spath, MAX_PATH_LEN, "%s/%s", Dir, key);
+}
+
+/**
+ * @brief Remove unreferenced segments until the store fits in the budget,
+ *        the caller holds Store_lock.
+ * @return Void.
+ */
+static void seg_store_evict(void)
+{
+  while ((Used_bytes > Budget) && (Lru_tail != NULL)) {
+    struct seg_entry *e = Lru_tail;
+    char spath[MAX_PATH_LEN] = "";
+    seg_store_get_path(e->key, spath);
+    dbg_print("[DBG] evicting segment %s from the store\n", e->key);
+
+    unlink(spath);
+    seg_store_lru_remove(e);
+    seg_store_unhash(e);
+    Used_bytes -= e->size;
+    free(e);
+  }
+}
+
+/**
+ * @brief Add a segment to the store, the caller holds Store_lock.
+ * @param key Key of the segment.
+ * @param size Size of the segment.
+ * @param state State of the segment.
+ * @return The entry, NULL if out of memory.
+ */
+static struct seg_entry *seg_store_insert(const char *key, long size,
+    int state)
+{
+  struct seg_entry *e =
+    (struct seg_entry *) calloc(1, sizeof(struct seg_entry));
+  if (e == NULL) {
+    cloudfs_error("seg_store_insert");
+    return NULL;
+  }
+  strncpy(e->key, key, MAX_KEY_LEN);
+  e->size = size;
+  e->state = state;
+
+  int bucket_id = seg_store_hash(key);
+  e->next = Buckets[bucket_id];
+  Buckets[bucket_id] = e;
+
+  return e;
+}
+
+/**
+ * @brief Reuse the segments left by a previous mount.
+ *        Partial segments, and segments not in the hash table or whose
+ *        size does not match it, are removed.
+ * @return 0 on success, -errno otherwise.
+ */
+static int seg_store_scan(void)
+{
+  int retval = 0;
+
+  DIR *dirp = opendir(Dir);
+  if (dirp == NULL) {
+    retval = cloudfs_error("seg_store_scan");
+    return retval;
+  }
+
+  struct dirent *entry = NULL;
+  while ((entry = readdir(dirp)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    char spath[MAX_PATH_LEN] = "";
+    seg_store_get_path(entry->d_name, spath);
+
+    struct stat sb;
+    if (!fp_is_key(entry->d_name)
+        || (lstat(spath, &sb) < 0) || !S_ISREG(sb.st_mode)) {
+      dbg_print("[DBG] removing %s from the store\n", spath);
+      unlink(spath);
+      continue;
+    }
+
+    struct cloudfs_seg seg;
+    struct cloudfs_seg found;
+    memset(&seg, 0, sizeof(struct cloudfs_seg));
+    strcpy(seg.key, entry->d_name);
+    ht_search(&seg, &found);
+    if ((found.ref_count == 0) || (found.seg_size != sb.st_size)) {
+      dbg_print("[DBG] removing stale segment %s from the store\n", spath);
+      unlink(spath);
+      continue;
+    }
+
+    struct seg_entry *e = seg_store_insert(entry->d_name, sb.st_size,
+        SEG_READY);
+    if (e == NULL) {
+      unlink(spath);
+      continue;
+    }
+    seg_store_lru_push(e);
+    Used_bytes += e->size;
+  }
+  closedir(dirp);
+
+  seg_store_evict();
+
+  return retval;
+}
+
+/**
+ * @brief Initialize the segment store.
+ * @param dir The directory holding the segments, created if missing.
+ * @param budget Bytes of unreferenced segments to keep.
+ * @param fn The function downloading a segment.
+ * @return 0 on success, -errno otherwise.
+ */
+int seg_store_init(char *dir, long budget, seg_store_load_fn_t fn)
+{
+  int retval = 0;
+
+  strncpy(Dir, dir, MAX_PATH_LEN);
+  Dir[MAX_PATH_LEN - 1] = '\0';
+  Budget = budget;
+  Load_fn = fn;
+
+  if ((mkdir(Dir, DEFAULT_DIR_MODE) < 0) && (errno != EEXIST)) {
+    retval = cloudfs_error("seg_store_init");
+    return retval;
+  }
+
+  pthread_mutex_lock(&Store_lock);
+  retval = seg_store_scan();
+  pthread_mutex_unlock(&Store_lock);
+
+  dbg_print("[DBG] seg_store_init(dir=\"%s\", budget=%ld)=%d, %ld bytes"
+      " reused\n", dir, budget, retval, Used_bytes);
+
+  return retval;
+}
+
+/**
+ * @brief CloudFS should call this function upon exiting.
+ *        The segments stay on SSD for the next mount.
+ * @return Void.
+ */
+void seg_store_destroy(void)
+{
+  pthread_mutex_lock(&Store_lock);
+  int i = 0;
+  for (i = 0; i < STORE_BKT_NUM; i++) {
+    while (Buckets[i] != NULL) {
+      struct seg_entry *e = Buckets[i];
+      Buckets[i] = e->next;
+      free(e);
+    }
+  }
+  Lru_head = NULL;
+  Lru_tail = NULL;
+  Used_bytes = 0;
+  pthread_mutex_unlock(&Store_lock);
+}
+
+/**
+ * @brief Check a downloaded segment and flush it to disk.
+ * @param spath Pathname of the segment.
+ * @param size The size it should have.
+ * @return 0 on success, -errno otherwise.
+ */
+static int seg_store_sync(const char *spath, long size)
+{
+  int retval = 0;
+
+  int fd = open(spath, O_RDONLY);
+  if (fd < 0) {
+    retval = cloudfs_error("seg_store_sync");
+    return retval;
+  }
+
+  struct stat sb;
+  if (fstat(fd, &sb) < 0) {
+    retval = cloudfs_error("seg_store_sync");
+  } else if (sb.st_size != size) {
+    dbg_print("[ERR] downloaded %ld bytes of segment %s instead of %ld\n",
+        (long) sb.st_size, spath, size);
+    retval = -EIO;
+  } else if (fsync(fd) < 0) {
+    retval = cloudfs_error("seg_store_sync");
+  }
+  close(fd);
+
+  return retval;
+}
+
+/**
+ * @brief Get a segment from the store and reference it.
+ *        If the segment is not in the store, it is downloaded;
+ *        if it is being downloaded by another thread, wait for it.
+ * @param segp The segment.
+ * @param spath If not NULL, the pathname of the segment is returned here.
+ *              It should have at least MAX_PATH_LEN bytes.
+ * @return 0 on success, -errno otherwise. On success the caller should
+ *         call seg_store_release() once the segment is no longer used.
+ */
+int seg_store_acquire(struct cloudfs_seg *segp, char *spath)
+{
+  int retval = 0;
+  char path[MAX_PATH_LEN] = "";
+  seg_store_get_path(segp->key, path);
+  if (spath != NULL) {
+    strcpy(spath, path);
+  }
+
+  pthread_mutex_lock(&Store_lock);
+  struct seg_entry *e = seg_store_lookup(segp->key);
+  if ((e != NULL) && (e->state == SEG_READY) && (e->size != segp->seg_size)) {
+    if (e->ref_count > 0) {
+      pthread_mutex_unlock(&Store_lock);
+      return -EIO;
+    }
+    /* a bad segment, download it again */
+    dbg_print("[ERR] segment %s has %ld bytes instead of %ld\n", segp->key,
+        e->size, segp->seg_size);
+    seg_store_lru_remove(e);
+    seg_store_unhash(e);
+    Used_bytes -= e->size;
+    unlink(path);
+    free(e);
+    e = NULL;
+  }
+  if (e != NULL) {
+    if ((e->ref_count == 0) && (e->state == SEG_READY)) {
+      seg_store_lru_remove(e);
+    }
+    e->ref_count++;
+    while (e->state == SEG_LOADING) {
+      pthread_cond_wait(&Load_cond, &Store_lock);
+    }
+    if (e->state == SEG_FAILED) {
+      retval = -EIO;
+      e->ref_count--;
+      if (e->ref_count == 0) {
+        free(e);
+      }
+    }
+    pthread_mutex_unlock(&Store_lock);
+    dbg_print("[DBG] segment %s found in the store\n", segp->key);
+    return retval;
+  }
+
+  e = seg_store_insert(segp->key, segp->seg_size, SEG_LOADING);
+  if (e == NULL) {
+    pthread_mutex_unlock(&Store_lock);
+    return -ENOMEM;
+  }
+  e->ref_count = 1;
+  pthread_mutex_unlock(&Store_lock);
+
+  /* download into a partial file, so a crash never leaves a bad segment */
+  char part[MAX_PATH_LEN] = "";
+  snprintf(part, MAX_PATH_LEN, "%s%s", path, PART_SUFFIX);
+  dbg_print("[DBG] downloading segment %s into the store\n", segp->key);
+  retval = Load_fn(part, segp);
+  if (retval >= 0) {
+    retval = seg_store_sync(part, segp->seg_size);
+  }
+  if (retval >= 0) {
+    retval = rename(part, path);
+    if (retval < 0) {
+      retval = cloudfs_error("seg_store_acquire");
+    }
+  }
+  if (retval < 0) {
+    unlink(part);
+  }
+
+  pthread_mutex_lock(&Store_lock);
+  if (retval < 0) {
+    /* waiters see the failure and free the entry */
+    e->state = SEG_FAILED;
+    seg_store_unhash(e);
+    e->ref_count--;
+    if (e->ref_count == 0) {
+      free(e);
+    }
+  } else {
+    e->state = SEG_READY;
+    Used_bytes += e->size;
+    seg_store_evict();
+    retval = 0;
+  }
+  pthread_cond_broadcast(&Load_cond);
+  pthread_mutex_unlock(&Store_lock);
+
+  dbg_print("[DBG] seg_store_acquire(key=%s)=%d\n", segp->key, retval);
+
+  return retval;
+}
+
+/**
+ * @brief Drop a reference taken by seg_store_acquire().
+ * @param segp The segment.
+ * @return Void.
+ */
+void seg_store_release(struct cloudfs_seg *segp)
+{
+  pthread_mutex_lock(&Store_lock);
+  struct seg_entry *e = seg_store_lookup(segp->key);
+  if ((e != NULL) && (e->ref_count > 0)) {
+    e->ref_count--;
+    if (e->ref_count == 0) {
+      seg_store_lru_push(e);
+      seg_store_evict();
+    }
+  }
+  pthread_mutex_unlock(&Store_lock);
+}
@@ -0,0 +1,13 @@
+#ifndef __SEG_STORE_H_
+#define __SEG_STORE_H_
+
+/* downloads and decompresses a segment into a file,
+ * returns a value >= 0 on success, -errno otherwise */
+typedef int (*seg_store_load_fn_t)(char *spath, struct cloudfs_seg *segp);
+
+int seg_store_init(char *dir, long budget, seg_store_load_fn_t fn);
+void seg_store_destroy(void);
+int seg_store_acquire(struct cloudfs_seg *segp, char *spath);
+void seg_store_release(struct cloudfs_seg *segp);
+
+#endif
@@ -0,0 +1,1344 @@
+/**
+ * @file simulate.c
+ * @brief Offline cache and cost simulator of CloudFS.
+ *
+ *        Replays a workload through the chunker, the dedup index and the
+ *        cache replacement policies of CloudFS, against a modeled cloud
+ *        that counts requests, bytes and capacity, and prints the cost of
+ *        each configuration of a sweep of cache sizes, average segment
+ *        sizes and cache policies. No FUSE mount and no S3 server needed.
+ *
+ *        The workload is either a trace (-t), one operation per line:
+ *          open <path>
+ *          read <path> <offset> <length>
+ *          write <path> <offset> <length> [<local file> <local offset>]
+ *          truncate <path> <length>
+ *          close <path>
+ *          unlink <path>
+ *        where written data comes from a local file, or is generated if
+ *        none is given; or a directory snapshot (-D), which is copied in
+ *        and read back file by file, like scripts/test_part3.sh does.
+ *        Lines starting with '#' are ignored.
+ *
+ *        The model follows CloudFS: a file moves to the cloud when closed
+ *        bigger than the threshold, as segments stored once each, in the
+ *        cache if there is room and in the cloud otherwise; reads fetch
+ *        the segments they need once per open, through the cache, which
+ *        keeps their cloud copies or not according to the cache mode. A
+ *        closed dirty file is re-chunked, and the old segments overlapping
+ *        the modified range are fetched first.
+ *
+ *        Reads go through a model of the decompressed segment store, keyed
+ *        by segment like seg_store.c: a segment is fetched only if no file
+ *        holds it and it is not among the unreferenced segments kept
+ *        within the store budget (-B). An opened file holds the segments
+ *        it has read until its last close.
+ *
+ *        The cost is the one of calculate_cloud_cost() in
+ *        scripts/functions.sh.
+ *
+ * @author Yinsu Chu (yinsuc)
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "cloudfs.h"
+
+#include "dedup.h"
+#include "compressapi.h"
+#include "fingerprint.h"
+#include "cache_index.h"
+#include "cache_policy.h"
+
+/* longest line of a trace */
+#define LINE_LEN (8192)
+
+/* most values of a swept parameter */
+#define MAX_SWEEP (32)
+
+/* number of hash buckets of the files */
+#define FILE_BUCKETS (4096)
+
+/* bytes handed to the chunker per call, like the dedup layer */
+#define FEED_LEN (64 * 1024)
+
+#define OP_OPEN (0)
+#define OP_READ (1)
+#define OP_WRITE (2)
+#define OP_TRUNCATE (3)
+#define OP_CLOSE (4)
+#define OP_UNLINK (5)
+
+/* an operation of the workload */
+struct sim_op {
+  int type;
+  char *path;
+  long offset;
+  long len;
+  char *src; /* local file holding the data written, NULL to generate it */
+  long src_offset;
+};
+
+/* a segment of a file in the cloud */
+struct sim_seg {
+  char key[MAX_KEY_LEN + 1];
+  long offset;
+  long len;
+  long comp_len;
+};
+
+/* a file of the simulated file system */
+struct sim_file {
+  char *path;
+  char *data;
+  long size;
+  long cap;
+  int in_cloud;
+  int opens;
+  long dirty_start; /* range modified since the last close */
+  long dirty_end;
+  int num_seg; /* segments of the cloud version */
+  struct sim_seg *segs;
+  struct cache_index *held; /* segments read during this open */
+  long obj_size; /* size of the cloud object without dedup */
+  struct sim_file *next;
+};
+
+/* what a run costs */
+struct sim_result {
+  long requests;
+  long puts;
+  long gets;
+  long dels;
+  long read_bytes;
+  long write_bytes;
+  long usage;
+  long max_usage;
+  long hits;
+  long misses;
+  long evictions;
+  long deletions;
+  long rejected;
+  double cost;
+  double seconds;
+};
+
+/* settings of the simulated CloudFS, some of them swept */
+static long Threshold = 64 * 1024;
+static int Rabin_window = 48;
+static int Chunker_type = CHUNKER_RABIN;
+static int No_dedup;
+static int No_cache;
+static int Evict_high; /* watermarks of the evictor in percent, 0 if none */
+static int Evict_low = 80;
+static int No_compress;
+static long Store_size = 32 * 1024 * 1024;
+static long Cache_size;
+static int Avg_seg_size;
+static struct cache_policy *Policy;
+static int Mode;
+
+FILE *Log;
+
+static struct sim_op *Ops;
+static int Num_ops;
+
+static struct sim_file *Files[FILE_BUCKETS];
+static struct cache_index Index; /* the dedup index, size is compressed */
+static struct cache_index Cached; /* segments in the cache */
+static struct cache_index Comp_lens; /* compressed sizes, kept across runs */
+static chunker_t *Chunker;
+static long Remaining_space;
+static long Clock;
+static struct sim_result R;
+
+/* the segment store, size is the decompressed length */
+static struct cache_index Store;
+static long Store_used;
+static struct cache_entry *Store_head; /* unreferenced, most recently used */
+static struct cache_entry *Store_tail;
+
+/**
+ * @brief Same as the CloudFS one, for the modules linked in.
+ * @param error_str The error message.
+ * @return -errno.
+ */
+int cloudfs_error(char *error_str)
+{
+  int retval = -errno;
+  fprintf(stderr, "[ERR] %s : %s\n", error_str, strerror(errno));
+  return retval;
+}
+
+/* the modeled cloud ------------------------------------------------------- */
+
+static void cloud_put(long size)
+{
+  R.requests++;
+  R.puts++;
+  R.write_bytes += size;
+  R.usage += size;
+  if (R.usage > R.max_usage) {
+    R.max_usage = R.usage;
+  }
+}
+
+static void cloud_get(long size)
+{
+  R.requests++;
+  R.gets++;
+  R.read_bytes += size;
+}
+
+static void cloud_delete(long size)
+{
+  R.requests++;
+  R.dels++;
+  R.usage -= size;
+}
+
+/**
+ * @brief Add an entry to an index, exits if out of memory.
+ * @param idx The index.
+ * @param key Key of the entry, not in the index yet.
+ * @return The entry, zeroed but for its key.
+ */
+static struct cache_entry *sim_entry_new(struct cache_index *idx,
+    const char *key)
+{
+  struct cache_entry *e =
+    (struct cache_entry *) calloc(1, sizeof(struct cache_entry));
+  if (e != NULL) {
+    snprintf(e->key, MAX_KEY_LEN + 1, "%s", key);
+  }
+  if ((e == NULL) || (cache_index_insert(idx, e) < 0)) {
+    fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  return e;
+}
+
+/* the cache layer --------------------------------------------------------- */
+
+/**
+ * @brief Keep track of a segment that entered the cache.
+ * @param key Key of the segment.
+ * @param size Compressed size of the segment.
+ * @param ref_count Its reference count.
+ * @return The entry of the segment.
+ */
+static struct cache_entry *sim_cache_track(char *key, long size,
+    int ref_count)
+{
+  struct cache_entry *e = sim_entry_new(&Cached, key);
+  e->size = size;
+  e->ref_count = ref_count;
+  e->atime.tv_sec = ++Clock;
+  if (Policy->insert(e) < 0) {
+    fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  Remaining_space -= size;
+  return e;
+}
+
+/**
+ * @brief Upload a segment to evict it, like cache_layer_clean().
+ * @param e Entry of the segment, taken by Policy->victim().
+ * @return 0.
+ */
+static int sim_evict_upload(struct cache_entry *e)
+{
+  cloud_put(e->size);
+  e->clean = 1;
+  return 0;
+}
+
+/**
+ * @brief Delete an evicted segment from the cache, like
+ *        cache_layer_drop().
+ * @param e Entry of the segment, taken by Policy->victim(), freed.
+ * @param uploaded Whether the segment was uploaded to be evicted.
+ * @return 0.
+ */
+static int sim_evict_drop(struct cache_entry *e, int uploaded)
+{
+  (void) uploaded;
+
+  Remaining_space += e->size;
+  if (Policy->evicted != NULL) {
+    Policy->evicted(e);
+  }
+  cache_index_delete(&Cached, e);
+  free(e);
+  R.evictions++;
+  return 0;
+}
+
+/* how the policy evicts from the simulated cache */
+static const struct cache_evict_ops Evict_ops = {
+  sim_evict_upload,
+  sim_evict_drop
+};
+
+/**
+ * @brief Evict segments, like cache_layer_evict_segments().
+ * @param cand The segment to make room for.
+ * @return 0 on success, CANNOT_EVICT if not enough can be evicted.
+ */
+static int sim_cache_evict(struct cache_entry *cand)
+{
+  int retval = cache_policy_evict(Policy, &Remaining_space, cand,
+      &Evict_ops);
+  if ((retval < 0) && (retval != CANNOT_EVICT)) {
+    fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  return retval;
+}
+
+/**
+ * @brief Evict segments like the evictor of the cache layer, if the cache
+ *        is used beyond the high watermark. The evictor runs in the
+ *        background, but its requests are the same.
+ * @return Void.
+ */
+static void sim_cache_evict_background(void)
+{
+  if ((Evict_high == 0)
+      || (Cache_size - Remaining_space <= Cache_size * Evict_high / 100)) {
+    return;
+  }
+  cache_policy_drain(Policy, &Remaining_space,
+      Cache_size - Cache_size * Evict_low / 100, NULL, &Evict_ops);
+}
+
+/**
+ * @brief Store a new segment, like cache_layer_upload_buf().
+ * @param key Key of the segment.
+ * @param size Compressed size of the segment.
+ * @return Void.
+ */
+static void sim_cache_upload(char *key, long size)
+{
+  if (!No_cache && (Remaining_space >= size)) {
+    sim_cache_track(key, size, 0);
+    sim_cache_evict_background();
+  } else {
+    cloud_put(size);
+  }
+}
+
+/**
+ * @brief Fetch a segment, like cache_layer_download_seg().
+ * @param seg The segment.
+ * @param ref_count Its reference count.
+ * @return Void.
+ */
+static void sim_cache_download(struct sim_seg *seg, int ref_count)
+{
+  if (No_cache) {
+    cloud_get(seg->comp_len);
+    return;
+  }
+
+  if (Policy->reference != NULL) {
+    Policy->reference(seg->key);
+  }
+  struct cache_entry *e = cache_index_find(&Cached, seg->key);
+  if (e != NULL) {
+    R.hits++;
+    e->atime.tv_sec = ++Clock;
+    Policy->access(e);
+    return;
+  }
+
+  R.misses++;
+  cloud_get(seg->comp_len);
+
+  struct cache_entry cand;
+  memset(&cand, 0, sizeof(struct cache_entry));
+  memcpy(cand.key, seg->key, MAX_KEY_LEN + 1);
+  cand.ref_count = ref_count;
+  Remaining_space -= seg->comp_len;
+  int evict_failed = 0;
+  if (Remaining_space < 0) {
+    evict_failed = (sim_cache_evict(&cand) == CANNOT_EVICT);
+  }
+  Remaining_space += seg->comp_len;
+  if (evict_failed) {
+    R.rejected++;
+  } else {
+    e = sim_cache_track(seg->key, seg->comp_len, ref_count);
+    if (cache_policy_keep_copy(Mode, e->size, e->ref_count, R.evictions,
+          R.deletions)) {
+      e->clean = 1;
+    } else {
+      cloud_delete(seg->comp_len);
+    }
+    sim_cache_evict_background();
+  }
+}
+
+/**
+ * @brief Delete a segment, like cache_layer_remove_seg().
+ * @param key Key of the segment.
+ * @param size Compressed size of the segment.
+ * @return Void.
+ */
+static void sim_cache_remove(char *key, long size)
+{
+  struct cache_entry *e = No_cache ? NULL : cache_index_find(&Cached, key);
+  if (e == NULL) {
+    cloud_delete(size);
+    return;
+  }
+  Remaining_space += e->size;
+  R.deletions++;
+  if (e->clean) {
+    cloud_delete(size);
+  }
+  Policy->remove(e);
+  cache_index_delete(&Cached, e);
+  free(e);
+}
+
+/**
+ * @brief Report a new reference count, like cache_layer_set_ref().
+ * @param key Key of the segment.
+ * @param ref_count The reference count.
+ * @return Void.
+ */
+static void sim_cache_set_ref(char *key, int ref_count)
+{
+  struct cache_entry *e = No_cache ? NULL : cache_index_find(&Cached, key);
+  if (e != NULL) {
+    e->ref_count = ref_count;
+    if (Policy->update != NULL) {
+      Policy->update(e);
+    }
+  }
+}
+
+/* the segment store ------------------------------------------------------- */
+
+/**
+ * @brief Take an unreferenced segment out of the LRU list of the store.
+ * @param e Entry of the segment.
+ * @return Void.
+ */
+static void sim_store_lru_remove(struct cache_entry *e)
+{
+  if (e->prev != NULL) {
+    e->prev->next = e->next;
+  } else {
+    Store_head = e->next;
+  }
+  if (e->next != NULL) {
+    e->next->prev = e->prev;
+  } else {
+    Store_tail = e->prev;
+  }
+  e->prev = NULL;
+  e->next = NULL;
+}
+
+/**
+ * @brief Remove unreferenced segments, least recently used first, while
+ *        the store holds more than its budget, like seg_store_evict().
+ * @return Void.
+ */
+static void sim_store_evict(void)
+{
+  while ((Store_used > Store_size) && (Store_tail != NULL)) {
+    struct cache_entry *e = Store_tail;
+    sim_store_lru_remove(e);
+    Store_used -= e->size;
+    cache_index_delete(&Store, e);
+    free(e);
+  }
+}
+
+/**
+ * @brief Read a segment through the store, like seg_store_acquire(), and
+ *        hold it for the file until its last close.
+ * @param f The file.
+ * @param seg The segment.
+ * @return Void.
+ */
+static void sim_store_acquire(struct sim_file *f, struct sim_seg *seg)
+{
+  if (cache_index_find(f->held, seg->key) != NULL) {
+    return;
+  }
+  sim_entry_new(f->held, seg->key);
+
+  struct cache_entry *e = cache_index_find(&Store, seg->key);
+  if (e == NULL) {
+    struct cache_entry *d = cache_index_find(&Index, seg->key);
+    sim_cache_download(seg, (d != NULL) ? d->ref_count : 0);
+    e = sim_entry_new(&Store, seg->key);
+    e->size = seg->len;
+    Store_used += e->size;
+  } else if (e->ref_count == 0) {
+    sim_store_lru_remove(e);
+  }
+  e->ref_count++;
+  sim_store_evict();
+}
+
+/**
+ * @brief Drop the segments a file holds, like seg_store_release().
+ * @param f The file.
+ * @return Void.
+ */
+static void sim_store_release(struct sim_file *f)
+{
+  if (f->held == NULL) {
+    return;
+  }
+  int i = 0;
+  for (i = 0; i < f->held->num_buckets; i++) {
+    struct cache_entry *h = NULL;
+    for (h = f->held->buckets[i]; h != NULL; h = h->hnext) {
+      struct cache_entry *e = cache_index_find(&Store, h->key);
+      if ((e != NULL) && (--e->ref_count == 0)) {
+        e->prev = NULL;
+        e->next = Store_head;
+        if (Store_head != NULL) {
+          Store_head->prev = e;
+        }
+        Store_head = e;
+        if (Store_tail == NULL) {
+          Store_tail = e;
+        }
+      }
+    }
+  }
+  cache_index_destroy(f->held);
+  free(f->held);
+  f->held = NULL;
+  sim_store_evict();
+}
+
+/* the dedup layer --------------------------------------------------------- */
+
+/**
+ * @brief Get the compressed size of a segment, computing it only once.
+ * @param key Key of the segment.
+ * @param data The segment.
+ * @param len Length of the segment.
+ * @return The compressed size.
+ */
+static long sim_comp_len(char *key, char *data, long len)
+{
+  if (No_compress) {
+    return len;
+  }
+  struct cache_entry *e = cache_index_find(&Comp_lens, key);
+  if (e != NULL) {
+    return e->size;
+  }
+
+  char *comp = NULL;
+  size_t comp_len = 0;
+  FILE *decomp = fmemopen(data, (len > 0) ? len : 1, "rb");
+  FILE *cfile = open_memstream(&comp, &comp_len);
+  if ((decomp == NULL) || (cfile == NULL)) {
+    perror("fmemopen");
+    exit(EXIT_FAILURE);
+  }
+  def(decomp, cfile, len, Z_DEFAULT_COMPRESSION);
+  fclose(decomp);
+  fclose(cfile);
+  free(comp);
+
+  e = sim_entry_new(&Comp_lens, key);
+  e->size = comp_len;
+  return e->size;
+}
+
+/**
+ * @brief Divide a file into segments, like the dedup layer.
+ * @param f The file.
+ * @param segs The segments are returned here, to be freed by the caller.
+ * @return Number of segments.
+ */
+static int sim_chunk(struct sim_file *f, struct sim_seg **segs)
+{
+  int num_seg = 0;
+  int max_seg = 0;
+  long pos = 0;
+  long seg_start = 0;
+  int new_segment = 0;
+  int len = 0;
+
+  *segs = NULL;
+  chunker_reset(Chunker);
+  while (pos < f->size) {
+    long bytes = f->size - pos;
+    if (bytes > FEED_LEN) {
+      bytes = FEED_LEN;
+    }
+    len = chunker_next(Chunker, f->data + pos, bytes, &new_segment);
+    if (len <= 0) {
+      break;
+    }
+    pos += len;
+    if (!new_segment && (pos < f->size)) {
+      continue;
+    }
+
+    if (num_seg == max_seg) {
+      max_seg = (max_seg > 0) ? 2 * max_seg : 64;
+      *segs = (struct sim_seg *)
+        realloc(*segs, max_seg * sizeof(struct sim_seg));
+      if (*segs == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+      }
+    }
+    struct sim_seg *s = &(*segs)[num_seg++];
+    unsigned char digest[FP_MAX_DIGEST_LEN];
+    fp_digest(FP_SHA256, f->data + seg_start, pos - seg_start, digest);
+    memset(s->key, '\0', MAX_KEY_LEN + 1);
+    fp_key(FP_SHA256, digest, s->key);
+    s->offset = seg_start;
+    s->len = pos - seg_start;
+    s->comp_len = sim_comp_len(s->key, f->data + seg_start, s->len);
+    seg_start = pos;
+  }
+
+  return num_seg;
+}
+
+/**
+ * @brief Add a reference to a segment, storing it if it is new.
+ * @param s The segment.
+ * @return Void.
+ */
+static void sim_add_seg(struct sim_seg *s)
+{
+  struct cache_entry *e = cache_index_find(&Index, s->key);
+  if (e == NULL) {
+    sim_cache_upload(s->key, s->comp_len);
+    e = sim_entry_new(&Index, s->key);
+    e->size = s->comp_len;
+  }
+  e->ref_count++;
+  sim_cache_set_ref(s->key, e->ref_count);
+}
+
+/**
+ * @brief Drop a reference to a segment, deleting it if it was the last.
+ * @param s The segment.
+ * @return Void.
+ */
+static void sim_remove_seg(struct sim_seg *s)
+{
+  struct cache_entry *e = cache_index_find(&Index, s->key);
+  if (e == NULL) {
+    return;
+  }
+  if (--e->ref_count > 0) {
+    sim_cache_set_ref(s->key, e->ref_count);
+    return;
+  }
+  sim_cache_remove(s->key, e->size);
+  cache_index_delete(&Index, e);
+  free(e);
+}
+
+/**
+ * @brief Read the segments of the cloud version of a file overlapping
+ *        a range through the store.
+ * @param f The file.
+ * @param start Start of the range.
+ * @param end End of the range.
+ * @return Void.
+ */
+static void sim_fetch(struct sim_file *f, long start, long end)
+{
+  int lo = 0;
+  int hi = f->num_seg;
+
+  /* first segment ending after "start" */
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (f->segs[mid].offset + f->segs[mid].len <= start) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  for (; (lo < f->num_seg) && (f->segs[lo].offset < end); lo++) {
+    sim_store_acquire(f, &f->segs[lo]);
+  }
+}
+
+/**
+ * @brief Store a file in the cloud, or store its new version.
+ * @param f The file.
+ * @return Void.
+ */
+static void sim_upload(struct sim_file *f)
+{
+  if (No_dedup) {
+    /* the object is overwritten */
+    R.usage -= f->obj_size;
+    cloud_put(f->size);
+    f->obj_size = f->size;
+    return;
+  }
+
+  struct sim_seg *segs = NULL;
+  int num_seg = sim_chunk(f, &segs);
+  int i = 0;
+  for (i = 0; i < num_seg; i++) {
+    sim_add_seg(&segs[i]);
+  }
+  for (i = 0; i < f->num_seg; i++) {
+    sim_remove_seg(&f->segs[i]);
+  }
+  free(f->segs);
+  f->segs = segs;
+  f->num_seg = num_seg;
+}
+
+/**
+ * @brief Delete a file from the cloud.
+ * @param f The file.
+ * @return Void.
+ */
+static void sim_delete(struct sim_file *f)
+{
+  if (No_dedup) {
+    cloud_delete(f->obj_size);
+    f->obj_size = 0;
+    return;
+  }
+
+  int i = 0;
+  for (i = 0; i < f->num_seg; i++) {
+    sim_remove_seg(&f->segs[i]);
+  }
+  free(f->segs);
+  f->segs = NULL;
+  f->num_seg = 0;
+}
+
+/* the file system --------------------------------------------------------- */
+
+/**
+ * @brief Find a file, creating it if asked to.
+ * @param path Path of the file.
+ * @param create Whether to create it.
+ * @return The file, NULL if not found.
+ */
+static struct sim_file *sim_file_get(char *path, int create)
+{
+  unsigned int h = 2166136261U;
+  char *c = path;
+  while (*c != '\0') {
+    h = (h ^ (unsigned char) *c++) * 16777619U;
+  }
+  struct sim_file **pf = &Files[h % FILE_BUCKETS];
+  while ((*pf != NULL) && (strcmp((*pf)->path, path) != 0)) {
+    pf = &(*pf)->next;
+  }
+  if ((*pf == NULL) && create) {
+    *pf = (struct sim_file *) calloc(1, sizeof(struct sim_file));
+    if (*pf == NULL) {
+      perror("calloc");
+      exit(EXIT_FAILURE);
+    }
+    (*pf)->path = path;
+    (*pf)->dirty_start = -1;
+  }
+  return *pf;
+}
+
+/**
+ * @brief Write to a file.
+ * @param f The file.
+ * @param op The write operation.
+ * @return Void.
+ */
+static void sim_write(struct sim_file *f, struct sim_op *op)
+{
+  long end = op->offset + op->len;
+  if (end > f->cap) {
+    f->cap = (end > 2 * f->cap) ? end : 2 * f->cap;
+    f->data = (char *) realloc(f->data, f->cap);
+    if (f->data == NULL) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (op->offset > f->size) {
+    memset(f->data + f->size, 0, op->offset - f->size);
+  }
+
+  long done = 0;
+  if (op->src != NULL) {
+    int fd = open(op->src, O_RDONLY);
+    if (fd >= 0) {
+      ssize_t n = 0;
+      while ((done < op->len) && ((n = pread(fd, f->data + op->offset + done,
+                op->len - done, op->src_offset + done)) > 0)) {
+        done += n;
+      }
+      close(fd);
+    }
+  }
+
+  /* generated data, the same for the same path and offset */
+  unsigned int seed = 2166136261U;
+  char *c = op->path;
+  while (*c != '\0') {
+    seed = (seed ^ (unsigned char) *c++) * 16777619U;
+  }
+  seed ^= (unsigned int) op->offset;
+  for (; done < op->len; done++) {
+    seed = seed * 1103515245U + 12345U;
+    f->data[op->offset + done] = (char) (seed >> 16);
+  }
+
+  if (end > f->size) {
+    f->size = end;
+  }
+  if ((f->dirty_start < 0) || (op->offset < f->dirty_start)) {
+    f->dirty_start = op->offset;
+  }
+  if (end > f->dirty_end) {
+    f->dirty_end = end;
+  }
+}
+
+/**
+ * @brief Close a file, the last close stores it as CloudFS would.
+ * @param f The file.
+ * @return Void.
+ */
+static void sim_close(struct sim_file *f)
+{
+  if ((f->opens == 0) || (--f->opens > 0)) {
+    return;
+  }
+
+  if (f->dirty_start >= 0) {
+    if (!f->in_cloud) {
+      if (f->size > Threshold) {
+        sim_upload(f);
+        f->in_cloud = 1;
+      }
+    } else if (f->size < Threshold) {
+      sim_delete(f);
+      f->in_cloud = 0;
+    } else {
+      if (!No_dedup) {
+        /* the untouched data of the modified segments */
+        sim_fetch(f, f->dirty_start, f->dirty_end);
+      }
+      sim_upload(f);
+    }
+  }
+
+  f->dirty_start = -1;
+  f->dirty_end = 0;
+  sim_store_release(f);
+}
+
+/**
+ * @brief Apply an operation of the workload.
+ * @param op The operation.
+ * @return Void.
+ */
+static void sim_apply(struct sim_op *op)
+{
+  struct sim_file *f = sim_file_get(op->path,
+      (op->type == OP_OPEN) || (op->type == OP_WRITE));
+  if (f == NULL) {
+    return;
+  }
+
+  switch (op->type) {
+    case OP_OPEN:
+      if (f->opens++ == 0) {
+        f->held = (struct cache_index *) malloc(sizeof(struct cache_index));
+        if ((f->held == NULL) || (cache_index_init(f->held) < 0)) {
+          fprintf(stderr, "out of memory\n");
+          exit(EXIT_FAILURE);
+        }
+        if (f->in_cloud && No_dedup) {
+          cloud_get(f->obj_size);
+        }
+      }
+      break;
+    case OP_READ:
+      if (f->in_cloud && !No_dedup && (f->held != NULL)) {
+        sim_fetch(f, op->offset, op->offset + op->len);
+      }
+      break;
+    case OP_WRITE:
+      sim_write(f, op);
+      break;
+    case OP_TRUNCATE:
+      if (op->len < f->size) {
+        if ((f->dirty_start < 0) || (op->len < f->dirty_start)) {
+          f->dirty_start = op->len;
+        }
+        if (f->size > f->dirty_end) {
+          f->dirty_end = f->size;
+        }
+        f->size = op->len;
+      } else if (op->len > f->size) {
+        struct sim_op grow = { OP_WRITE, op->path, f->size, op->len - f->size,
+          NULL, 0 };
+        sim_write(f, &grow);
+      }
+      break;
+    case OP_CLOSE:
+      sim_close(f);
+      break;
+    case OP_UNLINK:
+      if (f->in_cloud) {
+        sim_delete(f);
+        f->in_cloud = 0;
+      }
+      f->size = 0;
+      f->dirty_start = -1;
+      f->dirty_end = 0;
+      break;
+  }
+}
+
+/**
+ * @brief Forget all files.
+ * @return Void.
+ */
+static void sim_files_free(void)
+{
+  int i = 0;
+  for (i = 0; i < FILE_BUCKETS; i++) {
+    while (Files[i] != NULL) {
+      struct sim_file *f = Files[i];
+      Files[i] = f->next;
+      free(f->data);
+      free(f->segs);
+      sim_store_release(f);
+      free(f);
+    }
+  }
+}
+
+/**
+ * @brief Replay the workload with one configuration.
+ * @param policy One of the CACHE_POLICY_* policies.
+ * @param mode One of the CACHE_MODE_* modes.
+ * @param cache_size Size of the cache in bytes.
+ * @param avg_seg_size Average segment size in bytes.
+ * @return Void, the result is in R.
+ */
+static void sim_run(int policy, int mode, long cache_size, int avg_seg_size)
+{
+  struct timespec t0;
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  memset(&R, 0, sizeof(struct sim_result));
+  Policy = cache_policy_get(policy);
+  Mode = mode;
+  Cache_size = cache_size;
+  Avg_seg_size = avg_seg_size;
+  Remaining_space = cache_size;
+  Clock = 0;
+  Store_used = 0;
+  Store_head = NULL;
+  Store_tail = NULL;
+  Chunker = chunker_init(Chunker_type, Rabin_window, avg_seg_size,
+      avg_seg_size / 2, avg_seg_size * 2);
+  if ((Chunker == NULL) || (cache_index_init(&Index) < 0)
+      || (cache_index_init(&Cached) < 0) || (cache_index_init(&Store) < 0)
+      || (Policy->init(cache_size) < 0)) {
+    fprintf(stderr, "failed to initialize the simulation\n");
+    exit(EXIT_FAILURE);
+  }
+
+  int i = 0;
+  for (i = 0; i < Num_ops; i++) {
+    sim_apply(&Ops[i]);
+  }
+
+  sim_files_free();
+  Policy->destroy();
+  cache_index_destroy(&Store);
+  cache_index_destroy(&Cached);
+  cache_index_destroy(&Index);
+  chunker_free(&Chunker);
+
+  R.cost = R.max_usage * CLOUD_COST_CAPACITY + R.requests * CLOUD_COST_REQUEST
+    + R.read_bytes * CLOUD_COST_READ;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  R.seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+/* the workload ------------------------------------------------------------ */
+
+/**
+ * @brief Append an operation to the workload.
+ * @param op The operation, copied.
+ * @return Void.
+ */
+static void add_op(struct sim_op *op)
+{
+  static int max_ops;
+  if (Num_ops == max_ops) {
+    max_ops = (max_ops > 0) ? 2 * max_ops : 1024;
+    Ops = (struct sim_op *) realloc(Ops, max_ops * sizeof(struct sim_op));
+    if (Ops == NULL) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+  Ops[Num_ops++] = *op;
+}
+
+/**
+ * @brief Read a trace.
+ * @param trace Pathname of the trace, "-" for stdin.
+ * @return 0 on success, -1 otherwise.
+ */
+static int read_trace(const char *trace)
+{
+  FILE *in = (strcmp(trace, "-") == 0) ? stdin : fopen(trace, "r");
+  if (in == NULL) {
+    perror(trace);
+    return -1;
+  }
+
+  char line[LINE_LEN];
+  char cmd[16];
+  char path[LINE_LEN];
+  char src[LINE_LEN];
+  int num = 0;
+  while (fgets(line, LINE_LEN, in) != NULL) {
+    num++;
+    struct sim_op op;
+    memset(&op, 0, sizeof(struct sim_op));
+    int n = sscanf(line, "%15s %s %ld %ld %s %ld", cmd, path, &op.offset,
+        &op.len, src, &op.src_offset);
+    if ((n <= 0) || (cmd[0] == '#')) {
+      continue;
+    }
+
+    if ((strcmp(cmd, "open") == 0) && (n >= 2)) {
+      op.type = OP_OPEN;
+    } else if ((strcmp(cmd, "close") == 0) && (n >= 2)) {
+      op.type = OP_CLOSE;
+    } else if ((strcmp(cmd, "unlink") == 0) && (n >= 2)) {
+      op.type = OP_UNLINK;
+    } else if ((strcmp(cmd, "read") == 0) && (n >= 4)) {
+      op.type = OP_READ;
+    } else if ((strcmp(cmd, "write") == 0) && (n >= 4)) {
+      op.type = OP_WRITE;
+      if (n >= 5) {
+        op.src = strdup(src);
+      }
+    } else if ((strcmp(cmd, "truncate") == 0) && (n >= 3)) {
+      op.type = OP_TRUNCATE;
+      op.len = op.offset;
+      op.offset = 0;
+    } else {
+      fprintf(stderr, "%s:%d: bad operation\n", trace, num);
+      if (in != stdin) {
+        fclose(in);
+      }
+      return -1;
+    }
+    op.path = strdup(path);
+    add_op(&op);
+  }
+
+  if (in != stdin) {
+    fclose(in);
+  }
+  return 0;
+}
+
+static const char *Snapshot_root;
+static int Snapshot_num;
+static char **Snapshot_files;
+
+/* collects the regular files of a snapshot */
+static int snapshot_file(const char *fpath, const struct stat *sb,
+    int typeflag, struct FTW *ftwbuf)
+{
+  (void) sb;
+  (void) ftwbuf;
+  if (typeflag == FTW_F) {
+    Snapshot_files = (char **)
+      realloc(Snapshot_files, (Snapshot_num + 1) * sizeof(char *));
+    if (Snapshot_files == NULL) {
+      return -1;
+    }
+    Snapshot_files[Snapshot_num++] = strdup(fpath);
+  }
+  return 0;
+}
+
+/**
+ * @brief Make the workload of a directory snapshot: every file is
+ *        copied in, then every file is read back.
+ * @param dir The directory.
+ * @return 0 on success, -1 otherwise.
+ */
+static int read_snapshot(const char *dir)
+{
+  Snapshot_root = dir;
+  if (nftw(dir, snapshot_file, 16, FTW_PHYS) < 0) {
+    perror(dir);
+    return -1;
+  }
+
+  int pass = 0;
+  int i = 0;
+  for (pass = 0; pass < 2; pass++) {
+    for (i = 0; i < Snapshot_num; i++) {
+      struct stat sb;
+      if (lstat(Snapshot_files[i], &sb) < 0) {
+        continue;
+      }
+      struct sim_op op;
+      memset(&op, 0, sizeof(struct sim_op));
+      op.path = Snapshot_files[i] + strlen(Snapshot_root);
+      op.type = OP_OPEN;
+      add_op(&op);
+      op.len = sb.st_size;
+      if (pass == 0) {
+        op.type = OP_WRITE;
+        op.src = Snapshot_files[i];
+      } else {
+        op.type = OP_READ;
+      }
+      add_op(&op);
+      op.type = OP_CLOSE;
+      add_op(&op);
+    }
+  }
+  return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void usage(const char *program)
+{
+  printf("\n");
+  printf("This program replays a workload through the chunker, the dedup\n");
+  printf("index and the cache of CloudFS against a modeled cloud, and\n");
+  printf("prints the cloud requests, bytes, peak usage and cost of every\n");
+  printf("combination of the swept settings, cheapest last.\n\n");
+  printf("Usage : %s (-t <trace> | -D <directory>)\n", program);
+  printf("           [-c <cache-size>[,...]] [-S <avg-seg-size>[,...]]\n");
+  printf("           [-E <cache-policy>[,...]|all]\n");
+  printf("           [-I <cache-mode>[,...]|all] [-C rabin|gear]\n");
+  printf("           [-T <threshold>] [-w <rabin-window-size>]"
+      " [-B <store-size>]\n");
+  printf("           [-H <evict-high>] [-L <evict-low>] [-d] [-o] [-z]\n\n");
+  printf("Sizes are in KB, as for CloudFS, and default to its defaults.\n");
+  printf("-H and -L are the watermarks of background eviction in percent.\n");
+  printf("-B is the budget of the decompressed segment store, as for\n");
+  printf("CloudFS; 0 keeps segments only while opened files hold them.\n");
+  printf("-d, -o and -z turn off dedup, the cache and compression.\n\n");
+}
+
+/**
+ * @brief Parse a comma-separated list of sizes in KB.
+ * @param arg The list.
+ * @param values The sizes in bytes are returned here.
+ * @return Number of sizes, -1 if the list is invalid.
+ */
+static int parse_sizes(char *arg, long *values)
+{
+  int num = 0;
+  char *tok = strtok(arg, ",");
+  while ((tok != NULL) && (num < MAX_SWEEP)) {
+    values[num] = atol(tok) * 1024;
+    if (values[num] < 0) {
+      return -1;
+    }
+    num++;
+    tok = strtok(NULL, ",");
+  }
+  return num;
+}
+
+/**
+ * @brief Parse a comma-separated list of cache policies or modes.
+ * @param arg The list, or "all".
+ * @param values The policies or modes are returned here.
+ * @param type Gets a policy or mode by its name, -1 if unknown.
+ * @param num_types Number of policies or modes.
+ * @return Number of policies or modes, -1 if the list is invalid.
+ */
+static int parse_names(char *arg, int *values, int (*type)(const char *),
+    int num_types)
+{
+  int num = 0;
+  if (strcmp(arg, "all") == 0) {
+    for (num = 0; num < num_types; num++) {
+      values[num] = num;
+    }
+    return num;
+  }
+  char *tok = strtok(arg, ",");
+  while ((tok != NULL) && (num < MAX_SWEEP)) {
+    values[num] = type(tok);
+    if (values[num] < 0) {
+      return -1;
+    }
+    num++;
+    tok = strtok(NULL, ",");
+  }
+  return num;
+}
+
+int main(int argc, char **argv)
+{
+  long cache_sizes[MAX_SWEEP] = { 32 * 1024 * 1024 };
+  long seg_sizes[MAX_SWEEP] = { 4096 };
+  int policies[MAX_SWEEP] = { CACHE_POLICY_REFCOUNT };
+  int modes[MAX_SWEEP] = { CACHE_MODE_EXCLUSIVE };
+  int num_cache = 1;
+  int num_seg = 1;
+  int num_policy = 1;
+  int num_mode = 1;
+  char *trace = NULL;
+  char *dir = NULL;
+  int c = 0;
+
+  Log = stderr;
+  while ((c = getopt(argc, argv, "t:D:c:S:E:I:H:L:C:T:w:B:doz")) != -1) {
+    switch (c) {
+      case 't':
+        trace = optarg;
+        break;
+      case 'D':
+        dir = optarg;
+        break;
+      case 'c':
+        num_cache = parse_sizes(optarg, cache_sizes);
+        break;
+      case 'S':
+        num_seg = parse_sizes(optarg, seg_sizes);
+        break;
+      case 'E':
+        num_policy = parse_names(optarg, policies, cache_policy_type,
+            CACHE_POLICY_NUM);
+        break;
+      case 'I':
+        num_mode = parse_names(optarg, modes, cache_policy_mode,
+            CACHE_MODE_NUM);
+        break;
+      case 'C':
+        Chunker_type = chunker_type(optarg);
+        break;
+      case 'T':
+        Threshold = atol(optarg) * 1024;
+        break;
+      case 'w':
+        Rabin_window = atoi(optarg);
+        break;
+      case 'B':
+        Store_size = atol(optarg) * 1024;
+        break;
+      case 'd':
+        No_dedup = 1;
+        break;
+      case 'o':
+        No_cache = 1;
+        break;
+      case 'z':
+        No_compress = 1;
+        break;
+      case 'H':
+        Evict_high = atoi(optarg);
+        break;
+      case 'L':
+        Evict_low = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (((trace == NULL) == (dir == NULL)) || (num_cache <= 0)
+      || (num_seg <= 0) || (num_policy <= 0) || (num_mode <= 0)
+      || (Chunker_type < 0) || (Store_size < 0) || (Evict_high < 0)
+      || (Evict_high > 100)
+      || ((Evict_high > 0) && ((Evict_low < 0) || (Evict_low >= Evict_high)))) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (((trace != NULL) ? read_trace(trace) : read_snapshot(dir)) < 0) {
+    return EXIT_FAILURE;
+  }
+  if (cache_index_init(&Comp_lens) < 0) {
+    return EXIT_FAILURE;
+  }
+
+  /* without dedup the cache is not used, nor the segment size */
+  if (No_dedup) {
+    num_seg = 1;
+  }
+  if (No_dedup || No_cache) {
+    num_cache = 1;
+    num_policy = 1;
+    num_mode = 1;
+  }
+
+  printf("%-9s %-9s %9s %7s %9s %7s %7s %7s %12s %12s %12s %10s %7s\n",
+      "policy", "mode", "cache_kb", "seg_kb", "requests", "puts", "gets",
+      "dels", "read_bytes", "write_bytes", "max_usage", "cost", "seconds");
+  double best_cost = -1;
+  char best[256] = "";
+  int i = 0;
+  int j = 0;
+  int k = 0;
+  int m = 0;
+  for (k = 0; k < num_seg; k++) {
+    for (j = 0; j < num_cache; j++) {
+      for (i = 0; i < num_policy; i++) {
+        for (m = 0; m < num_mode; m++) {
+          sim_run(policies[i], modes[m], cache_sizes[j], seg_sizes[k]);
+          char row[256];
+          snprintf(row, sizeof(row), "%-9s %-9s %9ld %7ld %9ld %7ld %7ld %7ld"
+              " %12ld %12ld %12ld %10.4f %7.2f", Policy->name,
+              cache_policy_mode_name(Mode), Cache_size / 1024,
+              (long) Avg_seg_size / 1024, R.requests, R.puts, R.gets, R.dels,
+              R.read_bytes, R.write_bytes, R.max_usage, R.cost, R.seconds);
+          printf("%s\n", row);
+          if ((best_cost < 0) || (R.cost < best_cost)) {
+            best_cost = R.cost;
+            strcpy(best, row);
+          }
+        }
+      }
+    }
+  }
+  printf("cheapest:\n%s\n", best);
+
+  return EXIT_SUCCESS;
+}
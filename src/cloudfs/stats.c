@@ -0,0 +1,129 @@
+/**
+ * @file stats.c
+ * @brief Statistics of CloudFS modules.
+ *
+ *        Modules register a function writing their statistics, and all
+ *        of them are written to a text file, a "[section]" line followed
+ *        by "name value" lines for each module. The file is rewritten
+ *        now and then as files are closed, and when unmounting; a new
+ *        version is written aside and renamed, so readers never see a
+ *        partial file.
+ *
+ * @author Yinsu Chu (yinsuc)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+// #define DEBUG
+#include "cloudfs.h"
+
+#include "stats.h"
+
+/* most modules that can register */
+#define STATS_MAX_SECTIONS (16)
+
+/* least number of seconds between two writes of the file */
+#define STATS_INTERVAL (10)
+
+extern FILE *Log;
+
+static char Stats_path[MAX_PATH_LEN];
+static struct {
+  const char *section;
+  stats_fn_t fn;
+} Sections[STATS_MAX_SECTIONS];
+static int Num_sections;
+static time_t Last_write;
+
+/* serializes writes of the file */
+static pthread_mutex_t Stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Initialize the statistics.
+ * @param path Pathname of the statistics file.
+ * @return Void.
+ */
+void stats_init(char *path)
+{
+  memset(Stats_path, '\0', MAX_PATH_LEN);
+  strncpy(Stats_path, path, MAX_PATH_LEN - 1);
+  Num_sections = 0;
+  Last_write = 0;
+}
+
+/**
+ * @brief Register the statistics of a module.
+ * @param section Name of the module, a constant string.
+ * @param fn Function writing the statistics, it must be safe to call
+ *           from any thread.
+ * @return Void.
+ */
+void stats_register(const char *section, stats_fn_t fn)
+{
+  pthread_mutex_lock(&Stats_lock);
+  if (Num_sections < STATS_MAX_SECTIONS) {
+    Sections[Num_sections].section = section;
+    Sections[Num_sections].fn = fn;
+    Num_sections++;
+  }
+  pthread_mutex_unlock(&Stats_lock);
+}
+
+/**
+ * @brief Write the statistics file.
+ * @param force If not set, the file is only written if it was not
+ *              written for a while.
+ * @return Void.
+ */
+void stats_write(int force)
+{
+  char tmp[MAX_PATH_LEN] = "";
+  int i = 0;
+
+  if (Stats_path[0] == '\0') {
+    return;
+  }
+
+  pthread_mutex_lock(&Stats_lock);
+  time_t now = time(NULL);
+  if (!force && (now - Last_write < STATS_INTERVAL)) {
+    pthread_mutex_unlock(&Stats_lock);
+    return;
+  }
+  Last_write = now;
+
+  snprintf(tmp, MAX_PATH_LEN, "%s.new", Stats_path);
+  FILE *out = fopen(tmp, "w");
+  if (out == NULL) {
+    cloudfs_error("stats_write - fopen");
+    pthread_mutex_unlock(&Stats_lock);
+    return;
+  }
+  for (i = 0; i < Num_sections; i++) {
+    fprintf(out, "[%s]\n", Sections[i].section);
+    Sections[i].fn(out);
+  }
+  if (fclose(out) != 0) {
+    cloudfs_error("stats_write - fclose");
+  } else if (rename(tmp, Stats_path) < 0) {
+    cloudfs_error("stats_write - rename");
+  }
+  pthread_mutex_unlock(&Stats_lock);
+
+  dbg_print("[DBG] stats_write(force=%d)\n", force);
+}
+
+/**
+ * @brief Write the statistics file a last time, and forget the modules.
+ * @return Void.
+ */
+void stats_destroy(void)
+{
+  stats_write(1);
+  pthread_mutex_lock(&Stats_lock);
+  Num_sections = 0;
+  pthread_mutex_unlock(&Stats_lock);
+}
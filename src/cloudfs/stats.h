@@ -0,0 +1,14 @@
+#ifndef __STATS_H_
+#define __STATS_H_
+
+#include <stdio.h>
+
+/* writes the statistics of a module, one "name value" per line */
+typedef void (*stats_fn_t)(FILE *out);
+
+void stats_init(char *path);
+void stats_register(const char *section, stats_fn_t fn);
+void stats_write(int force);
+void stats_destroy(void);
+
+#endif
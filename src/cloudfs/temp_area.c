@@ -0,0 +1,357 @@
+/**
+ * @file temp_area.c
+ * @brief Scratch directories of opened cloud files.
+ *
+ *        An opened cloud file needs a directory for its overlay and the
+ *        per-segment flags. Instead of creating a directory on every open
+ *        and removing it on every release, directories are numbered slots
+ *        under one parent: a slot is bound to a file while it is opened
+ *        (all handles of the file share it), emptied when the last handle
+ *        is gone, and kept for the next open. Only a bounded number of
+ *        free slots are kept, the others are removed.
+ *
+ *        Removal is done in-process with openat()/unlinkat(), without
+ *        running any external command. Slots left by a crash are removed
+ *        on the next mount.
+ *
+ * @author Yinsu Chu (yinsuc)
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// #define DEBUG
+#include "cloudfs.h"
+
+#include "temp_area.h"
+
+extern FILE *Log;
+
+/* a scratch directory */
+struct temp_slot {
+  long id; /* also the name of the directory */
+  char *key; /* the file it is bound to, NULL if free */
+  int ref_count;
+  struct temp_slot *next;
+};
+
+static char Dir[MAX_PATH_LEN];
+static int Max_free;
+static int Num_free;
+static long Next_id;
+
+static struct temp_slot *Used;
+static struct temp_slot *Free;
+
+/* protects everything above */
+static pthread_mutex_t Temp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Get the pathname of a slot.
+ * @param id Number of the slot.
+ * @param dir The pathname is returned here. It should have at least
+ *            MAX_PATH_LEN bytes.
+ * @return Void.
+ */
+static void temp_area_get_path(long id, char *dir)
+{
+  snprintf(dir, MAX_PATH_LEN, "%s/%ld", Dir, id);
+}
+
+/**
+ * @brief Find a bound slot by its pathname, the caller holds Temp_lock.
+ * @param dir Pathname of the slot.
+ * @return The slot, NULL if not found.
+ */
+static struct temp_slot *temp_area_find(const char *dir)
+{
+  struct temp_slot *slot = NULL;
+  for (slot = Used; slot != NULL; slot = slot->next) {
+    char path[MAX_PATH_LEN] = "";
+    temp_area_get_path(slot->id, path);
+    if (strcmp(path, dir) == 0) {
+      break;
+    }
+  }
+  return slot;
+}
+
+/**
+ * @brief Remove everything inside a directory.
+ * @param fd Descriptor of the directory, closed by this function.
+ * @return 0 on success, -errno otherwise.
+ */
+static int temp_area_clear_fd(int fd)
+{
+  int retval = 0;
+
+  DIR *dirp = fdopendir(fd);
+  if (dirp == NULL) {
+    retval = cloudfs_error("temp_area_clear_fd");
+    close(fd);
+    return retval;
+  }
+  int dfd = dirfd(dirp);
+
+  struct dirent *entry = NULL;
+  while ((entry = readdir(dirp)) != NULL) {
+    const char *name = entry->d_name;
+    if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
+      continue;
+    }
+
+    int is_dir = (entry->d_type == DT_DIR);
+    if (entry->d_type == DT_UNKNOWN) {
+      struct stat sb;
+      if (fstatat(dfd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+        is_dir = S_ISDIR(sb.st_mode);
+      }
+    }
+
+    if (!is_dir) {
+      if ((unlinkat(dfd, name, 0) < 0) && (errno != ENOENT)) {
+        retval = cloudfs_error("temp_area_clear_fd");
+      }
+      continue;
+    }
+
+    int sub = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (sub < 0) {
+      retval = cloudfs_error("temp_area_clear_fd");
+      continue;
+    }
+    int sub_retval = temp_area_clear_fd(sub);
+    if (sub_retval < 0) {
+      retval = sub_retval;
+    }
+    if (unlinkat(dfd, name, AT_REMOVEDIR) < 0) {
+      retval = cloudfs_error("temp_area_clear_fd");
+    }
+  }
+  closedir(dirp);
+
+  return retval;
+}
+
+/**
+ * @brief Recursively remove a directory.
+ *        This directory along with everything inside it are removed.
+ * @param path Pathname of the directory.
+ * @return 0 on success (or if it does not exist), -errno otherwise.
+ */
+int temp_area_remove_tree(const char *path)
+{
+  int retval = 0;
+
+  int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+  if (fd < 0) {
+    return (errno == ENOENT) ? 0 : cloudfs_error("temp_area_remove_tree");
+  }
+  retval = temp_area_clear_fd(fd);
+  if ((retval == 0) && (rmdir(path) < 0)) {
+    retval = cloudfs_error("temp_area_remove_tree");
+  }
+
+  dbg_print("[DBG] temp_area_remove_tree(path=\"%s\")=%d\n", path, retval);
+
+  return retval;
+}
+
+/**
+ * @brief Initialize the temporary area.
+ *        Whatever a previous mount left there is removed.
+ * @param dir The directory holding the slots.
+ * @param max_free Maximum number of free slots to keep.
+ * @return 0 on success, -errno otherwise.
+ */
+int temp_area_init(char *dir, int max_free)
+{
+  int retval = 0;
+
+  strncpy(Dir, dir, MAX_PATH_LEN);
+  Dir[MAX_PATH_LEN - 1] = '\0';
+  Max_free = max_free;
+
+  retval = temp_area_remove_tree(Dir);
+  if (retval < 0) {
+    return retval;
+  }
+  if (mkdir(Dir, DEFAULT_DIR_MODE) < 0) {
+    retval = cloudfs_error("temp_area_init");
+  }
+
+  dbg_print("[DBG] temp_area_init(dir=\"%s\", max_free=%d)=%d\n", dir,
+      max_free, retval);
+
+  return retval;
+}
+
+/**
+ * @brief CloudFS should call this function upon exiting.
+ *        The directories are left for the next mount to remove.
+ * @return Void.
+ */
+void temp_area_destroy(void)
+{
+  pthread_mutex_lock(&Temp_lock);
+  while (Used != NULL) {
+    struct temp_slot *slot = Used;
+    Used = slot->next;
+    free(slot->key);
+    free(slot);
+  }
+  while (Free != NULL) {
+    struct temp_slot *slot = Free;
+    Free = slot->next;
+    free(slot);
+  }
+  Num_free = 0;
+  pthread_mutex_unlock(&Temp_lock);
+}
+
+/**
+ * @brief Get the scratch directory of a file and reference it.
+ *        If the file has none, a free slot is bound to it, or a new one
+ *        is created.
+ * @param key Identifies the file, e.g. its pathname on SSD.
+ * @param dir The pathname of the directory is returned here. It should have
+ *            at least MAX_PATH_LEN bytes.
+ * @return 1 if the directory is newly bound to the file (so it is empty),
+ *         0 if the file has it already, -errno otherwise. On success the
+ *         caller should call temp_area_release() once the directory is no
+ *         longer used.
+ */
+int temp_area_acquire(const char *key, char *dir)
+{
+  int retval = 0;
+
+  pthread_mutex_lock(&Temp_lock);
+  struct temp_slot *slot = NULL;
+  for (slot = Used; slot != NULL; slot = slot->next) {
+    if (strcmp(slot->key, key) == 0) {
+      break;
+    }
+  }
+  if (slot != NULL) {
+    slot->ref_count++;
+    temp_area_get_path(slot->id, dir);
+    pthread_mutex_unlock(&Temp_lock);
+    return retval;
+  }
+
+  char *copy = strdup(key);
+  if (copy == NULL) {
+    retval = cloudfs_error("temp_area_acquire");
+    pthread_mutex_unlock(&Temp_lock);
+    return retval;
+  }
+
+  if (Free != NULL) {
+    slot = Free;
+    Free = slot->next;
+    Num_free--;
+    temp_area_get_path(slot->id, dir);
+  } else {
+    slot = (struct temp_slot *) calloc(1, sizeof(struct temp_slot));
+    if (slot == NULL) {
+      retval = cloudfs_error("temp_area_acquire");
+      free(copy);
+      pthread_mutex_unlock(&Temp_lock);
+      return retval;
+    }
+    slot->id = Next_id++;
+    temp_area_get_path(slot->id, dir);
+    if (mkdir(dir, DEFAULT_DIR_MODE) < 0) {
+      retval = cloudfs_error("temp_area_acquire");
+      free(copy);
+      free(slot);
+      pthread_mutex_unlock(&Temp_lock);
+      return retval;
+    }
+  }
+  slot->key = copy;
+  slot->ref_count = 1;
+  slot->next = Used;
+  Used = slot;
+  pthread_mutex_unlock(&Temp_lock);
+  retval = 1;
+
+  dbg_print("[DBG] temp_area_acquire(key=\"%s\", dir=\"%s\")=%d\n", key, dir,
+      retval);
+
+  return retval;
+}
+
+/**
+ * @brief Take another reference on a directory from temp_area_acquire().
+ * @param dir Pathname of the directory.
+ * @return Void.
+ */
+void temp_area_hold(const char *dir)
+{
+  pthread_mutex_lock(&Temp_lock);
+  struct temp_slot *slot = temp_area_find(dir);
+  if (slot != NULL) {
+    slot->ref_count++;
+  }
+  pthread_mutex_unlock(&Temp_lock);
+}
+
+/**
+ * @brief Drop a reference on a directory.
+ *        When the last one is dropped, the directory is emptied and kept
+ *        for another file, or removed if enough are kept already.
+ * @param dir Pathname of the directory.
+ * @return Void.
+ */
+void temp_area_release(const char *dir)
+{
+  pthread_mutex_lock(&Temp_lock);
+  struct temp_slot *slot = temp_area_find(dir);
+  if ((slot == NULL) || (--slot->ref_count > 0)) {
+    pthread_mutex_unlock(&Temp_lock);
+    return;
+  }
+  struct temp_slot **pp = &Used;
+  while (*pp != slot) {
+    pp = &((*pp)->next);
+  }
+  *pp = slot->next;
+  free(slot->key);
+  slot->key = NULL;
+  pthread_mutex_unlock(&Temp_lock);
+
+  /* no one can reach the slot now, empty it without holding the lock */
+  int retval = 0;
+  int fd = open(dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+  if (fd < 0) {
+    retval = cloudfs_error("temp_area_release");
+  } else {
+    retval = temp_area_clear_fd(fd);
+  }
+
+  pthread_mutex_lock(&Temp_lock);
+  if ((retval == 0) && (Num_free < Max_free)) {
+    slot->next = Free;
+    Free = slot;
+    Num_free++;
+    pthread_mutex_unlock(&Temp_lock);
+    dbg_print("[DBG] scratch directory %s recycled\n", dir);
+    return;
+  }
+  pthread_mutex_unlock(&Temp_lock);
+
+  temp_area_remove_tree(dir);
+  free(slot);
+  dbg_print("[DBG] scratch directory %s removed\n", dir);
+}
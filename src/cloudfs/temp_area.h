@@ -0,0 +1,14 @@
+#ifndef __TEMP_AREA_H_
+#define __TEMP_AREA_H_
+
+/* empty scratch directories kept for reuse */
+#define TEMP_AREA_MAX_FREE (64)
+
+int temp_area_init(char *dir, int max_free);
+void temp_area_destroy(void);
+int temp_area_acquire(const char *key, char *dir);
+void temp_area_hold(const char *dir);
+void temp_area_release(const char *dir);
+int temp_area_remove_tree(const char *path);
+
+#endif
@@ -13,8 +13,11 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
 #include "zlib.h"
 
 #if defined(MSDOS) || defined(OS2) || defined(WIN32) || defined(__CYGWIN__)
@@ -27,17 +30,66 @@
 
 #define CHUNK 16384
 
-static int compress_compute_cost = 0;
-
-static void log_compress_compute_cost()
+/* The compression compute cost is the number of def() and inf() calls. It
+   is counted in memory and written to COMPUTE_COST_FILE from time to time,
+   when compress_compute_cost_flush() is called and at exit, rather than on
+   every call. Callers flush at the end of each operation, so the file is
+   current even if no further call comes. */
+#define COMPUTE_COST_FILE "/tmp/compress_compute_cost"
+#define COMPUTE_COST_FLUSH_INTERVAL 1   /* seconds */
+
+static long compress_compute_cost_count = 0;
+static long compress_compute_cost_flushed = -1;  /* value in the file */
+static time_t compress_compute_cost_time = 0;    /* when it was written */
+static pthread_mutex_t compress_compute_cost_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t compress_compute_cost_once = PTHREAD_ONCE_INIT;
+
+/* write the counter out, the caller holds compress_compute_cost_lock */
+static void write_compress_compute_cost()
 {
-    FILE* fp = fopen("/tmp/compress_compute_cost","w");
+    long cost = __sync_add_and_fetch(&compress_compute_cost_count, 0);
+    compress_compute_cost_time = time(NULL);
+    if (cost == compress_compute_cost_flushed) {
+        return;
+    }
+    FILE* fp = fopen(COMPUTE_COST_FILE,"w");
     if (!fp) {
         return;
     }
-    compress_compute_cost++;
-    fprintf(fp, "%d\n", compress_compute_cost);
+    fprintf(fp, "%ld\n", cost);
     fclose(fp);
+    compress_compute_cost_flushed = cost;
+}
+
+long compress_compute_cost(void)
+{
+    return __sync_add_and_fetch(&compress_compute_cost_count, 0);
+}
+
+void compress_compute_cost_flush(void)
+{
+    pthread_mutex_lock(&compress_compute_cost_lock);
+    write_compress_compute_cost();
+    pthread_mutex_unlock(&compress_compute_cost_lock);
+}
+
+static void register_compress_compute_cost()
+{
+    atexit(compress_compute_cost_flush);
+}
+
+static void log_compress_compute_cost()
+{
+    pthread_once(&compress_compute_cost_once, register_compress_compute_cost);
+    __sync_add_and_fetch(&compress_compute_cost_count, 1);
+    /* a stale read of the time only delays the write */
+    if (time(NULL) - compress_compute_cost_time < COMPUTE_COST_FLUSH_INTERVAL) {
+        return;
+    }
+    if (pthread_mutex_trylock(&compress_compute_cost_lock) == 0) {
+        write_compress_compute_cost();
+        pthread_mutex_unlock(&compress_compute_cost_lock);
+    }
 }
 
 /* Compress from file source to file dest until EOF on source.
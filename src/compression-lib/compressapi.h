@@ -39,5 +39,20 @@ int def(FILE *source, FILE *dest, int len, int level);
   * @return returns Z_OK if success, negative otherwise
   */
 int inf(FILE *source, FILE *dest);
+/** @brief This api returns the compression compute cost so far
+  *
+  * The cost is the number of def() and inf() calls made by the process.
+  * It is also written to /tmp/compress_compute_cost by a call coming a
+  * second or more after the last write, when compress_compute_cost_flush()
+  * is called, and at exit. Call compress_compute_cost_flush() at the end
+  * of an operation to keep the file current.
+  *
+  * @return returns the number of def() and inf() calls
+  */
+long compress_compute_cost(void);
+/** @brief This api writes the compression compute cost to
+  *        /tmp/compress_compute_cost now
+  */
+void compress_compute_cost_flush(void);
 
 #endif
@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <openssl/md5.h>
+#include "dedup.h"
+
+/* bytes handed to the engine per call, like a read() buffer */
+#define FEED_LEN (64 * 1024)
+
+/* distinct segments tracked to estimate the dedup ratio */
+#define HASH_BUCKETS (1 << 20)
+
+struct digest {
+	unsigned char md5[MD5_DIGEST_LENGTH];
+	struct digest *next;
+};
+
+void usage(const char *program)
+{
+	printf("\n");
+	printf("This program reads its input into memory and divides it into\n");
+	printf("segments with every chunking engine. It prints the throughput,\n");
+	printf("the number and mean size of the segments and the dedup ratio\n");
+	printf("(input bytes over bytes of distinct segments) of each engine.\n\n");
+	printf("Usage : %s -a <avg-segment-size> -i <min-segment-size>\n", program);
+	printf("           -x <max-segment-size> -w <rabin-window-size>\n");
+	printf("           -r <rounds>\n\n");
+	printf("Input is read from stdin.\n\n");
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* cut the data, record the segment lengths if "lens" is given */
+static long segment(chunker_t *c, const char *data, long size, int *lens)
+{
+	long num = 0;
+	long pos = 0;
+	int seg_len = 0;
+	int new_segment = 0;
+	int len = 0;
+
+	while (pos < size) {
+		long bytes = size - pos;
+		if (bytes > FEED_LEN) {
+			bytes = FEED_LEN;
+		}
+		const char *buftoread = data + pos;
+		while ((bytes > 0) &&
+				((len = chunker_next(c, buftoread, bytes, &new_segment)) > 0)) {
+			seg_len += len;
+			if (new_segment) {
+				if (lens) {
+					lens[num] = seg_len;
+				}
+				num++;
+				seg_len = 0;
+			}
+			buftoread += len;
+			bytes -= len;
+			pos += len;
+		}
+		if (len == -1) {
+			fprintf(stderr, "Failed to process the segment\n");
+			exit(2);
+		}
+	}
+	if (lens) {
+		lens[num] = seg_len;
+	}
+	return num + 1;
+}
+
+/* bytes of distinct segments */
+static long distinct_bytes(const char *data, int *lens, long num)
+{
+	struct digest **buckets = calloc(HASH_BUCKETS, sizeof(struct digest *));
+	long total = 0;
+	long pos = 0;
+	long i;
+
+	for (i = 0; i < num; i++) {
+		struct digest *d = malloc(sizeof(struct digest));
+		MD5((const unsigned char *)data + pos, lens[i], d->md5);
+		pos += lens[i];
+
+		unsigned int b;
+		memcpy(&b, d->md5, sizeof b);
+		b %= HASH_BUCKETS;
+		struct digest *e;
+		for (e = buckets[b]; e; e = e->next) {
+			if (!memcmp(e->md5, d->md5, MD5_DIGEST_LENGTH)) {
+				break;
+			}
+		}
+		if (e) {
+			free(d);
+			continue;
+		}
+		d->next = buckets[b];
+		buckets[b] = d;
+		total += lens[i];
+	}
+
+	for (i = 0; i < HASH_BUCKETS; i++) {
+		while (buckets[i]) {
+			struct digest *d = buckets[i];
+			buckets[i] = d->next;
+			free(d);
+		}
+	}
+	free(buckets);
+	return total;
+}
+
+int main(int argc, const char *argv[])
+{
+	int window_size = 48;
+	int avg_seg_size = 4096;
+	int min_seg_size = 2048;
+	int max_seg_size = 8192;
+	int rounds = 3;
+
+	int c;
+	while ((c = getopt(argc, (char * const*)argv, "w:a:i:x:r:")) != -1) {
+		switch (c) {
+		case 'w':
+			window_size = atoi(optarg);
+			break;
+		case 'a':
+			avg_seg_size = atoi(optarg);
+			break;
+		case 'i':
+			min_seg_size = atoi(optarg);
+			break;
+		case 'x':
+			max_seg_size = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	/* read everything first, so that only chunking is timed */
+	long size = 0;
+	long cap = 1 << 20;
+	char *data = malloc(cap);
+	ssize_t bytes;
+	while (data && (bytes = read(STDIN_FILENO, data + size, cap - size)) > 0) {
+		size += bytes;
+		if (size == cap) {
+			cap *= 2;
+			data = realloc(data, cap);
+		}
+	}
+	if (!data) {
+		fprintf(stderr, "Failed to read the input\n");
+		exit(2);
+	}
+
+	int *lens = malloc((size / (min_seg_size > 0 ? min_seg_size : 1) + 2)
+					   * sizeof(int));
+	printf("%-6s %12s %10s %10s %10s\n", "engine", "MB/s", "segments",
+		   "mean", "dedup");
+
+	int type;
+	for (type = CHUNKER_RABIN; type <= CHUNKER_GEAR; type++) {
+		double best = 0;
+		long num = 0;
+		int r;
+		for (r = 0; r < rounds; r++) {
+			chunker_t *ck = chunker_init(type, window_size, avg_seg_size,
+										 min_seg_size, max_seg_size);
+			if (!ck) {
+				fprintf(stderr, "Failed to init the %s engine\n",
+						chunker_name(type));
+				exit(1);
+			}
+			double start = now();
+			num = segment(ck, data, size, NULL);
+			double elapsed = now() - start;
+			chunker_free(&ck);
+			if ((best == 0) || (elapsed < best)) {
+				best = elapsed;
+			}
+		}
+
+		chunker_t *ck = chunker_init(type, window_size, avg_seg_size,
+									 min_seg_size, max_seg_size);
+		segment(ck, data, size, lens);
+		chunker_free(&ck);
+		long distinct = distinct_bytes(data, lens, num);
+
+		printf("%-6s %12.1f %10ld %10ld %10.3f\n", chunker_name(type),
+			   size / best / (1 << 20), num, size / num,
+			   distinct ? (double)size / distinct : 0.0);
+	}
+
+	free(lens);
+	free(data);
+	return 0;
+}
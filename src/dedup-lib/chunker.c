@@ -0,0 +1,258 @@
+/**
+ * @file chunker.c
+ * @brief Pluggable content-defined chunking engines
+ *
+ * A chunker_t wraps one of the engines behind the same call-in-a-loop
+ * interface as rabin_segment_next():
+ *
+ *  - CHUNKER_RABIN runs the Rabin fingerprinting of rabinpoly.c, so
+ *    its boundaries are exactly those of rabin_segment_next().
+ *
+ *  - CHUNKER_GEAR is a FastCDC style engine. The rolling hash is a gear
+ *    hash, one shift and one table lookup per byte, where each byte falls
+ *    out of the hash after 64 more bytes. The first min_segment_size bytes
+ *    of a segment are skipped without hashing, as no cut is possible
+ *    there. Normalized chunking is used to keep segment sizes close to the
+ *    average: a mask with two more bits than avg_segment_size asks for is
+ *    used before the average size, and one with two less bits after it.
+ *    The mask bits are the high bits of the hash, which depend on the most
+ *    bytes. The gear table comes from a fixed seed, so boundaries are
+ *    stable across runs and hosts.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rabinpoly.h"
+#include "msb.h"
+
+/* seed of the gear table, changing it moves every gear boundary */
+#define GEAR_SEED 0x6a09e667f3bcc909ULL
+
+/* bits added to/removed from the mask before/after the average size */
+#define GEAR_NORMALIZATION 2
+
+struct gear {
+	u_int64_t table[256];
+	u_int64_t hash;
+	u_int64_t mask_small;		// used before the average size
+	u_int64_t mask_large;		// used after the average size
+	unsigned int avg_segment_size;
+	unsigned int min_segment_size;
+	unsigned int max_segment_size;
+	unsigned int cur_seg_size;	// tracks size of the current active segment
+};
+
+struct chunker {
+	chunker_type_t type;
+	rabinpoly_t *rp;
+	struct gear *gear;
+};
+
+/* splitmix64, fills the gear table from GEAR_SEED */
+static u_int64_t gear_random(u_int64_t *state)
+{
+	u_int64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* a mask of the "bits" high bits of a 64-bit word */
+static u_int64_t gear_mask(int bits)
+{
+	if (bits <= 0) {
+		return 0;
+	}
+	if (bits >= 64) {
+		return ~0ULL;
+	}
+	return ~0ULL << (64 - bits);
+}
+
+static struct gear *gear_init(unsigned int avg_segment_size,
+						unsigned int min_segment_size,
+						unsigned int max_segment_size)
+{
+	struct gear *g = (struct gear *)malloc(sizeof(struct gear));
+	if (!g) {
+		return NULL;
+	}
+
+	u_int64_t state = GEAR_SEED;
+	int i;
+	for (i = 0; i < 256; i++) {
+		g->table[i] = gear_random(&state);
+	}
+
+	/* the same number of bits rabinpoly.c uses for its mask */
+	int bits = fls32(avg_segment_size) - 1;
+	g->mask_small = gear_mask(bits + GEAR_NORMALIZATION);
+	g->mask_large = gear_mask(bits - GEAR_NORMALIZATION);
+
+	g->avg_segment_size = avg_segment_size;
+	g->min_segment_size = min_segment_size;
+	g->max_segment_size = max_segment_size;
+	g->hash = 0;
+	g->cur_seg_size = 0;
+	return g;
+}
+
+static int gear_segment_next(struct gear *g,
+						const unsigned char *buf,
+						unsigned int bytes,
+						int *is_new_segment)
+{
+	unsigned int i = 0;
+
+	*is_new_segment = 0;
+	log_dedupe_compute_cost();
+
+	/* no cut is possible before the minimum size, do not even hash */
+	if (g->cur_seg_size < g->min_segment_size) {
+		unsigned int skip = g->min_segment_size - g->cur_seg_size;
+		if (skip > bytes) {
+			g->cur_seg_size += bytes;
+			return bytes;
+		}
+		g->cur_seg_size += skip;
+		i = skip;
+	}
+
+	u_int64_t hash = g->hash;
+	unsigned int size = g->cur_seg_size;
+	unsigned int normal = g->avg_segment_size;
+	if (normal > g->max_segment_size) {
+		normal = g->max_segment_size;
+	}
+	/* the skip may already end at the maximum size, e.g. if min == max */
+	if (size >= g->max_segment_size) {
+		goto cut;
+	}
+
+	/* strict part, up to the average size */
+	while ((i < bytes) && (size < normal)) {
+		hash = (hash << 1) + g->table[buf[i++]];
+		size++;
+		if (((hash & g->mask_small) == 0) || (size >= g->max_segment_size)) {
+			goto cut;
+		}
+	}
+	/* loose part, up to the maximum size */
+	while (i < bytes) {
+		hash = (hash << 1) + g->table[buf[i++]];
+		size++;
+		if (((hash & g->mask_large) == 0) || (size >= g->max_segment_size)) {
+			goto cut;
+		}
+	}
+
+	g->hash = hash;
+	g->cur_seg_size = size;
+	return i;
+
+cut:
+	*is_new_segment = 1;
+	g->hash = 0;
+	g->cur_seg_size = 0;
+	return i;
+}
+
+chunker_t *chunker_init(chunker_type_t type,
+						unsigned int window_size,
+						unsigned int avg_segment_size,
+						unsigned int min_segment_size,
+						unsigned int max_segment_size)
+{
+	chunker_t *c = (chunker_t *)calloc(1, sizeof(chunker_t));
+	if (!c) {
+		return NULL;
+	}
+	c->type = type;
+
+	switch (type) {
+	case CHUNKER_RABIN:
+		c->rp = rabin_init(window_size, avg_segment_size,
+						   min_segment_size, max_segment_size);
+		break;
+	case CHUNKER_GEAR:
+		c->gear = gear_init(avg_segment_size, min_segment_size,
+							max_segment_size);
+		break;
+	}
+
+	if (!c->rp && !c->gear) {
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+int chunker_next(chunker_t *c,
+				const char *buf,
+				unsigned int bytes,
+				int *is_new_segment)
+{
+	if (!c || !buf || !is_new_segment) {
+		return -1;
+	}
+
+	if (c->type == CHUNKER_GEAR) {
+		return gear_segment_next(c->gear, (const unsigned char *)buf,
+								 bytes, is_new_segment);
+	}
+	return rabin_segment_next(c->rp, buf, bytes, is_new_segment);
+}
+
+void chunker_reset(chunker_t *c)
+{
+	if (c->type == CHUNKER_GEAR) {
+		c->gear->hash = 0;
+		c->gear->cur_seg_size = 0;
+	} else {
+		rabin_reset(c->rp);
+	}
+}
+
+void chunker_free(chunker_t **p_c)
+{
+	if (!p_c || !*p_c) {
+		return;
+	}
+
+	if ((*p_c)->rp) {
+		rabin_free(&(*p_c)->rp);
+	}
+	if ((*p_c)->gear) {
+		free((*p_c)->gear);
+		/* rabin_free() writes the compute cost out, do the same */
+		rabin_compute_cost_flush();
+	}
+	free(*p_c);
+	*p_c = NULL;
+}
+
+const char *chunker_name(chunker_type_t type)
+{
+	switch (type) {
+	case CHUNKER_RABIN:
+		return "rabin";
+	case CHUNKER_GEAR:
+		return "gear";
+	}
+	return NULL;
+}
+
+int chunker_type(const char *name)
+{
+	int type;
+	for (type = CHUNKER_RABIN; type <= CHUNKER_GEAR; type++) {
+		if (strcmp(name, chunker_name(type)) == 0) {
+			return type;
+		}
+	}
+	return -1;
+}
@@ -21,6 +21,8 @@
  */
 
 
+#define _GNU_SOURCE
+
 #include "msb.h"
 
 /* Highest bit set in a byte */
@@ -0,0 +1,283 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "rabinpoly.h"
+
+/* segment parameters tried by the differential test, window sizes
+ * 32/48/64 run the specialized loops, the others the generic one */
+static const unsigned int Params[][4] = {
+	/* window, avg, min, max */
+	{48, 4096, 2048, 8192},
+	{32, 4096, 2048, 8192},
+	{64, 4096, 2048, 8192},
+	{40, 4096, 2048, 8192},
+	{48, 1024, 48, 1024},		/* min == window, nothing skipped */
+	{48, 1024, 49, 4096},		/* one byte skipped */
+	{64, 256, 32, 512},			/* min < window */
+	{32, 512, 512, 512},		/* fixed size segments */
+	{96, 8192, 4096, 16384},
+};
+
+void usage(const char *program)
+{
+	printf("\n");
+	printf("This program checks that rabin_segment_next() cuts exactly\n");
+	printf("where the byte-at-a-time reference loop does, on generated\n");
+	printf("data fed in buffers of random sizes. With -b, it also prints\n");
+	printf("the throughput of both for the common window sizes.\n\n");
+	printf("Usage : %s -n <bytes> -s <seed> [-b]\n\n", program);
+}
+
+/**
+ * The reference loop, as rabin_segment_next() was before the skip-ahead
+ * and the specialized loops.
+ */
+static u_int64_t ref_append8(rabinpoly_t *rp, u_int64_t p, u_char m)
+{
+	return ((p << 8) | m) ^ rp->T[p >> rp->shift];
+}
+
+static u_int64_t ref_slide8(rabinpoly_t *rp, u_char m)
+{
+	rp->bufpos++;
+
+	if (rp->bufpos >= rp->window_size) {
+		rp->bufpos = 0;
+	}
+	u_char om = rp->buf[rp->bufpos];
+	rp->buf[rp->bufpos] = m;
+	return rp->fingerprint = ref_append8(rp, rp->fingerprint ^ rp->U[om], m);
+}
+
+static int ref_segment_next(rabinpoly_t *rp, const char *buf,
+							unsigned int bytes, int *is_new_segment)
+{
+	unsigned int i;
+
+	*is_new_segment = 0;
+	for (i = 0; i < bytes; i++) {
+		ref_slide8(rp, buf[i]);
+		rp->cur_seg_size++;
+
+		if (rp->cur_seg_size < rp->min_segment_size) {
+			continue;
+		}
+
+		if(((rp->fingerprint & rp->fingerprint_mask) == 0)
+				|| (rp->cur_seg_size == rp->max_segment_size)) {
+			*is_new_segment = 1;
+			rp->cur_seg_size = 0;
+			return i+1;
+		}
+	}
+
+	return i;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* random bytes with repeated runs, zero runs and copies of earlier data */
+static char *generate(long size)
+{
+	char *data = malloc(size);
+	long pos = 0;
+
+	if (!data) {
+		return NULL;
+	}
+	while (pos < size) {
+		long len = 1 + random() % 65536;
+		if (len > size - pos) {
+			len = size - pos;
+		}
+		long i;
+		switch (random() % 4) {
+		case 0:
+			memset(data + pos, random() % 2 ? 0 : random(), len);
+			break;
+		case 1:
+			if (pos > len) {
+				memcpy(data + pos, data + random() % (pos - len), len);
+				break;
+			}
+			/* fall through */
+		default:
+			for (i = 0; i < len; i++) {
+				data[pos + i] = random();
+			}
+			break;
+		}
+		pos += len;
+	}
+	return data;
+}
+
+/**
+ * Cuts the data with rabin_segment_next() (ref == 0) or the reference
+ * loop, in buffers of random sizes up to max_feed bytes if it is not 0,
+ * and optionally resetting at some boundaries as the dedup layer of
+ * CloudFS does. Returns the number of boundaries written to "cuts".
+ */
+static long segment(rabinpoly_t *rp, int ref, const char *data, long size,
+					unsigned int max_feed, unsigned int seed, long *cuts)
+{
+	long num = 0;
+	long pos = 0;
+	int new_segment = 0;
+	int len = 0;
+
+	srandom(seed);
+	while (pos < size) {
+		long bytes = size - pos;
+		if (max_feed && (bytes > max_feed)) {
+			bytes = random() % (max_feed + 1);
+		}
+		const char *buftoread = data + pos;
+		while (1) {
+			if (ref) {
+				len = ref_segment_next(rp, buftoread, bytes, &new_segment);
+			} else {
+				len = rabin_segment_next(rp, buftoread, bytes, &new_segment);
+			}
+			if (len < 0) {
+				fprintf(stderr, "Failed to process the segment\n");
+				exit(2);
+			}
+			buftoread += len;
+			bytes -= len;
+			pos += len;
+			if (new_segment) {
+				cuts[num++] = pos;
+				if (random() % 8 == 0) {
+					rabin_reset(rp);
+				}
+			}
+			if ((bytes <= 0) || (len == 0)) {
+				break;
+			}
+		}
+	}
+	return num;
+}
+
+static int check(const char *data, long size, const unsigned int *p,
+				 unsigned int max_feed, unsigned int seed, long *cuts,
+				 long *ref_cuts)
+{
+	rabinpoly_t *rp = rabin_init(p[0], p[1], p[2], p[3]);
+	rabinpoly_t *ref_rp = rabin_init(p[0], p[1], p[2], p[3]);
+	if (!rp || !ref_rp) {
+		fprintf(stderr, "Failed to init rabin\n");
+		exit(1);
+	}
+
+	long num = segment(rp, 0, data, size, max_feed, seed, cuts);
+	long ref_num = segment(ref_rp, 1, data, size, max_feed, seed, ref_cuts);
+	rabin_free(&rp);
+	rabin_free(&ref_rp);
+
+	long i;
+	for (i = 0; (i < num) && (i < ref_num); i++) {
+		if (cuts[i] != ref_cuts[i]) {
+			break;
+		}
+	}
+	if ((i < num) || (i < ref_num)) {
+		printf("FAIL window %u avg %u min %u max %u feed %u: boundary %ld "
+			   "at %ld, reference at %ld\n", p[0], p[1], p[2], p[3], max_feed,
+			   i, i < num ? cuts[i] : -1, i < ref_num ? ref_cuts[i] : -1);
+		return 1;
+	}
+	return 0;
+}
+
+static double throughput(const char *data, long size, unsigned int window,
+						 int ref, long *cuts)
+{
+	double best = 0;
+	int r;
+	for (r = 0; r < 3; r++) {
+		rabinpoly_t *rp = rabin_init(window, 4096, 2048, 8192);
+		double start = now();
+		segment(rp, ref, data, size, 0, 0, cuts);
+		double elapsed = now() - start;
+		rabin_free(&rp);
+		if ((best == 0) || (elapsed < best)) {
+			best = elapsed;
+		}
+	}
+	return size / best / (1 << 20);
+}
+
+int main(int argc, const char *argv[])
+{
+	long size = 8 << 20;
+	unsigned int seed = 1;
+	int bench = 0;
+
+	int c;
+	while ((c = getopt(argc, (char * const*)argv, "n:s:b")) != -1) {
+		switch (c) {
+		case 'n':
+			size = atol(optarg);
+			break;
+		case 's':
+			seed = atoi(optarg);
+			break;
+		case 'b':
+			bench = 1;
+			break;
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	srandom(seed);
+	char *data = generate(size);
+	/* every boundary is at least one byte apart */
+	long *cuts = malloc((size + 1) * sizeof(long));
+	long *ref_cuts = malloc((size + 1) * sizeof(long));
+	if (!data || !cuts || !ref_cuts) {
+		fprintf(stderr, "Failed to allocate %ld bytes\n", size);
+		exit(2);
+	}
+
+	/* whole buffers, then random sizes around the window and min sizes */
+	static const unsigned int feeds[] = {0, 1, 7, 64, 3000, 70000};
+	unsigned int i, j;
+	int failed = 0;
+	for (i = 0; i < sizeof(Params) / sizeof(Params[0]); i++) {
+		for (j = 0; j < sizeof(feeds) / sizeof(feeds[0]); j++) {
+			failed += check(data, size, Params[i], feeds[j], seed + i + j,
+							cuts, ref_cuts);
+		}
+	}
+	printf("%s: %d of %lu runs differ from the reference\n",
+		   failed ? "FAIL" : "OK", failed,
+		   sizeof(Params) / sizeof(Params[0]) * sizeof(feeds) / sizeof(feeds[0]));
+
+	if (bench) {
+		printf("%-6s %12s %12s\n", "window", "ref MB/s", "MB/s");
+		static const unsigned int windows[] = {32, 48, 64};
+		for (i = 0; i < sizeof(windows) / sizeof(windows[0]); i++) {
+			printf("%-6u %12.1f %12.1f\n", windows[i],
+				   throughput(data, size, windows[i], 1, cuts),
+				   throughput(data, size, windows[i], 0, cuts));
+		}
+	}
+
+	free(ref_cuts);
+	free(cuts);
+	free(data);
+	return failed ? 1 : 0;
+}
@@ -21,8 +21,12 @@
  * USA
  *
  */
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "rabinpoly.h"
 #include "msb.h"
@@ -41,20 +45,67 @@ static void polymult (u_int64_t *php, u_int64_t *plp, u_int64_t x, u_int64_t y);
 static u_int64_t polymmult (u_int64_t x, u_int64_t y, u_int64_t d);
 
 static void calcT(rabinpoly_t *rp);
-static u_int64_t slide8(rabinpoly_t *rp, u_char m);
 static u_int64_t append8(rabinpoly_t *rp, u_int64_t p, u_char m);
 
-static int dedupe_compute_cost = 0;
-
-static void log_dedupe_compute_cost()
+/* The dedup compute cost is the number of calls of the chunking engines
+ * (rabin_segment_next() and the engines of chunker.c). It is counted in
+ * memory and written to COMPUTE_COST_FILE from time to time, when a handle
+ * is freed and at exit, rather than on every call. */
+#define COMPUTE_COST_FILE "/tmp/dedupe_compute_cost"
+#define COMPUTE_COST_FLUSH_INTERVAL 1	/* seconds */
+
+static long dedupe_compute_cost = 0;
+static long dedupe_compute_cost_flushed = -1;	/* value in the file */
+static time_t dedupe_compute_cost_time = 0;	/* when it was written */
+static pthread_mutex_t dedupe_compute_cost_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t dedupe_compute_cost_once = PTHREAD_ONCE_INIT;
+
+/* write the counter out, the caller holds dedupe_compute_cost_lock */
+static void write_dedupe_compute_cost()
 {
-    FILE* fp = fopen("/tmp/dedupe_compute_cost","w");
+    long cost = __sync_add_and_fetch(&dedupe_compute_cost, 0);
+    dedupe_compute_cost_time = time(NULL);
+    if (cost == dedupe_compute_cost_flushed) {
+        return;
+    }
+    FILE* fp = fopen(COMPUTE_COST_FILE,"w");
     if (!fp) {
         return;
     }
-    dedupe_compute_cost++;
-    fprintf(fp, "%d\n", dedupe_compute_cost);
+    fprintf(fp, "%ld\n", cost);
     fclose(fp);
+    dedupe_compute_cost_flushed = cost;
+}
+
+long rabin_compute_cost(void)
+{
+    return __sync_add_and_fetch(&dedupe_compute_cost, 0);
+}
+
+void rabin_compute_cost_flush(void)
+{
+    pthread_mutex_lock(&dedupe_compute_cost_lock);
+    write_dedupe_compute_cost();
+    pthread_mutex_unlock(&dedupe_compute_cost_lock);
+}
+
+static void register_dedupe_compute_cost()
+{
+    atexit(rabin_compute_cost_flush);
+}
+
+void log_dedupe_compute_cost(void)
+{
+    pthread_once(&dedupe_compute_cost_once, register_dedupe_compute_cost);
+    __sync_add_and_fetch(&dedupe_compute_cost, 1);
+    /* a stale read of the time only delays the write */
+    if (time(NULL) - dedupe_compute_cost_time < COMPUTE_COST_FLUSH_INTERVAL) {
+        return;
+    }
+    if (pthread_mutex_trylock(&dedupe_compute_cost_lock) == 0) {
+        write_dedupe_compute_cost();
+        pthread_mutex_unlock(&dedupe_compute_cost_lock);
+    }
 }
 
 
@@ -136,22 +187,6 @@ static void calcT(rabinpoly_t *rp)
 	}
 }
 
-/**
- * Feed a new byte into the rabin sliding window and update 
- * the rabin fingerprint
- */
-static u_int64_t slide8(rabinpoly_t *rp, u_char m) 
-{
-	rp->bufpos++;
-
-	if (rp->bufpos >= rp->window_size) {
-		rp->bufpos = 0;
-	}
-	u_char om = rp->buf[rp->bufpos];
-	rp->buf[rp->bufpos] = m;
-	return rp->fingerprint = append8 (rp, rp->fingerprint ^ rp->U[om], m);
-}
-
 static u_int64_t append8(rabinpoly_t *rp, u_int64_t p, u_char m) 
 { 	
 	return ((p << 8) | m) ^ rp->T[p >> rp->shift]; 
@@ -202,36 +237,118 @@ rabinpoly_t *rabin_init(unsigned int window_size,
 	return rp;
 }
 
+/**
+ * The segmentation loop, inlined into rabin_segment_next() once for each
+ * common window size so that the compiler sees a constant window_size and
+ * wraps bufpos without a division (a mask for 32 and 64).
+ *
+ * It produces exactly the boundaries of the original byte-at-a-time loop:
+ *  - The fingerprint only depends on the last window_size bytes, and is
+ *    only checked from min_segment_size on. The first min_segment_size -
+ *    window_size bytes of a segment are therefore skipped without hashing,
+ *    and hashing restarts from an empty window, which is fully refilled by
+ *    the first check.
+ *  - The state lives in locals for the duration of a call.
+ */
+static inline __attribute__((always_inline))
+int rabin_kernel(rabinpoly_t *rp, const u_char *buf, unsigned int bytes,
+				 int *is_new_segment, const unsigned int window_size)
+{
+	const u_int64_t *T = rp->T;
+	const u_int64_t *U = rp->U;
+	const int shift = rp->shift;
+	const u_int64_t mask = rp->fingerprint_mask;
+	const unsigned int min = rp->min_segment_size;
+	const unsigned int max = rp->max_segment_size;
+	const unsigned int skip_to = (min > window_size) ? min - window_size : 0;
+	u_char *win = rp->buf;
+	u_int64_t fp = rp->fingerprint;
+	unsigned int pos = rp->bufpos;
+	unsigned int size = rp->cur_seg_size;
+	unsigned int i = 0;
+
+	if (skip_to && (size <= skip_to)) {
+		unsigned int skip = skip_to - size;
+		if (skip >= bytes) {
+			rp->cur_seg_size += bytes;
+			return bytes;
+		}
+		i = skip;
+		size = skip_to;
+		fp = 0;
+		memset(win, 0, window_size);
+	}
+
+#define RABIN_SLIDE(m)											\
+	do {														\
+		if ((window_size & (window_size - 1)) == 0) {			\
+			pos = (pos + 1) & (window_size - 1);				\
+		} else if (++pos >= window_size) {						\
+			pos = 0;											\
+		}														\
+		u_int64_t p = fp ^ U[win[pos]];							\
+		win[pos] = (m);											\
+		fp = ((p << 8) | (m)) ^ T[p >> shift];					\
+	} while (0)
+
+	/* bytes that leave the segment short of the minimum size are not checked */
+	while ((i < bytes) && (size + 1 < min)) {
+		RABIN_SLIDE(buf[i]);
+		i++;
+		size++;
+	}
+	/* the others are, and the maximum size check is hoisted out of the loop */
+	unsigned int end = bytes;
+	if (end - i > max - size) {
+		end = i + (max - size);
+	}
+	while (i < end) {
+		RABIN_SLIDE(buf[i]);
+		i++;
+		size++;
+		if ((fp & mask) == 0) {
+			goto cut;
+		}
+	}
+	if (size == max) {
+		goto cut;
+	}
+#undef RABIN_SLIDE
+	rp->fingerprint = fp;
+	rp->bufpos = pos;
+	rp->cur_seg_size = size;
+	return i;
+
+cut:
+	*is_new_segment = 1;
+	rp->fingerprint = fp;
+	rp->bufpos = pos;
+	rp->cur_seg_size = 0;
+	return i;
+}
+
 int rabin_segment_next(rabinpoly_t *rp, 
 						const char *buf, 
 						unsigned int bytes,
 						int *is_new_segment)
 {
-	unsigned int i;
-
 	if (!rp || !buf || !is_new_segment) {
 		return -1;
 	}
 
 	*is_new_segment = 0;
     log_dedupe_compute_cost();
-	for (i = 0; i < bytes; i++) {
-		slide8(rp, buf[i]);
-		rp->cur_seg_size++;
-
-		if (rp->cur_seg_size < rp->min_segment_size) {
-			continue;
-		}
-
-		if(((rp->fingerprint & rp->fingerprint_mask) == 0) 
-				|| (rp->cur_seg_size == rp->max_segment_size)) {
-			*is_new_segment = 1;
-			rp->cur_seg_size = 0;
-			return i+1;
-		}
+	const u_char *ubuf = (const u_char *)buf;
+	switch (rp->window_size) {
+	case 32:
+		return rabin_kernel(rp, ubuf, bytes, is_new_segment, 32);
+	case 48:
+		return rabin_kernel(rp, ubuf, bytes, is_new_segment, 48);
+	case 64:
+		return rabin_kernel(rp, ubuf, bytes, is_new_segment, 64);
+	default:
+		return rabin_kernel(rp, ubuf, bytes, is_new_segment, rp->window_size);
 	}
-
-	return i;
 }
 
 void rabin_reset(rabinpoly_t *rp) { 
@@ -250,5 +367,7 @@ void rabin_free(rabinpoly_t **p_rp)
 	free((*p_rp)->buf);
 	free(*p_rp);
 	*p_rp = NULL;
+
+	rabin_compute_cost_flush();
 }
 
@@ -49,4 +49,7 @@ struct rabinpoly {
 	u_int64_t U[256];
 };
 
+/* counts a call of a chunking engine in the dedup compute cost */
+void log_dedupe_compute_cost(void);
+
 #endif /* !_RABINPOLY_H_ */
@@ -101,4 +101,109 @@ void rabin_reset(rabinpoly_t *rp);
  */
 void rabin_free(rabinpoly_t **p_rp);
 
+/**
+ * Chunking engines, see chunker.c
+ */
+typedef enum {
+	CHUNKER_RABIN = 0,	/* Rabin fingerprinting, same as rabin_segment_next() */
+	CHUNKER_GEAR = 1	/* Gear hash with normalized chunking (FastCDC) */
+} chunker_type_t;
+
+/**
+ * Chunker structure declaration, a handle on one of the engines
+ */
+struct chunker;
+typedef struct chunker chunker_t;
+
+/**
+ * @brief Initializes a chunker of the given engine.
+ *
+ * Works like rabin_init(), the handle should later be free'ed by passing
+ * it to chunker_free(). The gear engine does not use a window.
+ *
+ * @param [in] type The engine
+ * @param [in] window_size Rabin fingerprint window size in bytes
+ * @param [in] avg_segment_size Average desired segment size
+ * @param [in] min_segment_size Minumim size of the produced segment
+ * @param [in] max_segment_size Maximum size of the produced segment
+ *
+ * @retval c Pointer to a allocated chunker_t structure
+ * @retval NULL Incase of errors during initialization
+ */
+chunker_t *chunker_init(chunker_type_t type,
+						unsigned int window_size,
+						unsigned int avg_segment_size,
+						unsigned int min_segment_size,
+						unsigned int max_segment_size);
+
+/**
+ * @brief Find the next segment boundary.
+ *
+ * Same contract as rabin_segment_next(), with the engine of the chunker.
+ *
+ * @param [in] c Pointer to the chunker_t structure returned by chunker_init
+ * @param [in] buf Pointer to a characher buffer containing data
+ * @param [in] bytes Number of bytes to read from the buf
+ * @param [out] is_new_segment 1 if a new segment starts after the
+ *                             processed bytes, 0 otherwise
+ *
+ * @retval int Number of bytes processed.
+ *         -1  Error
+ */
+int chunker_next(chunker_t *c,
+				const char *buf,
+				unsigned int bytes,
+				int *is_new_segment);
+
+/**
+ * @brief Resets a chunker to reuse it for a different file or stream.
+ *
+ * @param [in] c Pointer to the chunker_t structure returned by chunker_init
+ *
+ * @retval void None
+ */
+void chunker_reset(chunker_t *c);
+
+/**
+ * @brief Frees a chunker.
+ *
+ * @param [in] p_c Address of the pointer returned by chunker_init()
+ *
+ * @retval void None
+ */
+void chunker_free(chunker_t **p_c);
+
+/**
+ * @brief Name of an engine, e.g. "rabin" or "gear".
+ *
+ * @retval name The name, NULL for an unknown engine
+ */
+const char *chunker_name(chunker_type_t type);
+
+/**
+ * @brief Engine of a name, the inverse of chunker_name().
+ *
+ * @retval int The engine, -1 for an unknown name
+ */
+int chunker_type(const char *name);
+
+/**
+ * @brief Returns the dedup compute cost so far
+ *
+ * The cost is the number of rabin_segment_next() and chunker_next() calls
+ * made by the process. It is also written to /tmp/dedupe_compute_cost
+ * every second or so, whenever a handle is freed by rabin_free() or
+ * chunker_free(), and at exit.
+ *
+ * @retval long Number of calls
+ */
+long rabin_compute_cost(void);
+
+/**
+ * @brief Writes the dedup compute cost to /tmp/dedupe_compute_cost now
+ *
+ * @retval void None
+ */
+void rabin_compute_cost_flush(void);
+
 #endif /* _DEDUP_H_ */
@@ -0,0 +1,88 @@
+#!/bin/bash
+#
+# A script to measure aggregate read throughput of cold cloud files
+# with 1 to N concurrent readers, without and with the SSD cache. Has
+# to be run from the ./src/scripts/ directory.
+#
+
+FUSE="/mnt/fuse"
+SSD="/mnt/ssd"
+CLOUD="/tmp/s3"
+CLOUDFSOPTS=""
+# cloudfs options of every configuration measured: without the cache
+# every read goes to the cloud; the cache is smaller than one file, so
+# most reads miss too, but the readers contend on admitting segments to
+# the cache and evicting them
+CONFIGS=("--multithread --no-cache" "--multithread --cache-size 1024")
+
+MAXTHREADS="8"
+FILESIZE="4096"
+# size of every test file in KB
+
+source ./functions.sh
+function usage()
+{
+	echo "bench_concurrency.sh [max_threads] [file_size_in_KB] [cloudfs_options]"
+	echo " runs 1, 2, 4, ... max_threads parallel readers, each one reading"
+	echo " its own file, and prints the aggregate throughput for every"
+	echo " configuration, or only with the cloudfs_options given"
+}
+
+if [ $# -gt 0 ]; then
+	MAXTHREADS=$1
+	shift
+fi
+if [ $# -gt 0 ]; then
+	FILESIZE=$1
+	shift
+fi
+if [ $# -gt 0 ]; then
+	CONFIGS=("$*")
+fi
+
+for opts in "${CONFIGS[@]}"
+do
+	CLOUDFSOPTS=" $opts"
+	reinit_env
+
+	echo "Creating $MAXTHREADS files of $FILESIZE KB ..."
+	for((i=1; i <= $MAXTHREADS ; i++))
+	do
+		dd if=/dev/urandom of=$FUSE/bench$i bs=1024 count=$FILESIZE > /dev/null 2>&1
+		if [ $? -ne 0 ]; then
+			echo "Unable to create $FUSE/bench$i"
+			exit 1
+		fi
+	done
+
+	echo ""
+	echo "cloudfs options:$CLOUDFSOPTS"
+	echo "threads  seconds  aggregate(MB/s)"
+	for((t=1; t <= $MAXTHREADS ; t*=2))
+	do
+		# remount so that every round starts cold: the SSD is remounted
+		# to drop the page cache, and the decompressed segments the
+		# store keeps across mounts are removed in between. The SSD
+		# cache stays, it may hold the only copy of some segments.
+		./cloudfs_controller.sh u
+		rm -rf $SSD/.tmp/segments
+		./umount_disks.sh $SSD
+		./mount_disks.sh $SSD
+		./cloudfs_controller.sh m $CLOUDFSOPTS
+
+		start=`date +%s.%N`
+		for((i=1; i <= $t ; i++))
+		do
+			cat $FUSE/bench$i > /dev/null &
+		done
+		wait
+		end=`date +%s.%N`
+
+		seconds=$(echo "scale=3; ($end - $start) / 1" | bc -q)
+		mbps=$(echo "scale=2; $t * $FILESIZE / 1024 / ($end - $start)" | bc -q)
+		printf "%7d  %7s  %15s\n" $t $seconds $mbps
+	done
+
+	rm -f $FUSE/bench*
+done
+./cloudfs_controller.sh u